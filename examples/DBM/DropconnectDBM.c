@@ -15,6 +15,8 @@ int main(int argc, char **argv)
     gsl_vector *n_hidden_units = NULL, *eta = NULL, *lambda = NULL, *alpha = NULL, *eta_min = NULL, *eta_max = NULL;
     int n_layers = atoi(argv[10]);
     double temp_eta, temp_lambda, temp_alpha, temp_eta_min, temp_eta_max, temp_p, temp_hidden_units;
+    double beta1 = 0.9, beta2 = 0.999, epsilon = 1e-8;
+    int optimizer = OPTIMIZER_SGD;
     double *p;
     double errorTRAIN, errorTEST;
     char *fileName = argv[5];
@@ -62,6 +64,8 @@ int main(int argc, char **argv)
         WaiveLibDEEPComment(fp);
         p[i] = temp_p;
     }
+    fscanf(fp, "%d %lf %lf %lf", &optimizer, &beta1, &beta2, &epsilon);
+    WaiveLibDEEPComment(fp);
     fclose(fp);
 
     fprintf(stderr, "\nCreating and initializing Dropconnect DBM ... ");
@@ -74,6 +78,10 @@ int main(int argc, char **argv)
         d->m[i]->alpha = gsl_vector_get(alpha, i);
         d->m[i]->eta_min = gsl_vector_get(eta_min, i);
         d->m[i]->eta_max = gsl_vector_get(eta_max, i);
+        d->m[i]->optimizer = optimizer;
+        d->m[i]->beta1 = beta1;
+        d->m[i]->beta2 = beta2;
+        d->m[i]->epsilon = epsilon;
     }
     fprintf(stderr, "\nOk\n");
 
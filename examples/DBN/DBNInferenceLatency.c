@@ -0,0 +1,86 @@
+#include "deep.h"
+
+/* It compares two latencies for qsort */
+int CompareLatencies(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* It returns the elapsed time between two timestamps in microseconds */
+double ElapsedMicroseconds(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e6 + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+int main(int argc, char **argv)
+{
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "\nusage DBNInferenceLatency <number of timed requests> <number of warm-up requests>\n");
+        fprintf(stderr, "It measures the single-sample inference latency of a 784-500-500-2000 DBN on one core.\n");
+        exit(-1);
+    }
+
+    int n_requests = atoi(argv[1]), n_warmup = atoi(argv[2]), i, j;
+    int n_hidden_units[3] = {500, 500, 2000};
+    double *latency = NULL, sum = 0.0, checksum = 0.0;
+    struct timespec start, end;
+    const gsl_rng_type *T = NULL;
+    gsl_rng *r = NULL;
+    gsl_vector **input = NULL, *h = NULL;
+    DBNWorkspace *w = NULL;
+    DBN *d = NULL;
+
+    fprintf(stderr, "\nCreating and initializing DBN ... ");
+    d = CreateNewDBN(784, n_hidden_units, 1, 3);
+    InitializeDBN(d);
+    w = CreateDBNWorkspace(d, 0);
+    fprintf(stderr, "\nOk\n");
+
+    /* It draws a pool of binary requests beforehand, so the timed loop only measures inference */
+    T = gsl_rng_default;
+    r = gsl_rng_alloc(T);
+    gsl_rng_set(r, random_seed_deep());
+    input = (gsl_vector **)malloc(64 * sizeof(gsl_vector *));
+    for (i = 0; i < 64; i++)
+    {
+        input[i] = gsl_vector_alloc(784);
+        for (j = 0; j < 784; j++)
+            gsl_vector_set(input[i], j, gsl_ran_bernoulli(r, 0.2));
+    }
+
+    for (i = 0; i < n_warmup; i++)
+        FASTForwardPass(input[i % 64], d, w);
+
+    latency = (double *)malloc(n_requests * sizeof(double));
+    for (i = 0; i < n_requests; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        h = FASTForwardPass(input[i % 64], d, w);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        latency[i] = ElapsedMicroseconds(&start, &end);
+        sum += latency[i];
+        checksum += gsl_vector_get(h, 0);
+    }
+
+    qsort(latency, n_requests, sizeof(double), CompareLatencies);
+    fprintf(stderr, "\nRequests: %d (checksum %lf)", n_requests, checksum);
+    fprintf(stderr, "\nMean latency: %lf us", sum / n_requests);
+    fprintf(stderr, "\np50 latency: %lf us", latency[(int)(0.50 * (n_requests - 1))]);
+    fprintf(stderr, "\np99 latency: %lf us", latency[(int)(0.99 * (n_requests - 1))]);
+    fprintf(stderr, "\nMax latency: %lf us\n", latency[n_requests - 1]);
+    fprintf(stdout, "%lf %lf %lf\n", sum / n_requests, latency[(int)(0.50 * (n_requests - 1))], latency[(int)(0.99 * (n_requests - 1))]);
+
+    for (i = 0; i < 64; i++)
+        gsl_vector_free(input[i]);
+    free(input);
+    free(latency);
+    gsl_rng_free(r);
+    DestroyDBNWorkspace(&w);
+    DestroyDBN(&d);
+
+    return 0;
+}
@@ -13,6 +13,8 @@ int main(int argc, char **argv)
     int iteration = atoi(argv[4]), i, n_epochs = atoi(argv[6]), batch_size = atoi(argv[7]), n_gibbs_sampling = atoi(argv[8]), op = atoi(argv[9]);
     int n_hidden_units;
     double eta, lambda, alpha, eta_min, eta_max;
+    double beta1 = 0.9, beta2 = 0.999, epsilon = 1e-8;
+    int optimizer = OPTIMIZER_SGD;
     double p;
     double errorTRAIN, errorTEST;
     char *fileName = argv[5];
@@ -39,6 +41,8 @@ int main(int argc, char **argv)
     WaiveLibDEEPComment(fp);
     fscanf(fp, "%lf", &p);
     WaiveLibDEEPComment(fp);
+    fscanf(fp, "%d %lf %lf %lf", &optimizer, &beta1, &beta2, &epsilon);
+    WaiveLibDEEPComment(fp);
     fclose(fp);
 
     fprintf(stderr, "\nCreating and initializing Dropout RBM ... ");
@@ -48,6 +52,10 @@ int main(int argc, char **argv)
     m->alpha = alpha;
     m->eta_min = eta_min;
     m->eta_max = eta_max;
+    m->optimizer = optimizer;
+    m->beta1 = beta1;
+    m->beta2 = beta2;
+    m->epsilon = epsilon;
     InitializeWeights(m);
     InitializeBias4HiddenUnits(m);
     InitializeBias4VisibleUnitsWithRandomValues(m);
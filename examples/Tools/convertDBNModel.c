@@ -0,0 +1,55 @@
+#include "deep.h"
+
+int main(int argc, char **argv)
+{
+
+    if (argc != 6)
+    {
+        fprintf(stderr, "\nusage convertDBNModel <training set> <input parameters file> <model file> <number of DBN layers> <output binary model file>\n");
+        fprintf(stderr, "It converts the parameters saved by saveDBNParameters into a binary model file that can be served by deepd.\n");
+        exit(-1);
+    }
+    int i;
+    int n_layers = atoi(argv[4]);
+    double temp_hidden_units;
+    char *fileName = argv[3];
+    gsl_vector *n_hidden_units = NULL;
+    FILE *fp = NULL;
+    DBN *d = NULL;
+    Subgraph *Train = NULL;
+
+    Train = ReadSubgraph(argv[1]);
+
+    n_hidden_units = gsl_vector_alloc(n_layers);
+    fp = fopen(fileName, "r");
+    if (!fp)
+    {
+        fprintf(stderr, "\nUnable to open file %s.\n", fileName);
+        exit(1);
+    }
+    for (i = 0; i < n_layers; i++)
+    {
+        fscanf(fp, "%lf", &temp_hidden_units);
+        WaiveLibDEEPComment(fp);
+        gsl_vector_set(n_hidden_units, i, temp_hidden_units);
+        WaiveLibDEEPComment(fp);
+    }
+    fclose(fp);
+
+    fprintf(stderr, "\nLoading DBN ... ");
+    d = CreateDBN(Train->nfeats, n_hidden_units, Train->nlabels, n_layers);
+    InitializeDBN(d);
+    loadDBNParametersFromFile(d, argv[2]);
+    fprintf(stderr, "\nOk\n");
+
+    fprintf(stderr, "\nWriting %s ... ", argv[5]);
+    if (saveDBNParametersBinary(d, argv[5]))
+        exit(-1);
+    fprintf(stderr, "\nOk\n");
+
+    DestroySubgraph(&Train);
+    DestroyDBN(&d);
+    gsl_vector_free(n_hidden_units);
+
+    return 0;
+}
@@ -0,0 +1,36 @@
+#include "deep.h"
+#include <unistd.h>
+
+int main(int argc, char **argv)
+{
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "\nusage printServerMetrics <socket path>\n");
+        fprintf(stderr, "It prints the metrics of a running deepd server in the Prometheus text format.\n");
+        exit(-1);
+    }
+    int fd;
+    char *text = NULL;
+
+    fd = ConnectServer(argv[1]);
+    if (fd < 0)
+    {
+        fprintf(stderr, "\nUnable to connect to %s.\n", argv[1]);
+        exit(-1);
+    }
+
+    text = RequestServerMetrics(fd);
+    if (!text)
+    {
+        fprintf(stderr, "\nUnable to fetch metrics from %s.\n", argv[1]);
+        close(fd);
+        exit(-1);
+    }
+    fprintf(stdout, "%s", text);
+
+    free(text);
+    close(fd);
+
+    return 0;
+}
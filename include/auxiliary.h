@@ -34,11 +34,14 @@ void DestroyDataset(Dataset **D);                      /* It destroys a dataset
 Dataset *CopyDataset(Dataset *d);                      /* It copies a given dataset */
 Dataset *ConcatenateDataset(Dataset *d1, Dataset *d2); /* It concatenates 2 subsets of a dataset */
 Dataset *UndoConcatenateDataset(Dataset *d1);          /* It undo concatenation of datasets */
+Dataset *CreateDatasetBuffer(int size, int nfeatures); /* It creates a dataset whose samples are the rows of a single block, so it can be reused as an activation buffer */
+void ResizeDatasetBuffer(Dataset *D, int nfeatures);   /* It changes the number of features of a dataset created by CreateDatasetBuffer */
 
 /* Common auxiliary functions */
 void WaiveLibDEEPComment(FILE *fp);                     /* It waives a comment in a LibDEEP model file */
 Subgraph *Dataset2Subgraph(Dataset *D);                 /* It converts a Dataset to a Subgraph */
 Dataset *Subgraph2Dataset(Subgraph *g);                 /* It converts a Subgraph to a Dataset */
+double getDatasetAccuracy(Dataset *D);                  /* It computes the accuracy of the predicted labels of a dataset as opf_Accuracy does */
 gsl_vector *label2binary_gsl_vector(int l, int n_bits); /* It converts an integer to a set of bits. Ex.: for a 3-bit representation, if label = 2, output = 010 */
 gsl_vector *node2gsl_vector(float *x, int n);           /* It converts a graph node to a gsl_vector */
 double *node2double_vector(float *x, int n);            /* It converts a graph node to a double vector */
@@ -0,0 +1,48 @@
+/* It implements a bounded feature cache that lets repeated inference requests skip the forward pass */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "dbn.h"
+
+typedef struct _FeatureCacheEntry
+{
+    uint64_t key;        /* hash of the input */
+    uint64_t generation; /* model generation the output was computed with */
+    int nx, ny;          /* sizes of the stored input and output */
+    double *data;        /* copy of the input, used to rule out hash collisions, followed by the output */
+    int referenced;      /* CLOCK reference bit */
+} FeatureCacheEntry;
+
+typedef struct _FeatureCacheShard
+{
+    pthread_mutex_t lock;
+    FeatureCacheEntry *entry;
+    int *index;                          /* open addressing table of entries (entry id + 1, or 0 if the slot is empty) */
+    int capacity, n_entries, hand, mask; /* hand: CLOCK hand, mask: index size - 1 */
+} FeatureCacheShard;
+
+typedef struct _FeatureCache
+{
+    FeatureCacheShard *shard;
+    int n_shards;
+    uint64_t hits, misses, evictions; /* they are only accessed atomically */
+} FeatureCache;
+
+/* Allocation and deallocation */
+FeatureCache *CreateFeatureCache(int capacity, int n_shards); /* It allocates a feature cache */
+void DestroyFeatureCache(FeatureCache **c);                   /* It deallocates a feature cache */
+
+/* Feature cache */
+uint64_t HashFeatureVector(gsl_vector *x);                                                   /* It computes a 64-bit hash of a feature vector */
+int LookupFeatureCache(FeatureCache *c, gsl_vector *x, uint64_t generation, gsl_vector *y);  /* It looks up the output of an input computed with a given model generation */
+void InsertFeatureCache(FeatureCache *c, gsl_vector *x, uint64_t generation, gsl_vector *y); /* It stores the output of an input, evicting an entry if the shard is full */
+void ClearFeatureCache(FeatureCache *c);                                                     /* It drops every entry of a feature cache */
+
+/* DBN inference */
+gsl_vector *CachedForwardPass(gsl_vector *s, DBN *d, DBNWorkspace *w, FeatureCache *c, uint64_t generation); /* It executes the forward pass for a sample s unless its output is cached */
+
+#endif
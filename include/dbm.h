@@ -5,12 +5,24 @@
 
 #include "rbm.h"
 
+#define DBM_INFERENCE_BATCH_SIZE 256 /* samples per batch of the batched reconstruction and feature extraction */
+
 typedef struct _DBM
 {
     RBM **m;
     int n_layers;
+    struct _EarlyStopping *stopping; /* optional early stopping on held-out samples, owned by the caller (NULL by default) */
 } DBM;
 
+typedef struct _DBMWorkspace
+{
+    gsl_matrix *X;  /* preallocated visible units of a batch of samples */
+    gsl_matrix **H; /* preallocated hidden units' probabilities of each layer on the up pass */
+    gsl_matrix **R; /* preallocated hidden units' probabilities of each layer but the top one on the down pass (R[n_layers - 1] is NULL) */
+    gsl_matrix *V;  /* preallocated probabilities of the reconstructed visible units */
+    int n_layers, batch_size;
+} DBMWorkspace;
+
 /* Allocation and deallocation */
 DBM *CreateDBM(int n_visible_layer_neurons, gsl_vector *n_hidden_units, int n_labels);           /* It allocates a DBM */
 DBM *CreateNewDBM(int n_visible_layer_neurons, int *n_hidden_units, int n_labels, int n_layers); /* It allocates a new DBM */
@@ -24,13 +36,31 @@ double GreedyPreTrainingDBM(Dataset *D, DBM *d, int n_epochs, int n_samplings, i
 double GreedyPreTrainingDBMwithDropout(Dataset *D, DBM *d, int n_epochs, int n_samplings, int batch_size, int LearningType, double *p);     /* It performs DBM with Dropout greedy pre-training step */
 double GreedyPreTrainingDBMwithDropconnect(Dataset *D, DBM *d, int n_epochs, int n_samplings, int batch_size, int LearningType, double *p); /* It performs DBM with Dropconnect greedy pre-training step */
 
+/* Bernoulli DBM joint training */
+void getDBMLayerProbabilities(DBM *d, gsl_matrix **X, int k, gsl_matrix *P);                                                                                           /* It computes the probabilities of turning on the units of a DBM layer given the layers next to it, for a batch of samples at once */
+double DBMMeanFieldInference(DBM *d, gsl_matrix **MU, int n_iterations, double tolerance);                                                                             /* It runs mean-field inference over the hidden layers of a DBM for a batch of samples, with per-sample early exit */
+double BernoulliDBMJointTraining(Dataset *D, DBM *d, int n_epochs, int batch_size, int n_mean_field_iterations, double tolerance, int n_chains, int n_gibbs_sampling); /* It trains a DBM jointly with mean-field inference and persistent Gibbs chains */
+
+/* Bernoulli DBM sampling */
+void BlockGibbsSamplingDBM(DBM *d, gsl_matrix **S, int n_steps, gsl_rng *r); /* It runs odd/even block Gibbs sampling over a batch of DBM chains */
+Dataset *GenerateDBMSamples(DBM *d, int n_samples, int n_gibbs_sampling);    /* It generates samples from a DBM by running independent chains from random states */
+
+/* Bernoulli DBM inference */
+DBMWorkspace *CreateDBMWorkspace(DBM *d, int batch_size);             /* It allocates the scratch matrices used by the batched DBM inference paths */
+void DestroyDBMWorkspace(DBMWorkspace **w);                           /* It deallocates a DBM workspace */
+gsl_matrix *BatchDBMUpPass(gsl_matrix *X, DBM *d, DBMWorkspace *w);   /* It executes the up pass of a DBM for a batch of samples using one GEMM per layer */
+gsl_matrix *BatchDBMDownPass(gsl_matrix *X, DBM *d, DBMWorkspace *w); /* It executes the down pass of a DBM for the batch of the last up pass, returning the reconstructed visible units */
+
 /* Bernoulli DBM reconstruction */
 double BernoulliDBMReconstruction(Dataset *D, DBM *d); /* It reconstructs an input dataset given a trained DBM */
+double getDBMReconstructionError(Dataset *D, DBM *d);  /* It computes the mean reconstruction error of a dataset given a DBM */
 
 /* Auxiliary functions */
 gsl_vector *getProbabilityTurningOnDBMIntermediateLayersOnDownPass(RBM *m, gsl_vector *h, RBM *beneath_layer); /* It computes the probability of turning on an intermediate layer of a DBM, as show in Eq. 28 and 29 */
 void saveDBMParameters(DBM *d, char *file);                                                                    /* It saves DBM weight matrixes and bias vectors */
 void loadDBMParametersFromFile(DBM *d, char *file);                                                            /* It loads DBM weight matrixes and bias vectors from file */
+int saveDBMParametersBinary(DBM *d, char *file);                                                               /* It saves a DBM to a binary model file */
+DBM *loadDBMFromBinaryFile(char *file);                                                                        /* It allocates a DBM from a binary model file */
 
 void extractDBMUpperLayerFeatures(Dataset *D, DBM *d, char *fileName); /* It generates a file in OPF format with DBM's upper hidden layer units values as features */
 
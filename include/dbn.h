@@ -3,14 +3,48 @@
 #ifndef DBN_H
 #define DBN_H
 
+#include <stdint.h>
+#include <pthread.h>
+
 #include "rbm.h"
+#include "metrics.h"
+
+typedef struct _DBNLayerCache
+{
+    char *dir;          /* directory holding one <key>.layer file per cached layer */
+    unsigned long seed; /* seed of the run, which is part of every key */
+} DBNLayerCache;
 
 typedef struct _DBN
 {
     RBM **m;
     int n_layers;
+    DBNLayerCache *cache;            /* optional on-disk cache of greedily trained layers, owned by the caller (NULL by default) */
+    struct _EarlyStopping *stopping; /* optional early stopping on held-out samples, applied to every layer, owned by the caller (NULL by default) */
 } DBN;
 
+typedef struct _DBNWorkspace
+{
+    gsl_vector **h;   /* preallocated hidden units' probabilities of each layer */
+    gsl_matrix **H;   /* preallocated hidden units' probabilities of each layer for a batch of samples (NULL if batch_size is 0) */
+    Metrics *metrics; /* optional registry updated by BatchForwardPass with the throughput of each layer (NULL by default) */
+    int n_layers, batch_size;
+} DBNWorkspace;
+
+typedef struct _DBNPipelineStage
+{
+    DBN *d;
+    int id;                          /* layer trained by the stage */
+    Dataset *input;                  /* hidden probabilities of the layer beneath (the training set for the bottom layer) */
+    RBM *snapshot;                   /* weights and hidden biases the layer had at the end of its last round */
+    int epochs_done, finished;       /* training progress, which the stage above waits on */
+    pthread_mutex_t lock;            /* it protects input, snapshot and the training progress */
+    pthread_cond_t progress;         /* it is signaled after every round */
+    struct _DBNPipelineStage *below; /* stage of the layer beneath (NULL for the bottom layer) */
+    int n_epochs, n_CD_iterations, batch_size, LearningType, Regularization, n_warmup_epochs, n_refresh_epochs;
+    double p, error;
+} DBNPipelineStage;
+
 /* Allocation and deallocation */
 DBN *CreateDBN(int n_visible_units, gsl_vector *n_hidden_units, int n_labels, int n_layers); /* It allocates an DBN */
 DBN *CreateNewDBN(int n_visible_units, int *n_hidden_units, int n_labels, int n_layers);     /* It allocates an new DBN */
@@ -22,6 +56,10 @@ void DBNSaveWeights(DBN *d, char *path); /* It writes the weight matrix as PGM i
 /* DBN initialization */
 void InitializeDBN(DBN *d); /* It initializes an DBN */
 
+/* DBN layer cache */
+DBNLayerCache *CreateDBNLayerCache(char *dir, unsigned long seed); /* It allocates an on-disk cache of greedily trained layers */
+void DestroyDBNLayerCache(DBNLayerCache **c);                      /* It deallocates a layer cache, leaving its files on disk */
+
 /* Bernoulli DBN training */
 double BernoulliDBNTrainingbyContrastiveDivergence(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size);                                         /* It trains a DBN for image reconstruction using Contrastive Divergence */
 double BernoulliDBNTrainingbyContrastiveDivergenceWithDropout(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p);                   /* It trains a DBN with Dropout for image reconstruction using Contrastive Divergence */
@@ -29,22 +67,34 @@ double BernoulliDBNTrainingbyContrastiveDivergenceWithDropconnect(Dataset *D, DB
 double BernoulliDBNTrainingbyPersistentContrastiveDivergence(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size);                               /* It trains a DBN for image reconstruction using Persistent Contrastive Divergence */
 double BernoulliDBNTrainingbyPersistentContrastiveDivergenceWithDropout(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p);         /* It trains a DBN with Dropout for image reconstruction using Persistent Contrastive Divergence */
 double BernoulliDBNTrainingbyPersistentContrastiveDivergenceWithDropconnect(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p);     /* It trains a DBN with Dropconnect for image reconstruction using Persistent Contrastive Divergence */
+double BernoulliDBNTrainingbyContrastiveDivergenceWithBoundedMemory(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size);                        /* It trains a DBN for image reconstruction using Contrastive Divergence with bounded memory */
 double BernoulliDBNTrainingbyFastPersistentContrastiveDivergence(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size);                           /* It trains a DBN for image reconstruction using Fast Persistent Contrastive Divergence */
 double BernoulliDBNTrainingbyFastPersistentContrastiveDivergenceWithDropout(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p);     /* It trains a DBN with Dropout for image reconstruction using Fast Persistent Contrastive Divergence */
 double BernoulliDBNTrainingbyFastPersistentContrastiveDivergenceWithDropconnect(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p); /* It trains a DBN with Dropconnect for image reconstruction using Fast Persistent Contrastive Divergence */
 
+/* Pipelined DBN training */
+double BernoulliDBNPipelinedTraining(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, int LearningType, int Regularization, double *p, int n_warmup_epochs, int n_refresh_epochs); /* It trains all the layers of a DBN concurrently, each one refreshing its input from the layer beneath it */
+
 /* Bernoulli DBN reconstruction */
 double BernoulliDBNReconstruction(Dataset *D, DBN *d); /* It reconstructs an input dataset given a trained DBN */
 
 /* Backpropagation fine-tuning (IN PROGRESS) */
 gsl_vector *ForwardPass(gsl_vector *s, DBN *d); /* It executes the forward pass for a given sample s, and outputs the net's response for that sample */
 
+/* DBN inference */
+DBNWorkspace *CreateDBNWorkspace(DBN *d, int batch_size);             /* It allocates the scratch vectors and matrices used by the allocation-free inference paths */
+void DestroyDBNWorkspace(DBNWorkspace **w);                           /* It deallocates a DBN workspace */
+gsl_vector *FASTForwardPass(gsl_vector *s, DBN *d, DBNWorkspace *w);  /* It executes the forward pass for a given sample s without any heap allocation */
+gsl_matrix *BatchForwardPass(gsl_matrix *X, DBN *d, DBNWorkspace *w); /* It executes the forward pass for a batch of samples using one GEMM per layer */
+
 /* Data conversion */
 Subgraph *DBN2Subgraph(DBN *d, Dataset *D); /* It generates a subgraph using the learned features from the top layer of the DBN over the dataset */
 
 /* Auxiliary functions */
 void saveDBNParameters(DBN *d, char *file);         /* It saves DBN weight matrixes and bias vectors */
 void loadDBNParametersFromFile(DBN *d, char *file); /* It loads DBN weight matrixes and bias vectors from file */
+int saveDBNParametersBinary(DBN *d, char *file);    /* It saves a DBN to a binary model file */
+DBN *loadDBNFromBinaryFile(char *file);             /* It allocates a DBN from a binary model file */
 
 void extractDBNUpperLayerFeatures(Dataset *D, DBN *d, char *fileName); /* It generates a file in OPF format with DBN's upper hidden layer units values as features */
 
@@ -39,6 +39,13 @@ extern "C"
 #include "epnn.h"
 #include "pca.h"
 #include "ann.h"
+#include "metrics.h"
+#include "cache.h"
+#include "serving.h"
+#include "sampler.h"
+#include "optimizer.h"
+#include "stopping.h"
+#include "monitor.h"
 
 #ifdef __cplusplus
 }
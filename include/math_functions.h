@@ -3,6 +3,7 @@
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_linalg.h>
 #include <gsl/gsl_blas.h>
+#include <gsl/gsl_rng.h>
 
 #define PI 3.1415926536
 
@@ -18,3 +19,5 @@ void ComputeVariances(int size, gsl_matrix *mu, gsl_matrix **cov);
 double Determinant(gsl_matrix *m);                                              /* It computes the matrix determinant */
 double GaussianDensity(gsl_matrix **cov, gsl_matrix *mu, gsl_vector *x, int j); /* It computes the a multivariate gaussian density of a sample x */
 gsl_matrix *PseudoInverse(gsl_matrix *A);                                       /* It computes the Moore�Penrose Pseudoinverse A+ = VS^+U^T */
+
+void SampleBernoulliMatrix(gsl_matrix *P, gsl_matrix *S, gsl_rng *r); /* It samples a binary matrix whose entries are turned on with the probabilities held by another one */
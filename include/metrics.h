@@ -0,0 +1,54 @@
+/* It implements a lock-free metrics registry with HDR-style histograms and a Prometheus text format dump */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Histogram buckets are log-linear: every power of two is split into 2^METRICS_SUB_BUCKET_BITS buckets, which bounds the relative error of a recorded value by 1/16 */
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_MAX_EXPONENT 48 /* values are clamped to 2^METRICS_MAX_EXPONENT - 1 */
+#define METRICS_N_BUCKETS ((METRICS_MAX_EXPONENT - METRICS_SUB_BUCKET_BITS + 1) << METRICS_SUB_BUCKET_BITS)
+#define METRICS_MAX_LAYERS 32
+
+typedef struct _MetricsHistogram
+{
+    uint64_t counts[METRICS_N_BUCKETS];
+    uint64_t count, sum, max;
+} MetricsHistogram;
+
+typedef struct _LayerMetrics
+{
+    uint64_t samples;     /* samples propagated through the layer */
+    uint64_t nanoseconds; /* time spent propagating them */
+} LayerMetrics;
+
+typedef struct _Metrics
+{
+    uint64_t requests[4];        /* answered requests, indexed by response status */
+    uint64_t batches;            /* batches run by the workers */
+    MetricsHistogram batch_size; /* samples per batch */
+    MetricsHistogram queue_wait; /* time between a request's arrival and the start of its batch, in nanoseconds */
+    MetricsHistogram compute;    /* time spent in the forward pass of each batch, in nanoseconds */
+    MetricsHistogram latency;    /* time between a request's arrival and its answer, in nanoseconds */
+    LayerMetrics layer[METRICS_MAX_LAYERS];
+} Metrics;
+
+/* Allocation and deallocation */
+Metrics *CreateMetrics(void);     /* It allocates an empty metrics registry */
+void DestroyMetrics(Metrics **m); /* It deallocates a metrics registry */
+
+/* Recording (lock-free, safe to call from any thread) */
+void IncrementMetricsCounter(uint64_t *counter, uint64_t n);                   /* It adds n to a counter */
+void RecordMetricsHistogram(MetricsHistogram *h, uint64_t value);              /* It records a value in a histogram */
+void RecordLayerMetrics(Metrics *m, int layer, uint64_t samples, uint64_t ns); /* It records the samples propagated through a layer and the time it took */
+
+/* Querying */
+uint64_t getMetricsHistogramQuantile(MetricsHistogram *h, double q);                                           /* It computes an approximate quantile of a histogram */
+uint64_t getElapsedNanoseconds(struct timespec *start, struct timespec *end);                                  /* It computes the time between two timestamps in nanoseconds */
+void PrintMetricsHistogram(FILE *fp, char *prefix, char *name, char *help, MetricsHistogram *h, double scale); /* It writes a histogram as a Prometheus summary */
+void PrintMetrics(FILE *fp, Metrics *m, char *prefix);                                                         /* It writes the whole registry in the Prometheus text format */
+
+#endif
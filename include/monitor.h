@@ -0,0 +1,48 @@
+/* It implements an asynchronous training monitor, which evaluates snapshots of an RBM on a low-priority thread while the trainer goes on */
+
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rbm.h"
+
+typedef struct _MonitorSnapshot
+{
+    RBM *m;                /* copy of the parameters the metrics depend on (W, a, b, sigma and t) */
+    long batch;            /* batches trained when the copy was taken */
+    long version;          /* sequence number of the snapshot */
+    struct timespec taken; /* time the copy was taken at */
+} MonitorSnapshot;
+
+typedef struct _TrainingMonitor
+{
+    Dataset *held_out;           /* fixed held-out samples, owned by the caller */
+    Dataset *reference;          /* training samples the free-energy gap is measured against (NULL to skip it), owned by the caller */
+    int n_samples;               /* held-out samples evaluated, and at most as many reference ones */
+    int interval;                /* batches between two snapshots */
+    FILE *log;                   /* stream the records are written to, one JSON object per line */
+    int *flip;                   /* visible unit flipped by the pseudo-likelihood of every held-out sample, drawn once so that the records compare */
+    long batches;                /* batches trained since the monitor was attached (only touched by the training thread) */
+    MonitorSnapshot buffer[2];   /* double buffer: the trainer fills the one the monitor thread is not reading */
+    int pending, reading;        /* buffer with the newest snapshot not evaluated yet, and buffer under evaluation (-1 if none) */
+    long n_snapshots, n_dropped; /* snapshots taken, and the ones overwritten before the monitor thread got to them */
+    int running;                 /* it is cleared to stop the monitor thread once the pending snapshot is evaluated */
+    struct timespec start;       /* time the monitor was created at */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} TrainingMonitor;
+
+/* Allocation and deallocation */
+TrainingMonitor *CreateTrainingMonitor(RBM *m, Dataset *held_out, Dataset *reference, int n_samples, int interval, FILE *log); /* It allocates a training monitor for an RBM and starts its thread */
+void DestroyTrainingMonitor(TrainingMonitor **t);                                                                              /* It evaluates the pending snapshot, stops the monitor thread and deallocates the monitor */
+
+/* Monitoring */
+void SnapshotTrainingMonitor(TrainingMonitor *t, RBM *m);                /* It hands a copy of the parameters of an RBM over to the monitor thread */
+void PublishTrainingMonitor(RBM *m);                                     /* It accounts for a trained batch, taking a snapshot every t->interval batches */
+double getMonitorPseudoLikelihood(Dataset *D, int n, int *flip, RBM *m); /* It computes the mean pseudo-likelihood of the first n samples of a dataset */
+
+#endif
@@ -0,0 +1,30 @@
+/* It implements the fused parameter updates shared by the RBM-family trainers */
+
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "rbm.h"
+
+#define OPTIMIZER_PARALLEL_THRESHOLD 65536 /* parameters of a matrix below which its update runs on a single thread */
+#define OPTIMIZER_TILE_ROWS 64             /* rows of the gradient tiles computed from the activations of a mini-batch */
+
+typedef struct _ParameterState
+{
+    int optimizer;       /* update rule the state was allocated for */
+    size_t size1, size2; /* shape of the parameter block (size2 is 1 for vectors) */
+    long step;           /* number of updates applied to the block, for the bias correction of Adam */
+    double *delta;       /* last update of every parameter (SGD and Nesterov), or running average of its gradient (Adam) */
+    double *square;      /* sum (AdaGrad) or running average (RMSProp and Adam) of the squared gradients of every parameter */
+} ParameterState;
+
+/* Allocation and deallocation */
+ParameterState *CreateParameterState(RBM *m, size_t size1, size_t size2); /* It allocates the optimizer state of a parameter block */
+void DestroyParameterState(ParameterState **s);                            /* It deallocates the optimizer state of a parameter block */
+
+/* Fused updates */
+void UpdateParameterMatrix(RBM *m, gsl_matrix *W, gsl_matrix *pos, gsl_matrix *neg, double scale, double eta, double lambda, ParameterState *s);                                                                           /* It updates a weight matrix by the optimizer of the RBM in a single pass */
+void UpdateFastParameterMatrix(RBM *m, gsl_matrix *W, gsl_matrix *pos, gsl_matrix *neg, double scale, double eta, double lambda, ParameterState *s, gsl_matrix *fast_W, gsl_matrix *eff_W, double fast_eta, double ratio); /* It updates the regular, fast and effective weights of FPCD in a single sweep */
+void UpdateParameterVector(RBM *m, gsl_vector *w, gsl_vector *pos, gsl_vector *neg, double scale, double eta, ParameterState *s);                                                                                          /* It updates a bias vector by the optimizer of the RBM in a single pass */
+void UpdateParameterMatrix4Batch(RBM *m, gsl_matrix *W, gsl_matrix *X, gsl_matrix *H, double pos_scale, gsl_matrix *Xn, gsl_matrix *Hn, double neg_scale, double eta, double lambda, ParameterState *s);                   /* It updates a weight matrix tile by tile straight from the activations of a mini-batch */
+
+#endif
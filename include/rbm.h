@@ -3,6 +3,8 @@
 #ifndef RBM_H
 #define RBM_H
 
+#include <stdint.h>
+
 /* GSL libraries */
 #include <gsl/gsl_randist.h>
 #include <gsl/gsl_rng.h>
@@ -11,40 +13,71 @@
 #include "auxiliary.h"
 #include "math_functions.h"
 
+/* Binary model files start with this 8-byte tag, followed by the model kind and its number of layers */
+#define MODEL_FILE_MAGIC "LIBDEEP1"
+#define MODEL_FILE_RBM 1
+#define MODEL_FILE_DBN 2
+#define MODEL_FILE_DBM 3
+#define MODEL_FILE_LAYER 4 /* one greedily trained layer and its activations, see DBNLayerCache */
+
+#define RBM_PROPAGATION_CHUNK_SIZE 256 /* samples propagated by each GEMM of getDatasetProbabilityTurningOnHiddenUnit */
+
+#define OPTIMIZER_SGD 0      /* stochastic gradient descent with classical momentum (alpha) */
+#define OPTIMIZER_NESTEROV 1 /* Nesterov's accelerated gradient, with momentum alpha */
+#define OPTIMIZER_ADAGRAD 2  /* AdaGrad */
+#define OPTIMIZER_RMSPROP 3  /* RMSProp, whose running average of the squared gradients decays by beta2 */
+#define OPTIMIZER_ADAM 4     /* Adam */
+
 typedef struct _RBM
 {
     int n_visible_layer_neurons, n_hidden_layer_neurons, n_labels;
     double eta, lambda, alpha, t;
-    double eta_min, eta_max; /* mininum and maximum values of the lerning rate */
-    gsl_vector *v;           /* visible layer neurons */
-    gsl_vector *h;           /* hidden layer neurons */
-    gsl_matrix *W;           /* weight matrix */
-    gsl_matrix *U;           /* weight matrix for labels */
-    gsl_vector *a;           /* visible neurons' bias */
-    gsl_vector *b;           /* hidden neurons' bias */
-    gsl_vector *c;           /* label neurons' bias */
-    gsl_vector *r;           /* hidden neurons' dropout bias */
-    gsl_matrix *M;           /* weight matrix dropconnect bias */
-    gsl_vector *sigma;       /* variance associated to each visible neuron for Gaussian visible units */
+    double eta_min, eta_max;         /* mininum and maximum values of the lerning rate */
+    gsl_vector *v;                   /* visible layer neurons */
+    gsl_vector *h;                   /* hidden layer neurons */
+    gsl_matrix *W;                   /* weight matrix */
+    gsl_matrix *U;                   /* weight matrix for labels */
+    gsl_vector *a;                   /* visible neurons' bias */
+    gsl_vector *b;                   /* hidden neurons' bias */
+    gsl_vector *c;                   /* label neurons' bias */
+    gsl_vector *r;                   /* hidden neurons' dropout bias */
+    gsl_matrix *M;                   /* weight matrix dropconnect bias */
+    gsl_vector *sigma;               /* variance associated to each visible neuron for Gaussian visible units */
+    double sigma_eta;                /* learning rate of the inverse of sigma in the Gaussian-Bernoulli trainers, which keep sigma fixed when it is zero */
+    int optimizer;                   /* rule the trainers update the parameters with (OPTIMIZER_SGD, OPTIMIZER_NESTEROV, OPTIMIZER_ADAGRAD, OPTIMIZER_RMSPROP or OPTIMIZER_ADAM) */
+    double beta1, beta2;             /* decay rates of the running averages of the gradients (Adam) and of their squares (RMSProp and Adam) */
+    double epsilon;                  /* constant that keeps the steps of the adaptive optimizers finite */
+    struct _EarlyStopping *stopping; /* optional early stopping on held-out samples, owned by the caller (NULL by default) */
+    struct _TrainingMonitor *monitor; /* optional asynchronous training monitor, owned by the caller (NULL by default) */
 } RBM;
 
+typedef struct _DropconnectMask
+{
+    uint64_t seed;      /* seed of the run */
+    uint64_t sample;    /* counter of the sample the current mask belongs to, which the trainers advance once per sample */
+    uint64_t threshold; /* a connection is kept when the top 53 bits of its hash fall below threshold = p * 2^53 */
+} DropconnectMask;
+
 /* Allocation and deallocation */
 RBM *CreateRBM(int n_visible_layers, int n_hidden_layers, int n_labels);                   /* It allocates an RBM */
 RBM *CreateDRBM(int n_visible_units, int n_hidden_units, int n_labels, gsl_vector *sigma); /* It allocates a DRBM */
 RBM *CreateNewDRBM(int n_visible_units, int n_hidden_units, int n_labels, double *sigma);  /* It allocates a new DRBM */
 void DestroyRBM(RBM **m);                                                                  /* It deallocates an RBM */
-void DestroyDRBM(RBM **m);                                                                 /* It deallocates a DRBM */
+void DestroyDRBM(RBM **m);
+DropconnectMask *CreateDropconnectMask(double p, unsigned long seed); /* It allocates a dropconnect mask whose bits are hashed on the fly */
+void DestroyDropconnectMask(DropconnectMask **M);                     /* It deallocates a dropconnect mask */                                                                 /* It deallocates a DRBM */
 
 /* RBM initialization */
 void InitializeBias4VisibleUnits(RBM *m, Dataset *D);     /* It initializes the bias of visible units according to Section 8.1 */
 void InitializeBias4VisibleUnitsWithRandomValues(RBM *m); /* It initializes the bias of visible units with small random values [0,1] */
 void InitializeBias4HiddenUnits(RBM *m);                  /* It initializes the bias of hidden units according to Section 8.1 */
-void InitializeBias4DropoutHiddenUnits(RBM *m, double p); /* It initializes the bias of hidden units dropout */
-void InitializeBias4DropconnectWeight(RBM *m, double p);  /* It initializes the bias of dropconnect */
-void InitializeBias4LabelUnits(RBM *m);                   /* It initializes the bias of label units */
-void InitializeWeights(RBM *m);                           /* It initializes the weight matrix according to Section 8.1 */
-void InitializeLabelWeights(RBM *m);                      /* It initializes the label weight matrix according to Section 8.1 */
-void setVisibleLayer(RBM *m, gsl_vector *visible_layer);  /* It sets the visible layer of a Restricted Boltzmann Machine */
+void InitializeBias4DropoutHiddenUnits(RBM *m, double p);
+int SampleDropoutHiddenUnits(RBM *m, double p, gsl_rng *r, int *active); /* It draws the hidden units dropout array and compacts the indices of the surviving units */ /* It initializes the bias of hidden units dropout */
+void InitializeBias4DropconnectWeight(RBM *m, double p);                 /* It initializes the bias of dropconnect */
+void InitializeBias4LabelUnits(RBM *m);                                  /* It initializes the bias of label units */
+void InitializeWeights(RBM *m);                                          /* It initializes the weight matrix according to Section 8.1 */
+void InitializeLabelWeights(RBM *m);                                     /* It initializes the label weight matrix according to Section 8.1 */
+void setVisibleLayer(RBM *m, gsl_vector *visible_layer);                 /* It sets the visible layer of a Restricted Boltzmann Machine */
 
 /* RBM information */
 void PrintWeights(RBM *m);                                                                 /* It prints the weights */
@@ -57,6 +90,14 @@ void PrintDropconnectWeight(RBM *m);
 void SaveRBMFeatures(char *s, Dataset *D, RBM *m);                                         /* It saves the learned features from the hidden vector neurons */
 void SaveWeightsWithoutCV(RBM *m, char *name, int indexHiddenUnit, int width, int height); /* It writes the weight matrix as PGM images without using CV */
 
+/* RBM serialization */
+int fwriteModelHeader(FILE *fp, int kind, int n_layers);  /* It writes the header shared by all binary model files */
+int freadModelHeader(FILE *fp, int *kind, int *n_layers); /* It reads and validates the header of a binary model file */
+int fwriteRBMParameters(FILE *fp, RBM *m);                /* It writes the parameters of an RBM to a binary stream */
+RBM *freadRBMParameters(FILE *fp);                        /* It reads the parameters of an RBM from a binary stream */
+int saveRBMParametersBinary(RBM *m, char *file);          /* It saves an RBM to a binary model file */
+RBM *loadRBMFromBinaryFile(char *file);                   /* It allocates an RBM from a binary model file */
+
 /* Bernoulli-Bernoulli RBM training */
 double BernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size);                                         /* It trains a Bernoulli RBM by Constrative Divergence for image reconstruction (binary images) */
 double BernoulliRBMTrainingbyContrastiveDivergencewithDropout(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p);                    /* It trains a Bernoulli RBM by Constrative Divergence for image reconstruction (binary images) with Dropout */
@@ -64,11 +105,16 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropconnect(Dataset *D, RB
 double BernoulliRBMTrainingbyPersistentContrastiveDivergence(Dataset *D, RBM *m, int n_epochs, int n_PCD_iterations, int batch_size);                              /* It trains a Bernoulli RBM by Persistent Constrative Divergence */
 double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropout(Dataset *D, RBM *m, int n_epochs, int n_PCD_iterations, int batch_size, double p);         /* It trains a Bernoulli RBM by Persistent Constrative Divergence with Dropout */
 double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropconnect(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p);      /* It trains a Bernoulli RBM with Dropconnect by Persistent Constrative Divergence */
+double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithChains(Dataset *D, RBM *m, int n_epochs, int n_PCD_iterations, int batch_size, int n_chains);      /* It trains a Bernoulli RBM by Persistent Constrative Divergence with a given number of persistent chains */
+double BernoulliRBMTrainingbyContrastiveDivergencewithBoundedMemory(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size);                        /* It trains a Bernoulli RBM by Constrative Divergence with bounded memory, without full-size statistics matrices */
 double BernoulliRBMTrainingbyFastPersistentContrastiveDivergence(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size);                          /* It trains a Bernoulli RBM by Fast Persistent Constrative Divergence */
 double BernoulliRBMTrainingbyFastPersistentContrastiveDivergencewithDropout(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size, double p);     /* It trains a Bernoulli RBM by Fast Persistent Constrative Divergence with Dropout */
 double BernoulliRBMTrainingbyFastPersistentContrastiveDivergencewithDropconnect(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size, double p); /* It trains a Bernoulli RBM with Dropconnect by Fast Persistent Constrative Divergence */
+double BernoulliRBMTrainingbyFastPersistentContrastiveDivergencewithChains(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size, int n_chains);  /* It trains a Bernoulli RBM by Fast Persistent Constrative Divergence with a given number of persistent chains */
 double DiscriminativeBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size);                          /* It trains a Discriminative Bernoulli RBM by Constrative Divergence for pattern classification */
 double DiscriminativeBernoulliRBMTrainingbyContrastiveDivergencewithDropout(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size, double p);     /* It trains a Discriminative Bernoulli RBM with Dropout by Constrative Divergence for pattern classification */
+double DiscriminativeBernoulliRBMTrainingbyExactGradient(Dataset *D, RBM *m, int n_epochs, int batch_size);                                                        /* It trains a Discriminative Bernoulli RBM by the exact gradient of the conditional log-likelihood for pattern classification */
+double DiscriminativeBernoulliRBMTrainingbyHybridGradient(Dataset *D, RBM *m, int n_epochs, int batch_size, double generative_weight);                             /* It trains a Discriminative Bernoulli RBM by the exact conditional gradient plus a weighted generative one for pattern classification */
 double Bernoulli_TrainingRBMbyCD4DBM_BottomLayer(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size);                                           /* It trains a Bernoulli RBM by Constrative Divergence for image reconstruction regarding DBMs at the bottom layer */
 double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropout(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p);                      /* It trains a Bernoulli RBM with Dropout by Constrative Divergence for image reconstruction regarding DBMs at the bottom layer */
 double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropconnect(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p);                  /* It trains a Bernoulli RBM with Dropconnect by Constrative Divergence for image reconstruction regarding DBMs at the bottom layer */
@@ -94,39 +140,55 @@ double GaussianBernoulliRBMReconstruction(Dataset *D, RBM *m);       /* It recon
 double DiscriminativeBernoulliRBMClassification(Dataset *D, RBM *m); /* It classifies an input dataset given a trained RBM and it outputs the classification error */
 
 /* Auxiliary functions */
-double FreeEnergy(RBM *m, gsl_vector *v);                                                                                            /* It computes the pseudo-likelihood of a sample x in an RBM, and it assumes x is a binary vector */
-double FreeEnergy4DRBM(RBM *m, int y, gsl_vector *x);                                                                                /* It computes the free energy of a given label and a sample */
-gsl_vector *getProbabilityTurningOnHiddenUnit(RBM *m, gsl_vector *v);                                                                /* It computes the probability of turning on a hidden unit j, as described by Equation 10 */
-gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit(RBM *m, gsl_vector *r, gsl_vector *v);                          /* It computes the probability of dropping out visible units and turning on a hidden unit j, as described by Equation 11 */
-gsl_vector *getProbabilityTurningOnHiddenUnit4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *v);                                     /* It computes the probability of turning on a hidden unit j using a dropconnect mask */
-gsl_vector *getProbabilityTurningOnHiddenUnit4DBM(RBM *m, gsl_vector *v);                                                            /* It computes the probability of turning on a hidden unit j considering a DBM at bottom layer */
-gsl_vector *getProbabilityTurningOnHiddenUnit4DBM4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *v);                                 /* It computes the probability of turning on a hidden unit j using a dropconnect mask considering a DBM at bottom layer */
-gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4DBM(RBM *m, gsl_vector *r, gsl_vector *v);                      /* It computes the probability of dropping visible units for turning on a hidden unit j considering a DBM at bottom layer using Equation 22 */
-gsl_vector *getProbabilityTurningOnHiddenUnit4FPCD(RBM *m, gsl_vector *v, gsl_matrix *fast_W);                                       /* It computes the probability of turning on a hidden unit j for FPCD */
-gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4FPCD(RBM *m, gsl_vector *r, gsl_vector *v, gsl_matrix *fast_W); /* It computes the probability of dropping out visible units and turning on a hidden unit j for FPCD */
-gsl_vector *getProbabilityTurningOnHiddenUnit4FPCD4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *v, gsl_matrix *fast_W);            /* It computes the probability of turning on a hidden unit j for FPCD with a dropconnect mask */
-gsl_vector *getProbabilityTurningOnVisibleUnit(RBM *m, gsl_vector *h);                                                               /* It computes the probability of turning on a visible unit j, as described by Equation 11 */
-gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit(RBM *m, gsl_vector *r, gsl_vector *h);                          /* It computes the probability of dropping out hidden units and turning on a visible unit j, as described by Equation 11 */
-gsl_vector *getProbabilityTurningOnVisibleUnit4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *h);                                    /* It computes the probability of turning on a visible unit j using a dropconnect mask */
-gsl_vector *getProbabilityTurningOnVisibleUnit4DBM(RBM *m, gsl_vector *h);                                                           /* It computes the probability of turning on a visible unit j considering a DBM at top layer */
-gsl_vector *getProbabilityTurningOnVisibleUnit4DBM4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *h);                                /* It computes the probability of turning on a visible unit j using a dropconnect mask considering a DBM at top layer */
-gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4DBM(RBM *m, gsl_vector *r, gsl_vector *h);                      /* It computes the probability of dropping hidden units for turning on a visible unit j considering a DBM at top layer */
-gsl_vector *getProbabilityTurningOnVisibleUnit4FPCD(RBM *m, gsl_vector *h, gsl_matrix *fast_W);                                      /* It computes the probability of turning on a visible unit j for FPCD */
-gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4FPCD(RBM *m, gsl_vector *r, gsl_vector *h, gsl_matrix *fast_W); /* It computes the probability of dropping out hidden units and turning on a visible unit j for FPCD */
-gsl_vector *getProbabilityTurningOnVisibleUnit4FPCD4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *h, gsl_matrix *fast_W);           /* It computes the probability of turning on a visible unit j for FPCD using a dropconnect mask */
-gsl_vector *getProbabilityTurningOnHiddenUnit4Gaussian(RBM *m, gsl_vector *v, gsl_vector *sigma);                                    /* It computes the probability of turning on a hidden unit j considering Gaussian RBMs */
-gsl_vector *getProbabilityTurningOnHiddenUnit4Gaussian4Dropout(RBM *m, gsl_vector *r, gsl_vector *v, gsl_vector *sigma);             /* It computes the probability of turning on a hidden unit j considering Gaussian RBMs with Dropout */
-gsl_vector *getProbabilityTurningOnVisibleUnit4Gaussian(RBM *m, gsl_vector *h, gsl_vector *sigma);                                   /* It computes the probability of turning on a visible unit i considering Gaussian RBMs */
-gsl_vector *getProbabilityTurningOnVisibleUnit4Gaussian4Dropout(RBM *m, gsl_vector *r, gsl_vector *h, gsl_vector *sigma);            /* It computes the probability of turning on a visible unit i considering Gaussian RBMs with Dropout */
-gsl_vector *getDiscriminativeProbabilityTurningOnHiddenUnit(RBM *m, gsl_vector *y);                                                  /* It computes the probability of turning on a hidden unit j considering Discriminative RBMs and Bernoulli visible units */
-gsl_vector *getDiscriminativeProbabilityTurningOnHiddenUnit4Dropout(RBM *m, gsl_vector *r, gsl_vector *y);                           /* It computes the probability of turning on a hidden unit j with Dropout considering Discriminative RBMs with Bernoulli visible units, i..e, p(h|y,x) */
-gsl_vector *getDiscriminativeProbabilityTurningOnHiddenUnit4GaussianVisibleUnit(RBM *m, gsl_vector *y);                              /* It computes the probability of turning on a hidden unit j considering Discriminative RBMs and Gaussian visible units */
-gsl_vector *getDiscriminativeProbabilityTurningOnHiddenUnit4GaussianVisibleUnit4Dropout(RBM *m, gsl_vector *r, gsl_vector *y);       /* It computes the probability of turning on a hidden unit j with Dropout considering Discriminative RBMs and Gaussian visible units */
-gsl_vector *getDiscriminativeProbabilityTurningOnVisibleUnit4GaussianVisibleUnit(RBM *m, gsl_vector *h);                             /* It computes the probability of turning on a visible unit i considering Discriminative RBMs and Gaussian visible units */
-gsl_vector *getDiscriminativeProbabilityTurningOnVisibleUnit4GaussianVisibleUnit4Dropout(RBM *m, gsl_vector *r, gsl_vector *h);      /* It computes the probability of turning on a visible unit i with Dropout considering Discriminative RBMs and Gaussian visible units */
-gsl_vector *getDiscriminativeProbabilityLabelUnit(RBM *m);                                                                           /* It computes the probability of label unit (y) given the hidden (h) one, i.e., P(y|h) */
-double getReconstructionError(gsl_vector *input, gsl_vector *output);                                                                /* It computes the minimum square error among input and output */
-double getPseudoLikelihood(RBM *m, gsl_vector *x);                                                                                   /* It computes the pseudo-likelihood of a sample x in an RBM */
-void FASTgetProbabilityTurningOnHiddenUnit(RBM *m, gsl_vector *v, gsl_vector *prob_h);                                               /* It computes the probability of turning on a hidden unit - Fast version */
+double FreeEnergy(RBM *m, gsl_vector *v);                                                                                                               /* It computes the pseudo-likelihood of a sample x in an RBM, and it assumes x is a binary vector */
+double FreeEnergy4DRBM(RBM *m, int y, gsl_vector *x);                                                                                                   /* It computes the free energy of a given label and a sample */
+gsl_vector *getProbabilityTurningOnHiddenUnit(RBM *m, gsl_vector *v);                                                                                   /* It computes the probability of turning on a hidden unit j, as described by Equation 10 */
+gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit(RBM *m, gsl_vector *r, gsl_vector *v);                                             /* It computes the probability of dropping out visible units and turning on a hidden unit j, as described by Equation 11 */
+gsl_vector *getProbabilityTurningOnHiddenUnit4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *v);                                                        /* It computes the probability of turning on a hidden unit j using a dropconnect mask */
+gsl_vector *getProbabilityTurningOnHiddenUnit4DBM(RBM *m, gsl_vector *v);                                                                               /* It computes the probability of turning on a hidden unit j considering a DBM at bottom layer */
+gsl_vector *getProbabilityTurningOnHiddenUnit4DBM4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *v);                                                    /* It computes the probability of turning on a hidden unit j using a dropconnect mask considering a DBM at bottom layer */
+gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4DBM(RBM *m, gsl_vector *r, gsl_vector *v);                                         /* It computes the probability of dropping visible units for turning on a hidden unit j considering a DBM at bottom layer using Equation 22 */
+gsl_vector *getProbabilityTurningOnHiddenUnit4FPCD(RBM *m, gsl_vector *v, gsl_matrix *eff_W);                                                           /* It computes the probability of turning on a hidden unit j for FPCD */
+gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4FPCD(RBM *m, gsl_vector *r, gsl_vector *v, gsl_matrix *eff_W);                     /* It computes the probability of dropping out visible units and turning on a hidden unit j for FPCD */
+gsl_vector *getProbabilityTurningOnHiddenUnit4FPCD4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *v, gsl_matrix *eff_W);                                /* It computes the probability of turning on a hidden unit j for FPCD with a dropconnect mask */
+gsl_vector *getProbabilityTurningOnVisibleUnit(RBM *m, gsl_vector *h);                                                                                  /* It computes the probability of turning on a visible unit j, as described by Equation 11 */
+gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit(RBM *m, gsl_vector *r, gsl_vector *h);                                             /* It computes the probability of dropping out hidden units and turning on a visible unit j, as described by Equation 11 */
+gsl_vector *getProbabilityTurningOnVisibleUnit4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *h);                                                       /* It computes the probability of turning on a visible unit j using a dropconnect mask */
+gsl_vector *getProbabilityTurningOnVisibleUnit4DBM(RBM *m, gsl_vector *h);                                                                              /* It computes the probability of turning on a visible unit j considering a DBM at top layer */
+gsl_vector *getProbabilityTurningOnVisibleUnit4DBM4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *h);                                                   /* It computes the probability of turning on a visible unit j using a dropconnect mask considering a DBM at top layer */
+gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4DBM(RBM *m, gsl_vector *r, gsl_vector *h);                                         /* It computes the probability of dropping hidden units for turning on a visible unit j considering a DBM at top layer */
+gsl_vector *getProbabilityTurningOnVisibleUnit4FPCD(RBM *m, gsl_vector *h, gsl_matrix *eff_W);                                                          /* It computes the probability of turning on a visible unit j for FPCD */
+gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4FPCD(RBM *m, gsl_vector *r, gsl_vector *h, gsl_matrix *eff_W);                     /* It computes the probability of dropping out hidden units and turning on a visible unit j for FPCD */
+gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4Compact(RBM *m, int *active, int n_active, gsl_vector *v);                         /* It computes the probability of turning on the surviving hidden units only, given their compacted indices */
+gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4DBM4Compact(RBM *m, int *active, int n_active, gsl_vector *v);                     /* It computes the probability of turning on the surviving hidden units only considering a DBM at bottom layer */
+gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4FPCD4Compact(RBM *m, int *active, int n_active, gsl_vector *v, gsl_matrix *eff_W); /* It computes the probability of turning on the surviving hidden units only for FPCD */
+gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4Compact(RBM *m, int *active, int n_active, gsl_vector *h, int *on, double *h_on);                         /* It computes the probability of turning on a visible unit j reading the surviving hidden units only */
+gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4DBM4Compact(RBM *m, int *active, int n_active, gsl_vector *h, int *on, double *h_on);                     /* It computes the probability of turning on a visible unit j reading the surviving hidden units only considering a DBM at top layer */
+gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4FPCD4Compact(RBM *m, int *active, int n_active, gsl_vector *h, int *on, double *h_on, gsl_matrix *eff_W); /* It computes the probability of turning on a visible unit j reading the surviving hidden units only for FPCD */
+gsl_vector *getProbabilityTurningOnVisibleUnit4FPCD4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *h, gsl_matrix *eff_W);                               /* It computes the probability of turning on a visible unit j for FPCD using a dropconnect mask */
+gsl_vector *getProbabilityTurningOnHiddenUnit4HashedDropconnect(RBM *m, DropconnectMask *M, gsl_vector *v);                                             /* It computes the probability of turning on a hidden unit j using a hashed dropconnect mask */
+gsl_vector *getProbabilityTurningOnHiddenUnit4DBM4HashedDropconnect(RBM *m, DropconnectMask *M, gsl_vector *v);                                         /* It computes the probability of turning on a hidden unit j using a hashed dropconnect mask considering a DBM at bottom layer */
+gsl_vector *getProbabilityTurningOnHiddenUnit4FPCD4HashedDropconnect(RBM *m, DropconnectMask *M, gsl_vector *v, gsl_matrix *eff_W);                     /* It computes the probability of turning on a hidden unit j for FPCD using a hashed dropconnect mask */
+gsl_vector *getProbabilityTurningOnVisibleUnit4HashedDropconnect(RBM *m, DropconnectMask *M, gsl_vector *h);                                            /* It computes the probability of turning on a visible unit j using a hashed dropconnect mask */
+gsl_vector *getProbabilityTurningOnVisibleUnit4DBM4HashedDropconnect(RBM *m, DropconnectMask *M, gsl_vector *h);                                        /* It computes the probability of turning on a visible unit j using a hashed dropconnect mask considering a DBM at top layer */
+gsl_vector *getProbabilityTurningOnVisibleUnit4FPCD4HashedDropconnect(RBM *m, DropconnectMask *M, gsl_vector *h, gsl_matrix *eff_W);                    /* It computes the probability of turning on a visible unit j for FPCD using a hashed dropconnect mask */
+gsl_vector *getProbabilityTurningOnHiddenUnit4Gaussian(RBM *m, gsl_vector *v, gsl_vector *sigma);                                                       /* It computes the probability of turning on a hidden unit j considering Gaussian RBMs */
+gsl_vector *getProbabilityTurningOnHiddenUnit4Gaussian4Dropout(RBM *m, gsl_vector *r, gsl_vector *v, gsl_vector *sigma);                                /* It computes the probability of turning on a hidden unit j considering Gaussian RBMs with Dropout */
+gsl_vector *getProbabilityTurningOnVisibleUnit4Gaussian(RBM *m, gsl_vector *h, gsl_vector *sigma);                                                      /* It computes the probability of turning on a visible unit i considering Gaussian RBMs */
+gsl_vector *getProbabilityTurningOnVisibleUnit4Gaussian4Dropout(RBM *m, gsl_vector *r, gsl_vector *h, gsl_vector *sigma);                               /* It computes the probability of turning on a visible unit i considering Gaussian RBMs with Dropout */
+gsl_vector *getDiscriminativeProbabilityTurningOnHiddenUnit(RBM *m, gsl_vector *y);                                                                     /* It computes the probability of turning on a hidden unit j considering Discriminative RBMs and Bernoulli visible units */
+gsl_vector *getDiscriminativeProbabilityTurningOnHiddenUnit4Dropout(RBM *m, gsl_vector *r, gsl_vector *y);                                              /* It computes the probability of turning on a hidden unit j with Dropout considering Discriminative RBMs with Bernoulli visible units, i..e, p(h|y,x) */
+gsl_vector *getDiscriminativeProbabilityTurningOnHiddenUnit4GaussianVisibleUnit(RBM *m, gsl_vector *y);                                                 /* It computes the probability of turning on a hidden unit j considering Discriminative RBMs and Gaussian visible units */
+gsl_vector *getDiscriminativeProbabilityTurningOnHiddenUnit4GaussianVisibleUnit4Dropout(RBM *m, gsl_vector *r, gsl_vector *y);                          /* It computes the probability of turning on a hidden unit j with Dropout considering Discriminative RBMs and Gaussian visible units */
+gsl_vector *getDiscriminativeProbabilityTurningOnVisibleUnit4GaussianVisibleUnit(RBM *m, gsl_vector *h);                                                /* It computes the probability of turning on a visible unit i considering Discriminative RBMs and Gaussian visible units */
+gsl_vector *getDiscriminativeProbabilityTurningOnVisibleUnit4GaussianVisibleUnit4Dropout(RBM *m, gsl_vector *r, gsl_vector *h);                         /* It computes the probability of turning on a visible unit i with Dropout considering Discriminative RBMs and Gaussian visible units */
+gsl_vector *getDiscriminativeProbabilityLabelUnit(RBM *m);                                                                                              /* It computes the probability of label unit (y) given the hidden (h) one, i.e., P(y|h) */
+double getReconstructionError(gsl_vector *input, gsl_vector *output);                                                                                   /* It computes the minimum square error among input and output */
+double getPseudoLikelihood(RBM *m, gsl_vector *x);                                                                                                      /* It computes the pseudo-likelihood of a sample x in an RBM */
+void FASTgetProbabilityTurningOnHiddenUnit(RBM *m, gsl_vector *v, gsl_vector *prob_h);                                                                  /* It computes the probability of turning on a hidden unit - Fast version */
+void getBatchProbabilityTurningOnHiddenUnit(RBM *m, gsl_matrix *V, gsl_matrix *prob_H);                                                                 /* It computes the probability of turning on the hidden units of a batch of samples at once */
+void getDiscriminativeBatchLogProbabilityLabelUnit(RBM *m, gsl_matrix *X, gsl_matrix *log_P);                                                           /* It computes the log-probability of every label given each sample of a batch, sharing W*x + b among the labels */
+void getDatasetProbabilityTurningOnHiddenUnit(RBM *m, Dataset *D, double scale, Dataset *H);                                                            /* It computes the probability of turning on the hidden units of every sample of a dataset, one GEMM per chunk of samples */
+Dataset *PropagateGreedyLayer(Dataset *D, RBM **m, int n_layers, int id, double scale, Dataset **buffer);                                               /* It makes the output of a layer trained by a greedy pre-training step the input to the next one */
 
 #endif
@@ -0,0 +1,70 @@
+/* It implements batched negative-phase samplers for training Bernoulli RBMs, and a sample generator for drawing data from trained RBMs and DBNs */
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rbm.h"
+#include "dbn.h"
+
+#define SAMPLE_GENERATOR_BLOCK_SIZE 64 /* chains advanced together by one thread of a sample generator */
+
+typedef struct _ChainPool
+{
+    int n_chains;
+    gsl_matrix *V, *H; /* visible and hidden states of the fantasy particles (one chain per row) */
+    gsl_matrix *PV;    /* visible units' probabilities of the last Gibbs step */
+    gsl_matrix *PH;    /* hidden units' probabilities given the last visible states */
+    gsl_rng *r;
+} ChainPool;
+
+typedef struct _TemperingSampler
+{
+    int n_chains, n_replicas;
+    int swap_interval;                      /* Gibbs steps between two rounds of replica exchanges */
+    int n_steps, n_rounds;                  /* Gibbs steps and exchange rounds run so far */
+    double *t;                              /* temperature ladder, from the RBM's own temperature t[0] up to the hottest replica */
+    gsl_matrix **V, **H;                    /* visible and hidden states of each replica (one chain per row) */
+    gsl_matrix **P;                         /* hidden units' probabilities of each replica given its last visible state */
+    gsl_matrix **Q;                         /* scratch visible units' probabilities of each replica */
+    gsl_vector **E;                         /* energy of every chain of each replica */
+    gsl_rng **r;                            /* one generator per replica, so the replicas are advanced concurrently */
+    unsigned long *n_proposed, *n_accepted; /* exchanges between replicas k and k + 1 */
+} TemperingSampler;
+
+typedef struct _SampleGenerator
+{
+    RBM **m;                     /* layers of the model, the top one running the Gibbs chains (not owned by the generator) */
+    int n_layers, n_chains;
+    int burn_in, thinning;       /* Gibbs steps before the first sample of a chain and between two of its samples */
+    int n_rounds;                /* samples drawn from each chain so far */
+    gsl_matrix *V, *H, *PV, *PH; /* states and probabilities of the top RBM's chains (one chain per row) */
+    gsl_matrix **X;              /* X[l]: visible units of layer l on the down pass, sampled for l > 0 and probabilities for l = 0 (NULL for the top layer) */
+    gsl_rng **r;                 /* one generator per chain, seeded with seed + chain index, so every chain draws the same stream regardless of threading */
+} SampleGenerator;
+
+/* Allocation and deallocation */
+ChainPool *CreateChainPool(RBM *m, int n_chains);                                                                           /* It allocates a pool of persistent chains with random initial states */
+void DestroyChainPool(ChainPool **c);                                                                                       /* It deallocates a pool of persistent chains */
+TemperingSampler *CreateTemperingSampler(RBM *m, int n_chains, int n_replicas, double max_temperature, int swap_interval);  /* It allocates a parallel tempering sampler with random initial states */
+void DestroyTemperingSampler(TemperingSampler **s);                                                                         /* It deallocates a parallel tempering sampler */
+SampleGenerator *CreateSampleGenerator(RBM **m, int n_layers, int n_chains, int burn_in, int thinning, unsigned long seed); /* It allocates a sample generator whose chains start from reproducible random states */
+void DestroySampleGenerator(SampleGenerator **g);                                                                           /* It deallocates a sample generator */
+
+/* Persistent chains */
+void RunChainPool(ChainPool *c, RBM *m, gsl_matrix *W, int n_steps); /* It advances every chain of a pool by n_steps batched Gibbs steps with the given weights */
+
+/* Parallel tempering */
+void RunTemperingSampler(TemperingSampler *s, RBM *m, int n_steps); /* It advances every replica by n_steps Gibbs steps, exchanging adjacent replicas every swap_interval steps */
+double getTemperingSamplerSwapRate(TemperingSampler *s);            /* It computes the fraction of the proposed exchanges that were accepted */
+
+/* Bernoulli RBM training */
+double BernoulliRBMTrainingbyParallelTempering(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size, int n_chains, int n_replicas, double max_temperature, int swap_interval); /* It trains a Bernoulli RBM with a parallel tempering negative phase */
+
+/* Sample generation */
+gsl_matrix *RunSampleGenerator(SampleGenerator *g);                                                                               /* It draws one sample from every chain of a generator */
+Dataset *GenerateRBMSamples(RBM *m, int n_chains, int n_samples, int burn_in, int thinning, unsigned long seed);                  /* It generates samples from a trained RBM by running many Gibbs chains at once */
+Dataset *GenerateDBNSamples(DBN *d, int n_chains, int n_samples, int burn_in, int thinning, unsigned long seed);                  /* It generates samples from a trained DBN with Gibbs chains on its top RBM followed by a directed down pass */
+int WriteGeneratedRBMSamples(RBM *m, char *filename, int n_chains, int n_samples, int burn_in, int thinning, unsigned long seed); /* It generates samples from a trained RBM straight into a binary dataset file */
+int WriteGeneratedDBNSamples(DBN *d, char *filename, int n_chains, int n_samples, int burn_in, int thinning, unsigned long seed); /* It generates samples from a trained DBN straight into a binary dataset file */
+
+#endif
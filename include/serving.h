@@ -0,0 +1,110 @@
+/* It implements a model server that answers feature extraction requests over a Unix domain socket, coalescing concurrent requests into micro-batches */
+
+#ifndef SERVING_H
+#define SERVING_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "dbn.h"
+#include "dbm.h"
+#include "metrics.h"
+#include "cache.h"
+
+/* Wire protocol: every message is a ServingHeader followed by n doubles in host byte order */
+#define SERVING_OP_INFER 1   /* request: n input features, response: the top layer's hidden probabilities */
+#define SERVING_OP_METRICS 2 /* request: no payload, response: n bytes of metrics in the Prometheus text format */
+
+#define SERVING_STATUS_OK 0
+#define SERVING_STATUS_BUSY 1        /* the request queue is full and the client should retry later */
+#define SERVING_STATUS_BAD_REQUEST 2 /* unknown operation or wrong number of features */
+#define SERVING_STATUS_SHUTDOWN 3    /* the server is stopping and no longer accepts requests */
+
+#define SERVING_MAX_FEATURES 1048576 /* larger requests are rejected without being buffered */
+
+typedef struct _ServingHeader
+{
+    uint32_t code; /* operation on requests, status on responses */
+    uint32_t n;    /* number of doubles following the header */
+} ServingHeader;
+
+typedef struct _ServingConfig
+{
+    char *model_path;       /* binary RBM, DBN or DBM model file */
+    char *socket_path;
+    int n_workers;          /* number of threads running batches */
+    int max_batch_size;     /* maximum number of requests coalesced into one batch */
+    int max_delay_us;       /* maximum time the oldest request of a batch waits for more requests, in microseconds */
+    int queue_capacity;     /* requests arriving while this many are pending are answered with SERVING_STATUS_BUSY */
+    int reload_interval_ms; /* how often model_path is checked for a new model (0 disables hot reloading) */
+    int cache_capacity;     /* number of outputs kept in the feature cache (0 disables caching) */
+} ServingConfig;
+
+typedef struct _ServedModel
+{
+    int kind;                   /* MODEL_FILE_RBM, MODEL_FILE_DBN or MODEL_FILE_DBM */
+    DBN stack;                  /* model layers, since the three kinds share the same bottom-up pass for feature extraction */
+    unsigned long version;      /* it is assigned when the model is published */
+    unsigned long retire_epoch; /* epoch at which the model was replaced by a newer one */
+    uint64_t n_requests;        /* requests answered by the model */
+    uint64_t n_batches;         /* batches run with the model */
+    struct _ServedModel *next;  /* next retired model waiting to be reclaimed */
+} ServedModel;
+
+typedef struct _ServingEpoch
+{
+    unsigned long epoch; /* epoch a worker entered its current batch in, or 0 while it does not hold any model */
+    char pad[64 - sizeof(unsigned long)];
+} ServingEpoch;
+
+typedef struct _ServingRequest
+{
+    gsl_vector *x;            /* input features */
+    gsl_vector *y;            /* output features, (re)allocated by the worker to the size of the model's top layer */
+    int status, done;
+    struct timespec arrival;  /* time (CLOCK_MONOTONIC) the request was queued */
+    pthread_cond_t finished;
+    struct _ServingRequest *next;
+} ServingRequest;
+
+typedef struct _Server
+{
+    ServingConfig config;
+    int listen_fd, n_pending, n_connections;
+    int running;                             /* it is only accessed atomically */
+    ServingRequest *head, *tail;             /* FIFO of pending requests */
+    struct _ServingConnection *connections; /* list of open client connections */
+    pthread_mutex_t lock;                    /* it protects the queue, the connection list and every request's done flag */
+    pthread_cond_t not_empty, no_connections, stopped;
+    pthread_t *workers, watcher;
+    Metrics *metrics;                        /* registry updated by the workers and dumped by SERVING_OP_METRICS */
+    FeatureCache *cache;                     /* outputs of recent inputs, tagged with the model version (NULL if disabled) */
+
+    /* Model publication: workers read model without locking, and replaced models are reclaimed once no worker can still hold them */
+    ServedModel *model;          /* model answering new batches */
+    ServedModel *retired;        /* replaced models waiting for the workers that may hold them */
+    unsigned long epoch;         /* it is advanced every time a model is replaced */
+    unsigned long n_versions;    /* number of models published so far */
+    ServingEpoch *active;        /* one slot per worker */
+    pthread_mutex_t reload_lock; /* it serializes publishers and protects the retired list */
+    struct stat model_stat;      /* identity of the model file currently published */
+} Server;
+
+/* Allocation and deallocation */
+ServedModel *LoadServedModel(char *file);     /* It loads a binary RBM, DBN or DBM model file to be served */
+void DestroyServedModel(ServedModel **model); /* It deallocates a served model */
+Server *CreateServer(ServingConfig *config);  /* It loads the model, binds the server socket and starts the worker threads */
+void DestroyServer(Server **s);               /* It deallocates a server stopped by RunServer */
+
+/* Serving */
+void RunServer(Server *s);                                       /* It accepts client connections until StopServer is called, and then drains the pending requests */
+void StopServer(Server *s);                                      /* It asks RunServer to return, and it is safe to call from a signal handler */
+unsigned long PublishServerModel(Server *s, ServedModel *model); /* It replaces the served model without blocking the workers */
+
+/* Client */
+int ConnectServer(char *socket_path);                             /* It opens a client connection to a server */
+int RequestServerInference(int fd, gsl_vector *x, gsl_vector *y); /* It sends one inference request and waits for its response */
+char *RequestServerMetrics(int fd);                               /* It fetches the server metrics in the Prometheus text format */
+
+#endif
@@ -0,0 +1,52 @@
+/* It implements early stopping on held-out samples for the RBM-family trainers, keeping the best parameters seen during training */
+
+#ifndef STOPPING_H
+#define STOPPING_H
+
+#include "rbm.h"
+#include "dbm.h"
+
+#define STOPPING_RECONSTRUCTION_ERROR 0 /* mean squared error of the mean-field reconstruction of the held-out samples */
+#define STOPPING_FREE_ENERGY_GAP 1      /* mean free energy of the held-out samples minus the one of as many training samples, which grows as the model overfits; it only triggers the stop, and the snapshot is chosen by the reconstruction error */
+#define STOPPING_CLASSIFICATION_ERROR 2 /* fraction of held-out samples whose most probable label is not theirs (DRBMs only) */
+
+typedef struct _EarlyStopping
+{
+    Dataset *validation;         /* held-out samples, owned by the caller */
+    int metric;                  /* STOPPING_RECONSTRUCTION_ERROR, STOPPING_FREE_ENERGY_GAP or STOPPING_CLASSIFICATION_ERROR */
+    int patience;                /* evaluations in a row without improvement after which training stops */
+    int interval;                /* batches between two evaluations */
+    double min_delta;            /* decrease of the metric below its best value that counts as an improvement (0 by default) */
+    long batches;                /* batches trained since the run started */
+    int n_evaluations, n_misses; /* evaluations run so far, and the ones in a row without improvement */
+    int stop;                    /* it is set once the patience runs out */
+    double best;                 /* best value of the metric so far (of the reconstruction error with the free-energy gap) */
+    double gap_min;              /* running minimum of the free-energy gap */
+    int best_evaluation;         /* evaluation the snapshot was taken at (0 if there is none) */
+    long best_batches;           /* batches trained when the snapshot was taken, so later ones are rolled back */
+    int n_layers;                /* layers held by the snapshot */
+    gsl_matrix **W, **U;         /* snapshot of the weights of every layer */
+    gsl_vector **a, **b, **c;    /* snapshot of the biases of every layer */
+    gsl_vector **sigma;          /* snapshot of the standard deviations of every layer with Gaussian visible units (NULL entries otherwise) */
+} EarlyStopping;
+
+/* Allocation and deallocation */
+EarlyStopping *CreateEarlyStopping(Dataset *validation, int metric, int patience, int interval); /* It allocates an early stopping criterion over a held-out dataset */
+EarlyStopping *CreateLayerEarlyStopping(EarlyStopping *s, Dataset *validation);                 /* It allocates a criterion with the settings of another one over the input of a layer */
+void DestroyEarlyStopping(EarlyStopping **s);                                                   /* It deallocates an early stopping criterion */
+
+/* Evaluation */
+double getHeldOutReconstructionError(Dataset *D, int n, RBM *m);     /* It computes the mean squared error of the mean-field reconstruction of the first n samples of a dataset */
+double getHeldOutFreeEnergy(Dataset *D, int n, RBM *m);              /* It computes the mean free energy of the first n samples of a dataset */
+double getHeldOutClassificationError(Dataset *D, RBM *m);            /* It computes the fraction of samples of a dataset a DRBM misclassifies */
+double getEarlyStoppingMetric(Dataset *D, RBM *m, EarlyStopping *s); /* It computes the metric of a criterion for an RBM over the held-out samples */
+
+/* Training hooks */
+int CheckEarlyStopping(Dataset *D, RBM *m); /* It accounts for a trained batch, evaluating the RBM every s->interval batches, and returns 1 once training must stop */
+int HasStoppedEarly(RBM *m);                /* It returns 1 if the criterion of an RBM has run out of patience */
+void RestoreEarlyStopping(RBM *m);          /* It restores the best parameters found by the run, and resets the criterion for the next one */
+int CheckDBMEarlyStopping(DBM *d);          /* It accounts for a batch of DBM joint training, and returns 1 once training must stop */
+int HasDBMStoppedEarly(DBM *d);             /* It returns 1 if the criterion of a DBM has run out of patience */
+void RestoreDBMEarlyStopping(DBM *d);       /* It restores the best parameters of every DBM layer found by the run, and resets the criterion */
+
+#endif
@@ -129,6 +129,62 @@ Dataset *UndoConcatenateDataset(Dataset *d1)
 
     return cpy;
 }
+
+/* It creates a dataset whose samples are the rows of a single block, so it can be reused as an activation buffer whose number of features
+changes (up to nfeatures) with ResizeDatasetBuffer. The first sample owns the block, thus DestroyDataset deallocates it as usual
+Parameters: [size, nfeatures]
+size: size of dataset
+nfeatures: maximum number of features */
+Dataset *CreateDatasetBuffer(int size, int nfeatures)
+{
+    Dataset *D = NULL;
+    gsl_block *block = NULL;
+    int i;
+
+    D = (Dataset *)malloc(sizeof(Dataset));
+    if (!D)
+    {
+        fprintf(stderr, "\nDataset not allocated @CreateDatasetBuffer.\n");
+        exit(-1);
+    }
+
+    D->size = size;
+    D->nfeatures = nfeatures;
+    D->nlabels = 0;
+
+    D->sample = (Sample *)malloc(D->size * sizeof(Sample));
+    block = gsl_block_alloc((size_t)D->size * D->nfeatures);
+    for (i = 0; i < D->size; i++)
+    {
+        D->sample[i].feature = gsl_vector_alloc_from_block(block, (size_t)i * D->nfeatures, D->nfeatures, 1);
+        D->sample[i].label = 0;
+    }
+    if (D->size)
+        D->sample[0].feature->owner = 1;
+    else
+        gsl_block_free(block);
+
+    return D;
+}
+
+/* It changes the number of features of a dataset created by CreateDatasetBuffer without moving its samples
+Parameters: [D, nfeatures]
+D: dataset
+nfeatures: number of features, which can not exceed the one the dataset was created with */
+void ResizeDatasetBuffer(Dataset *D, int nfeatures)
+{
+    int i;
+
+    if (D->size && (size_t)D->size * nfeatures > D->sample[0].feature->block->size)
+    {
+        fprintf(stderr, "\nDataset buffer is too small for %d features @ResizeDatasetBuffer.\n", nfeatures);
+        return;
+    }
+
+    D->nfeatures = nfeatures;
+    for (i = 0; i < D->size; i++)
+        D->sample[i].feature->size = nfeatures;
+}
 /**********************************************/
 
 /* Common auxiliary functions */
@@ -169,6 +225,56 @@ Subgraph *Dataset2Subgraph(Dataset *D)
     return g;
 }
 
+/* It computes the accuracy of the predicted labels of a dataset exactly as opf_Accuracy does for the Subgraph made by Dataset2Subgraph, i.e., the mean
+over the classes of the rates of false positives and false negatives, without converting the dataset
+Parameters: [D]
+D: dataset whose samples have label and predict set */
+double getDatasetAccuracy(Dataset *D)
+{
+    float **error_matrix = NULL, error = 0.0f;
+    int i, *nclass = NULL, nlabels = 0;
+
+    error_matrix = (float **)malloc((D->nlabels + 1) * sizeof(float *));
+    nclass = (int *)calloc(D->nlabels + 1, sizeof(int));
+    if (!error_matrix || !nclass)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @getDatasetAccuracy.\n");
+        exit(-1);
+    }
+    for (i = 0; i <= D->nlabels; i++)
+        error_matrix[i] = (float *)calloc(2, sizeof(float)); /* [0]: false positives, [1]: false negatives */
+
+    for (i = 0; i < D->size; i++)
+        nclass[D->sample[i].label]++;
+    for (i = 0; i < D->size; i++)
+    {
+        if (D->sample[i].label != D->sample[i].predict)
+        {
+            error_matrix[D->sample[i].label][1]++;
+            error_matrix[D->sample[i].predict][0]++;
+        }
+    }
+
+    /* Rates are kept in single precision, as in LibOPF, so the result matches opf_Accuracy bit for bit */
+    for (i = 1; i <= D->nlabels; i++)
+    {
+        if (nclass[i] != 0)
+        {
+            error_matrix[i][1] /= (float)nclass[i];
+            error_matrix[i][0] /= (float)(D->size - nclass[i]);
+            error += error_matrix[i][0] + error_matrix[i][1];
+            nlabels++;
+        }
+    }
+
+    for (i = 0; i <= D->nlabels; i++)
+        free(error_matrix[i]);
+    free(error_matrix);
+    free(nclass);
+
+    return (float)(1.0 - error / (2.0 * nlabels));
+}
+
 /* It converts a Subgraph to a Dataset
 Parameters: [g]
 g: graph */
@@ -0,0 +1,301 @@
+#include "cache.h"
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+
+/* Allocation and deallocation */
+
+/* It allocates a feature cache
+Parameters: [capacity, n_shards]
+capacity: maximum number of cached outputs
+n_shards: number of independently locked shards the entries are spread over (rounded up to a power of two) */
+FeatureCache *CreateFeatureCache(int capacity, int n_shards)
+{
+    FeatureCache *c = NULL;
+    FeatureCacheShard *sh = NULL;
+    int i, shards = 1, size;
+
+    if (capacity <= 0 || n_shards <= 0)
+    {
+        fprintf(stderr, "\nInvalid capacity or number of shards @CreateFeatureCache.\n");
+        return NULL;
+    }
+    while (shards < n_shards && shards < capacity)
+        shards <<= 1;
+
+    c = (FeatureCache *)calloc(1, sizeof(FeatureCache));
+    if (!c)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @CreateFeatureCache.\n");
+        exit(-1);
+    }
+    c->n_shards = shards;
+    c->shard = (FeatureCacheShard *)calloc(shards, sizeof(FeatureCacheShard));
+
+    for (i = 0; i < shards; i++)
+    {
+        sh = &c->shard[i];
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->capacity = (capacity + shards - 1) / shards;
+        sh->entry = (FeatureCacheEntry *)calloc(sh->capacity, sizeof(FeatureCacheEntry));
+
+        /* The index is kept at most half full, so probe sequences stay short */
+        for (size = 2; size < 2 * sh->capacity; size <<= 1)
+            ;
+        sh->index = (int *)calloc(size, sizeof(int));
+        sh->mask = size - 1;
+    }
+
+    return c;
+}
+
+/* It deallocates a feature cache
+Parameters: [c]
+c: feature cache */
+void DestroyFeatureCache(FeatureCache **c)
+{
+    int i, j;
+
+    if (*c)
+    {
+        for (i = 0; i < (*c)->n_shards; i++)
+        {
+            for (j = 0; j < (*c)->shard[i].n_entries; j++)
+                free((*c)->shard[i].entry[j].data);
+            free((*c)->shard[i].entry);
+            free((*c)->shard[i].index);
+            pthread_mutex_destroy(&(*c)->shard[i].lock);
+        }
+        free((*c)->shard);
+        free(*c);
+        *c = NULL;
+    }
+}
+/**********************************************/
+
+/* Feature cache */
+
+/* It computes a 64-bit hash of a feature vector from the bit patterns of its values, mixing one value per round as in xxHash64
+Parameters: [x]
+x: feature vector */
+uint64_t HashFeatureVector(gsl_vector *x)
+{
+    uint64_t h = HASH_PRIME3 + x->size * HASH_PRIME4, k;
+    size_t i;
+
+    for (i = 0; i < x->size; i++)
+    {
+        memcpy(&k, &x->data[i * x->stride], sizeof(uint64_t));
+        k *= HASH_PRIME2;
+        k = (k << 31) | (k >> 33);
+        h ^= k * HASH_PRIME1;
+        h = ((h << 27) | (h >> 37)) * HASH_PRIME1 + HASH_PRIME4;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/* It checks whether an entry holds exactly a given input
+Parameters: [e, key, x]
+e: cache entry
+key: hash of x
+x: feature vector */
+static int MatchFeatureCacheEntry(FeatureCacheEntry *e, uint64_t key, gsl_vector *x)
+{
+    size_t i;
+
+    if (e->key != key || e->nx != x->size)
+        return 0;
+    for (i = 0; i < x->size; i++)
+        if (memcmp(&e->data[i], &x->data[i * x->stride], sizeof(double)))
+            return 0;
+
+    return 1;
+}
+
+/* It finds the index slot holding the entry of an input, and it must be called with the shard lock held
+Parameters: [sh, key, x]
+sh: cache shard
+key: hash of x
+x: feature vector
+It returns -1 if the input is not cached */
+static int FindFeatureCacheSlot(FeatureCacheShard *sh, uint64_t key, gsl_vector *x)
+{
+    int i;
+
+    for (i = key & sh->mask; sh->index[i]; i = (i + 1) & sh->mask)
+        if (MatchFeatureCacheEntry(&sh->entry[sh->index[i] - 1], key, x))
+            return i;
+
+    return -1;
+}
+
+/* It removes an entry from the index of its shard, shifting back the entries that follow it in the probe sequence
+Parameters: [sh, id]
+sh: cache shard
+id: entry id */
+static void RemoveFeatureCacheIndex(FeatureCacheShard *sh, int id)
+{
+    int p, j, home;
+
+    for (p = sh->entry[id].key & sh->mask; sh->index[p] != id + 1; p = (p + 1) & sh->mask)
+        ;
+
+    for (j = (p + 1) & sh->mask; sh->index[j]; j = (j + 1) & sh->mask)
+    {
+        home = sh->entry[sh->index[j] - 1].key & sh->mask;
+        /* An entry stays where it is if its home slot lies cyclically in (p, j] */
+        if (p <= j ? (p < home && home <= j) : (p < home || home <= j))
+            continue;
+        sh->index[p] = sh->index[j];
+        p = j;
+    }
+    sh->index[p] = 0;
+}
+
+/* It looks up the output of an input computed with a given model generation
+Parameters: [c, x, generation, y]
+c: feature cache
+x: feature vector
+generation: model generation (e.g., the served model version), so outputs of older models are never returned
+y: output vector, filled in on a hit
+It returns 1 on a hit and 0 on a miss */
+int LookupFeatureCache(FeatureCache *c, gsl_vector *x, uint64_t generation, gsl_vector *y)
+{
+    uint64_t key = HashFeatureVector(x);
+    FeatureCacheShard *sh = &c->shard[(key >> 48) & (c->n_shards - 1)];
+    FeatureCacheEntry *e = NULL;
+    int slot, hit = 0;
+    size_t j;
+
+    pthread_mutex_lock(&sh->lock);
+    slot = FindFeatureCacheSlot(sh, key, x);
+    if (slot >= 0)
+    {
+        e = &sh->entry[sh->index[slot] - 1];
+        if (e->generation == generation && e->ny == y->size)
+        {
+            for (j = 0; j < y->size; j++)
+                y->data[j * y->stride] = e->data[e->nx + j];
+            e->referenced = 1;
+            hit = 1;
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    __atomic_fetch_add(hit ? &c->hits : &c->misses, 1, __ATOMIC_RELAXED);
+
+    return hit;
+}
+
+/* It stores the output of an input, replacing its entry if the input is already cached and evicting another one with CLOCK if the shard is full
+Parameters: [c, x, generation, y]
+c: feature cache
+x: feature vector
+generation: model generation y was computed with
+y: output vector */
+void InsertFeatureCache(FeatureCache *c, gsl_vector *x, uint64_t generation, gsl_vector *y)
+{
+    uint64_t key = HashFeatureVector(x);
+    FeatureCacheShard *sh = &c->shard[(key >> 48) & (c->n_shards - 1)];
+    FeatureCacheEntry *e = NULL;
+    int slot, id;
+    size_t j;
+
+    pthread_mutex_lock(&sh->lock);
+    slot = FindFeatureCacheSlot(sh, key, x);
+    if (slot >= 0)
+        id = sh->index[slot] - 1;
+    else
+    {
+        if (sh->n_entries < sh->capacity)
+            id = sh->n_entries++;
+        else
+        {
+            while (sh->entry[sh->hand].referenced)
+            {
+                sh->entry[sh->hand].referenced = 0;
+                sh->hand = (sh->hand + 1) % sh->capacity;
+            }
+            id = sh->hand;
+            sh->hand = (sh->hand + 1) % sh->capacity;
+            RemoveFeatureCacheIndex(sh, id);
+            __atomic_fetch_add(&c->evictions, 1, __ATOMIC_RELAXED);
+        }
+        for (slot = key & sh->mask; sh->index[slot]; slot = (slot + 1) & sh->mask)
+            ;
+        sh->index[slot] = id + 1;
+    }
+
+    e = &sh->entry[id];
+    if (!e->data || e->nx + e->ny != x->size + y->size)
+        e->data = (double *)realloc(e->data, (x->size + y->size) * sizeof(double));
+    e->key = key;
+    e->generation = generation;
+    e->nx = x->size;
+    e->ny = y->size;
+    for (j = 0; j < x->size; j++)
+        e->data[j] = x->data[j * x->stride];
+    for (j = 0; j < y->size; j++)
+        e->data[e->nx + j] = y->data[j * y->stride];
+    e->referenced = 0;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/* It drops every entry of a feature cache
+Parameters: [c]
+c: feature cache */
+void ClearFeatureCache(FeatureCache *c)
+{
+    FeatureCacheShard *sh = NULL;
+    int i, j;
+
+    for (i = 0; i < c->n_shards; i++)
+    {
+        sh = &c->shard[i];
+        pthread_mutex_lock(&sh->lock);
+        for (j = 0; j < sh->n_entries; j++)
+        {
+            free(sh->entry[j].data);
+            sh->entry[j].data = NULL;
+            sh->entry[j].referenced = 0;
+        }
+        memset(sh->index, 0, (sh->mask + 1) * sizeof(int));
+        sh->n_entries = 0;
+        sh->hand = 0;
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+/**********************************************/
+
+/* DBN inference */
+
+/* It executes the forward pass for a given sample s unless its output is already cached for the given model generation
+The returned vector belongs to the workspace, as in FASTForwardPass.
+Parameters: [s, d, w, c, generation]
+s: array of visible layer
+d: DBN
+w: workspace created by CreateDBNWorkspace for this DBN
+c: feature cache
+generation: model generation, which must be changed whenever the parameters of d change */
+gsl_vector *CachedForwardPass(gsl_vector *s, DBN *d, DBNWorkspace *w, FeatureCache *c, uint64_t generation)
+{
+    gsl_vector *h = w->h[d->n_layers - 1];
+
+    if (LookupFeatureCache(c, s, generation, h))
+        return h;
+
+    FASTForwardPass(s, d, w);
+    InsertFeatureCache(c, s, generation, h);
+
+    return h;
+}
+/**********************************************/
@@ -1,4 +1,6 @@
 #include "dbm.h"
+#include "optimizer.h"
+#include "stopping.h"
 
 /* Allocation and deallocation */
 
@@ -14,6 +16,7 @@ DBM *CreateDBM(int n_visible_layer_neurons, gsl_vector *n_hidden_units, int n_la
 
 	d = (DBM *)malloc(sizeof(DBM));
 	d->n_layers = n_hidden_units->size;
+	d->stopping = NULL;
 	d->m = (RBM **)malloc(d->n_layers * sizeof(RBM *));
 
 	/* Only the first layer has the number of visible inputs equals to the number of features */
@@ -37,6 +40,7 @@ DBM *CreateNewDBM(int n_visible_layer_neurons, int *n_hidden_units, int n_labels
 
 	d = (DBM *)malloc(sizeof(DBM));
 	d->n_layers = n_layers;
+	d->stopping = NULL;
 	d->m = (RBM **)malloc(d->n_layers * sizeof(RBM *));
 
 	/* Only the first layer has the number of visible inputs equals to the number of features */
@@ -61,6 +65,7 @@ void DestroyDBM(DBM **d)
 				DestroyRBM(&(*d)->m[i]);
 		free((*d)->m);
 		free(*d);
+		*d = NULL;
 	}
 }
 /**************************/
@@ -85,7 +90,7 @@ void InitializeDBM(DBM *d)
 	}
 }
 
-/* It performs DBM greedy pre-training step
+/* It performs DBM greedy pre-training step. If d->stopping is set, every layer stops early on the held-out samples propagated up to it
 Parameters: [D, d, n_epochs, n_samplings, batch_size, LearningType]
 D: dataset
 d: DBM
@@ -95,93 +100,85 @@ batch_size: mini-batch size
 LearningType: type of learning algorithm [1 - CD | 2 - PCD | 3 - FPCD] */
 double GreedyPreTrainingDBM(Dataset *D, DBM *d, int n_epochs, int n_samplings, int batch_size, int LearningType)
 {
-	double error = 0.0, aux = 0.0;
-	int i, j, k, l;
-	Dataset *tmp1 = NULL, *tmp2 = NULL;
+	double error = 0.0;
+	int i;
+	Dataset *tmp = D, *buffer = NULL, *validation = NULL, *validation_buffer = NULL;
 
 	error = 0;
-	tmp1 = CopyDataset(D);
+	if (d->stopping)
+		validation = d->stopping->validation;
 
 	for (i = 0; i < d->n_layers; i++)
 	{
+		if (d->stopping)
+			d->m[i]->stopping = CreateLayerEarlyStopping(d->stopping, validation);
+
 		switch (LearningType)
 		{
 		case 1:
 			if (i == 0)
 			{
 				fprintf(stderr, "\n Training bottom layer ... ");
-				error = Bernoulli_TrainingRBMbyCD4DBM_BottomLayer(tmp1, d->m[0], n_epochs, n_samplings, batch_size);
+				error = Bernoulli_TrainingRBMbyCD4DBM_BottomLayer(tmp, d->m[0], n_epochs, n_samplings, batch_size);
 			}
 			else if (i == d->n_layers - 1)
 			{
 				fprintf(stderr, "\n Training top layer ... ");
-				error += Bernoulli_TrainingRBMbyCD4DBM_TopLayer(tmp1, d->m[d->n_layers - 1], n_epochs, n_samplings, batch_size);
+				error += Bernoulli_TrainingRBMbyCD4DBM_TopLayer(tmp, d->m[d->n_layers - 1], n_epochs, n_samplings, batch_size);
 			}
 			else
 			{
 				fprintf(stderr, "\n Training layer %i ... ", i + 1);
-				error += Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayers(tmp1, d->m[i], n_epochs, n_samplings, batch_size);
+				error += Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayers(tmp, d->m[i], n_epochs, n_samplings, batch_size);
 			}
 			break;
 		case 2:
 			if (i == 0)
 			{
 				fprintf(stderr, "\n Training bottom layer ... ");
-				error = Bernoulli_TrainingRBMbyPCD4DBM_BottomLayer(tmp1, d->m[0], n_epochs, n_samplings, batch_size);
+				error = Bernoulli_TrainingRBMbyPCD4DBM_BottomLayer(tmp, d->m[0], n_epochs, n_samplings, batch_size);
 			}
 			else if (i == d->n_layers - 1)
 			{
 				fprintf(stderr, "\n Training top layer ... ");
-				error += Bernoulli_TrainingRBMbyPCD4DBM_TopLayer(tmp1, d->m[d->n_layers - 1], n_epochs, n_samplings, batch_size);
+				error += Bernoulli_TrainingRBMbyPCD4DBM_TopLayer(tmp, d->m[d->n_layers - 1], n_epochs, n_samplings, batch_size);
 			}
 			else
 			{
 				fprintf(stderr, "\n Training layer %i ... ", i + 1);
-				error += Bernoulli_TrainingRBMbyPCD4DBM_IntermediateLayers(tmp1, d->m[i], n_epochs, n_samplings, batch_size);
+				error += Bernoulli_TrainingRBMbyPCD4DBM_IntermediateLayers(tmp, d->m[i], n_epochs, n_samplings, batch_size);
 			}
 			break;
 			/* case 3:
 		if(i == 0){
 		    fprintf(stderr,"\n Training bottom layer ... ");
-		    error = Bernoulli_TrainingRBMbyFPCD4DBM_BottomLayer(tmp1, d->m[0], n_epochs, n_samplings, batch_size);
+		    error = Bernoulli_TrainingRBMbyFPCD4DBM_BottomLayer(tmp, d->m[0], n_epochs, n_samplings, batch_size);
 		}else if(i == d->n_layers - 1){
 		    fprintf(stderr,"\n Training top layer ... ");
-		    error += Bernoulli_TrainingRBMbyFPCD4DBM_TopLayer(tmp1, d->m[d->n_layers-1], n_epochs, n_samplings, batch_size);
+		    error += Bernoulli_TrainingRBMbyFPCD4DBM_TopLayer(tmp, d->m[d->n_layers-1], n_epochs, n_samplings, batch_size);
 		}else{
 		fprintf(stderr,"\n Training layer %i ... ",i+1);
-		    error += Bernoulli_TrainingRBMbyFPCD4DBM_IntermediateLayers(tmp1, d->m[i], n_epochs, n_samplings, batch_size);
+		    error += Bernoulli_TrainingRBMbyFPCD4DBM_IntermediateLayers(tmp, d->m[i], n_epochs, n_samplings, batch_size);
 		}
 	    break;*/
 		}
 		fprintf(stderr, "OK");
 
-		/* Making the hidden layer of RBM i to be the visible layer of RBM i+1 */
-		if (i < d->n_layers - 1)
+		/* Making the hidden layer of RBM i to be the visible layer of RBM i+1 (bottom-up input is doubled) */
+		tmp = PropagateGreedyLayer(D, d->m, d->n_layers, i, 2.0, &buffer);
+		if (d->stopping)
 		{
-			tmp2 = CopyDataset(tmp1);
-			DestroyDataset(&tmp1);
-			tmp1 = CreateDataset(D->size, d->m[i]->n_hidden_layer_neurons);
-			tmp1->nlabels = D->nlabels;
-			for (j = 0; j < tmp1->size; j++)
-			{
-				for (k = 0; k < tmp1->nfeatures; k++)
-				{
-					aux = 0.0;
-					for (l = 0; l < tmp2->nfeatures; l++)
-						aux += (gsl_vector_get(tmp2->sample[j].feature, l) * gsl_matrix_get(d->m[i]->W, l, k) + gsl_vector_get(tmp2->sample[j].feature, l) * gsl_matrix_get(d->m[i]->W, l, k));
-					aux += gsl_vector_get(d->m[i]->b, k);
-					gsl_vector_set(tmp1->sample[j].feature, k, SigmoidLogistic(aux));
-				}
-			}
-			DestroyDataset(&tmp2);
+			DestroyEarlyStopping(&d->m[i]->stopping);
+			validation = PropagateGreedyLayer(d->stopping->validation, d->m, d->n_layers, i, 2.0, &validation_buffer);
 		}
 	}
-	DestroyDataset(&tmp1);
+	DestroyDataset(&buffer);
+	DestroyDataset(&validation_buffer);
 
 	return error;
 }
 
-/* It performs DBM with Dropout greedy pre-training step
+/* It performs DBM with Dropout greedy pre-training step. If d->stopping is set, every layer stops early on the held-out samples propagated up to it
 Parameters: [D, d, n_epochs, n_samplings, batch_size, LearningType, *p]
 D: dataset
 d: DBM
@@ -192,88 +189,80 @@ LearningType: type of learning algorithm [1 - CD | 2 - PCD | 3 - FPCD]
 *p: array of hidden neurons dropout rate */
 double GreedyPreTrainingDBMwithDropout(Dataset *D, DBM *d, int n_epochs, int n_samplings, int batch_size, int LearningType, double *p)
 {
-	double error = 0.0, aux = 0.0;
-	int i, j, k, l;
-	Dataset *tmp1 = NULL, *tmp2 = NULL;
+	double error = 0.0;
+	int i;
+	Dataset *tmp = D, *buffer = NULL, *validation = NULL, *validation_buffer = NULL;
 
 	error = 0;
-	tmp1 = CopyDataset(D);
+	if (d->stopping)
+		validation = d->stopping->validation;
 
 	for (i = 0; i < d->n_layers; i++)
 	{
+		if (d->stopping)
+			d->m[i]->stopping = CreateLayerEarlyStopping(d->stopping, validation);
+
 		switch (LearningType)
 		{
 		case 1:
 			if (i == 0)
 			{
 				fprintf(stderr, "\n Training bottom layer ... ");
-				error = Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropout(tmp1, d->m[0], n_epochs, n_samplings, batch_size, p[i]);
+				error = Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropout(tmp, d->m[0], n_epochs, n_samplings, batch_size, p[i]);
 			}
 			else if (i == d->n_layers - 1)
 			{
 				fprintf(stderr, "\n Training top layer ... ");
-				error += Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropout(tmp1, d->m[d->n_layers - 1], n_epochs, n_samplings, batch_size, p[i]);
+				error += Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropout(tmp, d->m[d->n_layers - 1], n_epochs, n_samplings, batch_size, p[i]);
 			}
 			else
 			{
 				fprintf(stderr, "\n Training layer %i ... ", i + 1);
-				error += Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropout(tmp1, d->m[i], n_epochs, n_samplings, batch_size, p[i]);
+				error += Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropout(tmp, d->m[i], n_epochs, n_samplings, batch_size, p[i]);
 			}
 			break;
 			/*case 2:
 		if(i == 0){
 		    fprintf(stderr,"\n Training bottom layer ... ");
-		    error = Bernoulli_TrainingRBMbyPCD4DBM_BottomLayerwithDropout(tmp1, d->m[0], n_epochs, n_samplings, batch_size, p[i]);
+		    error = Bernoulli_TrainingRBMbyPCD4DBM_BottomLayerwithDropout(tmp, d->m[0], n_epochs, n_samplings, batch_size, p[i]);
 		}else if(i == d->n_layers - 1){
 		    fprintf(stderr,"\n Training top layer ... ");
-		    error += Bernoulli_TrainingRBMbyPCD4DBM_TopLayerwithDropout(tmp1, d->m[d->n_layers-1], n_epochs, n_samplings, batch_size, p[i]);
+		    error += Bernoulli_TrainingRBMbyPCD4DBM_TopLayerwithDropout(tmp, d->m[d->n_layers-1], n_epochs, n_samplings, batch_size, p[i]);
 		}else{
 		fprintf(stderr,"\n Training layer %i ... ",i+1);
-		    error += Bernoulli_TrainingRBMbyPCD4DBM_IntermediateLayerswithDropout(tmp1, d->m[i], n_epochs, n_samplings, batch_size, p[i]);
+		    error += Bernoulli_TrainingRBMbyPCD4DBM_IntermediateLayerswithDropout(tmp, d->m[i], n_epochs, n_samplings, batch_size, p[i]);
 		}
 	    break;*/
 			/* case 3:
 		if(i == 0){
 		    fprintf(stderr,"\n Training bottom layer ... ");
-		    error = Bernoulli_TrainingRBMbyFPCD4DBM_BottomLayer(tmp1, d->m[0], n_epochs, n_samplings, batch_size);
+		    error = Bernoulli_TrainingRBMbyFPCD4DBM_BottomLayer(tmp, d->m[0], n_epochs, n_samplings, batch_size);
 		}else if(i == d->n_layers - 1){
 		    fprintf(stderr,"\n Training top layer ... ");
-		    error += Bernoulli_TrainingRBMbyFPCD4DBM_TopLayer(tmp1, d->m[d->n_layers-1], n_epochs, n_samplings, batch_size);
+		    error += Bernoulli_TrainingRBMbyFPCD4DBM_TopLayer(tmp, d->m[d->n_layers-1], n_epochs, n_samplings, batch_size);
 		}else{
 		fprintf(stderr,"\n Training layer %i ... ",i+1);
-		    error += Bernoulli_TrainingRBMbyFPCD4DBM_IntermediateLayers(tmp1, d->m[i], n_epochs, n_samplings, batch_size);
+		    error += Bernoulli_TrainingRBMbyFPCD4DBM_IntermediateLayers(tmp, d->m[i], n_epochs, n_samplings, batch_size);
 		}
 	    break;*/
 		}
 		fprintf(stderr, "OK");
 
-		/* Making the hidden layer of RBM i to be the visible layer of RBM i+1 */
-		if (i < d->n_layers - 1)
+		/* Making the hidden layer of RBM i to be the visible layer of RBM i+1 (bottom-up input is doubled) */
+		tmp = PropagateGreedyLayer(D, d->m, d->n_layers, i, 2.0, &buffer);
+		if (d->stopping)
 		{
-			tmp2 = CopyDataset(tmp1);
-			DestroyDataset(&tmp1);
-			tmp1 = CreateDataset(D->size, d->m[i]->n_hidden_layer_neurons);
-			tmp1->nlabels = D->nlabels;
-			for (j = 0; j < tmp1->size; j++)
-			{
-				for (k = 0; k < tmp1->nfeatures; k++)
-				{
-					aux = 0.0;
-					for (l = 0; l < tmp2->nfeatures; l++)
-						aux += (gsl_vector_get(tmp2->sample[j].feature, l) * gsl_matrix_get(d->m[i]->W, l, k) + gsl_vector_get(tmp2->sample[j].feature, l) * gsl_matrix_get(d->m[i]->W, l, k));
-					aux += gsl_vector_get(d->m[i]->b, k);
-					gsl_vector_set(tmp1->sample[j].feature, k, SigmoidLogistic(aux));
-				}
-			}
-			DestroyDataset(&tmp2);
+			DestroyEarlyStopping(&d->m[i]->stopping);
+			validation = PropagateGreedyLayer(d->stopping->validation, d->m, d->n_layers, i, 2.0, &validation_buffer);
 		}
 	}
-	DestroyDataset(&tmp1);
+	DestroyDataset(&buffer);
+	DestroyDataset(&validation_buffer);
 
 	return error;
 }
 
-/* It performs DBM with Dropconnect greedy pre-training step
+/* It performs DBM with Dropconnect greedy pre-training step. If d->stopping is set, every layer stops early on the held-out samples propagated up to it
 Parameters: [D, d, n_epochs, n_samplings, batch_size, LearningType, *p]
 D: dataset
 d: DBM
@@ -284,133 +273,648 @@ LearningType: type of learning algorithm [1 - CD | 2 - PCD | 3 - FPCD]
 *p: array of dropconnect masks rate */
 double GreedyPreTrainingDBMwithDropconnect(Dataset *D, DBM *d, int n_epochs, int n_samplings, int batch_size, int LearningType, double *p)
 {
-	double error = 0.0, aux = 0.0;
-	int i, j, k, l;
-	Dataset *tmp1 = NULL, *tmp2 = NULL;
+	double error = 0.0;
+	int i;
+	Dataset *tmp = D, *buffer = NULL, *validation = NULL, *validation_buffer = NULL;
 
 	error = 0;
-	tmp1 = CopyDataset(D);
+	if (d->stopping)
+		validation = d->stopping->validation;
 
 	for (i = 0; i < d->n_layers; i++)
 	{
+		if (d->stopping)
+			d->m[i]->stopping = CreateLayerEarlyStopping(d->stopping, validation);
+
 		switch (LearningType)
 		{
 		case 1:
 			if (i == 0)
 			{
 				fprintf(stderr, "\n Training bottom layer ... ");
-				error = Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropconnect(tmp1, d->m[0], n_epochs, n_samplings, batch_size, p[i]);
+				error = Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropconnect(tmp, d->m[0], n_epochs, n_samplings, batch_size, p[i]);
 			}
 			else if (i == d->n_layers - 1)
 			{
 				fprintf(stderr, "\n Training top layer ... ");
-				error += Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropconnect(tmp1, d->m[d->n_layers - 1], n_epochs, n_samplings, batch_size, p[i]);
+				error += Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropconnect(tmp, d->m[d->n_layers - 1], n_epochs, n_samplings, batch_size, p[i]);
 			}
 			else
 			{
 				fprintf(stderr, "\n Training layer %i ... ", i + 1);
-				error += Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropconnect(tmp1, d->m[i], n_epochs, n_samplings, batch_size, p[i]);
+				error += Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropconnect(tmp, d->m[i], n_epochs, n_samplings, batch_size, p[i]);
 			}
 			break;
 			/*case 2:
 		if(i == 0){
 		    fprintf(stderr,"\n Training bottom layer ... ");
-		    error = Bernoulli_TrainingRBMbyPCD4DBM_BottomLayerwithDropconnect(tmp1, d->m[0], n_epochs, n_samplings, batch_size, p[i]);
+		    error = Bernoulli_TrainingRBMbyPCD4DBM_BottomLayerwithDropconnect(tmp, d->m[0], n_epochs, n_samplings, batch_size, p[i]);
 		}else if(i == d->n_layers - 1){
 		    fprintf(stderr,"\n Training top layer ... ");
-		    error += Bernoulli_TrainingRBMbyPCD4DBM_TopLayerwithDropconnect(tmp1, d->m[d->n_layers-1], n_epochs, n_samplings, batch_size, p[i]);
+		    error += Bernoulli_TrainingRBMbyPCD4DBM_TopLayerwithDropconnect(tmp, d->m[d->n_layers-1], n_epochs, n_samplings, batch_size, p[i]);
 		}else{
 		fprintf(stderr,"\n Training layer %i ... ",i+1);
-		    error += Bernoulli_TrainingRBMbyPCD4DBM_IntermediateLayerswithDropconnect(tmp1, d->m[i], n_epochs, n_samplings, batch_size, p[i]);
+		    error += Bernoulli_TrainingRBMbyPCD4DBM_IntermediateLayerswithDropconnect(tmp, d->m[i], n_epochs, n_samplings, batch_size, p[i]);
 		}
 	    break;*/
 			/* case 3:
 		if(i == 0){
 		    fprintf(stderr,"\n Training bottom layer ... ");
-		    error = Bernoulli_TrainingRBMbyFPCD4DBM_BottomLayer(tmp1, d->m[0], n_epochs, n_samplings, batch_size);
+		    error = Bernoulli_TrainingRBMbyFPCD4DBM_BottomLayer(tmp, d->m[0], n_epochs, n_samplings, batch_size);
 		}else if(i == d->n_layers - 1){
 		    fprintf(stderr,"\n Training top layer ... ");
-		    error += Bernoulli_TrainingRBMbyFPCD4DBM_TopLayer(tmp1, d->m[d->n_layers-1], n_epochs, n_samplings, batch_size);
+		    error += Bernoulli_TrainingRBMbyFPCD4DBM_TopLayer(tmp, d->m[d->n_layers-1], n_epochs, n_samplings, batch_size);
 		}else{
 		fprintf(stderr,"\n Training layer %i ... ",i+1);
-		    error += Bernoulli_TrainingRBMbyFPCD4DBM_IntermediateLayers(tmp1, d->m[i], n_epochs, n_samplings, batch_size);
+		    error += Bernoulli_TrainingRBMbyFPCD4DBM_IntermediateLayers(tmp, d->m[i], n_epochs, n_samplings, batch_size);
 		}
 	    break;*/
 		}
 		fprintf(stderr, "OK");
 
-		/* Making the hidden layer of RBM i to be the visible layer of RBM i+1 */
-		if (i < d->n_layers - 1)
+		/* Making the hidden layer of RBM i to be the visible layer of RBM i+1 (bottom-up input is doubled) */
+		tmp = PropagateGreedyLayer(D, d->m, d->n_layers, i, 2.0, &buffer);
+		if (d->stopping)
 		{
-			tmp2 = CopyDataset(tmp1);
-			DestroyDataset(&tmp1);
-			tmp1 = CreateDataset(D->size, d->m[i]->n_hidden_layer_neurons);
-			tmp1->nlabels = D->nlabels;
-			for (j = 0; j < tmp1->size; j++)
+			DestroyEarlyStopping(&d->m[i]->stopping);
+			validation = PropagateGreedyLayer(d->stopping->validation, d->m, d->n_layers, i, 2.0, &validation_buffer);
+		}
+	}
+	DestroyDataset(&buffer);
+	DestroyDataset(&validation_buffer);
+
+	return error;
+}
+
+/* Bernoulli DBM joint training */
+
+/* It computes the probabilities of turning on the units of a DBM layer given the layers next to it, for a batch of samples at once.
+Layer 0 is the visible layer and layer k > 0 is the hidden layer of d->m[k-1], whose bias is d->m[k-1]->b
+Parameters: [d, X, k, P]
+d: DBM
+X: values of layers 0, ..., d->n_layers (one sample per row, the same number of rows in every matrix)
+k: layer
+P: output probabilities of layer k (it may be X[k] itself) */
+void getDBMLayerProbabilities(DBM *d, gsl_matrix **X, int k, gsl_matrix *P)
+{
+	gsl_vector *bias = NULL;
+	double *p;
+	size_t i, j;
+
+	/* Input from the layer beneath */
+	if (k > 0)
+	{
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, X[k - 1], d->m[k - 1]->W, 0.0, P);
+		bias = d->m[k - 1]->b;
+	}
+
+	/* Input from the layer above */
+	if (k < d->n_layers)
+	{
+		gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, X[k + 1], d->m[k]->W, k > 0 ? 1.0 : 0.0, P);
+		if (!k)
+			bias = d->m[0]->a;
+	}
+
+	for (i = 0; i < P->size1; i++)
+	{
+		p = gsl_matrix_ptr(P, i, 0);
+		for (j = 0; j < P->size2; j++)
+			p[j] = SigmoidLogistic(p[j] + gsl_vector_get(bias, j));
+	}
+}
+
+/* It runs mean-field inference over the hidden layers of a DBM for a batch of samples. The hidden layers are initialized by a bottom-up pass
+with doubled weights (but for the top layer) and then updated in turn; a sample stops being updated as soon as none of its values changes by
+more than tolerance, and its rows are moved past the ones still being updated, so every update is a GEMM over the remaining samples only
+Parameters: [d, MU, n_iterations, tolerance]
+d: DBM
+MU: values of layers 0, ..., d->n_layers, in which MU[0] holds the samples; the rows of all matrices are reordered in the same way
+n_iterations: maximum number of mean-field updates
+tolerance: largest change of a value for its sample to be considered converged
+It returns the average number of updates per sample */
+double DBMMeanFieldInference(DBM *d, gsl_matrix **MU, int n_iterations, double tolerance)
+{
+	gsl_matrix **A = NULL, **NEW = NULL;
+	gsl_matrix_view *view = NULL, *new_view = NULL;
+	double *change = NULL, *p, *q, updates = 0.0;
+	size_t i, j;
+	int k, it, l, n = MU[0]->size1, active = MU[0]->size1;
+
+	if (!n)
+		return 0.0;
+
+	A = (gsl_matrix **)malloc((d->n_layers + 1) * sizeof(gsl_matrix *));
+	NEW = (gsl_matrix **)malloc((d->n_layers + 1) * sizeof(gsl_matrix *));
+	view = (gsl_matrix_view *)malloc((d->n_layers + 1) * sizeof(gsl_matrix_view));
+	new_view = (gsl_matrix_view *)malloc((d->n_layers + 1) * sizeof(gsl_matrix_view));
+	change = (double *)malloc(n * sizeof(double));
+	for (k = 1; k <= d->n_layers; k++)
+		NEW[k] = gsl_matrix_alloc(n, MU[k]->size2);
+
+	/* Bottom-up initialization */
+	for (k = 1; k <= d->n_layers; k++)
+	{
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, k < d->n_layers ? 2.0 : 1.0, MU[k - 1], d->m[k - 1]->W, 0.0, MU[k]);
+		for (i = 0; i < n; i++)
+		{
+			p = gsl_matrix_ptr(MU[k], i, 0);
+			for (j = 0; j < MU[k]->size2; j++)
+				p[j] = SigmoidLogistic(p[j] + gsl_vector_get(d->m[k - 1]->b, j));
+		}
+	}
+
+	for (it = 0; it < n_iterations && active > 0; it++)
+	{
+		for (k = 0; k <= d->n_layers; k++)
+		{
+			view[k] = gsl_matrix_submatrix(MU[k], 0, 0, active, MU[k]->size2);
+			A[k] = &view[k].matrix;
+		}
+		for (i = 0; i < active; i++)
+			change[i] = 0.0;
+
+		for (k = 1; k <= d->n_layers; k++)
+		{
+			new_view[k] = gsl_matrix_submatrix(NEW[k], 0, 0, active, NEW[k]->size2);
+			getDBMLayerProbabilities(d, A, k, &new_view[k].matrix);
+			for (i = 0; i < active; i++)
 			{
-				for (k = 0; k < tmp1->nfeatures; k++)
+				p = gsl_matrix_ptr(A[k], i, 0);
+				q = gsl_matrix_ptr(&new_view[k].matrix, i, 0);
+				for (j = 0; j < A[k]->size2; j++)
 				{
-					aux = 0.0;
-					for (l = 0; l < tmp2->nfeatures; l++)
-						aux += (gsl_vector_get(tmp2->sample[j].feature, l) * gsl_matrix_get(d->m[i]->W, l, k) + gsl_vector_get(tmp2->sample[j].feature, l) * gsl_matrix_get(d->m[i]->W, l, k));
-					aux += gsl_vector_get(d->m[i]->b, k);
-					gsl_vector_set(tmp1->sample[j].feature, k, SigmoidLogistic(aux));
+					if (fabs(q[j] - p[j]) > change[i])
+						change[i] = fabs(q[j] - p[j]);
+					p[j] = q[j];
 				}
 			}
-			DestroyDataset(&tmp2);
+		}
+		updates += active;
+
+		/* Converged samples are swapped with the last active one, which has already been checked */
+		for (l = active - 1; l >= 0; l--)
+		{
+			if (change[l] <= tolerance)
+			{
+				active--;
+				if (l != active)
+					for (k = 0; k <= d->n_layers; k++)
+						gsl_matrix_swap_rows(MU[k], l, active);
+				change[l] = change[active];
+			}
 		}
 	}
-	DestroyDataset(&tmp1);
+
+	for (k = 1; k <= d->n_layers; k++)
+		gsl_matrix_free(NEW[k]);
+	free(A);
+	free(NEW);
+	free(view);
+	free(new_view);
+	free(change);
+
+	return updates / n;
+}
+
+/* It adds the average of the rows of a matrix, times a scale factor, to a vector
+Parameters: [v, X, ones, scale]
+v: output vector
+X: matrix
+ones: vector of ones with at least as many entries as X has rows
+scale: scale factor */
+static void AddDBMRowAverage(gsl_vector *v, gsl_matrix *X, gsl_vector *ones, double scale)
+{
+	gsl_vector_view o = gsl_vector_subvector(ones, 0, X->size1);
+
+	gsl_blas_dgemv(CblasTrans, scale / X->size1, X, &o.vector, 1.0, v);
+}
+
+/* It trains a DBM jointly as in Salakhutdinov and Hinton's "Deep Boltzmann Machines": the data-dependent statistics come from mean-field
+inference over each mini-batch and the model statistics from a pool of persistent Gibbs chains. Layer k > 0 is the hidden layer of d->m[k-1]
+and uses its b as bias, while the visible layer uses d->m[0]->a; learning rate, momentum and weight decay of W are taken from d->m[k-1].
+If d->stopping is set, training stops once the reconstruction error of its held-out samples stops improving, and the best parameters are restored
+Parameters: [D, d, n_epochs, batch_size, n_mean_field_iterations, tolerance, n_chains, n_gibbs_sampling]
+D: dataset
+d: DBM (usually pre-trained by GreedyPreTrainingDBM)
+n_epochs: number of training epochs
+batch_size: size of batch data
+n_mean_field_iterations: maximum number of mean-field updates per sample
+tolerance: mean-field convergence threshold (see DBMMeanFieldInference)
+n_chains: number of persistent chains
+n_gibbs_sampling: number of block Gibbs steps of the chains per mini-batch */
+double BernoulliDBMJointTraining(Dataset *D, DBM *d, int n_epochs, int batch_size, int n_mean_field_iterations, double tolerance, int n_chains, int n_gibbs_sampling)
+{
+	int e, z, i, j, k, n, trained, L = d->n_layers;
+	double error, errorsum, updates, aux, *p, *q;
+	const gsl_rng_type *T;
+	gsl_rng *r;
+	gsl_matrix **MU = NULL, **S = NULL, **A = NULL, *R = NULL;
+	ParameterState **tmpW = NULL, **tmpb = NULL, *tmpa = NULL;
+	gsl_matrix_view *view = NULL, rview;
+	gsl_vector **bgrad = NULL, *agrad = NULL, *ones = NULL;
+
+	srand(time(NULL));
+	T = gsl_rng_default;
+	r = gsl_rng_alloc(T);
+	gsl_rng_set(r, random_seed_deep());
+
+	MU = (gsl_matrix **)malloc((L + 1) * sizeof(gsl_matrix *));
+	S = (gsl_matrix **)malloc((L + 1) * sizeof(gsl_matrix *));
+	A = (gsl_matrix **)malloc((L + 1) * sizeof(gsl_matrix *));
+	view = (gsl_matrix_view *)malloc((L + 1) * sizeof(gsl_matrix_view));
+	tmpW = (ParameterState **)malloc(L * sizeof(ParameterState *));
+	tmpb = (ParameterState **)malloc(L * sizeof(ParameterState *));
+	bgrad = (gsl_vector **)malloc(L * sizeof(gsl_vector *));
+
+	MU[0] = gsl_matrix_alloc(batch_size, d->m[0]->n_visible_layer_neurons);
+	S[0] = gsl_matrix_alloc(n_chains, d->m[0]->n_visible_layer_neurons);
+	for (k = 0; k < L; k++)
+	{
+		MU[k + 1] = gsl_matrix_alloc(batch_size, d->m[k]->n_hidden_layer_neurons);
+		S[k + 1] = gsl_matrix_alloc(n_chains, d->m[k]->n_hidden_layer_neurons);
+		tmpW[k] = CreateParameterState(d->m[k], d->m[k]->n_visible_layer_neurons, d->m[k]->n_hidden_layer_neurons);
+		tmpb[k] = CreateParameterState(d->m[k], d->m[k]->n_hidden_layer_neurons, 1);
+		bgrad[k] = gsl_vector_alloc(d->m[k]->n_hidden_layer_neurons);
+	}
+	tmpa = CreateParameterState(d->m[0], d->m[0]->n_visible_layer_neurons, 1);
+	agrad = gsl_vector_alloc(d->m[0]->n_visible_layer_neurons);
+	R = gsl_matrix_alloc(batch_size, d->m[0]->n_visible_layer_neurons);
+	ones = gsl_vector_alloc(batch_size > n_chains ? batch_size : n_chains);
+	gsl_vector_set_all(ones, 1.0);
+
+	/* The chains start from uniformly random states */
+	for (k = 0; k <= L; k++)
+	{
+		gsl_matrix_set_all(S[k], 0.5);
+		SampleBernoulliMatrix(S[k], S[k], r);
+	}
+
+	error = 0;
+
+	/* For each epoch */
+	for (e = 1; e <= n_epochs; e++)
+	{
+		fprintf(stderr, "\nRunning epoch %d ... ", e);
+
+		errorsum = updates = 0;
+
+		/* For each batch */
+		for (z = 0; z < D->size; z += batch_size)
+		{
+			n = D->size - z < batch_size ? D->size - z : batch_size;
+			for (k = 0; k <= L; k++)
+			{
+				view[k] = gsl_matrix_submatrix(MU[k], 0, 0, n, MU[k]->size2);
+				A[k] = &view[k].matrix;
+			}
+			for (i = 0; i < n; i++)
+				gsl_matrix_set_row(A[0], i, D->sample[z + i].feature);
+
+			/* Positive phase */
+			updates += n * DBMMeanFieldInference(d, A, n_mean_field_iterations, tolerance);
+
+			/* It reconstructs the visible layer from the mean-field values of the first hidden layer */
+			rview = gsl_matrix_submatrix(R, 0, 0, n, R->size2);
+			getDBMLayerProbabilities(d, A, 0, &rview.matrix);
+			for (i = 0; i < n; i++)
+			{
+				p = gsl_matrix_ptr(A[0], i, 0);
+				q = gsl_matrix_ptr(&rview.matrix, i, 0);
+				aux = 0.0;
+				for (j = 0; j < R->size2; j++)
+					aux += (p[j] - q[j]) * (p[j] - q[j]);
+				errorsum += aux / R->size2;
+			}
+
+			/* Negative phase */
+			BlockGibbsSamplingDBM(d, S, n_gibbs_sampling, r);
+
+			/* It updates DBM parameters */
+			for (k = 0; k < L; k++)
+			{
+				UpdateParameterMatrix4Batch(d->m[k], d->m[k]->W, A[k], A[k + 1], 1.0 / n, S[k], S[k + 1], 1.0 / n_chains, d->m[k]->eta, d->m[k]->lambda, tmpW[k]); /* It performs W' = alpha*W' - lambda*W + eta*(E_data[h_k h_k+1] - E_model[h_k h_k+1]) and W = W+W' */
+
+				gsl_vector_set_zero(bgrad[k]);
+				AddDBMRowAverage(bgrad[k], A[k + 1], ones, 1.0);                                        /* It performs E_data[h_k+1] */
+				AddDBMRowAverage(bgrad[k], S[k + 1], ones, -1.0);                                       /* It performs E_data[h_k+1] - E_model[h_k+1] */
+				UpdateParameterVector(d->m[k], d->m[k]->b, bgrad[k], NULL, 1.0, d->m[k]->eta, tmpb[k]); /* It performs b' = alpha*b' + eta*(E_data - E_model) and b = b + b' */
+			}
+			gsl_vector_set_zero(agrad);
+			AddDBMRowAverage(agrad, A[0], ones, 1.0);  /* It performs E_data[v] */
+			AddDBMRowAverage(agrad, S[0], ones, -1.0); /* It performs E_data[v] - E_model[v] */
+			UpdateParameterVector(d->m[0], d->m[0]->a, agrad, NULL, 1.0, d->m[0]->eta, tmpa); /* It performs a' = alpha*a' + eta*(E_data - E_model) and a = a + a' */
+
+			if (CheckDBMEarlyStopping(d))
+				break;
+		}
+
+		trained = z < D->size ? z + n : D->size; /* samples trained, fewer than D->size if the epoch stopped early */
+		error = errorsum / trained;
+		fprintf(stderr, "    -> Reconstruction error: %lf with %.2lf mean-field updates per sample", error, updates / trained);
+		fprintf(stdout, "%d %lf\n", e, error);
+
+		for (k = 0; k < L; k++)
+			d->m[k]->eta = d->m[k]->eta_max - ((d->m[k]->eta_max - d->m[k]->eta_min) / n_epochs) * e;
+
+		if (error < 0.0001 || HasDBMStoppedEarly(d))
+			e = n_epochs + 1;
+	}
+	RestoreDBMEarlyStopping(d);
+
+	gsl_rng_free(r);
+
+	for (k = 0; k <= L; k++)
+	{
+		gsl_matrix_free(MU[k]);
+		gsl_matrix_free(S[k]);
+	}
+	for (k = 0; k < L; k++)
+	{
+		DestroyParameterState(&tmpW[k]);
+		DestroyParameterState(&tmpb[k]);
+		gsl_vector_free(bgrad[k]);
+	}
+	DestroyParameterState(&tmpa);
+	gsl_vector_free(agrad);
+	gsl_vector_free(ones);
+	gsl_matrix_free(R);
+	free(MU);
+	free(S);
+	free(A);
+	free(view);
+	free(tmpW);
+	free(tmpb);
+	free(bgrad);
 
 	return error;
 }
 
+/* Bernoulli DBM sampling */
+
+/* It runs block Gibbs sampling over a batch of DBM chains. Given the even layers, the odd ones are conditionally independent (and vice versa),
+so every step computes the probabilities of all odd layers at once, samples them, and then does the same for the even layers
+Parameters: [d, S, n_steps, r]
+d: DBM
+S: binary states of layers 0, ..., d->n_layers (one chain per row)
+n_steps: number of Gibbs steps
+r: random number generator */
+void BlockGibbsSamplingDBM(DBM *d, gsl_matrix **S, int n_steps, gsl_rng *r)
+{
+	int step, parity, k;
+
+	for (step = 0; step < n_steps; step++)
+	{
+		for (parity = 1; parity >= 0; parity--)
+		{
+			/* Layers of the same parity only read layers of the other one, so their GEMMs run concurrently */
+#pragma omp parallel for schedule(dynamic)
+			for (k = parity; k <= d->n_layers; k += 2)
+				getDBMLayerProbabilities(d, S, k, S[k]);
+
+			/* The generator is shared, thus sampling stays sequential, which is cheap next to the GEMMs */
+			for (k = parity; k <= d->n_layers; k += 2)
+				SampleBernoulliMatrix(S[k], S[k], r);
+		}
+	}
+}
+
+/* It generates samples from a DBM by running independent chains from random states
+Parameters: [d, n_samples, n_gibbs_sampling]
+d: DBM
+n_samples: number of samples (i.e., of chains)
+n_gibbs_sampling: number of block Gibbs steps of every chain
+It returns a dataset with the probabilities of the visible units given the last state of each chain */
+Dataset *GenerateDBMSamples(DBM *d, int n_samples, int n_gibbs_sampling)
+{
+	const gsl_rng_type *T;
+	gsl_rng *r;
+	gsl_matrix **S = NULL;
+	Dataset *G = NULL;
+	int i, k;
+
+	srand(time(NULL));
+	T = gsl_rng_default;
+	r = gsl_rng_alloc(T);
+	gsl_rng_set(r, random_seed_deep());
+
+	S = (gsl_matrix **)malloc((d->n_layers + 1) * sizeof(gsl_matrix *));
+	S[0] = gsl_matrix_alloc(n_samples, d->m[0]->n_visible_layer_neurons);
+	for (k = 0; k < d->n_layers; k++)
+		S[k + 1] = gsl_matrix_alloc(n_samples, d->m[k]->n_hidden_layer_neurons);
+	for (k = 0; k <= d->n_layers; k++)
+	{
+		gsl_matrix_set_all(S[k], 0.5);
+		SampleBernoulliMatrix(S[k], S[k], r);
+	}
+
+	BlockGibbsSamplingDBM(d, S, n_gibbs_sampling, r);
+	getDBMLayerProbabilities(d, S, 0, S[0]);
+
+	G = CreateDataset(n_samples, d->m[0]->n_visible_layer_neurons);
+	G->nlabels = 0;
+	for (i = 0; i < n_samples; i++)
+	{
+		gsl_matrix_get_row(G->sample[i].feature, S[0], i);
+		G->sample[i].label = 0;
+	}
+
+	for (k = 0; k <= d->n_layers; k++)
+		gsl_matrix_free(S[k]);
+	free(S);
+	gsl_rng_free(r);
+
+	return G;
+}
+
+/* Bernoulli DBM inference */
+
+/* It allocates the scratch matrices used by the batched DBM inference paths
+Parameters: [d, batch_size]
+d: DBM
+batch_size: maximum number of samples handled at once */
+DBMWorkspace *CreateDBMWorkspace(DBM *d, int batch_size)
+{
+	DBMWorkspace *w = NULL;
+	int l;
+
+	if (!d || batch_size <= 0)
+	{
+		fprintf(stderr, "\nThere is no DBM allocated or the batch size is invalid @CreateDBMWorkspace.\n");
+		return NULL;
+	}
+
+	w = (DBMWorkspace *)malloc(sizeof(DBMWorkspace));
+	if (!w)
+	{
+		fprintf(stderr, "\nUnable to alloc memory @CreateDBMWorkspace.\n");
+		exit(-1);
+	}
+	w->n_layers = d->n_layers;
+	w->batch_size = batch_size;
+	w->X = gsl_matrix_alloc(batch_size, d->m[0]->n_visible_layer_neurons);
+	w->V = gsl_matrix_alloc(batch_size, d->m[0]->n_visible_layer_neurons);
+	w->H = (gsl_matrix **)malloc(w->n_layers * sizeof(gsl_matrix *));
+	w->R = (gsl_matrix **)malloc(w->n_layers * sizeof(gsl_matrix *));
+	for (l = 0; l < w->n_layers; l++)
+	{
+		w->H[l] = gsl_matrix_alloc(batch_size, d->m[l]->n_hidden_layer_neurons);
+		w->R[l] = l < w->n_layers - 1 ? gsl_matrix_alloc(batch_size, d->m[l]->n_hidden_layer_neurons) : NULL;
+	}
+
+	return w;
+}
+
+/* It deallocates a DBM workspace
+Parameters: [w]
+w: DBM workspace */
+void DestroyDBMWorkspace(DBMWorkspace **w)
+{
+	int l;
+
+	if (*w)
+	{
+		for (l = 0; l < (*w)->n_layers; l++)
+		{
+			gsl_matrix_free((*w)->H[l]);
+			if ((*w)->R[l])
+				gsl_matrix_free((*w)->R[l]);
+		}
+		free((*w)->H);
+		free((*w)->R);
+		gsl_matrix_free((*w)->X);
+		gsl_matrix_free((*w)->V);
+		free(*w);
+		*w = NULL;
+	}
+}
+
+/* It executes the up pass of a DBM for a batch of samples, running one GEMM per layer
+Only the first X->size1 rows of the returned matrix are meaningful. It belongs to the workspace, which also keeps the probabilities of the layers beneath for BatchDBMDownPass.
+Parameters: [X, d, w]
+X: matrix of visible layers (one sample per row, at most w->batch_size rows)
+d: DBM
+w: workspace created by CreateDBMWorkspace for this DBM */
+gsl_matrix *BatchDBMUpPass(gsl_matrix *X, DBM *d, DBMWorkspace *w)
+{
+	int l, n = X->size1;
+	gsl_matrix_view in, out;
+
+	if (n > w->batch_size)
+	{
+		fprintf(stderr, "\nBatch of %d samples does not fit the workspace @BatchDBMUpPass.\n", n);
+		return NULL;
+	}
+
+	for (l = 0; l < d->n_layers; l++)
+	{
+		out = gsl_matrix_submatrix(w->H[l], 0, 0, n, w->H[l]->size2);
+		getBatchProbabilityTurningOnHiddenUnit(d->m[l], l ? &in.matrix : X, &out.matrix);
+		in = out;
+	}
+
+	return w->H[d->n_layers - 1];
+}
+
+/* It executes the down pass of a DBM for the batch of the last BatchDBMUpPass call. Every intermediate layer gets the input of the layer above
+and the bottom-up input of the layer beneath, with its bias counted twice, as in getProbabilityTurningOnDBMIntermediateLayersOnDownPass.
+Only the first X->size1 rows of the returned matrix are meaningful, and it belongs to the workspace.
+Parameters: [X, d, w]
+X: matrix of visible layers given to BatchDBMUpPass
+d: DBM
+w: workspace used by BatchDBMUpPass
+It returns the probabilities of the visible units */
+gsl_matrix *BatchDBMDownPass(gsl_matrix *X, DBM *d, DBMWorkspace *w)
+{
+	int l, i, j, n = X->size1;
+	gsl_matrix_view above, beneath, out;
+	double *row;
+
+	above = gsl_matrix_submatrix(w->H[d->n_layers - 1], 0, 0, n, w->H[d->n_layers - 1]->size2);
+	for (l = d->n_layers - 1; l > 0; l--)
+	{
+		beneath = l > 1 ? gsl_matrix_submatrix(w->H[l - 2], 0, 0, n, w->H[l - 2]->size2) : gsl_matrix_submatrix(X, 0, 0, n, X->size2);
+		out = gsl_matrix_submatrix(w->R[l - 1], 0, 0, n, w->R[l - 1]->size2);
+
+		gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, &above.matrix, d->m[l]->W, 0.0, &out.matrix);
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, &beneath.matrix, d->m[l - 1]->W, 1.0, &out.matrix);
+		for (i = 0; i < n; i++)
+		{
+			row = gsl_matrix_ptr(&out.matrix, i, 0);
+			for (j = 0; j < d->m[l]->n_visible_layer_neurons; j++)
+				row[j] = SigmoidLogistic(row[j] + 2 * gsl_vector_get(d->m[l]->a, j));
+		}
+		above = out;
+	}
+
+	/* Reconstruction of the visible layer */
+	out = gsl_matrix_submatrix(w->V, 0, 0, n, w->V->size2);
+	gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, &above.matrix, d->m[0]->W, 0.0, &out.matrix);
+	for (i = 0; i < n; i++)
+	{
+		row = gsl_matrix_ptr(&out.matrix, i, 0);
+		for (j = 0; j < d->m[0]->n_visible_layer_neurons; j++)
+			row[j] = SigmoidLogistic(row[j] + gsl_vector_get(d->m[0]->a, j));
+	}
+
+	return w->V;
+}
+
 /* Bernoulli DBM reconstruction */
 
-/* It reconstructs an input dataset given a trained DBM
+/* It computes the mean reconstruction error of a dataset given a DBM. Batches of DBM_INFERENCE_BATCH_SIZE samples go through BatchDBMUpPass and
+BatchDBMDownPass, and the batches are spread over threads, each one with its own workspace
 Parameters: [D, d]
 D: dataset
 d: DBM */
-double BernoulliDBMReconstruction(Dataset *D, DBM *d)
+double getDBMReconstructionError(Dataset *D, DBM *d)
 {
 	double error = 0.0;
-	int l, i;
+	int z;
 
-	for (i = 0; i < D->size; i++)
+#pragma omp parallel reduction(+ : error)
 	{
-		/* Going up */
-		gsl_vector_free(d->m[0]->v);
-		d->m[0]->v = gsl_vector_alloc(d->m[0]->n_visible_layer_neurons);
-		gsl_vector_memcpy(d->m[0]->v, D->sample[i].feature);
-		for (l = 0; l < d->n_layers; l++)
-		{
-			gsl_vector_free(d->m[l]->h);
-			d->m[l]->h = getProbabilityTurningOnHiddenUnit(d->m[l], d->m[l]->v);
-			if (l < d->n_layers - 1)
-			{
-				gsl_vector_free(d->m[l + 1]->v);
-				d->m[l + 1]->v = gsl_vector_alloc(d->m[l + 1]->n_visible_layer_neurons);
-				gsl_vector_memcpy(d->m[l + 1]->v, d->m[l]->h);
-			}
-		}
-		/* Going down */
-		for (l = d->n_layers - 1; l > 0; l--)
+		DBMWorkspace *w = CreateDBMWorkspace(d, DBM_INFERENCE_BATCH_SIZE);
+		gsl_matrix_view x, v;
+		double diff, *in, *out;
+		int i, j, n;
+
+#pragma omp for schedule(dynamic)
+		for (z = 0; z < D->size; z += DBM_INFERENCE_BATCH_SIZE)
 		{
-			gsl_vector_free(d->m[l]->v);
-			d->m[l]->v = getProbabilityTurningOnDBMIntermediateLayersOnDownPass(d->m[l], d->m[l]->h, d->m[l - 1]);
-			if (l > 0)
+			n = D->size - z < DBM_INFERENCE_BATCH_SIZE ? D->size - z : DBM_INFERENCE_BATCH_SIZE;
+			x = gsl_matrix_submatrix(w->X, 0, 0, n, w->X->size2);
+			for (i = 0; i < n; i++)
+				gsl_matrix_set_row(&x.matrix, i, D->sample[z + i].feature);
+
+			BatchDBMUpPass(&x.matrix, d, w);
+			v = gsl_matrix_submatrix(BatchDBMDownPass(&x.matrix, d, w), 0, 0, n, w->V->size2);
+
+			for (i = 0; i < n; i++)
 			{
-				gsl_vector_free(d->m[l - 1]->h);
-				d->m[l - 1]->h = gsl_vector_alloc(d->m[l - 1]->n_hidden_layer_neurons);
-				gsl_vector_memcpy(d->m[l - 1]->h, d->m[l]->v);
+				in = gsl_matrix_ptr(&x.matrix, i, 0);
+				out = gsl_matrix_ptr(&v.matrix, i, 0);
+				diff = 0.0;
+				for (j = 0; j < D->nfeatures; j++)
+					diff += (in[j] - out[j]) * (in[j] - out[j]);
+				error += diff / D->nfeatures;
 			}
 		}
-		/* Reconstruction of the visible layer */
-		gsl_vector_free(d->m[0]->v);
-		d->m[0]->v = getProbabilityTurningOnVisibleUnit(d->m[0], d->m[0]->h);
-		error += getReconstructionError(D->sample[i].feature, d->m[0]->v);
+		DestroyDBMWorkspace(&w);
 	}
 	error /= D->size;
+
+	return error;
+}
+
+/* It reconstructs an input dataset given a trained DBM
+Parameters: [D, d]
+D: dataset
+d: DBM */
+double BernoulliDBMReconstruction(Dataset *D, DBM *d)
+{
+	double error = getDBMReconstructionError(D, d);
+
 	fprintf(stderr, "Reconstruction error: %lf OK", error);
 
 	return error;
@@ -558,6 +1062,78 @@ void loadDBMParametersFromFile(DBM *d, char *file)
 	fclose(fpin);
 }
 
+/* It saves a DBM to a binary model file, which is much faster to load than the text format and keeps full double precision
+Parameters: [d, file]
+d: DBM
+file: file name
+It returns 0 on success and a non-zero value otherwise */
+int saveDBMParametersBinary(DBM *d, char *file)
+{
+	int l, status = 0;
+	FILE *fp = NULL;
+
+	fp = fopen(file, "wb");
+	if (!fp)
+	{
+		fprintf(stderr, "\nUnable to open %s @saveDBMParametersBinary.\n", file);
+		return -1;
+	}
+
+	status = fwriteModelHeader(fp, MODEL_FILE_DBM, d->n_layers);
+	for (l = 0; l < d->n_layers && !status; l++)
+		status = fwriteRBMParameters(fp, d->m[l]);
+	if (fclose(fp))
+		status = -1;
+
+	if (status)
+		fprintf(stderr, "\nUnable to write %s @saveDBMParametersBinary.\n", file);
+
+	return status;
+}
+
+/* It allocates a DBM from a binary model file written by saveDBMParametersBinary
+Parameters: [file]
+file: file name
+It returns NULL if the file cannot be read or does not hold a consistent DBM */
+DBM *loadDBMFromBinaryFile(char *file)
+{
+	int l, kind, n_layers;
+	FILE *fp = NULL;
+	DBM *d = NULL;
+
+	fp = fopen(file, "rb");
+	if (!fp)
+	{
+		fprintf(stderr, "\nUnable to open %s @loadDBMFromBinaryFile.\n", file);
+		return NULL;
+	}
+
+	if (freadModelHeader(fp, &kind, &n_layers) || kind != MODEL_FILE_DBM)
+	{
+		fprintf(stderr, "\n%s is not a binary DBM file @loadDBMFromBinaryFile.\n", file);
+		fclose(fp);
+		return NULL;
+	}
+
+	d = (DBM *)malloc(sizeof(DBM));
+	d->n_layers = n_layers;
+	d->stopping = NULL;
+	d->m = (RBM **)calloc(n_layers, sizeof(RBM *));
+	for (l = 0; l < n_layers; l++)
+	{
+		d->m[l] = freadRBMParameters(fp);
+		if (!d->m[l] || (l > 0 && d->m[l]->n_visible_layer_neurons != d->m[l - 1]->n_hidden_layer_neurons))
+		{
+			fprintf(stderr, "\nInconsistent layer %d in %s @loadDBMFromBinaryFile.\n", l, file);
+			DestroyDBM(&d);
+			break;
+		}
+	}
+	fclose(fp);
+
+	return d;
+}
+
 /* It generates a file in OPF format with DBM's upper hidden layer units values as features 
 Parameters: [D, d, fileName]
 D: dataset
@@ -565,8 +1141,10 @@ d: DBM
 fileName: file name */
 void extractDBMUpperLayerFeatures(Dataset *D, DBM *d, char *fileName)
 {
-	double sample, error = 0.0;
-	int l, i, j;
+	DBMWorkspace *w = NULL;
+	gsl_matrix_view x;
+	gsl_matrix *H = NULL;
+	int z, i, j, n;
 	const gsl_rng_type *T;
 	FILE *fp = NULL;
 	gsl_rng *r;
@@ -574,36 +1152,30 @@ void extractDBMUpperLayerFeatures(Dataset *D, DBM *d, char *fileName)
 	r = gsl_rng_alloc(T);
 	fp = fopen(fileName, "w");
 	fprintf(fp, "%d %d %d", D->size, D->nlabels, d->m[d->n_layers - 1]->n_hidden_layer_neurons);
-	for (i = 0; i < D->size; i++)
+
+	w = CreateDBMWorkspace(d, DBM_INFERENCE_BATCH_SIZE);
+	for (z = 0; z < D->size; z += DBM_INFERENCE_BATCH_SIZE)
 	{
-		gsl_vector_free(d->m[0]->v);
-		d->m[0]->v = gsl_vector_alloc(d->m[0]->n_visible_layer_neurons);
-		gsl_vector_memcpy(d->m[0]->v, D->sample[i].feature);
+		n = D->size - z < DBM_INFERENCE_BATCH_SIZE ? D->size - z : DBM_INFERENCE_BATCH_SIZE;
+		x = gsl_matrix_submatrix(w->X, 0, 0, n, w->X->size2);
+		for (i = 0; i < n; i++)
+			gsl_matrix_set_row(&x.matrix, i, D->sample[z + i].feature);
+		H = BatchDBMUpPass(&x.matrix, d, w);
 
-		for (l = 0; l < d->n_layers; l++)
+		/* Units are sampled in the same order as sample by sample, so the generator yields the same features */
+		for (i = 0; i < n; i++)
 		{
-			gsl_vector_free(d->m[l]->h);
-			d->m[l]->h = getProbabilityTurningOnHiddenUnit(d->m[l], d->m[l]->v);
-
-			if (l < d->n_layers - 1)
+			fprintf(fp, "\n%d %d", z + i, (&D->sample[z + i])->label);
+			for (j = 0; j < H->size2; j++)
 			{
-				gsl_vector_free(d->m[l + 1]->v);
-				d->m[l + 1]->v = gsl_vector_alloc(d->m[l + 1]->n_visible_layer_neurons);
-				gsl_vector_memcpy(d->m[l + 1]->v, d->m[l]->h);
-			}
-			else
-			{
-				fprintf(fp, "\n%d %d", i, (&D->sample[i])->label);
-				for (j = 0; j < d->m[l]->n_hidden_layer_neurons; j++)
-				{
-					sample = gsl_rng_uniform(r);
-					if (gsl_vector_get(d->m[l]->h, j) >= sample)
-						fprintf(fp, " %f", 1.0);
-					else
-						fprintf(fp, " %f", 0.0);
-				}
+				if (gsl_matrix_get(H, i, j) >= gsl_rng_uniform(r))
+					fprintf(fp, " %f", 1.0);
+				else
+					fprintf(fp, " %f", 0.0);
 			}
 		}
 	}
+	DestroyDBMWorkspace(&w);
+	gsl_rng_free(r);
 	fclose(fp);
 }
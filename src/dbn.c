@@ -1,4 +1,9 @@
 #include "dbn.h"
+#include "stopping.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 /* Allocation and deallocation */
 
@@ -18,6 +23,8 @@ DBN *CreateDBN(int n_visible_units, gsl_vector *n_hidden_units, int n_labels, in
         d = (DBN *)malloc(sizeof(DBN));
         d->n_layers = n_layers;
         d->m = (RBM **)malloc(d->n_layers * sizeof(RBM *));
+        d->cache = NULL;
+        d->stopping = NULL;
 
         /* Only the first layer has the number of visible inputs equals to the number of features */
         d->m[0] = CreateRBM(n_visible_units, (int)gsl_vector_get(n_hidden_units, 0), n_labels);
@@ -49,6 +56,8 @@ DBN *CreateNewDBN(int n_visible_units, int *n_hidden_units, int n_labels, int n_
         d = (DBN *)malloc(sizeof(DBN));
         d->n_layers = n_layers;
         d->m = (RBM **)malloc(d->n_layers * sizeof(RBM *));
+        d->cache = NULL;
+        d->stopping = NULL;
 
         /* Only the first layer has the number of visible inputs equals to the number of features */
         d->m[0] = CreateRBM(n_visible_units, (int)n_hidden_units[0], n_labels);
@@ -77,6 +86,7 @@ void DestroyDBN(DBN **d)
                 DestroyRBM(&(*d)->m[i]);
         free((*d)->m);
         free(*d);
+        *d = NULL;
     }
 }
 /**************************/
@@ -102,187 +112,416 @@ void InitializeDBN(DBN *d)
 }
 /**************************/
 
-/* Bernoulli DBN training */
+/* DBN layer cache */
 
-/* It trains an DBN for image reconstruction using Contrastive Divergence
-Parameters: [D, d, n_epochs, n_CD_iterations, batch_size]
-D: dataset
+/* It allocates an on-disk cache of greedily trained layers, which is used by the DBN trainers once assigned to d->cache
+Parameters: [dir, seed]
+dir: directory holding the cached layers (it is created if it does not exist)
+seed: seed of the run, so that only runs sharing it share layers */
+DBNLayerCache *CreateDBNLayerCache(char *dir, unsigned long seed)
+{
+    DBNLayerCache *c = NULL;
+
+    if (mkdir(dir, 0755) && errno != EEXIST)
+    {
+        fprintf(stderr, "\nUnable to create directory %s @CreateDBNLayerCache.\n", dir);
+        return NULL;
+    }
+
+    c = (DBNLayerCache *)calloc(1, sizeof(DBNLayerCache));
+    if (!c)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @CreateDBNLayerCache.\n");
+        exit(-1);
+    }
+    c->dir = (char *)malloc(strlen(dir) + 1);
+    strcpy(c->dir, dir);
+    c->seed = seed;
+
+    return c;
+}
+
+/* It deallocates a layer cache, leaving its files on disk
+Parameters: [c]
+c: layer cache */
+void DestroyDBNLayerCache(DBNLayerCache **c)
+{
+    if (*c)
+    {
+        free((*c)->dir);
+        free(*c);
+        *c = NULL;
+    }
+}
+
+/* It mixes a buffer into a 64-bit hash, one 8-byte word per round as in xxHash64
+Parameters: [h, data, n]
+h: current hash
+data: buffer
+n: size of the buffer in bytes */
+static uint64_t MixLayerCacheKey(uint64_t h, const void *data, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t k;
+
+    for (; n; p += sizeof(uint64_t), n = n > sizeof(uint64_t) ? n - sizeof(uint64_t) : 0)
+    {
+        k = 0;
+        memcpy(&k, p, n < sizeof(uint64_t) ? n : sizeof(uint64_t));
+        k *= 0xC2B2AE3D27D4EB4FULL;
+        k = (k << 31) | (k >> 33);
+        h ^= k * 0x9E3779B185EBCA87ULL;
+        h = ((h << 27) | (h >> 37)) * 0x9E3779B185EBCA87ULL + 0x85EBCA77C2B2AE63ULL;
+    }
+
+    return h;
+}
+
+/* It computes the key of every layer of a DBN before it is trained: the key of layer l covers the training set, the seed of the run and the
+configuration of layers 0, ..., l, so two runs share a layer only if they share the whole stack beneath it
+Parameters: [D, d, n_epochs, n_CD_iterations, batch_size, LearningType, Regularization, p]
+D: training set
 d: DBN
-n_epochs: number of training epochs
-n_CD_iterations: number of CD iterations
-batch size: size of batch data */
-double BernoulliDBNTrainingbyContrastiveDivergence(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size)
+n_epochs, n_CD_iterations, batch_size, LearningType, Regularization, p: see GreedyDBNTraining */
+static uint64_t *getDBNLayerCacheKeys(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, int LearningType, int Regularization, double *p)
 {
-    double error = 0.0, aux = 0.0;
-    Dataset *tmp1 = NULL, *tmp2 = NULL;
-    int i, j, z, id;
+    uint64_t *key = NULL, h;
+    double value, conf[11];
+    int z, j, info[9];
 
-    tmp1 = CopyDataset(D);
+    key = (uint64_t *)malloc(d->n_layers * sizeof(uint64_t));
 
-    for (id = 0; id < d->n_layers; id++)
+    h = MixLayerCacheKey(0x165667B19E3779F9ULL, &d->cache->seed, sizeof(unsigned long));
+    info[0] = D->size;
+    info[1] = D->nfeatures;
+    h = MixLayerCacheKey(h, info, 2 * sizeof(int));
+    for (z = 0; z < D->size; z++)
     {
-        fprintf(stderr, "\nTraining layer %i ... ", id + 1);
-        error = BernoulliRBMTrainingbyContrastiveDivergence(tmp1, d->m[id], n_epochs, n_CD_iterations, batch_size);
+        for (j = 0; j < D->nfeatures; j++)
+        {
+            value = gsl_vector_get(D->sample[z].feature, j);
+            h = MixLayerCacheKey(h, &value, sizeof(double));
+        }
+        h = MixLayerCacheKey(h, &D->sample[z].label, sizeof(int));
+    }
 
-        /* It updates the last layer to be the input to the next RBM */
-        tmp2 = CopyDataset(tmp1);
-        DestroyDataset(&tmp1);
-        tmp1 = CreateDataset(D->size, d->m[id]->n_hidden_layer_neurons);
-        for (z = 0; z < tmp1->size; z++)
+    /* Early stopping changes the trained layers, so its held-out samples and settings are part of the key */
+    if (d->stopping)
+    {
+        info[0] = d->stopping->validation->size;
+        info[1] = d->stopping->metric;
+        info[2] = d->stopping->patience;
+        info[3] = d->stopping->interval;
+        h = MixLayerCacheKey(h, info, 4 * sizeof(int));
+        h = MixLayerCacheKey(h, &d->stopping->min_delta, sizeof(double));
+        for (z = 0; z < d->stopping->validation->size; z++)
         {
-            for (j = 0; j < tmp1->nfeatures; j++)
+            for (j = 0; j < d->stopping->validation->nfeatures; j++)
             {
-                aux = 0.0;
-                for (i = 0; i < tmp2->nfeatures; i++)
-                    aux += (gsl_vector_get(tmp2->sample[z].feature, i) * gsl_matrix_get(d->m[id]->W, i, j));
-                aux += gsl_vector_get(d->m[id]->b, j);
-                gsl_vector_set(tmp1->sample[z].feature, j, SigmoidLogistic(aux));
+                value = gsl_vector_get(d->stopping->validation->sample[z].feature, j);
+                h = MixLayerCacheKey(h, &value, sizeof(double));
             }
         }
-        DestroyDataset(&tmp2);
-        fprintf(stderr, "\nOK");
     }
-    DestroyDataset(&tmp1);
-    error = BernoulliDBNReconstruction(D, d);
 
-    return error;
+    for (j = 0; j < d->n_layers; j++)
+    {
+        info[0] = LearningType;
+        info[1] = Regularization;
+        info[2] = n_epochs;
+        info[3] = n_CD_iterations;
+        info[4] = batch_size;
+        info[5] = d->m[j]->n_visible_layer_neurons;
+        info[6] = d->m[j]->n_hidden_layer_neurons;
+        info[7] = d->m[j]->n_labels;
+        info[8] = d->m[j]->optimizer;
+        conf[0] = d->m[j]->eta;
+        conf[1] = d->m[j]->lambda;
+        conf[2] = d->m[j]->alpha;
+        conf[3] = d->m[j]->t;
+        conf[4] = d->m[j]->eta_min;
+        conf[5] = d->m[j]->eta_max;
+        conf[6] = Regularization ? p[j] : 0.0;
+        conf[7] = d->m[j]->beta1;
+        conf[8] = d->m[j]->beta2;
+        conf[9] = d->m[j]->epsilon;
+        conf[10] = d->m[j]->sigma_eta;
+        h = MixLayerCacheKey(h, info, 9 * sizeof(int));
+        h = MixLayerCacheKey(h, conf, 11 * sizeof(double));
+        key[j] = h;
+    }
+
+    return key;
 }
 
-/* It trains an DBN with Dropout for image reconstruction using Contrastive Divergence
-Parameters: [D, d, n_epochs, n_CD_iterations, batch_size, *p]
-D: dataset
+/* It builds the path of a cached layer
+Parameters: [c, key, path]
+c: layer cache
+key: layer key
+path: output buffer of at least strlen(c->dir) + 24 characters */
+static void getDBNLayerCachePath(DBNLayerCache *c, uint64_t key, char *path)
+{
+    sprintf(path, "%s/%016llx.layer", c->dir, (unsigned long long)key);
+}
+
+/* It loads a cached layer of a DBN, i.e., its parameters and (but for the top layer) its hidden probabilities over the training set
+Parameters: [d, id, key, D, buffer]
 d: DBN
-n_epochs: number of training epochs
-n_CD_iterations: number of CD iterations
-batch size: size of batch data
-*p: array of hidden neurons dropout rate */
-double BernoulliDBNTrainingbyContrastiveDivergenceWithDropout(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p)
+id: layer
+key: layer key
+D: training set
+buffer: activation buffer of the greedy trainer, allocated here if needed (see PropagateGreedyLayer)
+It returns 1 if the layer was found in the cache and 0 otherwise */
+static int LoadDBNCachedLayer(DBN *d, int id, uint64_t key, Dataset *D, Dataset **buffer)
 {
-    double error = 0.0, aux = 0.0;
-    Dataset *tmp1 = NULL, *tmp2 = NULL;
-    int i, j, z, id;
+    char *path = NULL;
+    FILE *fp = NULL;
+    RBM *m = NULL, *target = d->m[id];
+    uint64_t stored;
+    double eta;
+    int kind, n_layers, info[2], l, width = 0, valid;
+    long position, size;
+
+    path = (char *)malloc(strlen(d->cache->dir) + 24);
+    getDBNLayerCachePath(d->cache, key, path);
+    fp = fopen(path, "rb");
+    if (!fp)
+    {
+        free(path);
+        return 0;
+    }
 
-    tmp1 = CopyDataset(D);
+    valid = !freadModelHeader(fp, &kind, &n_layers) && kind == MODEL_FILE_LAYER && fread(&stored, sizeof(uint64_t), 1, fp) == 1 && stored == key &&
+            fread(&eta, sizeof(double), 1, fp) == 1 && (m = freadRBMParameters(fp)) && fread(info, sizeof(int), 2, fp) == 2;
+    if (valid)
+        valid = m->n_visible_layer_neurons == target->n_visible_layer_neurons && m->n_hidden_layer_neurons == target->n_hidden_layer_neurons &&
+                m->n_labels == target->n_labels && info[0] == D->size && info[1] == (id < d->n_layers - 1 ? target->n_hidden_layer_neurons : 0);
 
-    for (id = 0; id < d->n_layers; id++)
+    /* The activations overwrite the input of this layer, so the file must be complete before they are read */
+    if (valid)
     {
-        fprintf(stderr, "\nTraining layer %i ... ", id + 1);
-        error = BernoulliRBMTrainingbyContrastiveDivergencewithDropout(tmp1, d->m[id], n_epochs, n_CD_iterations, batch_size, p[id]);
+        position = ftell(fp);
+        size = (long)info[0] * info[1] * sizeof(double);
+        valid = !fseek(fp, 0, SEEK_END) && ftell(fp) == position + size && !fseek(fp, position, SEEK_SET);
+    }
 
-        /* It updates the last layer to be the input to the next RBM */
-        tmp2 = CopyDataset(tmp1);
-        DestroyDataset(&tmp1);
-        tmp1 = CreateDataset(D->size, d->m[id]->n_hidden_layer_neurons);
-        for (z = 0; z < tmp1->size; z++)
+    if (valid)
+    {
+        if (info[1])
         {
-            for (j = 0; j < tmp1->nfeatures; j++)
+            if (!*buffer)
             {
-                aux = 0.0;
-                for (i = 0; i < tmp2->nfeatures; i++)
-                    aux += (gsl_vector_get(tmp2->sample[z].feature, i) * gsl_matrix_get(d->m[id]->W, i, j));
-                aux += gsl_vector_get(d->m[id]->b, j);
-                gsl_vector_set(tmp1->sample[z].feature, j, SigmoidLogistic(aux));
+                for (l = 0; l < d->n_layers - 1; l++)
+                    if (d->m[l]->n_hidden_layer_neurons > width)
+                        width = d->m[l]->n_hidden_layer_neurons;
+                *buffer = CreateDatasetBuffer(D->size, width);
+            }
+            ResizeDatasetBuffer(*buffer, info[1]);
+            for (l = 0; l < D->size; l++)
+            {
+                if (gsl_vector_fread(fp, (*buffer)->sample[l].feature))
+                {
+                    fprintf(stderr, "\nUnable to read %s @LoadDBNCachedLayer.\n", path);
+                    exit(-1);
+                }
+                (*buffer)->sample[l].label = D->sample[l].label;
             }
+            (*buffer)->nlabels = D->nlabels;
         }
-        DestroyDataset(&tmp2);
-        fprintf(stderr, "\nOK");
+
+        gsl_matrix_memcpy(target->W, m->W);
+        gsl_vector_memcpy(target->a, m->a);
+        gsl_vector_memcpy(target->b, m->b);
+        gsl_matrix_memcpy(target->U, m->U);
+        gsl_vector_memcpy(target->c, m->c);
+        target->t = m->t;
+        target->eta = eta;
     }
-    DestroyDataset(&tmp1);
-    error = BernoulliDBNReconstruction(D, d);
+    else
+        fprintf(stderr, "\nIgnoring corrupted or mismatching %s @LoadDBNCachedLayer.\n", path);
 
-    return error;
+    DestroyRBM(&m);
+    fclose(fp);
+    free(path);
+
+    return valid;
 }
 
-/* It trains an DBN with Dropconnect for image reconstruction using Contrastive Divergence
-Parameters: [D, d, n_epochs, n_CD_iterations, batch_size, *p]
-D: dataset
+/* It stores a layer of a DBN just trained in the cache, writing a temporary file first so concurrent runs never read a partial layer
+Parameters: [d, id, key, D, H]
 d: DBN
-n_epochs: number of training epochs
-n_CD_iterations: number of CD iterations
-batch size: size of batch data
-*p: array of dropconnect masks rate */
-double BernoulliDBNTrainingbyContrastiveDivergenceWithDropconnect(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p)
+id: layer
+key: layer key
+D: training set
+H: hidden probabilities of the layer over the training set (NULL for the top layer) */
+static void StoreDBNCachedLayer(DBN *d, int id, uint64_t key, Dataset *D, Dataset *H)
 {
-    double error = 0.0, aux = 0.0;
-    Dataset *tmp1 = NULL, *tmp2 = NULL;
-    int i, j, z, id;
+    char *path = NULL, *tmp = NULL;
+    FILE *fp = NULL;
+    int z, info[2], status;
 
-    tmp1 = CopyDataset(D);
+    path = (char *)malloc(strlen(d->cache->dir) + 24);
+    tmp = (char *)malloc(strlen(d->cache->dir) + 48);
+    getDBNLayerCachePath(d->cache, key, path);
+    sprintf(tmp, "%s.%d.tmp", path, (int)getpid());
 
-    for (id = 0; id < d->n_layers; id++)
+    fp = fopen(tmp, "wb");
+    if (!fp)
     {
-        fprintf(stderr, "\nTraining layer %i ... ", id + 1);
-        error = BernoulliRBMTrainingbyContrastiveDivergencewithDropconnect(tmp1, d->m[id], n_epochs, n_CD_iterations, batch_size, p[id]);
+        fprintf(stderr, "\nUnable to open %s @StoreDBNCachedLayer.\n", tmp);
+        free(path);
+        free(tmp);
+        return;
+    }
 
-        /* It updates the last layer to be the input to the next RBM */
-        tmp2 = CopyDataset(tmp1);
-        DestroyDataset(&tmp1);
-        tmp1 = CreateDataset(D->size, d->m[id]->n_hidden_layer_neurons);
-        for (z = 0; z < tmp1->size; z++)
+    info[0] = D->size;
+    info[1] = H ? H->nfeatures : 0;
+    status = fwriteModelHeader(fp, MODEL_FILE_LAYER, 1);
+    if (!status && (fwrite(&key, sizeof(uint64_t), 1, fp) != 1 || fwrite(&d->m[id]->eta, sizeof(double), 1, fp) != 1))
+        status = -1;
+    if (!status)
+        status = fwriteRBMParameters(fp, d->m[id]);
+    if (!status && fwrite(info, sizeof(int), 2, fp) != 2)
+        status = -1;
+    for (z = 0; H && z < H->size && !status; z++)
+        status = gsl_vector_fwrite(fp, H->sample[z].feature);
+    if (fclose(fp))
+        status = -1;
+
+    if (status || rename(tmp, path))
+    {
+        fprintf(stderr, "\nUnable to write %s @StoreDBNCachedLayer.\n", path);
+        remove(tmp);
+    }
+    free(path);
+    free(tmp);
+}
+/**************************/
+
+/* Bernoulli DBN training */
+
+/* It trains one layer of a DBN greedily
+Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, LearningType, Regularization, p]
+D: dataset
+m: RBM
+n_epochs: number of training epochs
+n_CD_iterations: number of CD iterations
+batch_size: size of batch data
+LearningType: type of learning algorithm [1 - CD | 2 - PCD | 3 - FPCD | 4 - CD with bounded memory]
+Regularization: type of regularization [0 - none | 1 - Dropout | 2 - Dropconnect]
+p: dropout rate or dropconnect mask rate */
+static double TrainDBNLayer(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, int LearningType, int Regularization, double p)
+{
+    switch (LearningType)
+    {
+    case 1:
+        if (Regularization == 1)
+            return BernoulliRBMTrainingbyContrastiveDivergencewithDropout(D, m, n_epochs, n_CD_iterations, batch_size, p);
+        else if (Regularization == 2)
+            return BernoulliRBMTrainingbyContrastiveDivergencewithDropconnect(D, m, n_epochs, n_CD_iterations, batch_size, p);
+        return BernoulliRBMTrainingbyContrastiveDivergence(D, m, n_epochs, n_CD_iterations, batch_size);
+    case 2:
+        if (Regularization == 1)
+            return BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropout(D, m, n_epochs, n_CD_iterations, batch_size, p);
+        else if (Regularization == 2)
+            return BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropconnect(D, m, n_epochs, n_CD_iterations, batch_size, p);
+        return BernoulliRBMTrainingbyPersistentContrastiveDivergence(D, m, n_epochs, n_CD_iterations, batch_size);
+    case 3:
+        if (Regularization == 1)
+            return BernoulliRBMTrainingbyFastPersistentContrastiveDivergencewithDropout(D, m, n_epochs, n_CD_iterations, batch_size, p);
+        else if (Regularization == 2)
+            return BernoulliRBMTrainingbyFastPersistentContrastiveDivergencewithDropconnect(D, m, n_epochs, n_CD_iterations, batch_size, p);
+        return BernoulliRBMTrainingbyFastPersistentContrastiveDivergence(D, m, n_epochs, n_CD_iterations, batch_size);
+    case 4:
+        if (Regularization)
         {
-            for (j = 0; j < tmp1->nfeatures; j++)
-            {
-                aux = 0.0;
-                for (i = 0; i < tmp2->nfeatures; i++)
-                    aux += (gsl_vector_get(tmp2->sample[z].feature, i) * gsl_matrix_get(d->m[id]->W, i, j));
-                aux += gsl_vector_get(d->m[id]->b, j);
-                gsl_vector_set(tmp1->sample[z].feature, j, SigmoidLogistic(aux));
-            }
+            fprintf(stderr, "\nRegularization is not supported by the bounded-memory training @TrainDBNLayer.\n");
+            return 0.0;
         }
-        DestroyDataset(&tmp2);
-        fprintf(stderr, "\nOK");
+        return BernoulliRBMTrainingbyContrastiveDivergencewithBoundedMemory(D, m, n_epochs, n_CD_iterations, batch_size);
     }
-    DestroyDataset(&tmp1);
-    error = BernoulliDBNReconstruction(D, d);
 
-    return error;
+    fprintf(stderr, "\nInvalid learning type %d @TrainDBNLayer.\n", LearningType);
+    return 0.0;
 }
 
-/* It trains a DBN for image reconstruction using Persistent Contrastive Divergence
-Parameters: [D, d, n_epochs, n_CD_iterations, batch_size]
+/* It trains a DBN layer by layer, feeding each RBM with the hidden probabilities of the one beneath it. If d->cache is set, the bottom layers
+already trained with the same configuration by a previous run are loaded from it instead, and the newly trained ones are added to it. If d->stopping
+is set, every layer stops early on the held-out samples propagated up to it
+Parameters: [D, d, n_epochs, n_CD_iterations, batch_size, LearningType, Regularization, p]
 D: dataset
 d: DBN
 n_epochs: number of training epochs
 n_CD_iterations: number of CD iterations
-batch size: size of batch data */
-double BernoulliDBNTrainingbyPersistentContrastiveDivergence(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size)
+batch_size: size of batch data
+LearningType: type of learning algorithm [1 - CD | 2 - PCD | 3 - FPCD | 4 - CD with bounded memory]
+Regularization: type of regularization [0 - none | 1 - Dropout | 2 - Dropconnect]
+p: array of dropout rates or dropconnect mask rates, one per layer (unused without regularization) */
+static double GreedyDBNTraining(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, int LearningType, int Regularization, double *p)
 {
-    double error, aux;
-    Dataset *tmp1 = NULL, *tmp2 = NULL;
-    int i, j, z, id;
+    double error = 0.0;
+    Dataset *tmp = D, *buffer = NULL, *validation = NULL, *validation_buffer = NULL;
+    uint64_t *key = NULL;
+    int id, cached = 0;
 
-    tmp1 = CopyDataset(D);
+    if (d->cache)
+    {
+        key = getDBNLayerCacheKeys(D, d, n_epochs, n_CD_iterations, batch_size, LearningType, Regularization, p);
+        cached = 1;
+    }
+    if (d->stopping)
+        validation = d->stopping->validation;
 
     for (id = 0; id < d->n_layers; id++)
     {
-        fprintf(stderr, "\nTraining layer %d ... ", id + 1);
-        error = BernoulliRBMTrainingbyPersistentContrastiveDivergence(tmp1, d->m[id], n_epochs, n_CD_iterations, batch_size);
+        /* A layer is only taken from the cache if the layers beneath it were too, since its input must come from them */
+        if (cached && LoadDBNCachedLayer(d, id, key[id], D, &buffer))
+        {
+            fprintf(stderr, "\nLayer %i loaded from the cache", id + 1);
+            tmp = id < d->n_layers - 1 ? buffer : NULL;
+            if (d->stopping)
+                validation = PropagateGreedyLayer(d->stopping->validation, d->m, d->n_layers, id, 1.0, &validation_buffer);
+            continue;
+        }
+        cached = 0;
+
+        fprintf(stderr, "\nTraining layer %i ... ", id + 1);
+        if (d->stopping)
+            d->m[id]->stopping = CreateLayerEarlyStopping(d->stopping, validation);
+        error = TrainDBNLayer(tmp, d->m[id], n_epochs, n_CD_iterations, batch_size, LearningType, Regularization, Regularization ? p[id] : 0.0);
 
         /* It updates the last layer to be the input to the next RBM */
-        tmp2 = CopyDataset(tmp1);
-        DestroyDataset(&tmp1);
-        tmp1 = CreateDataset(D->size, d->m[id]->n_hidden_layer_neurons);
-        for (z = 0; z < tmp1->size; z++)
+        tmp = PropagateGreedyLayer(D, d->m, d->n_layers, id, 1.0, &buffer);
+        if (d->cache)
+            StoreDBNCachedLayer(d, id, key[id], D, tmp);
+        if (d->stopping)
         {
-            for (j = 0; j < tmp1->nfeatures; j++)
-            {
-                aux = 0.0;
-                for (i = 0; i < tmp2->nfeatures; i++)
-                    aux += (gsl_vector_get(tmp2->sample[z].feature, i) * gsl_matrix_get(d->m[id]->W, i, j));
-                aux += gsl_vector_get(d->m[id]->b, j);
-                gsl_vector_set(tmp1->sample[z].feature, j, SigmoidLogistic(aux));
-            }
+            DestroyEarlyStopping(&d->m[id]->stopping);
+            validation = PropagateGreedyLayer(d->stopping->validation, d->m, d->n_layers, id, 1.0, &validation_buffer);
         }
-        DestroyDataset(&tmp2);
         fprintf(stderr, "\nOK");
     }
-    DestroyDataset(&tmp1);
+    free(key);
+    DestroyDataset(&buffer);
+    DestroyDataset(&validation_buffer);
     error = BernoulliDBNReconstruction(D, d);
 
     return error;
 }
 
-/* It trains a DBN with Dropout for image reconstruction using Persistent Contrastive Divergence
+/* It trains an DBN for image reconstruction using Contrastive Divergence
+Parameters: [D, d, n_epochs, n_CD_iterations, batch_size]
+D: dataset
+d: DBN
+n_epochs: number of training epochs
+n_CD_iterations: number of CD iterations
+batch size: size of batch data */
+double BernoulliDBNTrainingbyContrastiveDivergence(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size)
+{
+    return GreedyDBNTraining(D, d, n_epochs, n_CD_iterations, batch_size, 1, 0, NULL);
+}
+
+/* It trains an DBN with Dropout for image reconstruction using Contrastive Divergence
 Parameters: [D, d, n_epochs, n_CD_iterations, batch_size, *p]
 D: dataset
 d: DBN
@@ -290,41 +529,47 @@ n_epochs: number of training epochs
 n_CD_iterations: number of CD iterations
 batch size: size of batch data
 *p: array of hidden neurons dropout rate */
-double BernoulliDBNTrainingbyPersistentContrastiveDivergenceWithDropout(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p)
+double BernoulliDBNTrainingbyContrastiveDivergenceWithDropout(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p)
 {
-    double error, aux;
-    Dataset *tmp1 = NULL, *tmp2 = NULL;
-    int i, j, z, id;
-
-    tmp1 = CopyDataset(D);
+    return GreedyDBNTraining(D, d, n_epochs, n_CD_iterations, batch_size, 1, 1, p);
+}
 
-    for (id = 0; id < d->n_layers; id++)
-    {
-        fprintf(stderr, "\nTraining layer %d ... ", id + 1);
-        error = BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropout(tmp1, d->m[id], n_epochs, n_CD_iterations, batch_size, p[id]);
+/* It trains an DBN with Dropconnect for image reconstruction using Contrastive Divergence
+Parameters: [D, d, n_epochs, n_CD_iterations, batch_size, *p]
+D: dataset
+d: DBN
+n_epochs: number of training epochs
+n_CD_iterations: number of CD iterations
+batch size: size of batch data
+*p: array of dropconnect masks rate */
+double BernoulliDBNTrainingbyContrastiveDivergenceWithDropconnect(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p)
+{
+    return GreedyDBNTraining(D, d, n_epochs, n_CD_iterations, batch_size, 1, 2, p);
+}
 
-        /* It updates the last layer to be the input to the next RBM */
-        tmp2 = CopyDataset(tmp1);
-        DestroyDataset(&tmp1);
-        tmp1 = CreateDataset(D->size, d->m[id]->n_hidden_layer_neurons);
-        for (z = 0; z < tmp1->size; z++)
-        {
-            for (j = 0; j < tmp1->nfeatures; j++)
-            {
-                aux = 0.0;
-                for (i = 0; i < tmp2->nfeatures; i++)
-                    aux += (gsl_vector_get(tmp2->sample[z].feature, i) * gsl_matrix_get(d->m[id]->W, i, j));
-                aux += gsl_vector_get(d->m[id]->b, j);
-                gsl_vector_set(tmp1->sample[z].feature, j, SigmoidLogistic(aux));
-            }
-        }
-        DestroyDataset(&tmp2);
-        fprintf(stderr, "\nOK");
-    }
-    DestroyDataset(&tmp1);
-    error = BernoulliDBNReconstruction(D, d);
+/* It trains a DBN for image reconstruction using Persistent Contrastive Divergence
+Parameters: [D, d, n_epochs, n_CD_iterations, batch_size]
+D: dataset
+d: DBN
+n_epochs: number of training epochs
+n_CD_iterations: number of CD iterations
+batch size: size of batch data */
+double BernoulliDBNTrainingbyPersistentContrastiveDivergence(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size)
+{
+    return GreedyDBNTraining(D, d, n_epochs, n_CD_iterations, batch_size, 2, 0, NULL);
+}
 
-    return error;
+/* It trains a DBN with Dropout for image reconstruction using Persistent Contrastive Divergence
+Parameters: [D, d, n_epochs, n_CD_iterations, batch_size, *p]
+D: dataset
+d: DBN
+n_epochs: number of training epochs
+n_CD_iterations: number of CD iterations
+batch size: size of batch data
+*p: array of hidden neurons dropout rate */
+double BernoulliDBNTrainingbyPersistentContrastiveDivergenceWithDropout(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p)
+{
+    return GreedyDBNTraining(D, d, n_epochs, n_CD_iterations, batch_size, 2, 1, p);
 }
 
 /* It trains a DBN with Dropconnect for image reconstruction using Persistent Contrastive Divergence
@@ -337,39 +582,19 @@ batch size: size of batch data
 *p: array of dropconnect masks rate */
 double BernoulliDBNTrainingbyPersistentContrastiveDivergenceWithDropconnect(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p)
 {
-    double error, aux;
-    Dataset *tmp1 = NULL, *tmp2 = NULL;
-    int i, j, z, id;
-
-    tmp1 = CopyDataset(D);
-
-    for (id = 0; id < d->n_layers; id++)
-    {
-        fprintf(stderr, "\nTraining layer %d ... ", id + 1);
-        error = BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropconnect(tmp1, d->m[id], n_epochs, n_CD_iterations, batch_size, p[id]);
-
-        /* It updates the last layer to be the input to the next RBM */
-        tmp2 = CopyDataset(tmp1);
-        DestroyDataset(&tmp1);
-        tmp1 = CreateDataset(D->size, d->m[id]->n_hidden_layer_neurons);
-        for (z = 0; z < tmp1->size; z++)
-        {
-            for (j = 0; j < tmp1->nfeatures; j++)
-            {
-                aux = 0.0;
-                for (i = 0; i < tmp2->nfeatures; i++)
-                    aux += (gsl_vector_get(tmp2->sample[z].feature, i) * gsl_matrix_get(d->m[id]->W, i, j));
-                aux += gsl_vector_get(d->m[id]->b, j);
-                gsl_vector_set(tmp1->sample[z].feature, j, SigmoidLogistic(aux));
-            }
-        }
-        DestroyDataset(&tmp2);
-        fprintf(stderr, "\nOK");
-    }
-    DestroyDataset(&tmp1);
-    error = BernoulliDBNReconstruction(D, d);
+    return GreedyDBNTraining(D, d, n_epochs, n_CD_iterations, batch_size, 2, 2, p);
+}
 
-    return error;
+/* It trains a DBN for image reconstruction using Contrastive Divergence with bounded memory, i.e., without full-size statistics matrices
+Parameters: [D, d, n_epochs, n_CD_iterations, batch_size]
+D: dataset
+d: DBN
+n_epochs: number of training epochs
+n_CD_iterations: number of CD iterations
+batch size: size of batch data */
+double BernoulliDBNTrainingbyContrastiveDivergenceWithBoundedMemory(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size)
+{
+    return GreedyDBNTraining(D, d, n_epochs, n_CD_iterations, batch_size, 4, 0, NULL);
 }
 
 /* It trains a DBN for image reconstruction using Fast Persistent Contrastive Divergence
@@ -381,39 +606,7 @@ n_CD_iterations: number of CD iterations
 batch size: size of batch data */
 double BernoulliDBNTrainingbyFastPersistentContrastiveDivergence(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size)
 {
-    double error, aux;
-    Dataset *tmp1 = NULL, *tmp2 = NULL;
-    int i, j, z, id;
-
-    tmp1 = CopyDataset(D);
-
-    for (id = 0; id < d->n_layers; id++)
-    {
-        fprintf(stderr, "\nTraining layer %d ... ", id + 1);
-        error = BernoulliRBMTrainingbyFastPersistentContrastiveDivergence(tmp1, d->m[id], n_epochs, n_CD_iterations, batch_size);
-
-        /* It updates the last layer to be the input to the next RBM */
-        tmp2 = CopyDataset(tmp1);
-        DestroyDataset(&tmp1);
-        tmp1 = CreateDataset(D->size, d->m[id]->n_hidden_layer_neurons);
-        for (z = 0; z < tmp1->size; z++)
-        {
-            for (j = 0; j < tmp1->nfeatures; j++)
-            {
-                aux = 0.0;
-                for (i = 0; i < tmp2->nfeatures; i++)
-                    aux += (gsl_vector_get(tmp2->sample[z].feature, i) * gsl_matrix_get(d->m[id]->W, i, j));
-                aux += gsl_vector_get(d->m[id]->b, j);
-                gsl_vector_set(tmp1->sample[z].feature, j, SigmoidLogistic(aux));
-            }
-        }
-        DestroyDataset(&tmp2);
-        fprintf(stderr, "\nOK");
-    }
-    DestroyDataset(&tmp1);
-    error = BernoulliDBNReconstruction(D, d);
-
-    return error;
+    return GreedyDBNTraining(D, d, n_epochs, n_CD_iterations, batch_size, 3, 0, NULL);
 }
 
 /* It trains a DBN with Dropout for image reconstruction using Fast Persistent Contrastive Divergence
@@ -426,81 +619,170 @@ batch size: size of batch data
 *p: array of hidden neurons dropout rate */
 double BernoulliDBNTrainingbyFastPersistentContrastiveDivergenceWithDropout(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p)
 {
-    double error, aux;
-    Dataset *tmp1 = NULL, *tmp2 = NULL;
-    int i, j, z, id;
+    return GreedyDBNTraining(D, d, n_epochs, n_CD_iterations, batch_size, 3, 1, p);
+}
 
-    tmp1 = CopyDataset(D);
+/* It trains a DBN with Dropconnect for image reconstruction using Fast Persistent Contrastive Divergence
+Parameters: [D, d, n_epochs, n_CD_iterations, batch_size, *p]
+D: dataset
+d: DBN
+n_epochs: number of training epochs
+n_CD_iterations: number of CD iterations
+batch size: size of batch data
+*p: array of dropconnect masks rate */
+double BernoulliDBNTrainingbyFastPersistentContrastiveDivergenceWithDropconnect(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p)
+{
+    return GreedyDBNTraining(D, d, n_epochs, n_CD_iterations, batch_size, 3, 2, p);
+}
+/**************************/
 
-    for (id = 0; id < d->n_layers; id++)
+/* Pipelined DBN training */
+
+/* It replaces the input of a pipeline stage with the hidden probabilities of the stage beneath it, computed with the parameters it published last
+Parameters: [s]
+s: pipeline stage */
+static void RefreshDBNPipelineStage(DBNPipelineStage *s)
+{
+    /* Locks are always taken bottom-up, so stages refreshing at the same time can not deadlock */
+    pthread_mutex_lock(&s->below->lock);
+    pthread_mutex_lock(&s->lock);
+    getDatasetProbabilityTurningOnHiddenUnit(s->below->snapshot, s->below->input, 1.0, s->input);
+    pthread_mutex_unlock(&s->lock);
+    pthread_mutex_unlock(&s->below->lock);
+}
+
+/* It trains one layer of a pipelined DBN in rounds of n_refresh_epochs epochs, refreshing its input from the layer beneath it before every round
+and publishing its own parameters after it
+Parameters: [arg]
+arg: pipeline stage */
+static void *RunDBNPipelineStage(void *arg)
+{
+    DBNPipelineStage *s = (DBNPipelineStage *)arg;
+    RBM *m = s->d->m[s->id];
+    double eta_min = m->eta_min, eta_max = m->eta_max, step = (m->eta_max - m->eta_min) / s->n_epochs;
+    int e = 0, k, stop = 0;
+
+    if (s->below)
     {
-        fprintf(stderr, "\nTraining layer %d ... ", id + 1);
-        error = BernoulliRBMTrainingbyFastPersistentContrastiveDivergencewithDropout(tmp1, d->m[id], n_epochs, n_CD_iterations, batch_size, p[id]);
+        pthread_mutex_lock(&s->below->lock);
+        while (s->below->epochs_done < s->n_warmup_epochs && !s->below->finished)
+            pthread_cond_wait(&s->below->progress, &s->below->lock);
+        pthread_mutex_unlock(&s->below->lock);
+    }
 
-        /* It updates the last layer to be the input to the next RBM */
-        tmp2 = CopyDataset(tmp1);
-        DestroyDataset(&tmp1);
-        tmp1 = CreateDataset(D->size, d->m[id]->n_hidden_layer_neurons);
-        for (z = 0; z < tmp1->size; z++)
-        {
-            for (j = 0; j < tmp1->nfeatures; j++)
-            {
-                aux = 0.0;
-                for (i = 0; i < tmp2->nfeatures; i++)
-                    aux += (gsl_vector_get(tmp2->sample[z].feature, i) * gsl_matrix_get(d->m[id]->W, i, j));
-                aux += gsl_vector_get(d->m[id]->b, j);
-                gsl_vector_set(tmp1->sample[z].feature, j, SigmoidLogistic(aux));
-            }
-        }
-        DestroyDataset(&tmp2);
-        fprintf(stderr, "\nOK");
+    while (e < s->n_epochs && !stop)
+    {
+        if (s->below)
+            RefreshDBNPipelineStage(s);
+
+        /* The learning rate of each round follows the same linear decay a single run over all the epochs would */
+        k = s->n_epochs - e < s->n_refresh_epochs ? s->n_epochs - e : s->n_refresh_epochs;
+        m->eta_max = eta_max - step * e;
+        m->eta_min = eta_max - step * (e + k);
+        s->error = TrainDBNLayer(s->input, m, k, s->n_CD_iterations, s->batch_size, s->LearningType, s->Regularization, s->p);
+        e += k;
+        stop = s->error < 0.0001;
+
+        pthread_mutex_lock(&s->lock);
+        gsl_matrix_memcpy(s->snapshot->W, m->W);
+        gsl_vector_memcpy(s->snapshot->b, m->b);
+        s->epochs_done = e;
+        pthread_cond_broadcast(&s->progress);
+        pthread_mutex_unlock(&s->lock);
     }
-    DestroyDataset(&tmp1);
-    error = BernoulliDBNReconstruction(D, d);
+    m->eta_max = eta_max;
+    m->eta_min = eta_min;
 
-    return error;
+    pthread_mutex_lock(&s->lock);
+    s->finished = 1;
+    pthread_cond_broadcast(&s->progress);
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
 }
 
-/* It trains a DBN with Dropconnect for image reconstruction using Fast Persistent Contrastive Divergence
-Parameters: [D, d, n_epochs, n_CD_iterations, batch_size, *p]
+/* It trains all the layers of a DBN at once, one thread per layer: layer l + 1 starts once layer l has run n_warmup_epochs epochs, and then
+it trains on the hidden probabilities of layer l, which are recomputed with the latest parameters of layer l every n_refresh_epochs epochs.
+Each layer still runs n_epochs epochs, and the last rounds of a layer see the final parameters of the layers beneath it. d->stopping is not used,
+since the input of a layer keeps changing while it trains.
+Parameters: [D, d, n_epochs, n_CD_iterations, batch_size, LearningType, Regularization, p, n_warmup_epochs, n_refresh_epochs]
 D: dataset
 d: DBN
 n_epochs: number of training epochs
 n_CD_iterations: number of CD iterations
-batch size: size of batch data
-*p: array of dropconnect masks rate */
-double BernoulliDBNTrainingbyFastPersistentContrastiveDivergenceWithDropconnect(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, double *p)
+batch_size: size of batch data
+LearningType: type of learning algorithm [1 - CD | 2 - PCD | 3 - FPCD | 4 - CD with bounded memory]
+Regularization: type of regularization [0 - none | 1 - Dropout | 2 - Dropconnect]
+p: array of dropout rates or dropconnect mask rates, one per layer (unused without regularization)
+n_warmup_epochs: number of epochs a layer runs before the layer above it starts
+n_refresh_epochs: number of epochs a layer runs between two refreshes of its input */
+double BernoulliDBNPipelinedTraining(Dataset *D, DBN *d, int n_epochs, int n_CD_iterations, int batch_size, int LearningType, int Regularization, double *p,
+                                     int n_warmup_epochs, int n_refresh_epochs)
 {
-    double error, aux;
-    Dataset *tmp1 = NULL, *tmp2 = NULL;
-    int i, j, z, id;
+    DBNPipelineStage *stage = NULL;
+    pthread_t *thread = NULL;
+    double error;
+    int id;
 
-    tmp1 = CopyDataset(D);
+    if (n_epochs <= 0 || n_refresh_epochs <= 0)
+    {
+        fprintf(stderr, "\nInvalid number of epochs or refresh interval @BernoulliDBNPipelinedTraining.\n");
+        return 0.0;
+    }
+
+    stage = (DBNPipelineStage *)calloc(d->n_layers, sizeof(DBNPipelineStage));
+    thread = (pthread_t *)malloc(d->n_layers * sizeof(pthread_t));
+    if (!stage || !thread)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @BernoulliDBNPipelinedTraining.\n");
+        exit(-1);
+    }
 
     for (id = 0; id < d->n_layers; id++)
     {
-        fprintf(stderr, "\nTraining layer %d ... ", id + 1);
-        error = BernoulliRBMTrainingbyFastPersistentContrastiveDivergencewithDropconnect(tmp1, d->m[id], n_epochs, n_CD_iterations, batch_size, p[id]);
+        stage[id].d = d;
+        stage[id].id = id;
+        stage[id].below = id ? &stage[id - 1] : NULL;
+        stage[id].input = id ? CreateDatasetBuffer(D->size, d->m[id]->n_visible_layer_neurons) : D;
+        stage[id].snapshot = CreateRBM(d->m[id]->n_visible_layer_neurons, d->m[id]->n_hidden_layer_neurons, d->m[id]->n_labels);
+        gsl_matrix_memcpy(stage[id].snapshot->W, d->m[id]->W);
+        gsl_vector_memcpy(stage[id].snapshot->b, d->m[id]->b);
+        stage[id].n_epochs = n_epochs;
+        stage[id].n_CD_iterations = n_CD_iterations;
+        stage[id].batch_size = batch_size;
+        stage[id].LearningType = LearningType;
+        stage[id].Regularization = Regularization;
+        stage[id].p = Regularization ? p[id] : 0.0;
+        stage[id].n_warmup_epochs = n_warmup_epochs;
+        stage[id].n_refresh_epochs = n_refresh_epochs;
+        pthread_mutex_init(&stage[id].lock, NULL);
+        pthread_cond_init(&stage[id].progress, NULL);
+    }
 
-        /* It updates the last layer to be the input to the next RBM */
-        tmp2 = CopyDataset(tmp1);
-        DestroyDataset(&tmp1);
-        tmp1 = CreateDataset(D->size, d->m[id]->n_hidden_layer_neurons);
-        for (z = 0; z < tmp1->size; z++)
+    fprintf(stderr, "\nTraining %d layers in a pipeline ... ", d->n_layers);
+    for (id = 0; id < d->n_layers; id++)
+    {
+        if (pthread_create(&thread[id], NULL, RunDBNPipelineStage, &stage[id]))
         {
-            for (j = 0; j < tmp1->nfeatures; j++)
-            {
-                aux = 0.0;
-                for (i = 0; i < tmp2->nfeatures; i++)
-                    aux += (gsl_vector_get(tmp2->sample[z].feature, i) * gsl_matrix_get(d->m[id]->W, i, j));
-                aux += gsl_vector_get(d->m[id]->b, j);
-                gsl_vector_set(tmp1->sample[z].feature, j, SigmoidLogistic(aux));
-            }
+            fprintf(stderr, "\nUnable to create the thread of layer %d @BernoulliDBNPipelinedTraining.\n", id + 1);
+            exit(-1);
         }
-        DestroyDataset(&tmp2);
-        fprintf(stderr, "\nOK");
     }
-    DestroyDataset(&tmp1);
+    for (id = 0; id < d->n_layers; id++)
+        pthread_join(thread[id], NULL);
+    fprintf(stderr, "\nOK");
+
+    for (id = 0; id < d->n_layers; id++)
+    {
+        if (id)
+            DestroyDataset(&stage[id].input);
+        DestroyRBM(&stage[id].snapshot);
+        pthread_mutex_destroy(&stage[id].lock);
+        pthread_cond_destroy(&stage[id].progress);
+    }
+    free(stage);
+    free(thread);
+
     error = BernoulliDBNReconstruction(D, d);
 
     return error;
@@ -567,24 +849,15 @@ s: array of visible layer
 d: DBN */
 gsl_vector *ForwardPass(gsl_vector *s, DBN *d)
 {
-    int l;
-    gsl_vector *h = NULL, *v = NULL;
+    gsl_vector *v = NULL;
+    DBNWorkspace *w = NULL;
 
     if (d)
     {
-        v = gsl_vector_calloc(d->m[0]->n_visible_layer_neurons);
-        setVisibleLayer(d->m[0], s);
-
-        /* For each layer */
-        for (l = 0; l < d->n_layers; l++)
-        {
-            h = gsl_vector_calloc(d->m[l]->n_hidden_layer_neurons);
-            h = getProbabilityTurningOnHiddenUnit(d->m[l], v);
-            gsl_vector_free(v);
-            v = gsl_vector_calloc(d->m[l]->n_hidden_layer_neurons);
-            gsl_vector_memcpy(v, h);
-            gsl_vector_free(h);
-        }
+        w = CreateDBNWorkspace(d, 0);
+        v = gsl_vector_alloc(d->m[d->n_layers - 1]->n_hidden_layer_neurons);
+        gsl_vector_memcpy(v, FASTForwardPass(s, d, w));
+        DestroyDBNWorkspace(&w);
         return v;
     }
     else
@@ -595,6 +868,123 @@ gsl_vector *ForwardPass(gsl_vector *s, DBN *d)
 }
 /**********************************************/
 
+/* DBN inference */
+
+/* It allocates the scratch vectors and matrices used by the allocation-free inference paths
+Parameters: [d, batch_size]
+d: DBN
+batch_size: maximum number of samples handled by BatchForwardPass (0 for single-sample inference only) */
+DBNWorkspace *CreateDBNWorkspace(DBN *d, int batch_size)
+{
+    DBNWorkspace *w = NULL;
+    int l;
+
+    if (!d)
+    {
+        fprintf(stderr, "\nThere is no DBN allocated @CreateDBNWorkspace.\n");
+        return NULL;
+    }
+
+    w = (DBNWorkspace *)malloc(sizeof(DBNWorkspace));
+    if (!w)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @CreateDBNWorkspace.\n");
+        exit(-1);
+    }
+    w->n_layers = d->n_layers;
+    w->h = (gsl_vector **)malloc(w->n_layers * sizeof(gsl_vector *));
+    for (l = 0; l < w->n_layers; l++)
+        w->h[l] = gsl_vector_alloc(d->m[l]->n_hidden_layer_neurons);
+
+    w->metrics = NULL;
+    w->batch_size = batch_size;
+    w->H = NULL;
+    if (batch_size > 0)
+    {
+        w->H = (gsl_matrix **)malloc(w->n_layers * sizeof(gsl_matrix *));
+        for (l = 0; l < w->n_layers; l++)
+            w->H[l] = gsl_matrix_alloc(batch_size, d->m[l]->n_hidden_layer_neurons);
+    }
+
+    return w;
+}
+
+/* It deallocates a DBN workspace
+Parameters: [w]
+w: DBN workspace */
+void DestroyDBNWorkspace(DBNWorkspace **w)
+{
+    int l;
+
+    if (*w)
+    {
+        for (l = 0; l < (*w)->n_layers; l++)
+            gsl_vector_free((*w)->h[l]);
+        free((*w)->h);
+        if ((*w)->H)
+        {
+            for (l = 0; l < (*w)->n_layers; l++)
+                gsl_matrix_free((*w)->H[l]);
+            free((*w)->H);
+        }
+        free(*w);
+        *w = NULL;
+    }
+}
+
+/* It executes the forward pass for a given sample s without any heap allocation, and outputs the net's response for that sample
+The returned vector belongs to the workspace and is overwritten by the next call, so it must be copied if it has to outlive it.
+Parameters: [s, d, w]
+s: array of visible layer
+d: DBN
+w: workspace created by CreateDBNWorkspace for this DBN */
+gsl_vector *FASTForwardPass(gsl_vector *s, DBN *d, DBNWorkspace *w)
+{
+    int l;
+
+    FASTgetProbabilityTurningOnHiddenUnit(d->m[0], s, w->h[0]);
+    for (l = 1; l < d->n_layers; l++)
+        FASTgetProbabilityTurningOnHiddenUnit(d->m[l], w->h[l - 1], w->h[l]);
+
+    return w->h[d->n_layers - 1];
+}
+
+/* It executes the forward pass for a batch of samples, running one GEMM per layer instead of one GEMV per sample
+Only the first X->size1 rows of the returned matrix are meaningful. It belongs to the workspace and is overwritten by the next call.
+Parameters: [X, d, w]
+X: matrix of visible layers (one sample per row, at most w->batch_size rows)
+d: DBN
+w: workspace created by CreateDBNWorkspace for this DBN with a non-zero batch size */
+gsl_matrix *BatchForwardPass(gsl_matrix *X, DBN *d, DBNWorkspace *w)
+{
+    int l, n = X->size1;
+    gsl_matrix_view in, out;
+    struct timespec start, end;
+
+    if (!w->H || n > w->batch_size)
+    {
+        fprintf(stderr, "\nBatch of %d samples does not fit the workspace @BatchForwardPass.\n", n);
+        return NULL;
+    }
+
+    for (l = 0; l < d->n_layers; l++)
+    {
+        if (w->metrics)
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        out = gsl_matrix_submatrix(w->H[l], 0, 0, n, w->H[l]->size2);
+        getBatchProbabilityTurningOnHiddenUnit(d->m[l], l ? &in.matrix : X, &out.matrix);
+        in = out;
+        if (w->metrics)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            RecordLayerMetrics(w->metrics, l, n, getElapsedNanoseconds(&start, &end));
+        }
+    }
+
+    return w->H[d->n_layers - 1];
+}
+/**********************************************/
+
 /* Data conversion */
 
 /* It generates a subgraph using the learned features from the top layer of the DBN over the dataset
@@ -684,6 +1074,79 @@ void saveDBNParameters(DBN *d, char *file)
     }
 }
 
+/* It saves a DBN to a binary model file, which is much faster to load than the text format and keeps full double precision
+Parameters: [d, file]
+d: DBN
+file: file name
+It returns 0 on success and a non-zero value otherwise */
+int saveDBNParametersBinary(DBN *d, char *file)
+{
+    int l, status = 0;
+    FILE *fp = NULL;
+
+    fp = fopen(file, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "\nUnable to open %s @saveDBNParametersBinary.\n", file);
+        return -1;
+    }
+
+    status = fwriteModelHeader(fp, MODEL_FILE_DBN, d->n_layers);
+    for (l = 0; l < d->n_layers && !status; l++)
+        status = fwriteRBMParameters(fp, d->m[l]);
+    if (fclose(fp))
+        status = -1;
+
+    if (status)
+        fprintf(stderr, "\nUnable to write %s @saveDBNParametersBinary.\n", file);
+
+    return status;
+}
+
+/* It allocates a DBN from a binary model file written by saveDBNParametersBinary
+Parameters: [file]
+file: file name
+It returns NULL if the file cannot be read or does not hold a consistent DBN */
+DBN *loadDBNFromBinaryFile(char *file)
+{
+    int l, kind, n_layers;
+    FILE *fp = NULL;
+    DBN *d = NULL;
+
+    fp = fopen(file, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "\nUnable to open %s @loadDBNFromBinaryFile.\n", file);
+        return NULL;
+    }
+
+    if (freadModelHeader(fp, &kind, &n_layers) || kind != MODEL_FILE_DBN)
+    {
+        fprintf(stderr, "\n%s is not a binary DBN file @loadDBNFromBinaryFile.\n", file);
+        fclose(fp);
+        return NULL;
+    }
+
+    d = (DBN *)malloc(sizeof(DBN));
+    d->n_layers = n_layers;
+    d->m = (RBM **)calloc(n_layers, sizeof(RBM *));
+    d->cache = NULL;
+    d->stopping = NULL;
+    for (l = 0; l < n_layers; l++)
+    {
+        d->m[l] = freadRBMParameters(fp);
+        if (!d->m[l] || (l > 0 && d->m[l]->n_visible_layer_neurons != d->m[l - 1]->n_hidden_layer_neurons))
+        {
+            fprintf(stderr, "\nInconsistent layer %d in %s @loadDBNFromBinaryFile.\n", l, file);
+            DestroyDBN(&d);
+            break;
+        }
+    }
+    fclose(fp);
+
+    return d;
+}
+
 /* It loads DBN weight matrixes and bias vectors from file
 Parameters: [d, file]
 d: DBN
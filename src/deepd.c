@@ -0,0 +1,66 @@
+/* deepd: it serves the top layer features of an RBM, DBN or DBM stored in a binary model file over a Unix domain socket */
+
+#include <signal.h>
+#include "deep.h"
+
+static Server *server = NULL;
+
+/* It stops the server on SIGINT and SIGTERM */
+static void HandleSignal(int sig)
+{
+    if (server)
+        StopServer(server);
+}
+
+int main(int argc, char **argv)
+{
+
+    if (argc != 9)
+    {
+        fprintf(stderr, "\nusage deepd <binary model file> <socket path> <number of worker threads> <maximum batch size> <batching deadline in microseconds> <queue capacity> <model reload interval in milliseconds (0 disables reloading)> <feature cache capacity (0 disables caching)>\n");
+        exit(-1);
+    }
+
+    ServingConfig config;
+    struct sigaction action;
+    sigset_t mask;
+
+    config.model_path = argv[1];
+    config.socket_path = argv[2];
+    config.n_workers = atoi(argv[3]);
+    config.max_batch_size = atoi(argv[4]);
+    config.max_delay_us = atoi(argv[5]);
+    config.queue_capacity = atoi(argv[6]);
+    config.reload_interval_ms = atoi(argv[7]);
+    config.cache_capacity = atoi(argv[8]);
+
+    /* Worker and connection threads inherit a mask with the termination signals blocked, so they are always delivered to the accepting thread */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    fprintf(stderr, "\nLoading model %s ... ", config.model_path);
+    server = CreateServer(&config);
+    if (!server)
+        exit(-1);
+    fprintf(stderr, "\nOk\n");
+
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = HandleSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+
+    fprintf(stderr, "\nServing on %s with %d workers (batches of up to %d samples, %d us deadline, %d pending requests)\n", config.socket_path, config.n_workers, config.max_batch_size, config.max_delay_us, config.queue_capacity);
+    if (config.reload_interval_ms > 0)
+        fprintf(stderr, "Watching %s for new models every %d ms\n", config.model_path, config.reload_interval_ms);
+    RunServer(server);
+    fprintf(stderr, "\nShutting down ... ");
+
+    DestroyServer(&server);
+    fprintf(stderr, "\nOk\n");
+
+    return 0;
+}
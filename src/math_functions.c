@@ -244,3 +244,22 @@ gsl_matrix *PseudoInverse(gsl_matrix *A)
 
     return inv;
 }
+
+/* It samples a binary matrix whose entries are turned on with the probabilities held by another one, one row at a time
+Parameters: [P, S, r]
+P: matrix of probabilities
+S: output binary matrix with the same size as P (it may be P itself)
+r: random number generator */
+void SampleBernoulliMatrix(gsl_matrix *P, gsl_matrix *S, gsl_rng *r)
+{
+    size_t i, j;
+    double *p, *s;
+
+    for (i = 0; i < P->size1; i++)
+    {
+        p = gsl_matrix_ptr(P, i, 0);
+        s = gsl_matrix_ptr(S, i, 0);
+        for (j = 0; j < P->size2; j++)
+            s[j] = p[j] >= gsl_rng_uniform(r) ? 1.0 : 0.0;
+    }
+}
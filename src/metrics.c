@@ -0,0 +1,225 @@
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Allocation and deallocation */
+
+/* It allocates an empty metrics registry */
+Metrics *CreateMetrics(void)
+{
+    Metrics *m = NULL;
+
+    m = (Metrics *)calloc(1, sizeof(Metrics));
+    if (!m)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @CreateMetrics.\n");
+        exit(-1);
+    }
+
+    return m;
+}
+
+/* It deallocates a metrics registry
+Parameters: [m]
+m: metrics registry */
+void DestroyMetrics(Metrics **m)
+{
+    if (*m)
+    {
+        free(*m);
+        *m = NULL;
+    }
+}
+/**********************************************/
+
+/* Recording */
+
+/* It adds n to a counter
+Parameters: [counter, n]
+counter: counter
+n: increment */
+void IncrementMetricsCounter(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/* It computes the bucket of a value: values below 2^METRICS_SUB_BUCKET_BITS have their own bucket, and larger ones
+are mapped by their exponent and the METRICS_SUB_BUCKET_BITS bits that follow their leading one
+Parameters: [value]
+value: recorded value */
+static int getMetricsBucket(uint64_t value)
+{
+    int e;
+
+    if (value < (1 << METRICS_SUB_BUCKET_BITS))
+        return (int)value;
+    if (value >> METRICS_MAX_EXPONENT)
+        return METRICS_N_BUCKETS - 1;
+
+    e = 63 - __builtin_clzll(value);
+    return ((e - METRICS_SUB_BUCKET_BITS + 1) << METRICS_SUB_BUCKET_BITS) + (int)((value >> (e - METRICS_SUB_BUCKET_BITS)) & ((1 << METRICS_SUB_BUCKET_BITS) - 1));
+}
+
+/* It computes the smallest value mapped to a bucket
+Parameters: [bucket]
+bucket: bucket index */
+static uint64_t getMetricsBucketLowerBound(int bucket)
+{
+    int e, sub;
+
+    if (bucket < (1 << METRICS_SUB_BUCKET_BITS))
+        return bucket;
+
+    e = (bucket >> METRICS_SUB_BUCKET_BITS) + METRICS_SUB_BUCKET_BITS - 1;
+    sub = bucket & ((1 << METRICS_SUB_BUCKET_BITS) - 1);
+    return (uint64_t)((1 << METRICS_SUB_BUCKET_BITS) + sub) << (e - METRICS_SUB_BUCKET_BITS);
+}
+
+/* It records a value in a histogram
+Parameters: [h, value]
+h: histogram
+value: recorded value */
+void RecordMetricsHistogram(MetricsHistogram *h, uint64_t value)
+{
+    uint64_t max;
+
+    __atomic_fetch_add(&h->counts[getMetricsBucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* It records the samples propagated through a layer and the time it took
+Parameters: [m, layer, samples, ns]
+m: metrics registry
+layer: layer index (layers beyond METRICS_MAX_LAYERS are not recorded)
+samples: number of samples
+ns: elapsed time in nanoseconds */
+void RecordLayerMetrics(Metrics *m, int layer, uint64_t samples, uint64_t ns)
+{
+    if (layer < 0 || layer >= METRICS_MAX_LAYERS)
+        return;
+
+    __atomic_fetch_add(&m->layer[layer].samples, samples, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->layer[layer].nanoseconds, ns, __ATOMIC_RELAXED);
+}
+/**********************************************/
+
+/* Querying */
+
+/* It computes an approximate quantile of a histogram, i.e., the middle of the bucket holding it
+Parameters: [h, q]
+h: histogram
+q: quantile in [0, 1] */
+uint64_t getMetricsHistogramQuantile(MetricsHistogram *h, double q)
+{
+    uint64_t count, target, seen = 0, lower, upper, max;
+    int i;
+
+    count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    if (!count)
+        return 0;
+
+    target = (uint64_t)(q * count + 0.5);
+    if (target < 1)
+        target = 1;
+
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    for (i = 0; i < METRICS_N_BUCKETS; i++)
+    {
+        seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        if (seen >= target)
+        {
+            lower = getMetricsBucketLowerBound(i);
+            upper = i + 1 < METRICS_N_BUCKETS ? getMetricsBucketLowerBound(i + 1) : lower + 1;
+            return (lower + (upper - 1)) / 2 < max ? (lower + (upper - 1)) / 2 : max;
+        }
+    }
+
+    return max;
+}
+
+/* It computes the time between two timestamps in nanoseconds
+Parameters: [start, end]
+start: first timestamp
+end: second timestamp */
+uint64_t getElapsedNanoseconds(struct timespec *start, struct timespec *end)
+{
+    int64_t ns = (int64_t)(end->tv_sec - start->tv_sec) * 1000000000 + (end->tv_nsec - start->tv_nsec);
+
+    return ns > 0 ? (uint64_t)ns : 0;
+}
+
+/* It writes a histogram as a Prometheus summary with its main quantiles
+Parameters: [fp, prefix, name, help, h, scale]
+fp: output stream
+prefix: metric name prefix
+name: metric name
+help: metric description
+h: histogram
+scale: factor converting recorded values to the exported unit (e.g., 1e-9 from nanoseconds to seconds) */
+void PrintMetricsHistogram(FILE *fp, char *prefix, char *name, char *help, MetricsHistogram *h, double scale)
+{
+    double quantiles[4] = {0.5, 0.9, 0.99, 0.999};
+    int i;
+
+    fprintf(fp, "# HELP %s_%s %s\n", prefix, name, help);
+    fprintf(fp, "# TYPE %s_%s summary\n", prefix, name);
+    for (i = 0; i < 4; i++)
+        fprintf(fp, "%s_%s{quantile=\"%g\"} %.9g\n", prefix, name, quantiles[i], getMetricsHistogramQuantile(h, quantiles[i]) * scale);
+    fprintf(fp, "%s_%s_sum %.9g\n", prefix, name, __atomic_load_n(&h->sum, __ATOMIC_RELAXED) * scale);
+    fprintf(fp, "%s_%s_count %llu\n", prefix, name, (unsigned long long)__atomic_load_n(&h->count, __ATOMIC_RELAXED));
+}
+
+/* It writes the whole registry in the Prometheus text format
+Parameters: [fp, m, prefix]
+fp: output stream
+m: metrics registry
+prefix: metric name prefix */
+void PrintMetrics(FILE *fp, Metrics *m, char *prefix)
+{
+    char *status[4] = {"ok", "busy", "bad_request", "shutdown"};
+    uint64_t samples, ns;
+    int i;
+
+    fprintf(fp, "# HELP %s_requests_total Answered requests by status\n", prefix);
+    fprintf(fp, "# TYPE %s_requests_total counter\n", prefix);
+    for (i = 0; i < 4; i++)
+        fprintf(fp, "%s_requests_total{status=\"%s\"} %llu\n", prefix, status[i], (unsigned long long)__atomic_load_n(&m->requests[i], __ATOMIC_RELAXED));
+
+    fprintf(fp, "# HELP %s_batches_total Batches run by the workers\n", prefix);
+    fprintf(fp, "# TYPE %s_batches_total counter\n", prefix);
+    fprintf(fp, "%s_batches_total %llu\n", prefix, (unsigned long long)__atomic_load_n(&m->batches, __ATOMIC_RELAXED));
+
+    PrintMetricsHistogram(fp, prefix, "batch_size", "Samples per batch", &m->batch_size, 1.0);
+    PrintMetricsHistogram(fp, prefix, "queue_wait_seconds", "Time between the arrival of a request and the start of its batch", &m->queue_wait, 1e-9);
+    PrintMetricsHistogram(fp, prefix, "compute_seconds", "Time spent in the forward pass of each batch", &m->compute, 1e-9);
+    PrintMetricsHistogram(fp, prefix, "request_latency_seconds", "Time between the arrival of a request and its answer", &m->latency, 1e-9);
+
+    fprintf(fp, "# HELP %s_layer_samples_total Samples propagated through each layer\n", prefix);
+    fprintf(fp, "# TYPE %s_layer_samples_total counter\n", prefix);
+    for (i = 0; i < METRICS_MAX_LAYERS; i++)
+        if ((samples = __atomic_load_n(&m->layer[i].samples, __ATOMIC_RELAXED)))
+            fprintf(fp, "%s_layer_samples_total{layer=\"%d\"} %llu\n", prefix, i, (unsigned long long)samples);
+
+    fprintf(fp, "# HELP %s_layer_seconds_total Time spent propagating samples through each layer\n", prefix);
+    fprintf(fp, "# TYPE %s_layer_seconds_total counter\n", prefix);
+    for (i = 0; i < METRICS_MAX_LAYERS; i++)
+        if (__atomic_load_n(&m->layer[i].samples, __ATOMIC_RELAXED))
+            fprintf(fp, "%s_layer_seconds_total{layer=\"%d\"} %.9g\n", prefix, i, __atomic_load_n(&m->layer[i].nanoseconds, __ATOMIC_RELAXED) * 1e-9);
+
+    fprintf(fp, "# HELP %s_layer_samples_per_second Throughput of each layer while it is computing\n", prefix);
+    fprintf(fp, "# TYPE %s_layer_samples_per_second gauge\n", prefix);
+    for (i = 0; i < METRICS_MAX_LAYERS; i++)
+    {
+        samples = __atomic_load_n(&m->layer[i].samples, __ATOMIC_RELAXED);
+        ns = __atomic_load_n(&m->layer[i].nanoseconds, __ATOMIC_RELAXED);
+        if (samples && ns)
+            fprintf(fp, "%s_layer_samples_per_second{layer=\"%d\"} %.6g\n", prefix, i, samples / (ns * 1e-9));
+    }
+}
+/**********************************************/
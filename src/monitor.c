@@ -0,0 +1,345 @@
+#define _GNU_SOURCE /* SCHED_IDLE */
+
+#include "monitor.h"
+#include "stopping.h"
+#include "metrics.h"
+
+#include <sched.h>
+#include <gsl/gsl_blas.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+static void *RunTrainingMonitor(void *arg);
+
+/* Allocation and deallocation */
+
+/* It allocates the buffer a snapshot of an RBM is copied to, leaving out the dropconnect matrix, which no metric needs
+Parameters: [m]
+m: RBM */
+static RBM *CreateMonitorSnapshot(RBM *m)
+{
+    RBM *s = CreateRBM(m->n_visible_layer_neurons, m->n_hidden_layer_neurons, 1);
+
+    gsl_matrix_free(s->M);
+    s->M = NULL;
+
+    return s;
+}
+
+/* It allocates a training monitor for an RBM and starts its thread, which sleeps until the trainer hands it a snapshot
+Parameters: [m, held_out, reference, n_samples, interval, log]
+m: RBM to be monitored, whose monitor field is not set by this function
+held_out: held-out samples, which must outlive the monitor
+reference: training samples the free-energy gap is measured against (NULL to skip it), which must outlive the monitor
+n_samples: held-out samples evaluated from the start of held_out (0 for all of them)
+interval: batches between two snapshots
+log: stream the records are written to */
+TrainingMonitor *CreateTrainingMonitor(RBM *m, Dataset *held_out, Dataset *reference, int n_samples, int interval, FILE *log)
+{
+    TrainingMonitor *t = NULL;
+    gsl_rng *r = NULL;
+    int i;
+
+    if (!held_out || !held_out->size || !log)
+    {
+        fprintf(stderr, "\nThere are no held-out samples or no log stream @CreateTrainingMonitor.\n");
+        return NULL;
+    }
+
+    t = (TrainingMonitor *)calloc(1, sizeof(TrainingMonitor));
+    if (!t)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @CreateTrainingMonitor.\n");
+        exit(-1);
+    }
+
+    t->held_out = held_out;
+    t->reference = reference;
+    t->n_samples = n_samples > 0 && n_samples < held_out->size ? n_samples : held_out->size;
+    t->interval = interval > 0 ? interval : 1;
+    t->log = log;
+    t->pending = t->reading = -1;
+    t->running = 1;
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+
+    /* The flipped units are drawn once, so the pseudo-likelihood of two snapshots only differs by the parameters */
+    t->flip = (int *)malloc(t->n_samples * sizeof(int));
+    r = gsl_rng_alloc(gsl_rng_default);
+    gsl_rng_set(r, random_seed_deep());
+    for (i = 0; i < t->n_samples; i++)
+        t->flip[i] = gsl_rng_uniform_int(r, (unsigned long int)m->n_visible_layer_neurons);
+    gsl_rng_free(r);
+
+    for (i = 0; i < 2; i++)
+        t->buffer[i].m = CreateMonitorSnapshot(m);
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->ready, NULL);
+    if (pthread_create(&t->thread, NULL, RunTrainingMonitor, t))
+    {
+        fprintf(stderr, "\nUnable to start the monitor thread @CreateTrainingMonitor.\n");
+        t->running = 0;
+        DestroyTrainingMonitor(&t);
+    }
+
+    return t;
+}
+
+/* It evaluates the pending snapshot, stops the monitor thread and deallocates the monitor
+Parameters: [t]
+t: training monitor */
+void DestroyTrainingMonitor(TrainingMonitor **t)
+{
+    int i;
+
+    if (*t)
+    {
+        if ((*t)->running)
+        {
+            pthread_mutex_lock(&(*t)->lock);
+            (*t)->running = 0;
+            pthread_cond_signal(&(*t)->ready);
+            pthread_mutex_unlock(&(*t)->lock);
+            pthread_join((*t)->thread, NULL);
+        }
+        pthread_mutex_destroy(&(*t)->lock);
+        pthread_cond_destroy(&(*t)->ready);
+
+        for (i = 0; i < 2; i++)
+        {
+            if ((*t)->buffer[i].m->sigma)
+                gsl_vector_free((*t)->buffer[i].m->sigma);
+            DestroyRBM(&(*t)->buffer[i].m);
+        }
+        free((*t)->flip);
+        free(*t);
+        *t = NULL;
+    }
+}
+/**********************************************/
+
+/* Monitoring */
+
+/* It hands a copy of the parameters of an RBM over to the monitor thread. The copy goes to the buffer the thread is not reading, so the
+trainer never waits for an evaluation, only for the few copies themselves; a snapshot the thread has not got to yet is overwritten and counted
+as dropped. Calling it once training is over records the final parameters, e.g., the ones restored by early stopping
+Parameters: [t, m]
+t: training monitor
+m: RBM */
+void SnapshotTrainingMonitor(TrainingMonitor *t, RBM *m)
+{
+    MonitorSnapshot *s = NULL;
+    int w;
+
+    pthread_mutex_lock(&t->lock);
+    w = t->reading == 0 ? 1 : 0;
+    s = &t->buffer[w];
+
+    gsl_matrix_memcpy(s->m->W, m->W);
+    gsl_vector_memcpy(s->m->a, m->a);
+    gsl_vector_memcpy(s->m->b, m->b);
+    if (m->sigma)
+    {
+        if (!s->m->sigma)
+            s->m->sigma = gsl_vector_alloc(m->sigma->size);
+        gsl_vector_memcpy(s->m->sigma, m->sigma);
+    }
+    s->m->t = m->t;
+    s->batch = t->batches;
+    s->version = ++t->n_snapshots;
+    clock_gettime(CLOCK_MONOTONIC, &s->taken);
+
+    if (t->pending >= 0)
+        t->n_dropped++;
+    t->pending = w;
+    pthread_cond_signal(&t->ready);
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* It accounts for a trained batch, taking a snapshot every t->interval batches. The trainers call it after every parameter update, and it
+returns at once if the RBM has no monitor
+Parameters: [m]
+m: RBM */
+void PublishTrainingMonitor(RBM *m)
+{
+    TrainingMonitor *t = m->monitor;
+
+    if (t && ++t->batches % t->interval == 0)
+        SnapshotTrainingMonitor(t, m);
+}
+
+/* It computes the mean pseudo-likelihood of the first n samples of a dataset, i.e., of N*log(sigmoid(F(x') - F(x))), where x' is x with the
+unit flip[i] flipped, as getPseudoLikelihood does for a single sample. The hidden inputs of every chunk of RBM_PROPAGATION_CHUNK_SIZE
+samples take one GEMM, and the ones of x' follow from them by adding or subtracting a single row of W
+Parameters: [D, n, flip, m]
+D: dataset
+n: number of samples
+flip: index of the flipped unit of every sample
+m: RBM with Bernoulli visible units */
+double getMonitorPseudoLikelihood(Dataset *D, int n, int *flip, RBM *m)
+{
+    gsl_matrix *X = gsl_matrix_alloc(RBM_PROPAGATION_CHUNK_SIZE, m->n_visible_layer_neurons);
+    gsl_matrix *H = gsl_matrix_alloc(RBM_PROPAGATION_CHUNK_SIZE, m->n_hidden_layer_neurons);
+    gsl_matrix_view x, h;
+    double *p, *w, *b = gsl_vector_ptr(m->b, 0), pl = 0.0, gap, in, sign, tmp;
+    int i, j, k, z;
+
+    for (z = 0; z < n; z += RBM_PROPAGATION_CHUNK_SIZE)
+    {
+        k = n - z < RBM_PROPAGATION_CHUNK_SIZE ? n - z : RBM_PROPAGATION_CHUNK_SIZE;
+        x = gsl_matrix_submatrix(X, 0, 0, k, X->size2);
+        h = gsl_matrix_submatrix(H, 0, 0, k, H->size2);
+        for (i = 0; i < k; i++)
+            gsl_matrix_set_row(&x.matrix, i, D->sample[z + i].feature);
+
+        gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, &x.matrix, m->W, 0.0, &h.matrix);
+        for (i = 0; i < k; i++)
+        {
+            p = gsl_matrix_ptr(&h.matrix, i, 0);
+            w = gsl_matrix_ptr(m->W, flip[z + i], 0);
+            in = gsl_vector_get(D->sample[z + i].feature, flip[z + i]);
+            sign = 1.0 - 2.0 * in; /* x'_i - x_i */
+
+            /* F(x') - F(x) */
+            gap = -gsl_vector_get(m->a, flip[z + i]) * sign;
+            for (j = 0; j < H->size2; j++)
+            {
+                tmp = p[j] + b[j];
+                gap += tmp > 0 ? tmp + log1p(exp(-tmp)) : log1p(exp(tmp)); /* softplus, which does not overflow */
+                tmp += sign * w[j];
+                gap -= tmp > 0 ? tmp + log1p(exp(-tmp)) : log1p(exp(tmp));
+            }
+            pl -= gap < 0 ? -gap + log1p(exp(gap)) : log1p(exp(-gap)); /* log(sigmoid(gap)) = -softplus(-gap) */
+        }
+    }
+    gsl_matrix_free(X);
+    gsl_matrix_free(H);
+
+    return m->n_visible_layer_neurons * pl / n;
+}
+
+/* It writes a value of a record, or null if it is not a finite number, which JSON cannot represent
+Parameters: [fp, name, value]
+fp: log stream
+name: key of the value
+value: value */
+static void PrintMonitorValue(FILE *fp, char *name, double value)
+{
+    if (isfinite(value))
+        fprintf(fp, ",\"%s\":%.9g", name, value);
+    else
+        fprintf(fp, ",\"%s\":null", name);
+}
+
+/* It computes the mean of the entries of a vector
+Parameters: [x]
+x: vector */
+static double getMonitorVectorMean(gsl_vector *x)
+{
+    double sum = 0.0;
+    int i;
+
+    for (i = 0; i < x->size; i++)
+        sum += gsl_vector_get(x, i);
+
+    return sum / x->size;
+}
+
+/* It evaluates a snapshot and writes its record as a single JSON line
+Parameters: [t, s, dropped]
+t: training monitor
+s: snapshot
+dropped: snapshots dropped so far */
+static void EvaluateMonitorSnapshot(TrainingMonitor *t, MonitorSnapshot *s, long dropped)
+{
+    RBM *m = s->m;
+    struct timespec end;
+    double error, pl = NAN, gap = NAN, mean, var, min, max, abs_mean, tmp;
+    int n, i, j;
+
+    error = getHeldOutReconstructionError(t->held_out, t->n_samples, m);
+    if (!m->sigma)
+        pl = getMonitorPseudoLikelihood(t->held_out, t->n_samples, t->flip, m);
+    if (t->reference && t->reference->size)
+    {
+        n = t->reference->size < t->n_samples ? t->reference->size : t->n_samples;
+        gap = getHeldOutFreeEnergy(t->held_out, t->n_samples, m) - getHeldOutFreeEnergy(t->reference, n, m);
+    }
+
+    /* Weight statistics, in a single pass */
+    mean = var = abs_mean = 0.0;
+    min = max = gsl_matrix_get(m->W, 0, 0);
+    for (i = 0; i < m->W->size1; i++)
+        for (j = 0; j < m->W->size2; j++)
+        {
+            tmp = gsl_matrix_get(m->W, i, j);
+            mean += tmp;
+            var += tmp * tmp;
+            abs_mean += fabs(tmp);
+            if (tmp < min)
+                min = tmp;
+            if (tmp > max)
+                max = tmp;
+        }
+    n = m->W->size1 * m->W->size2;
+    mean /= n;
+    var = var / n - mean * mean;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(t->log, "{\"snapshot\":%ld,\"batch\":%ld", s->version, s->batch);
+    PrintMonitorValue(t->log, "seconds", getElapsedNanoseconds(&t->start, &s->taken) * 1e-9);
+    PrintMonitorValue(t->log, "reconstruction_error", error);
+    PrintMonitorValue(t->log, "pseudo_likelihood", pl);
+    PrintMonitorValue(t->log, "free_energy_gap", gap);
+    PrintMonitorValue(t->log, "weight_mean", mean);
+    PrintMonitorValue(t->log, "weight_std", var > 0 ? sqrt(var) : 0.0);
+    PrintMonitorValue(t->log, "weight_min", min);
+    PrintMonitorValue(t->log, "weight_max", max);
+    PrintMonitorValue(t->log, "weight_abs_mean", abs_mean / n);
+    PrintMonitorValue(t->log, "visible_bias_mean", getMonitorVectorMean(m->a));
+    PrintMonitorValue(t->log, "hidden_bias_mean", getMonitorVectorMean(m->b));
+    PrintMonitorValue(t->log, "evaluation_seconds", getElapsedNanoseconds(&s->taken, &end) * 1e-9);
+    fprintf(t->log, ",\"dropped\":%ld}\n", dropped);
+    fflush(t->log);
+}
+
+/* It runs the monitor thread, which evaluates the newest snapshot whenever there is one. It asks for the idle scheduling class, so it only
+gets the cores the trainer leaves free, and runs the evaluations on a single thread, so they do not start OpenMP teams of their own
+Parameters: [arg]
+arg: training monitor */
+static void *RunTrainingMonitor(void *arg)
+{
+    TrainingMonitor *t = (TrainingMonitor *)arg;
+    long dropped;
+
+#ifdef SCHED_IDLE
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+#ifdef _OPENMP
+    omp_set_num_threads(1);
+#endif
+
+    pthread_mutex_lock(&t->lock);
+    while (1)
+    {
+        while (t->pending < 0 && t->running)
+            pthread_cond_wait(&t->ready, &t->lock);
+        if (t->pending < 0)
+            break;
+        t->reading = t->pending;
+        t->pending = -1;
+        dropped = t->n_dropped;
+        pthread_mutex_unlock(&t->lock);
+
+        EvaluateMonitorSnapshot(t, &t->buffer[t->reading], dropped);
+
+        pthread_mutex_lock(&t->lock);
+        t->reading = -1;
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+/**********************************************/
@@ -0,0 +1,380 @@
+#include "optimizer.h"
+
+/* Allocation and deallocation */
+
+/* It allocates the optimizer state of a parameter block, i.e., the buffers the update rule of the RBM keeps for every parameter, all set to zero
+Parameters: [m, size1, size2]
+m: RBM whose optimizer is used
+size1: number of rows of the block (or its size, for vectors)
+size2: number of columns of the block (1 for vectors) */
+ParameterState *CreateParameterState(RBM *m, size_t size1, size_t size2)
+{
+    ParameterState *s = NULL;
+
+    s = (ParameterState *)malloc(sizeof(ParameterState));
+    if (!s)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @CreateParameterState.\n");
+        exit(-1);
+    }
+
+    s->optimizer = m->optimizer;
+    if (s->optimizer < OPTIMIZER_SGD || s->optimizer > OPTIMIZER_ADAM)
+    {
+        fprintf(stderr, "\nInvalid optimizer %d, SGD is used instead @CreateParameterState.\n", m->optimizer);
+        s->optimizer = OPTIMIZER_SGD;
+    }
+    s->size1 = size1;
+    s->size2 = size2;
+    s->step = 0;
+    s->delta = NULL;
+    s->square = NULL;
+
+    /* AdaGrad and RMSProp do not keep the last update, and SGD and Nesterov do not keep the squared gradients */
+    if (s->optimizer != OPTIMIZER_ADAGRAD && s->optimizer != OPTIMIZER_RMSPROP)
+        s->delta = (double *)calloc(size1 * size2, sizeof(double));
+    if (s->optimizer != OPTIMIZER_SGD && s->optimizer != OPTIMIZER_NESTEROV)
+        s->square = (double *)calloc(size1 * size2, sizeof(double));
+    if ((s->optimizer != OPTIMIZER_ADAGRAD && s->optimizer != OPTIMIZER_RMSPROP && !s->delta) ||
+        (s->optimizer != OPTIMIZER_SGD && s->optimizer != OPTIMIZER_NESTEROV && !s->square))
+    {
+        fprintf(stderr, "\nUnable to alloc memory @CreateParameterState.\n");
+        exit(-1);
+    }
+
+    return s;
+}
+
+/* It deallocates the optimizer state of a parameter block
+Parameters: [s]
+s: optimizer state */
+void DestroyParameterState(ParameterState **s)
+{
+    if (*s)
+    {
+        free((*s)->delta);
+        free((*s)->square);
+        free(*s);
+        *s = NULL;
+    }
+}
+/**************************/
+
+/* Fused updates */
+
+typedef struct _UpdateRule
+{
+    int optimizer;
+    double eta_scale; /* learning rate times the averaging factor of the statistics (SGD and Nesterov) */
+    double scale;     /* averaging factor of the statistics, which the adaptive rules apply before squaring the gradient */
+    double eta;       /* learning rate of the adaptive rules, with the bias correction of Adam folded in */
+    double epsilon;   /* constant added to the root of the squared gradients, with the bias correction of Adam folded in */
+    double alpha, lambda, beta1, beta2;
+} UpdateRule;
+
+/* It gathers the coefficients of one update of a parameter block, advancing its step counter
+Parameters: [m, s, scale, eta, lambda, k]
+m: RBM whose hyperparameters are used
+s: optimizer state of the block
+scale: averaging factor of the statistics
+eta: learning rate
+lambda: weight decay
+k: output coefficients */
+static void getUpdateRule(RBM *m, ParameterState *s, double scale, double eta, double lambda, UpdateRule *k)
+{
+    double c1, c2;
+
+    s->step++;
+    k->optimizer = s->optimizer;
+    k->eta_scale = eta * scale;
+    k->scale = scale;
+    k->eta = eta;
+    k->epsilon = m->epsilon;
+    k->alpha = m->alpha;
+    k->lambda = lambda;
+    k->beta1 = m->beta1;
+    k->beta2 = m->beta2;
+
+    /* Adam divides its running averages by 1 - beta^step, which amounts to scaling the learning rate and epsilon once per update */
+    if (s->optimizer == OPTIMIZER_ADAM)
+    {
+        c1 = 1.0 - pow(m->beta1, s->step);
+        c2 = sqrt(1.0 - pow(m->beta2, s->step));
+        k->eta = eta * c2 / c1;
+        k->epsilon = m->epsilon * c2;
+    }
+}
+
+/* It applies the update rule to one contiguous run of parameters, where g = scale*(pos - neg) is the gradient and the weight decay lambda*w is
+subtracted from the weights at every rule:
+SGD: delta = alpha*delta - lambda*w + eta*g and w = w + delta
+Nesterov: delta = alpha*delta - lambda*w + eta*g and w = w + alpha*delta - lambda*w + eta*g
+AdaGrad: square = square + g^2 and w = w + eta*g/(sqrt(square) + epsilon) - lambda*w
+RMSProp: square = beta2*square + (1 - beta2)*g^2 and w = w + eta*g/(sqrt(square) + epsilon) - lambda*w
+Adam: delta = beta1*delta + (1 - beta1)*g, square = beta2*square + (1 - beta2)*g^2 and w = w + eta*delta/(sqrt(square) + epsilon) - lambda*w,
+with the bias corrections in eta and epsilon
+Parameters: [k, w, pos, neg, delta, square, n]
+k: coefficients of the update
+w: parameters
+pos: positive statistics, or the gradient itself when neg is NULL
+neg: negative statistics, or NULL
+delta: last update (SGD and Nesterov) or running average of the gradient (Adam) of every parameter
+square: squared gradients of every parameter (AdaGrad, RMSProp and Adam)
+n: number of parameters */
+static inline void ApplyUpdateRule(const UpdateRule *k, double *restrict w, const double *restrict pos, const double *restrict neg, double *restrict delta,
+                                      double *restrict square, size_t n)
+{
+    double eta_scale = k->eta_scale, scale = k->scale, eta = k->eta, epsilon = k->epsilon, alpha = k->alpha, lambda = k->lambda;
+    double beta1 = k->beta1, beta2 = k->beta2, g, step;
+    size_t j;
+
+    switch (k->optimizer)
+    {
+    case OPTIMIZER_SGD:
+#pragma omp simd
+        for (j = 0; j < n; j++)
+        {
+            delta[j] = alpha * delta[j] - lambda * w[j] + eta_scale * (neg ? pos[j] - neg[j] : pos[j]);
+            w[j] += delta[j];
+        }
+        break;
+    case OPTIMIZER_NESTEROV:
+#pragma omp simd private(step)
+        for (j = 0; j < n; j++)
+        {
+            step = eta_scale * (neg ? pos[j] - neg[j] : pos[j]) - lambda * w[j];
+            delta[j] = alpha * delta[j] + step;
+            w[j] += alpha * delta[j] + step;
+        }
+        break;
+    case OPTIMIZER_ADAGRAD:
+#pragma omp simd private(g)
+        for (j = 0; j < n; j++)
+        {
+            g = scale * (neg ? pos[j] - neg[j] : pos[j]);
+            square[j] += g * g;
+            w[j] += eta * g / (sqrt(square[j]) + epsilon) - lambda * w[j];
+        }
+        break;
+    case OPTIMIZER_RMSPROP:
+#pragma omp simd private(g)
+        for (j = 0; j < n; j++)
+        {
+            g = scale * (neg ? pos[j] - neg[j] : pos[j]);
+            square[j] = beta2 * square[j] + (1.0 - beta2) * g * g;
+            w[j] += eta * g / (sqrt(square[j]) + epsilon) - lambda * w[j];
+        }
+        break;
+    case OPTIMIZER_ADAM:
+#pragma omp simd private(g)
+        for (j = 0; j < n; j++)
+        {
+            g = scale * (neg ? pos[j] - neg[j] : pos[j]);
+            delta[j] = beta1 * delta[j] + (1.0 - beta1) * g;
+            square[j] = beta2 * square[j] + (1.0 - beta2) * g * g;
+            w[j] += eta * delta[j] / (sqrt(square[j]) + epsilon) - lambda * w[j];
+        }
+        break;
+    }
+}
+
+/* It applies the update rule to one contiguous run of parameters (see ApplyUpdateRule), whose two calls let the compiler drop the test of neg
+from the inner loops
+Parameters: [k, w, pos, neg, delta, square, n]
+k: coefficients of the update
+w: parameters
+pos: positive statistics, or the gradient itself when neg is NULL
+neg: negative statistics, or NULL
+delta: last update or running average of the gradient of every parameter
+square: squared gradients of every parameter
+n: number of parameters */
+static inline void UpdateParameterRun(const UpdateRule *k, double *restrict w, const double *restrict pos, const double *restrict neg, double *restrict delta,
+                                      double *restrict square, size_t n)
+{
+    if (neg)
+        ApplyUpdateRule(k, w, pos, neg, delta, square, n);
+    else
+        ApplyUpdateRule(k, w, pos, NULL, delta, square, n);
+}
+
+/* It updates a weight matrix by the optimizer of the RBM, i.e., W' = alpha*W' - lambda*W + eta*scale*(pos - neg) and W = W + W' for SGD (see
+UpdateParameterRun for the other rules), reading and writing every matrix once instead of the ten passes of the equivalent sequence of GSL calls.
+The rows are split among threads in contiguous blocks, so each thread streams its own part of the matrices, and the inner loop is vectorized
+Parameters: [m, W, pos, neg, scale, eta, lambda, s]
+m: RBM whose hyperparameters (alpha, beta1, beta2 and epsilon) are used
+W: weight matrix
+pos: positive statistics (e.g., E_data[vh]), or the gradient itself when neg is NULL
+neg: negative statistics (e.g., E_model[vh]), or NULL
+scale: averaging factor of the statistics (e.g., 1/batch_size)
+eta: learning rate
+lambda: weight decay (0 for none)
+s: optimizer state of W */
+void UpdateParameterMatrix(RBM *m, gsl_matrix *W, gsl_matrix *pos, gsl_matrix *neg, double scale, double eta, double lambda, ParameterState *s)
+{
+    UpdateRule k;
+    int i;
+
+    if (pos->size1 != W->size1 || pos->size2 != W->size2 || s->size1 != W->size1 || s->size2 != W->size2 ||
+        (neg && (neg->size1 != W->size1 || neg->size2 != W->size2)))
+    {
+        fprintf(stderr, "\nMatrices with different sizes @UpdateParameterMatrix.\n");
+        return;
+    }
+    getUpdateRule(m, s, scale, eta, lambda, &k);
+
+#pragma omp parallel for schedule(static) if (W->size1 * W->size2 >= OPTIMIZER_PARALLEL_THRESHOLD)
+    for (i = 0; i < W->size1; i++)
+        UpdateParameterRun(&k, gsl_matrix_ptr(W, i, 0), gsl_matrix_const_ptr(pos, i, 0), neg ? gsl_matrix_const_ptr(neg, i, 0) : NULL,
+                           s->delta ? s->delta + i * W->size2 : NULL, s->square ? s->square + i * W->size2 : NULL, W->size2);
+}
+
+/* It updates the regular weights of FPCD by the optimizer of the RBM (see UpdateParameterMatrix) and, in the same sweep, its fast weights and
+the effective weights W + fast_W that the negative phase runs with, i.e., fast_W = ratio*fast_W + fast_eta*scale*(pos - neg) and eff_W = W + fast_W.
+Every row of the fast and effective weights is written right after the one of W, while the row of the statistics is still in cache
+Parameters: [m, W, pos, neg, scale, eta, lambda, s, fast_W, eff_W, fast_eta, ratio]
+m: RBM whose hyperparameters (alpha, beta1, beta2 and epsilon) are used
+W: weight matrix
+pos: positive statistics (e.g., E_data[vh]), or the gradient itself when neg is NULL
+neg: negative statistics (e.g., E_model[vh]), or NULL
+scale: averaging factor of the statistics (e.g., 1/batch_size)
+eta: learning rate
+lambda: weight decay (0 for none)
+s: optimizer state of W
+fast_W: fast weights
+eff_W: effective weights
+fast_eta: learning rate of the fast weights
+ratio: decay of the fast weights */
+void UpdateFastParameterMatrix(RBM *m, gsl_matrix *W, gsl_matrix *pos, gsl_matrix *neg, double scale, double eta, double lambda, ParameterState *s,
+                               gsl_matrix *fast_W, gsl_matrix *eff_W, double fast_eta, double ratio)
+{
+    UpdateRule k;
+    int i;
+
+    if (pos->size1 != W->size1 || pos->size2 != W->size2 || s->size1 != W->size1 || s->size2 != W->size2 ||
+        (neg && (neg->size1 != W->size1 || neg->size2 != W->size2)) || fast_W->size1 != W->size1 || fast_W->size2 != W->size2 ||
+        eff_W->size1 != W->size1 || eff_W->size2 != W->size2)
+    {
+        fprintf(stderr, "\nMatrices with different sizes @UpdateFastParameterMatrix.\n");
+        return;
+    }
+    getUpdateRule(m, s, scale, eta, lambda, &k);
+
+#pragma omp parallel for schedule(static) if (W->size1 * W->size2 >= OPTIMIZER_PARALLEL_THRESHOLD)
+    for (i = 0; i < W->size1; i++)
+    {
+        const double *p = gsl_matrix_const_ptr(pos, i, 0), *q = neg ? gsl_matrix_const_ptr(neg, i, 0) : NULL;
+        double *w = gsl_matrix_ptr(W, i, 0), *fw = gsl_matrix_ptr(fast_W, i, 0), *ew = gsl_matrix_ptr(eff_W, i, 0);
+        size_t j;
+
+        UpdateParameterRun(&k, w, p, q, s->delta ? s->delta + i * W->size2 : NULL, s->square ? s->square + i * W->size2 : NULL, W->size2);
+        if (q)
+        {
+#pragma omp simd
+            for (j = 0; j < W->size2; j++)
+            {
+                fw[j] = ratio * fw[j] + fast_eta * scale * (p[j] - q[j]);
+                ew[j] = w[j] + fw[j];
+            }
+        }
+        else
+        {
+#pragma omp simd
+            for (j = 0; j < W->size2; j++)
+            {
+                fw[j] = ratio * fw[j] + fast_eta * scale * p[j];
+                ew[j] = w[j] + fw[j];
+            }
+        }
+    }
+}
+
+/* It updates a bias vector by the optimizer of the RBM, i.e., b' = alpha*b' + eta*scale*(pos - neg) and b = b + b' for SGD, in a single pass
+Parameters: [m, w, pos, neg, scale, eta, s]
+m: RBM whose hyperparameters (alpha, beta1, beta2 and epsilon) are used
+w: bias vector
+pos: positive statistics (e.g., E_data[h]), or the gradient itself when neg is NULL
+neg: negative statistics (e.g., E_model[h]), or NULL
+scale: averaging factor of the statistics (e.g., 1/batch_size)
+eta: learning rate
+s: optimizer state of w */
+void UpdateParameterVector(RBM *m, gsl_vector *w, gsl_vector *pos, gsl_vector *neg, double scale, double eta, ParameterState *s)
+{
+    UpdateRule k;
+    size_t j;
+
+    if (pos->size != w->size || s->size1 * s->size2 != w->size || (neg && neg->size != w->size))
+    {
+        fprintf(stderr, "\nVectors with different sizes @UpdateParameterVector.\n");
+        return;
+    }
+    getUpdateRule(m, s, scale, eta, 0.0, &k);
+
+    if (w->stride == 1 && pos->stride == 1 && (!neg || neg->stride == 1))
+    {
+        UpdateParameterRun(&k, w->data, pos->data, neg ? neg->data : NULL, s->delta, s->square, w->size);
+        return;
+    }
+
+    for (j = 0; j < w->size; j++)
+        UpdateParameterRun(&k, gsl_vector_ptr(w, j), gsl_vector_const_ptr(pos, j), neg ? gsl_vector_const_ptr(neg, j) : NULL, s->delta ? s->delta + j : NULL,
+                           s->square ? s->square + j : NULL, 1);
+}
+
+/* It updates a weight matrix straight from the activations of a mini-batch, i.e., W' = alpha*W' - lambda*W + eta*(pos_scale*X'H - neg_scale*Xn'Hn)
+and W = W + W' for SGD (see UpdateParameterRun for the other rules), without ever materializing the full-size statistics. The rows of W are visited in tiles of OPTIMIZER_TILE_ROWS, and the gradient of
+each tile is computed into a small buffer of the thread right before it is applied, so the extra memory is independent of the number of visible units
+Parameters: [m, W, X, H, pos_scale, Xn, Hn, neg_scale, eta, lambda, delta]
+m: RBM whose hyperparameters (alpha, beta1, beta2 and epsilon) are used
+W: weight matrix
+X: positive visible activations of the mini-batch, one sample per row
+H: positive hidden activations of the mini-batch, one sample per row
+pos_scale: averaging factor of the positive statistics (e.g., 1/batch_size)
+Xn: negative visible activations (e.g., the states of the chains), or NULL
+Hn: negative hidden activations, or NULL
+neg_scale: averaging factor of the negative statistics (e.g., 1/n_chains)
+eta: learning rate
+lambda: weight decay (0 for none)
+s: optimizer state of W */
+void UpdateParameterMatrix4Batch(RBM *m, gsl_matrix *W, gsl_matrix *X, gsl_matrix *H, double pos_scale, gsl_matrix *Xn, gsl_matrix *Hn, double neg_scale,
+                                 double eta, double lambda, ParameterState *s)
+{
+    int t, n_tiles = (W->size1 + OPTIMIZER_TILE_ROWS - 1) / OPTIMIZER_TILE_ROWS;
+    UpdateRule k;
+
+    if (X->size2 != W->size1 || H->size2 != W->size2 || X->size1 != H->size1 || s->size1 != W->size1 || s->size2 != W->size2 ||
+        (Xn && (!Hn || Xn->size2 != W->size1 || Hn->size2 != W->size2 || Xn->size1 != Hn->size1)))
+    {
+        fprintf(stderr, "\nMatrices with incompatible sizes @UpdateParameterMatrix4Batch.\n");
+        return;
+    }
+    getUpdateRule(m, s, 1.0, eta, lambda, &k); /* the tiles are already averaged */
+
+#pragma omp parallel if (W->size1 * W->size2 >= OPTIMIZER_PARALLEL_THRESHOLD)
+    {
+        gsl_matrix *G = gsl_matrix_alloc(OPTIMIZER_TILE_ROWS, W->size2);
+        gsl_matrix_view g, x;
+        size_t i, first, rows;
+
+#pragma omp for schedule(static)
+        for (t = 0; t < n_tiles; t++)
+        {
+            first = (size_t)t * OPTIMIZER_TILE_ROWS;
+            rows = W->size1 - first < OPTIMIZER_TILE_ROWS ? W->size1 - first : OPTIMIZER_TILE_ROWS;
+            g = gsl_matrix_submatrix(G, 0, 0, rows, W->size2);
+
+            x = gsl_matrix_submatrix(X, 0, first, X->size1, rows);
+            gsl_blas_dgemm(CblasTrans, CblasNoTrans, pos_scale, &x.matrix, H, 0.0, &g.matrix); /* It performs E_data[vh] over the rows of the tile */
+            if (Xn)
+            {
+                x = gsl_matrix_submatrix(Xn, 0, first, Xn->size1, rows);
+                gsl_blas_dgemm(CblasTrans, CblasNoTrans, -neg_scale, &x.matrix, Hn, 1.0, &g.matrix); /* It performs E_data[vh] - E_model[vh] */
+            }
+
+            for (i = 0; i < rows; i++)
+                UpdateParameterRun(&k, gsl_matrix_ptr(W, first + i, 0), gsl_matrix_const_ptr(&g.matrix, i, 0), NULL,
+                                   s->delta ? s->delta + (first + i) * W->size2 : NULL, s->square ? s->square + (first + i) * W->size2 : NULL, W->size2);
+        }
+
+        gsl_matrix_free(G);
+    }
+}
@@ -1,4 +1,8 @@
 #include "rbm.h"
+#include "sampler.h"
+#include "optimizer.h"
+#include "stopping.h"
+#include "monitor.h"
 
 /* Allocation and deallocation */
 
@@ -22,6 +26,14 @@ RBM *CreateRBM(int n_visible_layer_neurons, int n_hidden_layer_neurons, int n_la
     m->n_hidden_layer_neurons = n_hidden_layer_neurons;
     m->n_labels = n_labels;
     m->t = 1.0;
+    m->sigma_eta = 0.001;
+    m->optimizer = OPTIMIZER_SGD;
+    m->beta1 = 0.9;
+    m->beta2 = 0.999;
+    m->epsilon = 1e-8;
+    m->sigma = NULL;
+    m->stopping = NULL;
+    m->monitor = NULL;
 
     m->v = NULL;
     m->v = gsl_vector_alloc(n_visible_layer_neurons);
@@ -179,6 +191,47 @@ void DestroyDRBM(RBM **m)
     else
         fprintf(stderr, "\nThere is no DRBM allocated @DestroyDRBM.\n");
 }
+
+/* It allocates a dropconnect mask that is never materialized: the bit of connection (i, j) for a given sample is derived from a
+counter-based hash of (seed, sample, i, j), so the up and down passes over the same sample see the same mask
+Parameters: [p, seed]
+p: probability of keeping a connection, clamped to [0,1]
+seed: seed of the masks */
+DropconnectMask *CreateDropconnectMask(double p, unsigned long seed)
+{
+    DropconnectMask *M = NULL;
+
+    /* A rate out of [0,1] is clamped, which draws the same degenerate masks (all connections dropped or all kept) as comparing it to uniform samples did */
+    if (!(p >= 0.0 && p <= 1.0))
+    {
+        fprintf(stderr, "\nInvalid dropconnect rate %lf, %s is used instead @CreateDropconnectMask.\n", p, p > 1.0 ? "1" : "0");
+        p = p > 1.0 ? 1.0 : 0.0;
+    }
+
+    M = (DropconnectMask *)malloc(sizeof(DropconnectMask));
+    if (!M)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @CreateDropconnectMask.\n");
+        exit(-1);
+    }
+    M->seed = seed;
+    M->sample = 0;
+    M->threshold = (uint64_t)(p * 9007199254740992.0); /* p * 2^53 */
+
+    return M;
+}
+
+/* It deallocates a dropconnect mask
+Parameters: [M]
+M: dropconnect mask */
+void DestroyDropconnectMask(DropconnectMask **M)
+{
+    if (*M)
+    {
+        free(*M);
+        *M = NULL;
+    }
+}
 /**************************/
 
 /* RBM initialization */
@@ -286,6 +339,56 @@ void InitializeBias4DropoutHiddenUnits(RBM *m, double p)
     }
 }
 
+/* It draws the hidden units dropout array with a given generator and compacts the indices of the surviving units in the same pass,
+so the dropout trainers only evaluate and update the columns of W that belong to them
+Parameters: [m, p, r, active]
+m: RBM
+p: probability of keeping a hidden unit
+r: random number generator
+active: output array with room for n_hidden_layer_neurons indices
+It returns the number of surviving hidden units */
+int SampleDropoutHiddenUnits(RBM *m, double p, gsl_rng *r, int *active)
+{
+    int j, n_active = 0;
+
+    for (j = 0; j < m->n_hidden_layer_neurons; j++)
+    {
+        if (gsl_ran_bernoulli(r, p))
+        {
+            gsl_vector_set(m->r, j, 1.0);
+            active[n_active++] = j;
+        }
+        else
+            gsl_vector_set(m->r, j, 0.0);
+    }
+
+    return n_active;
+}
+
+/* It adds the outer product of a visible vector and the hidden probabilities of the surviving hidden units to the statistics of a dropout trainer,
+leaving the columns of the dropped units untouched, since their probabilities are zero
+Parameters: [CD, v, h, active, n_active]
+CD: statistics matrix
+v: visible units vector
+h: hidden units' probabilities
+active: indices of the surviving hidden units
+n_active: number of surviving hidden units */
+static void AccumulateDropoutStatistics(gsl_matrix *CD, gsl_vector *v, gsl_vector *h, int *active, int n_active)
+{
+    double x, *c;
+    int i, k;
+
+    for (i = 0; i < CD->size1; i++)
+    {
+        x = gsl_vector_get(v, i);
+        if (x == 0.0)
+            continue;
+        c = gsl_matrix_ptr(CD, i, 0);
+        for (k = 0; k < n_active; k++)
+            c[active[k]] += x * gsl_vector_get(h, active[k]);
+    }
+}
+
 /* It initializes the bias of dropconnect
 Parameters: [m, p]
 m: RBM
@@ -622,11 +725,12 @@ n_CD_iterations: number of CD iterations
 batch_size: size of batch data */
 double BernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1 = NULL, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
@@ -639,10 +743,8 @@ double BernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, int n_epo
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -652,10 +754,7 @@ double BernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, int n_epo
     tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     error = 0;
 
@@ -762,7 +861,8 @@ double BernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, int n_epo
                     gsl_matrix_add(CDneg, tmpCDneg);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -776,52 +876,37 @@ double BernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, int n_epo
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
 
@@ -829,8 +914,7 @@ double BernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, int n_epo
     gsl_matrix_free(CDneg);
     gsl_matrix_free(tmpCDneg);
     gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
 
     return error;
 }
@@ -845,40 +929,44 @@ batch_size: size of batch data
 p: hidden neurons dropout rate */
 double BernoulliRBMTrainingbyContrastiveDivergencewithDropout(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1 = NULL, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
+    int *active = NULL, *on = NULL, n_active;
+    double *h_on = NULL;
 
     srand(time(NULL));
     T = gsl_rng_default;
     r = gsl_rng_alloc(T);
     gsl_rng_set(r, random_seed_deep());
+    active = (int *)malloc(m->n_hidden_layer_neurons * sizeof(int));
+    on = (int *)malloc(m->n_hidden_layer_neurons * sizeof(int));
+    h_on = (double *)malloc(m->n_hidden_layer_neurons * sizeof(double));
+    if (!active || !on || !h_on)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @BernoulliRBMTrainingbyContrastiveDivergencewithDropout.\n");
+        exit(-1);
+    }
 
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
 
     CDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     CDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     error = 0;
 
@@ -904,8 +992,8 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropout(Dataset *D, RBM *m
 
             for (t = 0; t < batch_size; t++)
             {
-                /* It computes r for dropping out hidden units */
-                InitializeBias4DropoutHiddenUnits(m, p);
+                /* It draws r for dropping out hidden units, and it compacts the surviving ones */
+                n_active = SampleDropoutHiddenUnits(m, p, r, active);
 
                 if (z < D->size)
                 {
@@ -924,7 +1012,7 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropout(Dataset *D, RBM *m
                     for (i = 1; i <= n_CD_iterations; i++)
                     {
                         /* It computes the P(h=1|v1), i.e., it computes h1 */
-                        tmp_probh1 = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit(m, m->r, m->v);
+                        tmp_probh1 = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4Compact(m, active, n_active, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -941,7 +1029,7 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropout(Dataset *D, RBM *m
                         gsl_vector_free(tmp_probh1);
 
                         /* It computes the P(v2=1|h1), i.e., it computes v2 */
-                        tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit(m, m->r, m->h);
+                        tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4Compact(m, active, n_active, m->h, on, h_on);
                         for (j = 0; j < m->n_visible_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -952,7 +1040,7 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropout(Dataset *D, RBM *m
                         }
 
                         /* It computes the P(h2=1|v2), i.e., it computes h2 (hn) */
-                        tmp_probhn = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit(m, m->r, m->v);
+                        tmp_probhn = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4Compact(m, active, n_active, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -976,20 +1064,13 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropout(Dataset *D, RBM *m
                     /* It accumulates vn */
                     gsl_vector_add(vn, m->v);
 
-                    for (i = 0; i < tmpCDpos->size1; i++)
-                    {
-                        for (j = 0; j < tmpCDpos->size2; j++)
-                        {
-                            gsl_matrix_set(tmpCDpos, i, j, gsl_vector_get(D->sample[z].feature, i) * gsl_vector_get(probh1, j));
-                            gsl_matrix_set(tmpCDneg, i, j, gsl_vector_get(m->v, i) * gsl_vector_get(probhn, j));
-                        }
-                    }
-
-                    gsl_matrix_add(CDpos, tmpCDpos);
-                    gsl_matrix_add(CDneg, tmpCDneg);
+                    /* It accumulates the statistics of the surviving hidden units only */
+                    AccumulateDropoutStatistics(CDpos, D->sample[z].feature, probh1, active, n_active);
+                    AccumulateDropoutStatistics(CDneg, m->v, probhn, active, n_active);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -1003,61 +1084,46 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropout(Dataset *D, RBM *m
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
+    free(active);
+    free(on);
+    free(h_on);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
 
     gsl_matrix_free(CDpos);
     gsl_matrix_free(CDneg);
-    gsl_matrix_free(tmpCDneg);
-    gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
 
     return error;
 }
@@ -1072,27 +1138,28 @@ batch_size: size of batch data
 p: dropconnect mask rate */
 double BernoulliRBMTrainingbyContrastiveDivergencewithDropconnect(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1 = NULL, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
+    DropconnectMask *M = NULL;
 
     srand(time(NULL));
     T = gsl_rng_default;
     r = gsl_rng_alloc(T);
     gsl_rng_set(r, random_seed_deep());
+    M = CreateDropconnectMask(p, random_seed_deep());
 
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -1102,10 +1169,7 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropconnect(Dataset *D, RB
     tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     error = 0;
 
@@ -1131,8 +1195,8 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropconnect(Dataset *D, RB
 
             for (t = 0; t < batch_size; t++)
             {
-                /* It computes M for dropconnecting weight matrix */
-                InitializeBias4DropconnectWeight(m, p);
+                /* It moves on to the dropconnect mask of the next sample, whose bits are hashed on the fly */
+                M->sample++;
 
                 if (z < D->size)
                 {
@@ -1151,7 +1215,7 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropconnect(Dataset *D, RB
                     for (i = 1; i <= n_CD_iterations; i++)
                     {
                         /* It computes the P(h=1|v1), i.e., it computes h1 */
-                        tmp_probh1 = getProbabilityTurningOnHiddenUnit4Dropconnect(m, m->M, m->v);
+                        tmp_probh1 = getProbabilityTurningOnHiddenUnit4HashedDropconnect(m, M, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -1168,7 +1232,7 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropconnect(Dataset *D, RB
                         gsl_vector_free(tmp_probh1);
 
                         /* It computes the P(v2=1|h1), i.e., it computes v2 */
-                        tmp_probvn = getProbabilityTurningOnVisibleUnit4Dropconnect(m, m->M, m->h);
+                        tmp_probvn = getProbabilityTurningOnVisibleUnit4HashedDropconnect(m, M, m->h);
                         for (j = 0; j < m->n_visible_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -1179,7 +1243,7 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropconnect(Dataset *D, RB
                         }
 
                         /* It computes the P(h2=1|v2), i.e., it computes h2 (hn) */
-                        tmp_probhn = getProbabilityTurningOnHiddenUnit4Dropconnect(m, m->M, m->v);
+                        tmp_probhn = getProbabilityTurningOnHiddenUnit4HashedDropconnect(m, M, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -1215,7 +1279,8 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropconnect(Dataset *D, RB
                     gsl_matrix_add(CDneg, tmpCDneg);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -1229,52 +1294,38 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropconnect(Dataset *D, RB
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
+    DestroyDropconnectMask(&M);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
 
@@ -1282,8 +1333,172 @@ double BernoulliRBMTrainingbyContrastiveDivergencewithDropconnect(Dataset *D, RB
     gsl_matrix_free(CDneg);
     gsl_matrix_free(tmpCDneg);
     gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
+
+    return error;
+}
+
+/* It trains a Bernoulli RBM with a pool of chains that is advanced by batched Gibbs steps. Persistent chains carry their states over mini-batches,
+so their number does not depend on the batch size; otherwise, there is one chain per sample, restarted from the hidden states the sample draws at every
+mini-batch (Contrastive Divergence). With fast weights, the chains run with W + fast_W, where the fast weights follow the gradient with a fixed learning
+rate and decay by 19/20 at every mini-batch (Fast Persistent Contrastive Divergence). Without them, the weights are updated tile by tile straight from
+the activations of the mini-batch and of the chains, so the only full-size matrices allocated besides W are its optimizer state
+Parameters: [D, m, n_epochs, n_gibbs_sampling, batch_size, n_chains, fast, persistent]
+D: dataset
+m: RBM
+n_epochs: number of training epochs
+n_gibbs_sampling: number of Gibbs steps of the chains per mini-batch
+batch_size: size of batch data
+n_chains: number of chains (it must be equal to batch_size if the chains are not persistent)
+fast: it uses fast weights if non-zero
+persistent: it keeps the states of the chains over mini-batches if non-zero */
+static double PersistentChainTraining(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size, int n_chains, int fast, int persistent)
+{
+    int e, z, i, j, n, k, n_batches = ceil((float)D->size / batch_size), trained;
+    double error, errorsum, pl, plsum, fast_eta = m->eta, ratio = 19.0 / 20.0, aux, *p, *q;
+    ChainPool *c = NULL;
+    gsl_matrix *X = NULL, *PH = NULL, *R = NULL, *grad = NULL, *fast_W = NULL, *eff_W = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix_view x, ph, rv, cv, ch, cph;
+    gsl_vector_view data_ones, chain_ones, row;
+    gsl_vector *agrad = NULL, *bgrad = NULL, *ones = NULL;
+
+    c = CreateChainPool(m, n_chains);
+    if (!c)
+        return 0.0;
+
+    X = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    PH = gsl_matrix_alloc(batch_size, m->n_hidden_layer_neurons);
+    R = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
+    agrad = gsl_vector_alloc(m->n_visible_layer_neurons);
+    bgrad = gsl_vector_alloc(m->n_hidden_layer_neurons);
+    ones = gsl_vector_alloc(batch_size > n_chains ? batch_size : n_chains);
+    gsl_vector_set_all(ones, 1.0);
+
+    /* Fast weights purposes */
+    if (fast)
+    {
+        grad = gsl_matrix_alloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+        fast_W = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+        eff_W = gsl_matrix_alloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+        gsl_matrix_memcpy(eff_W, m->W); /* fast_W starts at zero */
+    }
+
+    error = 0;
+
+    /* For each epoch */
+    for (e = 1; e <= n_epochs; e++)
+    {
+        fprintf(stderr, "\nRunning epoch %d ... ", e);
+
+        errorsum = plsum = 0;
+
+        /* For each batch */
+        for (z = 0; z < D->size; z += batch_size)
+        {
+            n = D->size - z < batch_size ? D->size - z : batch_size;
+            x = gsl_matrix_submatrix(X, 0, 0, n, X->size2);
+            ph = gsl_matrix_submatrix(PH, 0, 0, n, PH->size2);
+            rv = gsl_matrix_submatrix(R, 0, 0, n, R->size2);
+            data_ones = gsl_vector_subvector(ones, 0, n);
+            for (i = 0; i < n; i++)
+                gsl_matrix_set_row(&x.matrix, i, D->sample[z + i].feature);
+
+            /* Positive phase */
+            getBatchProbabilityTurningOnHiddenUnit(m, &x.matrix, &ph.matrix);
+
+            /* It reconstructs the mini-batch from its hidden probabilities */
+            gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, &ph.matrix, m->W, 0.0, &rv.matrix);
+            for (i = 0; i < n; i++)
+            {
+                p = gsl_matrix_ptr(&x.matrix, i, 0);
+                q = gsl_matrix_ptr(&rv.matrix, i, 0);
+                aux = 0.0;
+                for (j = 0; j < R->size2; j++)
+                {
+                    q[j] = SigmoidLogistic(q[j] + gsl_vector_get(m->a, j));
+                    aux += (p[j] - q[j]) * (p[j] - q[j]);
+                }
+                errorsum += aux / R->size2;
+            }
+
+            /* Negative phase */
+            k = persistent ? n_chains : n;
+            if (!persistent)
+            {
+                ch = gsl_matrix_submatrix(c->H, 0, 0, n, c->H->size2);
+                SampleBernoulliMatrix(&ph.matrix, &ch.matrix, c->r); /* the chains restart from the data */
+            }
+            RunChainPool(c, m, fast ? eff_W : m->W, n_gibbs_sampling);
+            cv = gsl_matrix_submatrix(c->V, 0, 0, k, c->V->size2);
+            cph = gsl_matrix_submatrix(c->PH, 0, 0, k, c->PH->size2);
+            chain_ones = gsl_vector_subvector(ones, 0, k);
+
+            pl = 0;
+            if (!m->monitor)
+                for (i = 0; i < k; i++)
+                {
+                    row = gsl_matrix_row(c->V, i);
+                    pl += getPseudoLikelihood(m, &row.vector);
+                }
+            plsum += pl / k;
+
+            /* It updates RBM parameters */
+            if (fast)
+            {
+                gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0 / n, &x.matrix, &ph.matrix, 0.0, grad);    /* It performs E_data[vh] */
+                gsl_blas_dgemm(CblasTrans, CblasNoTrans, -1.0 / k, &cv.matrix, &cph.matrix, 1.0, grad); /* It performs E_data[vh] - E_model[vh] */
+                UpdateFastParameterMatrix(m, m->W, grad, NULL, 1.0, m->eta, m->lambda, tmpW, fast_W, eff_W, fast_eta, ratio);
+            }
+            else
+                UpdateParameterMatrix4Batch(m, m->W, &x.matrix, &ph.matrix, 1.0 / n, &cv.matrix, &cph.matrix, 1.0 / k, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(E_data - E_model) and W = W+W' */
+
+            gsl_blas_dgemv(CblasTrans, 1.0 / n, &x.matrix, &data_ones.vector, 0.0, agrad);    /* It performs E_data[v] */
+            gsl_blas_dgemv(CblasTrans, -1.0 / k, &cv.matrix, &chain_ones.vector, 1.0, agrad); /* It performs E_data[v] - E_model[v] */
+            UpdateParameterVector(m, m->a, agrad, NULL, 1.0, m->eta, tmpa);                   /* It performs a' = alpha*a' + eta*(E_data - E_model) and a = a + a' */
+
+            gsl_blas_dgemv(CblasTrans, 1.0 / n, &ph.matrix, &data_ones.vector, 0.0, bgrad);    /* It performs E_data[h] */
+            gsl_blas_dgemv(CblasTrans, -1.0 / k, &cph.matrix, &chain_ones.vector, 1.0, bgrad); /* It performs E_data[h] - E_model[h] */
+            UpdateParameterVector(m, m->b, bgrad, NULL, 1.0, m->eta, tmpb);                    /* It performs b' = alpha*b' + eta*(E_data - E_model) and b = b + b' */
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
+        }
+
+        trained = z < D->size ? z + n : D->size; /* samples trained, fewer than D->size if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / ceil((double)trained / batch_size);
+        fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
+        fprintf(stdout, "%d %lf %lf\n", e, error, pl);
+
+        m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
+
+        if (error < 0.0001 || HasStoppedEarly(m))
+            e = n_epochs + 1;
+    }
+    RestoreEarlyStopping(m);
+
+    DestroyChainPool(&c);
+
+    gsl_matrix_free(X);
+    gsl_matrix_free(PH);
+    gsl_matrix_free(R);
+    DestroyParameterState(&tmpW);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
+    gsl_vector_free(agrad);
+    gsl_vector_free(bgrad);
+    gsl_vector_free(ones);
+    if (fast)
+    {
+        gsl_matrix_free(grad);
+        gsl_matrix_free(fast_W);
+        gsl_matrix_free(eff_W);
+    }
 
     return error;
 }
@@ -1294,48 +1509,93 @@ D: dataset
 m: RBM
 n_epochs: number of training epochs
 n_CD_iterations: number of CD iterations
-batch_size: size of batch data */
+batch_size: size of batch data (and number of persistent chains) */
 double BernoulliRBMTrainingbyPersistentContrastiveDivergence(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    return PersistentChainTraining(D, m, n_epochs, n_CD_iterations, batch_size, batch_size, 0, 1);
+}
+
+/* It trains a Bernoulli RBM by Persistent Constrative Divergence with a given number of persistent chains
+Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, n_chains]
+D: dataset
+m: RBM
+n_epochs: number of training epochs
+n_CD_iterations: number of CD iterations
+batch_size: size of batch data
+n_chains: number of persistent chains */
+double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithChains(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, int n_chains)
+{
+    return PersistentChainTraining(D, m, n_epochs, n_CD_iterations, batch_size, n_chains, 0, 1);
+}
+
+/* It trains a Bernoulli RBM by Constrative Divergence with bounded memory. The Gibbs chains of a mini-batch run as a batch, and the weights are
+updated tile by tile straight from their activations, so the extra memory is the optimizer state of W plus a few batch_size x (n_visible + n_hidden)
+matrices, instead of the full-size statistics kept by BernoulliRBMTrainingbyContrastiveDivergence
+Parameters: [D, m, n_epochs, n_CD_iterations, batch_size]
+D: dataset
+m: RBM
+n_epochs: number of training epochs
+n_CD_iterations: number of CD iterations
+batch_size: size of batch data */
+double BernoulliRBMTrainingbyContrastiveDivergencewithBoundedMemory(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size)
+{
+    return PersistentChainTraining(D, m, n_epochs, n_CD_iterations, batch_size, batch_size, 0, 0);
+}
+
+/* It trains a Bernoulli RBM with Dropout by Persistent Constrative Divergence
+Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, p]
+D: dataset
+m: RBM
+n_epochs: number of training epochs
+n_CD_iterations: number of CD iterations
+batch_size: size of batch data
+p: hidden units dropout rate */
+double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropout(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
+{
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL, *last_probhn = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL, *aux = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *last_probhn = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL, *aux = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
+    int *active = NULL, *on = NULL, n_active;
+    double *h_on = NULL;
 
     srand(time(NULL));
     T = gsl_rng_default;
     r = gsl_rng_alloc(T);
     gsl_rng_set(r, random_seed_deep());
+    active = (int *)malloc(m->n_hidden_layer_neurons * sizeof(int));
+    on = (int *)malloc(m->n_hidden_layer_neurons * sizeof(int));
+    h_on = (double *)malloc(m->n_hidden_layer_neurons * sizeof(double));
+    if (!active || !on || !h_on)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropout.\n");
+        exit(-1);
+    }
 
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
 
     CDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     CDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     last_probhn = gsl_matrix_calloc(batch_size, m->n_hidden_layer_neurons);
     aux = gsl_vector_calloc(m->n_hidden_layer_neurons);
 
     error = 0;
+
     /* For each epoch */
     for (e = 1; e <= n_epochs; e++)
     {
@@ -1358,6 +1618,9 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergence(Dataset *D, RBM *m,
 
             for (t = 0; t < batch_size; t++)
             {
+                /* It draws r for dropping out hidden units, and it compacts the surviving ones */
+                n_active = SampleDropoutHiddenUnits(m, p, r, active);
+
                 if (z < D->size)
                 {
                     ctr++;
@@ -1375,7 +1638,7 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergence(Dataset *D, RBM *m,
                     for (i = 1; i <= n_CD_iterations; i++)
                     {
                         /* It computes the P(h=1|v1), i.e., it computes h1 */
-                        tmp_probh1 = getProbabilityTurningOnHiddenUnit(m, m->v);
+                        tmp_probh1 = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4Compact(m, active, n_active, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -1393,11 +1656,11 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergence(Dataset *D, RBM *m,
 
                         /* It computes the P(v2=1|h1), i.e., it computes v2 */
                         if ((e == 1) && (n == 1))
-                            tmp_probvn = getProbabilityTurningOnVisibleUnit(m, m->h);
+                            tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4Compact(m, active, n_active, m->h, on, h_on);
                         else
                         {
                             gsl_matrix_get_row(aux, last_probhn, t);
-                            tmp_probvn = getProbabilityTurningOnVisibleUnit(m, aux);
+                            tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4Compact(m, active, n_active, aux, on, h_on);
                         }
                         for (j = 0; j < m->n_visible_layer_neurons; j++)
                         {
@@ -1409,7 +1672,7 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergence(Dataset *D, RBM *m,
                         }
 
                         /* It computes the P(h2=1|v2), i.e., it computes h2 (hn) */
-                        tmp_probhn = getProbabilityTurningOnHiddenUnit(m, m->v);
+                        tmp_probhn = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4Compact(m, active, n_active, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -1433,20 +1696,13 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergence(Dataset *D, RBM *m,
                     /* It accumulates vn */
                     gsl_vector_add(vn, m->v);
 
-                    for (i = 0; i < tmpCDpos->size1; i++)
-                    {
-                        for (j = 0; j < tmpCDpos->size2; j++)
-                        {
-                            gsl_matrix_set(tmpCDpos, i, j, gsl_vector_get(D->sample[z].feature, i) * gsl_vector_get(probh1, j));
-                            gsl_matrix_set(tmpCDneg, i, j, gsl_vector_get(m->v, i) * gsl_vector_get(probhn, j));
-                        }
-                    }
-
-                    gsl_matrix_add(CDpos, tmpCDpos);
-                    gsl_matrix_add(CDneg, tmpCDneg);
+                    /* It accumulates the statistics of the surviving hidden units only */
+                    AccumulateDropoutStatistics(CDpos, D->sample[z].feature, probh1, active, n_active);
+                    AccumulateDropoutStatistics(CDneg, m->v, probhn, active, n_active);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -1460,98 +1716,84 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergence(Dataset *D, RBM *m,
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
+    free(active);
+    free(on);
+    free(h_on);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
     gsl_vector_free(aux);
 
     gsl_matrix_free(CDpos);
     gsl_matrix_free(CDneg);
-    gsl_matrix_free(tmpCDneg);
-    gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
     gsl_matrix_free(last_probhn);
 
     return error;
 }
 
-/* It trains a Bernoulli RBM with Dropout by Persistent Constrative Divergence
+/* It trains a Bernoulli RBM with Dropconnect by Persistent Constrative Divergence
 Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, p]
 D: dataset
 m: RBM
 n_epochs: number of training epochs
 n_CD_iterations: number of CD iterations
 batch_size: size of batch data
-p: hidden units dropout rate */
-double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropout(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
+p: dropconnect rate */
+double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropconnect(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL, *last_probhn = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL, *aux = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *last_probhn = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL, *aux = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
+    DropconnectMask *M = NULL;
 
     srand(time(NULL));
     T = gsl_rng_default;
     r = gsl_rng_alloc(T);
     gsl_rng_set(r, random_seed_deep());
+    M = CreateDropconnectMask(p, random_seed_deep());
 
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -1561,16 +1803,12 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropout(Dataset
     tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     last_probhn = gsl_matrix_calloc(batch_size, m->n_hidden_layer_neurons);
     aux = gsl_vector_calloc(m->n_hidden_layer_neurons);
 
     error = 0;
-
     /* For each epoch */
     for (e = 1; e <= n_epochs; e++)
     {
@@ -1593,9 +1831,8 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropout(Dataset
 
             for (t = 0; t < batch_size; t++)
             {
-                /* It computes r for dropping out hidden units */
-                InitializeBias4DropoutHiddenUnits(m, p);
-
+                /* It moves on to the dropconnect mask of the next sample, whose bits are hashed on the fly */
+                M->sample++;
                 if (z < D->size)
                 {
                     ctr++;
@@ -1613,7 +1850,7 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropout(Dataset
                     for (i = 1; i <= n_CD_iterations; i++)
                     {
                         /* It computes the P(h=1|v1), i.e., it computes h1 */
-                        tmp_probh1 = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit(m, m->r, m->v);
+                        tmp_probh1 = getProbabilityTurningOnHiddenUnit4HashedDropconnect(m, M, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -1631,11 +1868,11 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropout(Dataset
 
                         /* It computes the P(v2=1|h1), i.e., it computes v2 */
                         if ((e == 1) && (n == 1))
-                            tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit(m, m->r, m->h);
+                            tmp_probvn = getProbabilityTurningOnVisibleUnit4HashedDropconnect(m, M, m->h);
                         else
                         {
                             gsl_matrix_get_row(aux, last_probhn, t);
-                            tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit(m, m->r, aux);
+                            tmp_probvn = getProbabilityTurningOnVisibleUnit4HashedDropconnect(m, M, aux);
                         }
                         for (j = 0; j < m->n_visible_layer_neurons; j++)
                         {
@@ -1647,7 +1884,7 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropout(Dataset
                         }
 
                         /* It computes the P(h2=1|v2), i.e., it computes h2 (hn) */
-                        tmp_probhn = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit(m, m->r, m->v);
+                        tmp_probhn = getProbabilityTurningOnHiddenUnit4HashedDropconnect(m, M, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -1684,7 +1921,8 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropout(Dataset
                     gsl_matrix_add(CDneg, tmpCDneg);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -1698,52 +1936,38 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropout(Dataset
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
+    DestroyDropconnectMask(&M);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
     gsl_vector_free(aux);
@@ -1752,62 +1976,99 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropout(Dataset
     gsl_matrix_free(CDneg);
     gsl_matrix_free(tmpCDneg);
     gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
     gsl_matrix_free(last_probhn);
 
     return error;
 }
 
-/* It trains a Bernoulli RBM with Dropconnect by Persistent Constrative Divergence
+/* It trains a Bernoulli RBM by Fast Persistent Constrative Divergence
+Parameters: [D, m, n_epochs, n_gibbs_sampling, batch_size]
+D: dataset
+m: RBM
+n_epochs: number of training epochs
+n_gibbs_sampling: number of Gibbs steps of the chains per mini-batch
+batch_size: size of batch data (and number of persistent chains) */
+double BernoulliRBMTrainingbyFastPersistentContrastiveDivergence(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size)
+{
+    return PersistentChainTraining(D, m, n_epochs, n_gibbs_sampling, batch_size, batch_size, 1, 1);
+}
+
+/* It trains a Bernoulli RBM by Fast Persistent Constrative Divergence with a given number of persistent chains
+Parameters: [D, m, n_epochs, n_gibbs_sampling, batch_size, n_chains]
+D: dataset
+m: RBM
+n_epochs: number of training epochs
+n_gibbs_sampling: number of Gibbs steps of the chains per mini-batch
+batch_size: size of batch data
+n_chains: number of persistent chains */
+double BernoulliRBMTrainingbyFastPersistentContrastiveDivergencewithChains(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size, int n_chains)
+{
+    return PersistentChainTraining(D, m, n_epochs, n_gibbs_sampling, batch_size, n_chains, 1, 1);
+}
+
+/* It trains a Bernoulli RBM with Dropout by Fast Persistent Constrative Divergence
 Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, p]
 D: dataset
 m: RBM
 n_epochs: number of training epochs
 n_CD_iterations: number of CD iterations
 batch_size: size of batch data
-p: dropconnect rate */
-double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropconnect(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
+p: hidden units dropout rate */
+double BernoulliRBMTrainingbyFastPersistentContrastiveDivergencewithDropout(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size, double p)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
-    double error, sample, errorsum, pl, plsum;
-    const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL, *last_probhn = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL, *aux = NULL;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
+    double error, sample, errorsum, pl, plsum, fast_eta, ratio;
+    const gsl_rng_type *T = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *last_probhn = NULL, *fast_W = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix *eff_W = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL, *aux = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
-    gsl_rng *r;
+    gsl_rng *r = NULL;
+    int *active = NULL, *on = NULL, n_active;
+    double *h_on = NULL;
 
     srand(time(NULL));
     T = gsl_rng_default;
     r = gsl_rng_alloc(T);
     gsl_rng_set(r, random_seed_deep());
+    active = (int *)malloc(m->n_hidden_layer_neurons * sizeof(int));
+    on = (int *)malloc(m->n_hidden_layer_neurons * sizeof(int));
+    h_on = (double *)malloc(m->n_hidden_layer_neurons * sizeof(double));
+    if (!active || !on || !h_on)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @BernoulliRBMTrainingbyFastPersistentContrastiveDivergencewithDropout.\n");
+        exit(-1);
+    }
 
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
 
     CDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     CDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     last_probhn = gsl_matrix_calloc(batch_size, m->n_hidden_layer_neurons);
     aux = gsl_vector_calloc(m->n_hidden_layer_neurons);
 
+    /* Fast weights purposes */
+    fast_W = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    eff_W = gsl_matrix_alloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    gsl_matrix_memcpy(eff_W, m->W); /* fast_W starts at zero */
+    fast_eta = m->eta;
+    ratio = 19.0 / 20.0;
+
     error = 0;
+
     /* For each epoch */
     for (e = 1; e <= n_epochs; e++)
     {
@@ -1830,8 +2091,9 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropconnect(Data
 
             for (t = 0; t < batch_size; t++)
             {
-                /* It computes M for dropconnecting weight matrix */
-                InitializeBias4DropconnectWeight(m, p);
+                /* It draws r for dropping out hidden units, and it compacts the surviving ones */
+                n_active = SampleDropoutHiddenUnits(m, p, r, active);
+
                 if (z < D->size)
                 {
                     ctr++;
@@ -1846,10 +2108,11 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropconnect(Data
                     gsl_vector_add(v1, m->v);
 
                     /* For each CD iteration */
-                    for (i = 1; i <= n_CD_iterations; i++)
+                    for (i = 1; i <= n_gibbs_sampling; i++)
                     {
+
                         /* It computes the P(h=1|v1), i.e., it computes h1 */
-                        tmp_probh1 = getProbabilityTurningOnHiddenUnit4Dropconnect(m, m->M, m->v);
+                        tmp_probh1 = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4Compact(m, active, n_active, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -1867,11 +2130,11 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropconnect(Data
 
                         /* It computes the P(v2=1|h1), i.e., it computes v2 */
                         if ((e == 1) && (n == 1))
-                            tmp_probvn = getProbabilityTurningOnVisibleUnit4Dropconnect(m, m->M, m->h);
+                            tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4FPCD4Compact(m, active, n_active, m->h, on, h_on, eff_W);
                         else
                         {
                             gsl_matrix_get_row(aux, last_probhn, t);
-                            tmp_probvn = getProbabilityTurningOnVisibleUnit4Dropconnect(m, m->M, aux);
+                            tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4Compact(m, active, n_active, aux, on, h_on);
                         }
                         for (j = 0; j < m->n_visible_layer_neurons; j++)
                         {
@@ -1883,7 +2146,7 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropconnect(Data
                         }
 
                         /* It computes the P(h2=1|v2), i.e., it computes h2 (hn) */
-                        tmp_probhn = getProbabilityTurningOnHiddenUnit4Dropconnect(m, m->M, m->v);
+                        tmp_probhn = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4FPCD4Compact(m, active, n_active, m->v, eff_W);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -1892,7 +2155,7 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropconnect(Data
                             else
                                 gsl_vector_set(m->h, j, 0.0);
                         }
-                        if (i == n_CD_iterations)
+                        if (i == n_gibbs_sampling)
                         { /* In case of n_CD_iterations > 1 */
                             gsl_vector_memcpy(probhn, tmp_probhn);
                             gsl_vector_add(ctr_probhn, probhn);
@@ -1907,20 +2170,13 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropconnect(Data
                     /* It accumulates vn */
                     gsl_vector_add(vn, m->v);
 
-                    for (i = 0; i < tmpCDpos->size1; i++)
-                    {
-                        for (j = 0; j < tmpCDpos->size2; j++)
-                        {
-                            gsl_matrix_set(tmpCDpos, i, j, gsl_vector_get(D->sample[z].feature, i) * gsl_vector_get(probh1, j));
-                            gsl_matrix_set(tmpCDneg, i, j, gsl_vector_get(m->v, i) * gsl_vector_get(probhn, j));
-                        }
-                    }
-
-                    gsl_matrix_add(CDpos, tmpCDpos);
-                    gsl_matrix_add(CDneg, tmpCDneg);
+                    /* It accumulates the statistics of the surviving hidden units only */
+                    AccumulateDropoutStatistics(CDpos, D->sample[z].feature, probh1, active, n_active);
+                    AccumulateDropoutStatistics(CDneg, m->v, probhn, active, n_active);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -1933,99 +2189,88 @@ double BernoulliRBMTrainingbyPersistentContrastiveDivergencewithDropconnect(Data
             errorsum = errorsum + error / ctr;
             plsum = plsum + pl / ctr;
 
-            /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
-            /********************************/
+            /* It updates regular, fast and effective weights */
+            UpdateFastParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW, fast_W, eff_W, fast_eta, ratio);
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
+                                                            /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
+    free(active);
+    free(on);
+    free(h_on);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
     gsl_vector_free(aux);
 
     gsl_matrix_free(CDpos);
     gsl_matrix_free(CDneg);
-    gsl_matrix_free(tmpCDneg);
-    gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
     gsl_matrix_free(last_probhn);
+    gsl_matrix_free(fast_W);
+    gsl_matrix_free(eff_W);
 
     return error;
 }
 
-/* It trains a Bernoulli RBM by Fast Persistent Constrative Divergence
-Parameters: [D, m, n_epochs, n_CD_iterations, batch_size]
+/* It trains a Bernoulli RBM with Dropconnect by Fast Persistent Constrative Divergence
+Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, p]
 D: dataset
 m: RBM
 n_epochs: number of training epochs
 n_CD_iterations: number of CD iterations
-batch_size: size of batch data */
-double BernoulliRBMTrainingbyFastPersistentContrastiveDivergence(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size)
-{
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+batch_size: size of batch data
+p: dropconnect rate */
+double BernoulliRBMTrainingbyFastPersistentContrastiveDivergencewithDropconnect(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size, double p)
+{
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum, fast_eta, ratio;
     const gsl_rng_type *T = NULL;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL, *last_probhn = NULL, *fast_W = NULL;
-    gsl_matrix *g = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL, *aux = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *last_probhn = NULL, *fast_W = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix *eff_W = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL, *aux = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r = NULL;
+    DropconnectMask *M = NULL;
 
     srand(time(NULL));
     T = gsl_rng_default;
     r = gsl_rng_alloc(T);
     gsl_rng_set(r, random_seed_deep());
+    M = CreateDropconnectMask(p, random_seed_deep());
 
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -2035,17 +2280,15 @@ double BernoulliRBMTrainingbyFastPersistentContrastiveDivergence(Dataset *D, RBM
     tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     last_probhn = gsl_matrix_calloc(batch_size, m->n_hidden_layer_neurons);
     aux = gsl_vector_calloc(m->n_hidden_layer_neurons);
 
     /* Fast weights purposes */
     fast_W = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    g = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    eff_W = gsl_matrix_alloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    gsl_matrix_memcpy(eff_W, m->W); /* fast_W starts at zero */
     fast_eta = m->eta;
     ratio = 19.0 / 20.0;
 
@@ -2073,6 +2316,8 @@ double BernoulliRBMTrainingbyFastPersistentContrastiveDivergence(Dataset *D, RBM
 
             for (t = 0; t < batch_size; t++)
             {
+                /* It moves on to the dropconnect mask of the next sample, whose bits are hashed on the fly */
+                M->sample++;
                 if (z < D->size)
                 {
                     ctr++;
@@ -2090,7 +2335,7 @@ double BernoulliRBMTrainingbyFastPersistentContrastiveDivergence(Dataset *D, RBM
                     for (i = 1; i <= n_gibbs_sampling; i++)
                     {
                         /* It computes the P(h=1|v1), i.e., it computes h1 */
-                        tmp_probh1 = getProbabilityTurningOnHiddenUnit(m, m->v);
+                        tmp_probh1 = getProbabilityTurningOnHiddenUnit4HashedDropconnect(m, M, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -2108,11 +2353,11 @@ double BernoulliRBMTrainingbyFastPersistentContrastiveDivergence(Dataset *D, RBM
 
                         /* It computes the P(v2=1|h1), i.e., it computes v2 */
                         if ((e == 1) && (n == 1))
-                            tmp_probvn = getProbabilityTurningOnVisibleUnit4FPCD(m, m->h, fast_W);
+                            tmp_probvn = getProbabilityTurningOnVisibleUnit4FPCD4HashedDropconnect(m, M, m->h, eff_W);
                         else
                         {
                             gsl_matrix_get_row(aux, last_probhn, t);
-                            tmp_probvn = getProbabilityTurningOnVisibleUnit(m, aux);
+                            tmp_probvn = getProbabilityTurningOnVisibleUnit4HashedDropconnect(m, M, aux);
                         }
                         for (j = 0; j < m->n_visible_layer_neurons; j++)
                         {
@@ -2124,7 +2369,7 @@ double BernoulliRBMTrainingbyFastPersistentContrastiveDivergence(Dataset *D, RBM
                         }
 
                         /* It computes the P(h2=1|v2), i.e., it computes h2 (hn) */
-                        tmp_probhn = getProbabilityTurningOnHiddenUnit4FPCD(m, m->v, fast_W);
+                        tmp_probhn = getProbabilityTurningOnHiddenUnit4FPCD4HashedDropconnect(m, M, m->v, eff_W);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -2161,7 +2406,8 @@ double BernoulliRBMTrainingbyFastPersistentContrastiveDivergence(Dataset *D, RBM
                     gsl_matrix_add(CDneg, tmpCDneg);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -2174,59 +2420,39 @@ double BernoulliRBMTrainingbyFastPersistentContrastiveDivergence(Dataset *D, RBM
             errorsum = errorsum + error / ctr;
             plsum = plsum + pl / ctr;
 
-            /* It updates regular weights */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_memcpy(g, CDpos);               /* It copies the gradient to be used in the fast weights computation */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            /* It updates regular, fast and effective weights */
+            UpdateFastParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW, fast_W, eff_W, fast_eta, ratio);
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
                                                             /********************************/
 
-            /* It updates fast weights */
-            gsl_matrix_scale(g, fast_eta);   /* It computes g*fast_learning_rate */
-            gsl_matrix_scale(fast_W, ratio); /* It computes fast_W*19/20 */
-            gsl_matrix_add(fast_W, g);       /* It computes fast_W = fast_W*19/20 + gradient*fast_learning_rate */
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
+    DestroyDropconnectMask(&M);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
     gsl_vector_free(aux);
@@ -2235,33 +2461,30 @@ double BernoulliRBMTrainingbyFastPersistentContrastiveDivergence(Dataset *D, RBM
     gsl_matrix_free(CDneg);
     gsl_matrix_free(tmpCDneg);
     gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
     gsl_matrix_free(last_probhn);
     gsl_matrix_free(fast_W);
-    gsl_matrix_free(g);
+    gsl_matrix_free(eff_W);
 
     return error;
 }
 
-/* It trains a Bernoulli RBM with Dropout by Fast Persistent Constrative Divergence
-Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, p]
+/* It trains a Discriminative Bernoulli RBM by Constrative Divergence for pattern classification
+Parameters: [D, m, n_epochs, n_CD_iterations, batch_size]
 D: dataset
 m: RBM
 n_epochs: number of training epochs
 n_CD_iterations: number of CD iterations
-batch_size: size of batch data
-p: hidden units dropout rate */
-double BernoulliRBMTrainingbyFastPersistentContrastiveDivergencewithDropout(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size, double p)
+batch_size: size of batch data */
+double DiscriminativeBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
-    double error, sample, errorsum, pl, plsum, fast_eta, ratio;
+    int e, z, j, i, n, n_batches = ceil((float)D->size / batch_size), t, ctr, trained;
+    gsl_vector *y0 = NULL, *y1 = NULL, *py1 = NULL, *ph0 = NULL, *ph1 = NULL, *pv1 = NULL, *acc_v0 = NULL, *acc_v1 = NULL;
+    gsl_vector *acc_h0 = NULL, *acc_h1 = NULL, *acc_y0 = NULL, *acc_y1 = NULL;
+    ParameterState *delta_a = NULL, *delta_b = NULL, *delta_c = NULL, *delta_W = NULL, *delta_U = NULL;
+    gsl_matrix *_posW = NULL, *_negW = NULL, *posW = NULL, *negW = NULL, *_posU = NULL, *_negU = NULL, *posU = NULL, *negU = NULL;
+    double sample, error, errorsum, train_error;
     const gsl_rng_type *T = NULL;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL, *last_probhn = NULL, *fast_W = NULL;
-    gsl_matrix *g = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL, *aux = NULL;
-    gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
-    gsl_vector *tmp_probvn = NULL;
     gsl_rng *r = NULL;
 
     srand(time(NULL));
@@ -2269,501 +2492,216 @@ double BernoulliRBMTrainingbyFastPersistentContrastiveDivergencewithDropout(Data
     r = gsl_rng_alloc(T);
     gsl_rng_set(r, random_seed_deep());
 
-    v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    vn = gsl_vector_calloc(m->n_visible_layer_neurons);
-
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    _posW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    posW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    _negW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    negW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
+    _posU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
+    posU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
+    _negU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
+    negU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
 
-    CDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    CDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    delta_W = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    delta_U = CreateParameterState(m, m->n_labels, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    acc_v0 = gsl_vector_calloc(m->n_visible_layer_neurons);
+    acc_v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    last_probhn = gsl_matrix_calloc(batch_size, m->n_hidden_layer_neurons);
-    aux = gsl_vector_calloc(m->n_hidden_layer_neurons);
+    acc_h0 = gsl_vector_calloc(m->n_hidden_layer_neurons);
+    acc_h1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
+    acc_y0 = gsl_vector_calloc(m->n_labels);
+    acc_y1 = gsl_vector_calloc(m->n_labels);
 
-    /* Fast weights purposes */
-    fast_W = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    g = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    fast_eta = m->eta;
-    ratio = 19.0 / 20.0;
+    delta_a = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    delta_b = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
+    delta_c = CreateParameterState(m, m->n_labels, 1);
 
-    error = 0;
+    train_error = 0;
 
-    /* For each epoch */
     for (e = 1; e <= n_epochs; e++)
     {
         fprintf(stderr, "\nRunning epoch %d ... ", e);
 
-        errorsum = plsum = 0;
+        errorsum = 0;
         z = 0;
 
         /* For each batch */
         for (n = 1; n <= n_batches; n++)
         {
             ctr = 0;
-            error = pl = 0;
-            gsl_matrix_set_zero(CDpos);
-            gsl_matrix_set_zero(CDneg);
-            gsl_vector_set_zero(v1);
-            gsl_vector_set_zero(vn);
-            gsl_vector_set_zero(ctr_probh1);
-            gsl_vector_set_zero(ctr_probhn);
+            error = 0.0;
+            gsl_matrix_set_zero(posW);
+            gsl_matrix_set_zero(negW);
+            gsl_matrix_set_zero(posU);
+            gsl_matrix_set_zero(negU);
+            gsl_vector_set_zero(acc_v0);
+            gsl_vector_set_zero(acc_v1);
+            gsl_vector_set_zero(acc_h0);
+            gsl_vector_set_zero(acc_h1);
+            gsl_vector_set_zero(acc_y0);
+            gsl_vector_set_zero(acc_y1);
 
             for (t = 0; t < batch_size; t++)
             {
-                /* It computes r for dropping out hidden units */
-                InitializeBias4DropoutHiddenUnits(m, p);
 
                 if (z < D->size)
                 {
                     ctr++;
-                    probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
-                    probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
-                    probvn = gsl_vector_calloc(m->n_visible_layer_neurons);
-
-                    /* It sets v1 */
                     setVisibleLayer(m, D->sample[z].feature);
+                    gsl_vector_add(acc_v0, m->v);
+                    y0 = label2binary_gsl_vector(D->sample[z].label, D->nlabels);
+                    gsl_vector_add(acc_y0, y0);
 
-                    /* It accumulates v1 */
-                    gsl_vector_add(v1, m->v);
+                    /* It computes the P(h0|v0,y0) */
+                    ph0 = getDiscriminativeProbabilityTurningOnHiddenUnit(m, y0);
+                    for (j = 0; j < m->n_hidden_layer_neurons; j++)
+                    {
+                        sample = gsl_rng_uniform(r);
+                        if (gsl_vector_get(ph0, j) > sample)
+                            gsl_vector_set(m->h, j, 1.0);
+                        else
+                            gsl_vector_set(m->h, j, 0.0);
+                    }
+                    gsl_vector_add(acc_h0, ph0);
 
-                    /* For each CD iteration */
-                    for (i = 1; i <= n_gibbs_sampling; i++)
+                    /* It computes the P(v1|h0) */
+                    pv1 = getProbabilityTurningOnVisibleUnit(m, m->h);
+                    for (j = 0; j < m->n_visible_layer_neurons; j++)
                     {
+                        sample = gsl_rng_uniform(r);
+                        if (gsl_vector_get(pv1, j) > sample)
+                            gsl_vector_set(m->v, j, 1.0);
+                        else
+                            gsl_vector_set(m->v, j, 0.0);
+                    }
+                    gsl_vector_add(acc_v1, m->v);
 
-                        /* It computes the P(h=1|v1), i.e., it computes h1 */
-                        tmp_probh1 = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit(m, m->r, m->v);
-                        for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                        {
-                            sample = gsl_rng_uniform(r);
-                            if (gsl_vector_get(tmp_probh1, j) >= sample)
-                                gsl_vector_set(m->h, j, 1.0);
-                            else
-                                gsl_vector_set(m->h, j, 0.0);
-                        }
-                        if (i == 1)
-                        { /* In case of n_CD_iterations > 1 */
-                            gsl_vector_memcpy(probh1, tmp_probh1);
-                            gsl_vector_add(ctr_probh1, probh1);
-                        }
-                        gsl_vector_free(tmp_probh1);
+                    /* It computes the P(y1|h0) */
+                    py1 = getDiscriminativeProbabilityLabelUnit(m);
+                    y1 = gsl_vector_calloc(py1->size);
+                    gsl_vector_set(y1, gsl_vector_max_index(py1), 1.0); /* It samples the class with highest probability */
+                    gsl_vector_add(acc_y1, y1);
 
-                        /* It computes the P(v2=1|h1), i.e., it computes v2 */
-                        if ((e == 1) && (n == 1))
-                            tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4FPCD(m, m->r, m->h, fast_W);
+                    /* It computes the P(h1|y1,v1) */
+                    ph1 = getDiscriminativeProbabilityTurningOnHiddenUnit(m, y1);
+                    for (j = 0; j < m->n_hidden_layer_neurons; j++)
+                    {
+                        sample = gsl_rng_uniform(r);
+                        if (gsl_vector_get(ph1, j) > sample)
+                            gsl_vector_set(m->h, j, 1.0);
                         else
-                        {
-                            gsl_matrix_get_row(aux, last_probhn, t);
-                            tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit(m, m->r, aux);
-                        }
-                        for (j = 0; j < m->n_visible_layer_neurons; j++)
-                        {
-                            sample = gsl_rng_uniform(r);
-                            if (gsl_vector_get(tmp_probvn, j) >= sample)
-                                gsl_vector_set(m->v, j, 1.0);
-                            else
-                                gsl_vector_set(m->v, j, 0.0);
-                        }
+                            gsl_vector_set(m->h, j, 0.0);
+                    }
+                    gsl_vector_add(acc_h1, ph1);
 
-                        /* It computes the P(h2=1|v2), i.e., it computes h2 (hn) */
-                        tmp_probhn = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4FPCD(m, m->r, m->v, fast_W);
-                        for (j = 0; j < m->n_hidden_layer_neurons; j++)
+                    for (i = 0; i < _posW->size1; i++)
+                    {
+                        for (j = 0; j < _posW->size2; j++)
                         {
-                            sample = gsl_rng_uniform(r);
-                            if (gsl_vector_get(tmp_probhn, j) >= sample)
-                                gsl_vector_set(m->h, j, 1.0);
-                            else
-                                gsl_vector_set(m->h, j, 0.0);
-                        }
-                        if (i == n_gibbs_sampling)
-                        { /* In case of n_CD_iterations > 1 */
-                            gsl_vector_memcpy(probhn, tmp_probhn);
-                            gsl_vector_add(ctr_probhn, probhn);
-                            gsl_vector_memcpy(probvn, tmp_probvn);
-                            gsl_matrix_set_row(last_probhn, t, probhn); /* It saves the last chain elements of the current training sample */
+                            gsl_matrix_set(_posW, i, j, gsl_vector_get(ph0, j) * gsl_vector_get(D->sample[z].feature, i));
+                            gsl_matrix_set(_negW, i, j, gsl_vector_get(ph1, j) * gsl_vector_get(m->v, i));
                         }
-
-                        gsl_vector_free(tmp_probhn);
-                        gsl_vector_free(tmp_probvn);
                     }
 
-                    /* It accumulates vn */
-                    gsl_vector_add(vn, m->v);
-
-                    for (i = 0; i < tmpCDpos->size1; i++)
+                    for (i = 0; i < _posU->size1; i++)
                     {
-                        for (j = 0; j < tmpCDpos->size2; j++)
+                        for (j = 0; j < _posU->size2; j++)
                         {
-                            gsl_matrix_set(tmpCDpos, i, j, gsl_vector_get(D->sample[z].feature, i) * gsl_vector_get(probh1, j));
-                            gsl_matrix_set(tmpCDneg, i, j, gsl_vector_get(m->v, i) * gsl_vector_get(probhn, j));
+                            gsl_matrix_set(_posU, i, j, gsl_vector_get(ph0, j) * gsl_vector_get(y0, i));
+                            gsl_matrix_set(_negU, i, j, gsl_vector_get(ph1, j) * gsl_vector_get(y1, i));
                         }
                     }
 
-                    gsl_matrix_add(CDpos, tmpCDpos);
-                    gsl_matrix_add(CDneg, tmpCDneg);
+                    gsl_matrix_add(posW, _posW);
+                    gsl_matrix_add(negW, _negW);
 
-                    error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    gsl_matrix_add(posU, _posU);
+                    gsl_matrix_add(negU, _negU);
 
-                    gsl_vector_free(probh1);
-                    gsl_vector_free(probhn);
-                    gsl_vector_free(probvn);
+                    error += getReconstructionError(y0, py1);
+
+                    gsl_vector_free(y0);
+                    gsl_vector_free(y1);
+                    gsl_vector_free(py1);
+                    gsl_vector_free(ph0);
+                    gsl_vector_free(ph1);
+                    gsl_vector_free(pv1);
 
                     z++;
                 }
             }
 
             errorsum = errorsum + error / ctr;
-            plsum = plsum + pl / ctr;
 
-            /* It updates regular weights */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_memcpy(g, CDpos);               /* It copies the gradient to be used in the fast weights computation */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
-                                                            /********************************/
+            /* Updating W parameter */
+            UpdateParameterMatrix(m, m->W, posW, negW, 1.0 / ctr, m->eta, m->lambda, delta_W); /* W = W + alpha*delta_W + eta*(posW-negW) - lambda*W */
 
-            /* It updates fast weights */
-            gsl_matrix_scale(g, fast_eta);   /* It computes g*fast_learning_rate */
-            gsl_matrix_scale(fast_W, ratio); /* It computes fast_W*19/20 */
-            gsl_matrix_add(fast_W, g);       /* It computes fast_W = fast_W*19/20 + gradient*fast_learning_rate */
-        }
+            /* Updating U parameter */
+            UpdateParameterMatrix(m, m->U, posU, negU, 1.0 / ctr, m->eta, m->lambda, delta_U); /* U = U + alpha*delta_U + eta*(posU-negU) - lambda*U */
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
-        fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
-        fprintf(stdout, "%d %lf %lf\n", e, error, pl);
+            /* Updating a parameter */
+            UpdateParameterVector(m, m->a, acc_v0, acc_v1, 1.0 / ctr, m->eta, delta_a); /* a = a + alpha*delta_a + eta*(acc_v0-acc_v1) */
 
-        m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
+            /* Updating b parameter */
+            UpdateParameterVector(m, m->b, acc_h0, acc_h1, 1.0 / ctr, m->eta, delta_b); /* b = b + alpha*delta_b + eta*(acc_h0-acc_h1) */
+
+            /* Updating c parameter */
+            UpdateParameterVector(m, m->c, acc_y0, acc_y1, 1.0 / ctr, m->eta, delta_c); /* c = c + alpha*delta_c + eta*(acc_y0-acc_y1) */
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
+        }
+
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        fprintf(stderr, "MSE classification error: %lf OK", errorsum / trained);
+        train_error = errorsum / trained;
 
-        if (error < 0.0001)
+        if (HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
+    gsl_matrix_free(_posW);
+    gsl_matrix_free(posW);
+    gsl_matrix_free(_negW);
+    gsl_matrix_free(negW);
+    gsl_matrix_free(_posU);
+    gsl_matrix_free(_negU);
+    gsl_matrix_free(posU);
+    gsl_matrix_free(negU);
+    DestroyParameterState(&delta_W);
+    DestroyParameterState(&delta_U);
+    gsl_vector_free(acc_v0);
+    gsl_vector_free(acc_v1);
+    gsl_vector_free(acc_h0);
+    gsl_vector_free(acc_h1);
+    gsl_vector_free(acc_y0);
+    gsl_vector_free(acc_y1);
+    DestroyParameterState(&delta_a);
+    DestroyParameterState(&delta_b);
+    DestroyParameterState(&delta_c);
 
-    gsl_vector_free(v1);
-    gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
-    gsl_vector_free(ctr_probh1);
-    gsl_vector_free(ctr_probhn);
-    gsl_vector_free(aux);
-
-    gsl_matrix_free(CDpos);
-    gsl_matrix_free(CDneg);
-    gsl_matrix_free(tmpCDneg);
-    gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
-    gsl_matrix_free(last_probhn);
-    gsl_matrix_free(fast_W);
-    gsl_matrix_free(g);
-
-    return error;
+    return train_error;
 }
 
-/* It trains a Bernoulli RBM with Dropconnect by Fast Persistent Constrative Divergence
+/* It trains a Discriminative Bernoulli RBM with Dropout by Constrative Divergence for pattern classification
 Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, p]
 D: dataset
 m: RBM
 n_epochs: number of training epochs
 n_CD_iterations: number of CD iterations
 batch_size: size of batch data
-p: dropconnect rate */
-double BernoulliRBMTrainingbyFastPersistentContrastiveDivergencewithDropconnect(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size, double p)
+p: hidden neurons dropout rate */
+double DiscriminativeBernoulliRBMTrainingbyContrastiveDivergencewithDropout(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size, double p)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
-    double error, sample, errorsum, pl, plsum, fast_eta, ratio;
-    const gsl_rng_type *T = NULL;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL, *last_probhn = NULL, *fast_W = NULL;
-    gsl_matrix *g = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL, *aux = NULL;
-    gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
-    gsl_vector *tmp_probvn = NULL;
-    gsl_rng *r = NULL;
-
-    srand(time(NULL));
-    T = gsl_rng_default;
-    r = gsl_rng_alloc(T);
-    gsl_rng_set(r, random_seed_deep());
-
-    v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    vn = gsl_vector_calloc(m->n_visible_layer_neurons);
-
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
-
-    ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
-
-    CDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    CDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
-
-    last_probhn = gsl_matrix_calloc(batch_size, m->n_hidden_layer_neurons);
-    aux = gsl_vector_calloc(m->n_hidden_layer_neurons);
-
-    /* Fast weights purposes */
-    fast_W = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    g = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    fast_eta = m->eta;
-    ratio = 19.0 / 20.0;
-
-    error = 0;
-
-    /* For each epoch */
-    for (e = 1; e <= n_epochs; e++)
-    {
-        fprintf(stderr, "\nRunning epoch %d ... ", e);
-
-        errorsum = plsum = 0;
-        z = 0;
-
-        /* For each batch */
-        for (n = 1; n <= n_batches; n++)
-        {
-            ctr = 0;
-            error = pl = 0;
-            gsl_matrix_set_zero(CDpos);
-            gsl_matrix_set_zero(CDneg);
-            gsl_vector_set_zero(v1);
-            gsl_vector_set_zero(vn);
-            gsl_vector_set_zero(ctr_probh1);
-            gsl_vector_set_zero(ctr_probhn);
-
-            for (t = 0; t < batch_size; t++)
-            {
-                /* It computes M for dropconnecting weight matrix */
-                InitializeBias4DropconnectWeight(m, p);
-                if (z < D->size)
-                {
-                    ctr++;
-                    probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
-                    probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
-                    probvn = gsl_vector_calloc(m->n_visible_layer_neurons);
-
-                    /* It sets v1 */
-                    setVisibleLayer(m, D->sample[z].feature);
-
-                    /* It accumulates v1 */
-                    gsl_vector_add(v1, m->v);
-
-                    /* For each CD iteration */
-                    for (i = 1; i <= n_gibbs_sampling; i++)
-                    {
-                        /* It computes the P(h=1|v1), i.e., it computes h1 */
-                        tmp_probh1 = getProbabilityTurningOnHiddenUnit4Dropconnect(m, m->M, m->v);
-                        for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                        {
-                            sample = gsl_rng_uniform(r);
-                            if (gsl_vector_get(tmp_probh1, j) >= sample)
-                                gsl_vector_set(m->h, j, 1.0);
-                            else
-                                gsl_vector_set(m->h, j, 0.0);
-                        }
-                        if (i == 1)
-                        { /* In case of n_CD_iterations > 1 */
-                            gsl_vector_memcpy(probh1, tmp_probh1);
-                            gsl_vector_add(ctr_probh1, probh1);
-                        }
-                        gsl_vector_free(tmp_probh1);
-
-                        /* It computes the P(v2=1|h1), i.e., it computes v2 */
-                        if ((e == 1) && (n == 1))
-                            tmp_probvn = getProbabilityTurningOnVisibleUnit4FPCD4Dropconnect(m, m->M, m->h, fast_W);
-                        else
-                        {
-                            gsl_matrix_get_row(aux, last_probhn, t);
-                            tmp_probvn = getProbabilityTurningOnVisibleUnit4Dropconnect(m, m->M, aux);
-                        }
-                        for (j = 0; j < m->n_visible_layer_neurons; j++)
-                        {
-                            sample = gsl_rng_uniform(r);
-                            if (gsl_vector_get(tmp_probvn, j) >= sample)
-                                gsl_vector_set(m->v, j, 1.0);
-                            else
-                                gsl_vector_set(m->v, j, 0.0);
-                        }
-
-                        /* It computes the P(h2=1|v2), i.e., it computes h2 (hn) */
-                        tmp_probhn = getProbabilityTurningOnHiddenUnit4FPCD4Dropconnect(m, m->M, m->v, fast_W);
-                        for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                        {
-                            sample = gsl_rng_uniform(r);
-                            if (gsl_vector_get(tmp_probhn, j) >= sample)
-                                gsl_vector_set(m->h, j, 1.0);
-                            else
-                                gsl_vector_set(m->h, j, 0.0);
-                        }
-                        if (i == n_gibbs_sampling)
-                        { /* In case of n_CD_iterations > 1 */
-                            gsl_vector_memcpy(probhn, tmp_probhn);
-                            gsl_vector_add(ctr_probhn, probhn);
-                            gsl_vector_memcpy(probvn, tmp_probvn);
-                            gsl_matrix_set_row(last_probhn, t, probhn); /* It saves the last chain elements of the current training sample */
-                        }
-
-                        gsl_vector_free(tmp_probhn);
-                        gsl_vector_free(tmp_probvn);
-                    }
-
-                    /* It accumulates vn */
-                    gsl_vector_add(vn, m->v);
-
-                    for (i = 0; i < tmpCDpos->size1; i++)
-                    {
-                        for (j = 0; j < tmpCDpos->size2; j++)
-                        {
-                            gsl_matrix_set(tmpCDpos, i, j, gsl_vector_get(D->sample[z].feature, i) * gsl_vector_get(probh1, j));
-                            gsl_matrix_set(tmpCDneg, i, j, gsl_vector_get(m->v, i) * gsl_vector_get(probhn, j));
-                        }
-                    }
-
-                    gsl_matrix_add(CDpos, tmpCDpos);
-                    gsl_matrix_add(CDneg, tmpCDneg);
-
-                    error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
-
-                    gsl_vector_free(probh1);
-                    gsl_vector_free(probhn);
-                    gsl_vector_free(probvn);
-
-                    z++;
-                }
-            }
-
-            errorsum = errorsum + error / ctr;
-            plsum = plsum + pl / ctr;
-
-            /* It updates regular weights */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_memcpy(g, CDpos);               /* It copies the gradient to be used in the fast weights computation */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
-                                                            /********************************/
-
-            /* It updates fast weights */
-            gsl_matrix_scale(g, fast_eta);   /* It computes g*fast_learning_rate */
-            gsl_matrix_scale(fast_W, ratio); /* It computes fast_W*19/20 */
-            gsl_matrix_add(fast_W, g);       /* It computes fast_W = fast_W*19/20 + gradient*fast_learning_rate */
-        }
-
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
-        fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
-        fprintf(stdout, "%d %lf %lf\n", e, error, pl);
-
-        m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
-
-        if (error < 0.0001)
-            e = n_epochs + 1;
-    }
-
-    gsl_rng_free(r);
-
-    gsl_vector_free(v1);
-    gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
-    gsl_vector_free(ctr_probh1);
-    gsl_vector_free(ctr_probhn);
-    gsl_vector_free(aux);
-
-    gsl_matrix_free(CDpos);
-    gsl_matrix_free(CDneg);
-    gsl_matrix_free(tmpCDneg);
-    gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
-    gsl_matrix_free(last_probhn);
-    gsl_matrix_free(fast_W);
-    gsl_matrix_free(g);
-
-    return error;
-}
-
-/* It trains a Discriminative Bernoulli RBM by Constrative Divergence for pattern classification
-Parameters: [D, m, n_epochs, n_CD_iterations, batch_size]
-D: dataset
-m: RBM
-n_epochs: number of training epochs
-n_CD_iterations: number of CD iterations
-batch_size: size of batch data */
-double DiscriminativeBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size)
-{
-    int e, z, j, i, n, n_batches = ceil((float)D->size / batch_size), t, ctr;
+    int e, z, j, i, n, n_batches = ceil((float)D->size / batch_size), t, ctr, trained;
     gsl_vector *y0 = NULL, *y1 = NULL, *py1 = NULL, *ph0 = NULL, *ph1 = NULL, *pv1 = NULL, *acc_v0 = NULL, *acc_v1 = NULL;
-    gsl_vector *acc_h0 = NULL, *acc_h1 = NULL, *acc_y0 = NULL, *acc_y1 = NULL, *delta_a = NULL, *delta_b = NULL, *delta_c = NULL;
+    gsl_vector *acc_h0 = NULL, *acc_h1 = NULL, *acc_y0 = NULL, *acc_y1 = NULL;
+    ParameterState *delta_a = NULL, *delta_b = NULL, *delta_c = NULL, *delta_W = NULL, *delta_U = NULL;
     gsl_matrix *_posW = NULL, *_negW = NULL, *posW = NULL, *negW = NULL, *_posU = NULL, *_negU = NULL, *posU = NULL, *negU = NULL;
-    gsl_matrix *tmpW = NULL, *tmpU = NULL, *delta_W = NULL, *delta_U = NULL;
     double sample, error, errorsum, train_error;
     const gsl_rng_type *T = NULL;
     gsl_rng *r = NULL;
@@ -2783,11 +2721,8 @@ double DiscriminativeBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM
     _negU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
     negU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-
-    delta_W = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    delta_U = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
+    delta_W = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    delta_U = CreateParameterState(m, m->n_labels, m->n_hidden_layer_neurons);
 
     acc_v0 = gsl_vector_calloc(m->n_visible_layer_neurons);
     acc_v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
@@ -2797,9 +2732,9 @@ double DiscriminativeBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM
     acc_y0 = gsl_vector_calloc(m->n_labels);
     acc_y1 = gsl_vector_calloc(m->n_labels);
 
-    delta_a = gsl_vector_calloc(m->n_visible_layer_neurons);
-    delta_b = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    delta_c = gsl_vector_calloc(m->n_labels);
+    delta_a = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    delta_b = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
+    delta_c = CreateParameterState(m, m->n_labels, 1);
 
     train_error = 0;
 
@@ -2828,6 +2763,8 @@ double DiscriminativeBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM
 
             for (t = 0; t < batch_size; t++)
             {
+                /* It computes r for dropping out hidden units */
+                InitializeBias4DropoutHiddenUnits(m, p);
 
                 if (z < D->size)
                 {
@@ -2838,7 +2775,7 @@ double DiscriminativeBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM
                     gsl_vector_add(acc_y0, y0);
 
                     /* It computes the P(h0|v0,y0) */
-                    ph0 = getDiscriminativeProbabilityTurningOnHiddenUnit(m, y0);
+                    ph0 = getDiscriminativeProbabilityTurningOnHiddenUnit4Dropout(m, m->r, y0);
                     for (j = 0; j < m->n_hidden_layer_neurons; j++)
                     {
                         sample = gsl_rng_uniform(r);
@@ -2850,7 +2787,7 @@ double DiscriminativeBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM
                     gsl_vector_add(acc_h0, ph0);
 
                     /* It computes the P(v1|h0) */
-                    pv1 = getProbabilityTurningOnVisibleUnit(m, m->h);
+                    pv1 = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit(m, m->r, m->h);
                     for (j = 0; j < m->n_visible_layer_neurons; j++)
                     {
                         sample = gsl_rng_uniform(r);
@@ -2868,7 +2805,7 @@ double DiscriminativeBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM
                     gsl_vector_add(acc_y1, y1);
 
                     /* It computes the P(h1|y1,v1) */
-                    ph1 = getDiscriminativeProbabilityTurningOnHiddenUnit(m, y1);
+                    ph1 = getDiscriminativeProbabilityTurningOnHiddenUnit4Dropout(m, m->r, y1);
                     for (j = 0; j < m->n_hidden_layer_neurons; j++)
                     {
                         sample = gsl_rng_uniform(r);
@@ -2919,59 +2856,35 @@ double DiscriminativeBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM
             errorsum = errorsum + error / ctr;
 
             /* Updating W parameter */
-            gsl_matrix_sub(posW, negW); /* posW = posW-negW */
-            gsl_matrix_scale(posW, 1.0 / ctr);
-            gsl_matrix_scale(posW, m->eta); /* posW = eta*posW */
-            gsl_matrix_memcpy(tmpW, m->W);
-            gsl_matrix_scale(tmpW, -m->lambda);  /* tmp = -lambda*W */
-            gsl_matrix_add(posW, tmpW);          /* posW = eta*(posW-negW) - lambda*W */
-            gsl_matrix_scale(delta_W, m->alpha); /* delta_W = alpha*delta_W */
-            gsl_matrix_add(delta_W, posW);       /* delta_W = eta*(posW-negW) - lambda*W * alpha*delta_W */
-            gsl_matrix_add(m->W, delta_W);       /* W = W + delta_W */
+            UpdateParameterMatrix(m, m->W, posW, negW, 1.0 / ctr, m->eta, m->lambda, delta_W); /* W = W + alpha*delta_W + eta*(posW-negW) - lambda*W */
 
             /* Updating U parameter */
-            gsl_matrix_sub(posU, negU); /* posU = posU-negU */
-            gsl_matrix_scale(posU, 1.0 / ctr);
-            gsl_matrix_scale(posU, m->eta); /* posU = eta*posU */
-            gsl_matrix_memcpy(tmpU, m->U);
-            gsl_matrix_scale(tmpU, -m->lambda);  /* tmp = -lambda*U */
-            gsl_matrix_add(posU, tmpU);          /* posU = eta*(posU-negU) -lambda*U */
-            gsl_matrix_scale(delta_U, m->alpha); /* delta_U = alpha*delta_U */
-            gsl_matrix_add(delta_U, posU);       /* delta_U = eta*(posU-negU) -lambda*U + alpha*delta_U */
-            gsl_matrix_add(m->U, delta_U);       /* U = U + delta_U */
+            UpdateParameterMatrix(m, m->U, posU, negU, 1.0 / ctr, m->eta, m->lambda, delta_U); /* U = U + alpha*delta_U + eta*(posU-negU) - lambda*U */
 
             /* Updating a parameter */
-            gsl_vector_sub(acc_v0, acc_v1); /* v0 = v0 - v1 */
-            gsl_vector_scale(acc_v0, 1.0 / ctr);
-            gsl_vector_scale(acc_v0, m->eta);    /* v0 = eta*v0 */
-            gsl_vector_scale(delta_a, m->alpha); /* delta_a = alpha*delta_a */
-            gsl_vector_add(delta_a, acc_v0);     /* delta_a = eta*(v0-v1) + alpha*delta_a */
-            gsl_vector_add(m->a, delta_a);       /* a = a + delta_a */
+            UpdateParameterVector(m, m->a, acc_v0, acc_v1, 1.0 / ctr, m->eta, delta_a); /* a = a + alpha*delta_a + eta*(acc_v0-acc_v1) */
 
             /* Updating b parameter */
-            gsl_vector_sub(acc_h0, acc_h1); /* h0 = h0 - h1 */
-            gsl_vector_scale(acc_h0, 1.0 / ctr);
-            gsl_vector_scale(acc_h0, m->eta);    /* h0 = eta*h0 */
-            gsl_vector_scale(delta_b, m->alpha); /* delta_b = alpha*delta_b */
-            gsl_vector_add(delta_b, acc_h0);     /* delta_b = eta*(h0 - h1) + alpha*delta_b */
-            gsl_vector_add(m->b, delta_b);       /* b = b + delta_b */
+            UpdateParameterVector(m, m->b, acc_h0, acc_h1, 1.0 / ctr, m->eta, delta_b); /* b = b + alpha*delta_b + eta*(acc_h0-acc_h1) */
 
             /* Updating c parameter */
-            gsl_vector_sub(acc_y0, acc_y1); /* y0 = y0 - y1 */
-            gsl_vector_scale(acc_y0, 1.0 / ctr);
-            gsl_vector_scale(acc_y0, m->eta);    /* y0 = eta*y0 */
-            gsl_vector_scale(delta_c, m->alpha); /* delta_c = alpha*delta_c */
-            gsl_vector_add(delta_c, acc_y0);     /* delta_c = eta*(y0 - y1) + alpha*delta_c */
-            gsl_vector_add(m->c, delta_c);       /* c = c + delta_c */
+            UpdateParameterVector(m, m->c, acc_y0, acc_y1, 1.0 / ctr, m->eta, delta_c); /* c = c + alpha*delta_c + eta*(acc_y0-acc_y1) */
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        fprintf(stderr, "MSE classification error: %lf OK", errorsum / n_batches);
-        train_error = errorsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        fprintf(stderr, "MSE classification error: %lf OK", errorsum / trained);
+        train_error = errorsum / trained;
+
+        if (HasStoppedEarly(m))
+            e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(tmpU);
     gsl_matrix_free(_posW);
     gsl_matrix_free(posW);
     gsl_matrix_free(_negW);
@@ -2980,267 +2893,432 @@ double DiscriminativeBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM
     gsl_matrix_free(_negU);
     gsl_matrix_free(posU);
     gsl_matrix_free(negU);
-    gsl_matrix_free(delta_W);
-    gsl_matrix_free(delta_U);
+    DestroyParameterState(&delta_W);
+    DestroyParameterState(&delta_U);
     gsl_vector_free(acc_v0);
     gsl_vector_free(acc_v1);
     gsl_vector_free(acc_h0);
     gsl_vector_free(acc_h1);
     gsl_vector_free(acc_y0);
     gsl_vector_free(acc_y1);
-    gsl_vector_free(delta_a);
-    gsl_vector_free(delta_b);
-    gsl_vector_free(delta_c);
+    DestroyParameterState(&delta_a);
+    DestroyParameterState(&delta_b);
+    DestroyParameterState(&delta_c);
 
     return train_error;
 }
 
-/* It trains a Discriminative Bernoulli RBM with Dropout by Constrative Divergence for pattern classification
-Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, p]
-D: dataset
-m: RBM
-n_epochs: number of training epochs
-n_CD_iterations: number of CD iterations
-batch_size: size of batch data
-p: hidden neurons dropout rate */
-double DiscriminativeBernoulliRBMTrainingbyContrastiveDivergencewithDropout(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size, double p)
+/* It computes log P(y|x) of every label for one sample from the pre-activations W*x + b of its hidden units and, if g is not NULL, the gradient of
+log P(label|x) with respect to them, i.e., g_j = sigmoid(o_{label,j}) - sum_y P(y|x)*sigmoid(o_{yj}), where o_{yj} = (W*x)_j + b_j + U_{yj}
+Parameters: [m, a, label, log_p, s, g]
+m: DRBM
+a: pre-activations W*x + b of the hidden units
+label: index of the sample's label (only used when g is not NULL)
+log_p: log-probability of each label
+s: scratch array with room for n_labels*n_hidden_layer_neurons values, which receives sigmoid(o_{yj}) at [y*n_hidden_layer_neurons + j], or NULL
+g: gradient with respect to the pre-activations, which requires s, or NULL */
+static void getDiscriminativeRowLogProbability(RBM *m, double *a, int label, double *log_p, double *s, double *g)
 {
-    int e, z, j, i, n, n_batches = ceil((float)D->size / batch_size), t, ctr;
-    gsl_vector *y0 = NULL, *y1 = NULL, *py1 = NULL, *ph0 = NULL, *ph1 = NULL, *pv1 = NULL, *acc_v0 = NULL, *acc_v1 = NULL;
-    gsl_vector *acc_h0 = NULL, *acc_h1 = NULL, *acc_y0 = NULL, *acc_y1 = NULL, *delta_a = NULL, *delta_b = NULL, *delta_c = NULL;
-    gsl_matrix *_posW = NULL, *_negW = NULL, *posW = NULL, *negW = NULL, *_posU = NULL, *_negU = NULL, *posU = NULL, *negU = NULL;
-    gsl_matrix *tmpW = NULL, *tmpU = NULL, *delta_W = NULL, *delta_U = NULL;
-    double sample, error, errorsum, train_error;
-    const gsl_rng_type *T = NULL;
-    gsl_rng *r = NULL;
+    double *u, *c = gsl_vector_ptr(m->c, 0), x, t, sum, max;
+    int j, y, n_hidden = m->n_hidden_layer_neurons;
 
-    srand(time(NULL));
-    T = gsl_rng_default;
-    r = gsl_rng_alloc(T);
-    gsl_rng_set(r, random_seed_deep());
+    for (y = 0; y < m->n_labels; y++)
+    {
+        u = gsl_matrix_ptr(m->U, y, 0);
+        sum = c[y];
+        for (j = 0; j < n_hidden; j++)
+        {
+            x = a[j] + u[j];
+            /* softplus(x) and sigmoid(x) share a single exp, taken on -|x| so it never overflows */
+            if (x > 0)
+            {
+                t = exp(-x);
+                sum += x + log1p(t);
+                if (s)
+                    s[y * n_hidden + j] = 1.0 / (1.0 + t);
+            }
+            else
+            {
+                t = exp(x);
+                sum += log1p(t);
+                if (s)
+                    s[y * n_hidden + j] = t / (1.0 + t);
+            }
+        }
+        log_p[y] = sum;
+    }
 
-    _posW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    posW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    _negW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    negW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    /* It normalizes the scores by log-sum-exp */
+    max = log_p[0];
+    for (y = 1; y < m->n_labels; y++)
+        if (log_p[y] > max)
+            max = log_p[y];
+    sum = 0.0;
+    for (y = 0; y < m->n_labels; y++)
+        sum += exp(log_p[y] - max);
+    sum = max + log(sum);
+    for (y = 0; y < m->n_labels; y++)
+        log_p[y] -= sum;
+
+    if (g)
+    {
+        for (j = 0; j < n_hidden; j++)
+            g[j] = s[label * n_hidden + j];
+        for (y = 0; y < m->n_labels; y++)
+        {
+            t = exp(log_p[y]);
+            for (j = 0; j < n_hidden; j++)
+                g[j] -= t * s[y * n_hidden + j];
+        }
+    }
+}
 
-    _posU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-    posU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-    _negU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-    negU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
+/* It accumulates the gradient of sum_i log P(y_i|x_i) with respect to one row of U and one entry of c over a batch, i.e.,
+(1[y_i = y] - P(y|x_i))*sigmoid(o_{yj}), where o_{yj} = (W*x_i)_j + b_j + U_{yj}
+Parameters: [m, A, log_P, labels, y, gradU, gradc]
+m: DRBM
+A: pre-activations W*x + b of the hidden units (one sample per row)
+log_P: log-probability of every label given each sample
+labels: index of the label of each sample
+y: label whose row of U is accumulated
+gradU: gradient of that row of U
+gradc: gradient of c_y */
+static void AccumulateDiscriminativeLabelGradient(RBM *m, gsl_matrix *A, gsl_matrix *log_P, int *labels, int y, double *gradU, double *gradc)
+{
+    double *a, *u = gsl_matrix_ptr(m->U, y, 0), coeff;
+    int i, j;
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
+    for (i = 0; i < A->size1; i++)
+    {
+        coeff = (labels[i] == y) - exp(gsl_matrix_get(log_P, i, y));
+        a = gsl_matrix_ptr(A, i, 0);
+        for (j = 0; j < A->size2; j++)
+            gradU[j] += coeff * SigmoidLogistic(a[j] + u[j]);
+        *gradc += coeff;
+    }
+}
 
-    delta_W = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    delta_U = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
+/* It samples binary units from their probabilities, in place
+Parameters: [P, r]
+P: probabilities (one sample per row), which are replaced by the samples
+r: random number generator */
+static void SampleDiscriminativeBatchUnits(gsl_matrix *P, gsl_rng *r)
+{
+    double *p;
+    int i, j;
 
-    acc_v0 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    acc_v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
+    for (i = 0; i < P->size1; i++)
+    {
+        p = gsl_matrix_ptr(P, i, 0);
+        for (j = 0; j < P->size2; j++)
+            p[j] = p[j] > gsl_rng_uniform(r) ? 1.0 : 0.0;
+    }
+}
 
-    acc_h0 = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    acc_h1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    acc_y0 = gsl_vector_calloc(m->n_labels);
-    acc_y1 = gsl_vector_calloc(m->n_labels);
+/* It computes P(h|x,y) for a batch from the pre-activations W*x + b, i.e., sigmoid((W*x)_j + b_j + U_{yj})
+Parameters: [m, PH, labels]
+m: DRBM
+PH: W*x + b (one sample per row), which is replaced by the probabilities
+labels: index of the label of each sample */
+static void getDiscriminativeBatchHiddenProbability(RBM *m, gsl_matrix *PH, int *labels)
+{
+    double *p, *u;
+    int i, j;
+
+    for (i = 0; i < PH->size1; i++)
+    {
+        p = gsl_matrix_ptr(PH, i, 0);
+        u = gsl_matrix_ptr(m->U, labels[i], 0);
+        for (j = 0; j < PH->size2; j++)
+            p[j] = SigmoidLogistic(p[j] + u[j]);
+    }
+}
 
-    delta_a = gsl_vector_calloc(m->n_visible_layer_neurons);
-    delta_b = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    delta_c = gsl_vector_calloc(m->n_labels);
+/* It adds the statistics of one phase of Contrastive Divergence over P(x,y) to the gradients of a batch
+Parameters: [X, PH, labels, weight, ones, gradW, grada, gradb, gradU, gradc]
+X: visible units (one sample per row)
+PH: P(h|x,y) of every sample
+labels: index of the label of each sample
+weight: weight of the statistics (negative for the negative phase)
+ones: vector of ones with one entry per sample
+gradW, grada, gradb, gradU, gradc: gradients of the batch */
+static void AddDiscriminativeGenerativeStatistics(gsl_matrix *X, gsl_matrix *PH, int *labels, double weight, gsl_vector *ones, gsl_matrix *gradW, gsl_vector *grada,
+                                                  gsl_vector *gradb, gsl_matrix *gradU, gsl_vector *gradc)
+{
+    double *p, *u;
+    int i, j;
 
-    train_error = 0;
+    gsl_blas_dgemm(CblasTrans, CblasNoTrans, weight, X, PH, 1.0, gradW);
+    gsl_blas_dgemv(CblasTrans, weight, X, ones, 1.0, grada);
+    gsl_blas_dgemv(CblasTrans, weight, PH, ones, 1.0, gradb);
+    for (i = 0; i < PH->size1; i++)
+    {
+        p = gsl_matrix_ptr(PH, i, 0);
+        u = gsl_matrix_ptr(gradU, labels[i], 0);
+        for (j = 0; j < PH->size2; j++)
+            u[j] += weight * p[j];
+        *gsl_vector_ptr(gradc, labels[i]) += weight;
+    }
+}
+
+/* It trains a Discriminative Bernoulli RBM by the exact gradient of the conditional log-likelihood log P(y|x), which has a closed form, so no sampling
+is needed, as described in paper "Classification using Discriminative Restricted Boltzmann Machines". W*x + b is computed once per sample by a GEMM
+over the mini-batch, the samples and the rows of U are processed concurrently, and the gradient of W is a single GEMM. With a positive generative_weight,
+the gradient of the joint log-likelihood log P(x,y), estimated by one step of Contrastive Divergence, is added with that weight (hybrid training)
+Parameters: [D, m, n_epochs, batch_size, generative_weight]
+D: dataset
+m: DRBM
+n_epochs: number of training epochs
+batch_size: size of batch data
+generative_weight: weight of the generative gradient (0 for purely discriminative training)
+It returns the negative conditional log-likelihood of the training set at the last epoch */
+static double DiscriminativeGradientTraining(Dataset *D, RBM *m, int n_epochs, int batch_size, double generative_weight)
+{
+    int e, z, i, j, y, n, *y0 = NULL, *y1 = NULL, n_errors, trained;
+    double nll, error, *lp, *py, sample, max, sum;
+    gsl_matrix *X = NULL, *A = NULL, *G = NULL, *LP = NULL, *PH = NULL, *V = NULL, *PY = NULL;
+    gsl_matrix *gradW = NULL, *gradU = NULL;
+    ParameterState *delta_W = NULL, *delta_U = NULL, *delta_a = NULL, *delta_b = NULL, *delta_c = NULL;
+    gsl_matrix_view x, a, g, lp_view, ph, v, py_view;
+    gsl_vector_view ones_view;
+    gsl_vector *grada = NULL, *gradb = NULL, *gradc = NULL, *ones = NULL;
+    const gsl_rng_type *T = NULL;
+    gsl_rng *r = NULL;
+
+    if (D->nlabels > m->n_labels)
+    {
+        fprintf(stderr, "\nDataset has more labels than the DRBM @DiscriminativeGradientTraining.\n");
+        return 0.0;
+    }
+
+    if (generative_weight > 0)
+    {
+        srand(time(NULL));
+        T = gsl_rng_default;
+        r = gsl_rng_alloc(T);
+        gsl_rng_set(r, random_seed_deep());
+
+        PH = gsl_matrix_alloc(batch_size, m->n_hidden_layer_neurons);
+        V = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+        PY = gsl_matrix_alloc(batch_size, m->n_labels);
+    }
+
+    X = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    A = gsl_matrix_alloc(batch_size, m->n_hidden_layer_neurons);
+    G = gsl_matrix_alloc(batch_size, m->n_hidden_layer_neurons);
+    LP = gsl_matrix_alloc(batch_size, m->n_labels);
+    y0 = (int *)malloc(batch_size * sizeof(int));
+    y1 = (int *)malloc(batch_size * sizeof(int));
+    if (!y0 || !y1)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @DiscriminativeGradientTraining.\n");
+        exit(-1);
+    }
+    gradW = gsl_matrix_alloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    gradU = gsl_matrix_alloc(m->n_labels, m->n_hidden_layer_neurons);
+    delta_W = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    delta_U = CreateParameterState(m, m->n_labels, m->n_hidden_layer_neurons);
+    grada = gsl_vector_alloc(m->n_visible_layer_neurons);
+    gradb = gsl_vector_alloc(m->n_hidden_layer_neurons);
+    gradc = gsl_vector_alloc(m->n_labels);
+    delta_a = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    delta_b = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
+    delta_c = CreateParameterState(m, m->n_labels, 1);
+    ones = gsl_vector_alloc(batch_size);
+    gsl_vector_set_all(ones, 1.0);
+
+    nll = 0;
 
     for (e = 1; e <= n_epochs; e++)
     {
         fprintf(stderr, "\nRunning epoch %d ... ", e);
-
-        errorsum = 0;
-        z = 0;
+        nll = 0.0;
+        n_errors = 0;
 
         /* For each batch */
-        for (n = 1; n <= n_batches; n++)
+        for (z = 0; z < D->size; z += batch_size)
         {
-            ctr = 0;
-            error = 0.0;
-            gsl_matrix_set_zero(posW);
-            gsl_matrix_set_zero(negW);
-            gsl_matrix_set_zero(posU);
-            gsl_matrix_set_zero(negU);
-            gsl_vector_set_zero(acc_v0);
-            gsl_vector_set_zero(acc_v1);
-            gsl_vector_set_zero(acc_h0);
-            gsl_vector_set_zero(acc_h1);
-            gsl_vector_set_zero(acc_y0);
-            gsl_vector_set_zero(acc_y1);
+            n = D->size - z < batch_size ? D->size - z : batch_size;
+            x = gsl_matrix_submatrix(X, 0, 0, n, X->size2);
+            a = gsl_matrix_submatrix(A, 0, 0, n, A->size2);
+            g = gsl_matrix_submatrix(G, 0, 0, n, G->size2);
+            lp_view = gsl_matrix_submatrix(LP, 0, 0, n, LP->size2);
+            ones_view = gsl_vector_subvector(ones, 0, n);
+            for (i = 0; i < n; i++)
+            {
+                gsl_matrix_set_row(&x.matrix, i, D->sample[z + i].feature);
+                y0[i] = D->sample[z + i].label - 1;
+            }
 
-            for (t = 0; t < batch_size; t++)
+            /* It computes W*x + b, which is shared by all labels */
+            gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, &x.matrix, m->W, 0.0, &a.matrix);
+            for (i = 0; i < n; i++)
             {
-                /* It computes r for dropping out hidden units */
-                InitializeBias4DropoutHiddenUnits(m, p);
+                gsl_vector_view row = gsl_matrix_row(&a.matrix, i);
+                gsl_vector_add(&row.vector, m->b);
+            }
 
-                if (z < D->size)
-                {
-                    ctr++;
-                    setVisibleLayer(m, D->sample[z].feature);
-                    gsl_vector_add(acc_v0, m->v);
-                    y0 = label2binary_gsl_vector(D->sample[z].label, D->nlabels);
-                    gsl_vector_add(acc_y0, y0);
+            /* It computes log P(y|x) and the gradient with respect to the pre-activations of every sample */
+#pragma omp parallel
+            {
+                double *s = (double *)malloc(m->n_labels * m->n_hidden_layer_neurons * sizeof(double));
+                int k;
+
+#pragma omp for schedule(static)
+                for (k = 0; k < n; k++)
+                    getDiscriminativeRowLogProbability(m, gsl_matrix_ptr(&a.matrix, k, 0), y0[k], gsl_matrix_ptr(&lp_view.matrix, k, 0), s,
+                                                       gsl_matrix_ptr(&g.matrix, k, 0));
+                free(s);
+            }
 
-                    /* It computes the P(h0|v0,y0) */
-                    ph0 = getDiscriminativeProbabilityTurningOnHiddenUnit4Dropout(m, m->r, y0);
-                    for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                    {
-                        sample = gsl_rng_uniform(r);
-                        if (gsl_vector_get(ph0, j) > sample)
-                            gsl_vector_set(m->h, j, 1.0);
-                        else
-                            gsl_vector_set(m->h, j, 0.0);
-                    }
-                    gsl_vector_add(acc_h0, ph0);
+            for (i = 0; i < n; i++)
+            {
+                lp = gsl_matrix_ptr(&lp_view.matrix, i, 0);
+                nll -= lp[y0[i]];
+                y = 0;
+                for (j = 1; j < D->nlabels; j++)
+                    if (lp[j] > lp[y])
+                        y = j;
+                n_errors += y != y0[i];
+            }
 
-                    /* It computes the P(v1|h0) */
-                    pv1 = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit(m, m->r, m->h);
+            /* Discriminative gradient: W and b through the pre-activations, and U and c label by label */
+            gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, &x.matrix, &g.matrix, 0.0, gradW);
+            gsl_blas_dgemv(CblasTrans, 1.0, &g.matrix, &ones_view.vector, 0.0, gradb);
+            gsl_vector_set_zero(grada);
+            gsl_matrix_set_zero(gradU);
+            gsl_vector_set_zero(gradc);
+#pragma omp parallel for schedule(dynamic)
+            for (y = 0; y < m->n_labels; y++)
+                AccumulateDiscriminativeLabelGradient(m, &a.matrix, &lp_view.matrix, y0, y, gsl_matrix_ptr(gradU, y, 0), gsl_vector_ptr(gradc, y));
+
+            /* Generative gradient, estimated by one step of Contrastive Divergence over P(x,y) */
+            if (generative_weight > 0)
+            {
+                ph = gsl_matrix_submatrix(PH, 0, 0, n, PH->size2);
+                v = gsl_matrix_submatrix(V, 0, 0, n, V->size2);
+                py_view = gsl_matrix_submatrix(PY, 0, 0, n, PY->size2);
+
+                /* It computes the P(h0|x0,y0) */
+                gsl_matrix_memcpy(&ph.matrix, &a.matrix);
+                getDiscriminativeBatchHiddenProbability(m, &ph.matrix, y0);
+                AddDiscriminativeGenerativeStatistics(&x.matrix, &ph.matrix, y0, generative_weight, &ones_view.vector, gradW, grada, gradb, gradU, gradc);
+                SampleDiscriminativeBatchUnits(&ph.matrix, r);
+
+                /* It samples x1 ~ P(x|h0) */
+                gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, &ph.matrix, m->W, 0.0, &v.matrix);
+                for (i = 0; i < n; i++)
                     for (j = 0; j < m->n_visible_layer_neurons; j++)
-                    {
-                        sample = gsl_rng_uniform(r);
-                        if (gsl_vector_get(pv1, j) > sample)
-                            gsl_vector_set(m->v, j, 1.0);
-                        else
-                            gsl_vector_set(m->v, j, 0.0);
-                    }
-                    gsl_vector_add(acc_v1, m->v);
-
-                    /* It computes the P(y1|h0) */
-                    py1 = getDiscriminativeProbabilityLabelUnit(m);
-                    y1 = gsl_vector_calloc(py1->size);
-                    gsl_vector_set(y1, gsl_vector_max_index(py1), 1.0); /* It samples the class with highest probability */
-                    gsl_vector_add(acc_y1, y1);
-
-                    /* It computes the P(h1|y1,v1) */
-                    ph1 = getDiscriminativeProbabilityTurningOnHiddenUnit4Dropout(m, m->r, y1);
-                    for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                    {
-                        sample = gsl_rng_uniform(r);
-                        if (gsl_vector_get(ph1, j) > sample)
-                            gsl_vector_set(m->h, j, 1.0);
-                        else
-                            gsl_vector_set(m->h, j, 0.0);
-                    }
-                    gsl_vector_add(acc_h1, ph1);
+                        gsl_matrix_set(&v.matrix, i, j, SigmoidLogistic(gsl_matrix_get(&v.matrix, i, j) + gsl_vector_get(m->a, j)));
+                SampleDiscriminativeBatchUnits(&v.matrix, r);
 
-                    for (i = 0; i < _posW->size1; i++)
+                /* It samples y1 ~ P(y|h0) = softmax(U*h0 + c) */
+                gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, &ph.matrix, m->U, 0.0, &py_view.matrix);
+                for (i = 0; i < n; i++)
+                {
+                    py = gsl_matrix_ptr(&py_view.matrix, i, 0);
+                    max = -INFINITY;
+                    for (y = 0; y < m->n_labels; y++)
                     {
-                        for (j = 0; j < _posW->size2; j++)
-                        {
-                            gsl_matrix_set(_posW, i, j, gsl_vector_get(ph0, j) * gsl_vector_get(D->sample[z].feature, i));
-                            gsl_matrix_set(_negW, i, j, gsl_vector_get(ph1, j) * gsl_vector_get(m->v, i));
-                        }
+                        py[y] += gsl_vector_get(m->c, y);
+                        if (py[y] > max)
+                            max = py[y];
                     }
-
-                    for (i = 0; i < _posU->size1; i++)
+                    sum = 0.0;
+                    for (y = 0; y < m->n_labels; y++)
                     {
-                        for (j = 0; j < _posU->size2; j++)
-                        {
-                            gsl_matrix_set(_posU, i, j, gsl_vector_get(ph0, j) * gsl_vector_get(y0, i));
-                            gsl_matrix_set(_negU, i, j, gsl_vector_get(ph1, j) * gsl_vector_get(y1, i));
-                        }
+                        py[y] = exp(py[y] - max);
+                        sum += py[y];
                     }
+                    sample = gsl_rng_uniform(r) * sum;
+                    for (y1[i] = 0; y1[i] < m->n_labels - 1 && sample >= py[y1[i]]; y1[i]++)
+                        sample -= py[y1[i]];
+                }
 
-                    gsl_matrix_add(posW, _posW);
-                    gsl_matrix_add(negW, _negW);
-
-                    gsl_matrix_add(posU, _posU);
-                    gsl_matrix_add(negU, _negU);
-
-                    error += getReconstructionError(y0, py1);
-
-                    gsl_vector_free(y0);
-                    gsl_vector_free(y1);
-                    gsl_vector_free(py1);
-                    gsl_vector_free(ph0);
-                    gsl_vector_free(ph1);
-                    gsl_vector_free(pv1);
-
-                    z++;
+                /* It computes the P(h1|x1,y1) */
+                gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, &v.matrix, m->W, 0.0, &ph.matrix);
+                for (i = 0; i < n; i++)
+                {
+                    gsl_vector_view row = gsl_matrix_row(&ph.matrix, i);
+                    gsl_vector_add(&row.vector, m->b);
                 }
+                getDiscriminativeBatchHiddenProbability(m, &ph.matrix, y1);
+                AddDiscriminativeGenerativeStatistics(&v.matrix, &ph.matrix, y1, -generative_weight, &ones_view.vector, gradW, grada, gradb, gradU, gradc);
             }
 
-            errorsum = errorsum + error / ctr;
-
-            /* Updating W parameter */
-            gsl_matrix_sub(posW, negW); /* posW = posW-negW */
-            gsl_matrix_scale(posW, 1.0 / ctr);
-            gsl_matrix_scale(posW, m->eta); /* posW = eta*posW */
-            gsl_matrix_memcpy(tmpW, m->W);
-            gsl_matrix_scale(tmpW, -m->lambda);  /* tmp = -lambda*W */
-            gsl_matrix_add(posW, tmpW);          /* posW = eta*(posW-negW) - lambda*W */
-            gsl_matrix_scale(delta_W, m->alpha); /* delta_W = alpha*delta_W */
-            gsl_matrix_add(delta_W, posW);       /* delta_W = eta*(posW-negW) - lambda*W * alpha*delta_W */
-            gsl_matrix_add(m->W, delta_W);       /* W = W + delta_W */
-
-            /* Updating U parameter */
-            gsl_matrix_sub(posU, negU); /* posU = posU-negU */
-            gsl_matrix_scale(posU, 1.0 / ctr);
-            gsl_matrix_scale(posU, m->eta); /* posU = eta*posU */
-            gsl_matrix_memcpy(tmpU, m->U);
-            gsl_matrix_scale(tmpU, -m->lambda);  /* tmp = -lambda*U */
-            gsl_matrix_add(posU, tmpU);          /* posU = eta*(posU-negU) -lambda*U */
-            gsl_matrix_scale(delta_U, m->alpha); /* delta_U = alpha*delta_U */
-            gsl_matrix_add(delta_U, posU);       /* delta_U = eta*(posU-negU) -lambda*U + alpha*delta_U */
-            gsl_matrix_add(m->U, delta_U);       /* U = U + delta_U */
+            /* Updating W, U, a, b and c parameters */
+            UpdateParameterMatrix(m, m->W, gradW, NULL, 1.0 / n, m->eta, m->lambda, delta_W); /* W = W + alpha*delta_W + eta*gradW - lambda*W */
+            UpdateParameterMatrix(m, m->U, gradU, NULL, 1.0 / n, m->eta, m->lambda, delta_U); /* U = U + alpha*delta_U + eta*gradU - lambda*U */
+            UpdateParameterVector(m, m->a, grada, NULL, 1.0 / n, m->eta, delta_a);
+            UpdateParameterVector(m, m->b, gradb, NULL, 1.0 / n, m->eta, delta_b);
+            UpdateParameterVector(m, m->c, gradc, NULL, 1.0 / n, m->eta, delta_c);
 
-            /* Updating a parameter */
-            gsl_vector_sub(acc_v0, acc_v1); /* v0 = v0 - v1 */
-            gsl_vector_scale(acc_v0, 1.0 / ctr);
-            gsl_vector_scale(acc_v0, m->eta);    /* v0 = eta*v0 */
-            gsl_vector_scale(delta_a, m->alpha); /* delta_a = alpha*delta_a */
-            gsl_vector_add(delta_a, acc_v0);     /* delta_a = eta*(v0-v1) + alpha*delta_a */
-            gsl_vector_add(m->a, delta_a);       /* a = a + delta_a */
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
+        }
 
-            /* Updating b parameter */
-            gsl_vector_sub(acc_h0, acc_h1); /* h0 = h0 - h1 */
-            gsl_vector_scale(acc_h0, 1.0 / ctr);
-            gsl_vector_scale(acc_h0, m->eta);    /* h0 = eta*h0 */
-            gsl_vector_scale(delta_b, m->alpha); /* delta_b = alpha*delta_b */
-            gsl_vector_add(delta_b, acc_h0);     /* delta_b = eta*(h0 - h1) + alpha*delta_b */
-            gsl_vector_add(m->b, delta_b);       /* b = b + delta_b */
+        trained = z < D->size ? z + n : D->size; /* samples trained, fewer than D->size if the epoch stopped early */
+        nll /= trained;
+        error = (double)n_errors / trained;
+        fprintf(stderr, "  -> Negative log-likelihood: %lf with classification error of %lf", nll, error);
+        fprintf(stdout, "%d %lf %lf\n", e, nll, error);
 
-            /* Updating c parameter */
-            gsl_vector_sub(acc_y0, acc_y1); /* y0 = y0 - y1 */
-            gsl_vector_scale(acc_y0, 1.0 / ctr);
-            gsl_vector_scale(acc_y0, m->eta);    /* y0 = eta*y0 */
-            gsl_vector_scale(delta_c, m->alpha); /* delta_c = alpha*delta_c */
-            gsl_vector_add(delta_c, acc_y0);     /* delta_c = eta*(y0 - y1) + alpha*delta_c */
-            gsl_vector_add(m->c, delta_c);       /* c = c + delta_c */
-        }
+        if (HasStoppedEarly(m))
+            e = n_epochs + 1;
+    }
+    RestoreEarlyStopping(m);
 
-        fprintf(stderr, "MSE classification error: %lf OK", errorsum / n_batches);
-        train_error = errorsum / n_batches;
+    if (generative_weight > 0)
+    {
+        gsl_rng_free(r);
+        gsl_matrix_free(PH);
+        gsl_matrix_free(V);
+        gsl_matrix_free(PY);
     }
+    gsl_matrix_free(X);
+    gsl_matrix_free(A);
+    gsl_matrix_free(G);
+    gsl_matrix_free(LP);
+    free(y0);
+    free(y1);
+    gsl_matrix_free(gradW);
+    gsl_matrix_free(gradU);
+    DestroyParameterState(&delta_W);
+    DestroyParameterState(&delta_U);
+    gsl_vector_free(grada);
+    gsl_vector_free(gradb);
+    gsl_vector_free(gradc);
+    DestroyParameterState(&delta_a);
+    DestroyParameterState(&delta_b);
+    DestroyParameterState(&delta_c);
+    gsl_vector_free(ones);
+
+    return nll;
+}
 
-    gsl_rng_free(r);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(tmpU);
-    gsl_matrix_free(_posW);
-    gsl_matrix_free(posW);
-    gsl_matrix_free(_negW);
-    gsl_matrix_free(negW);
-    gsl_matrix_free(_posU);
-    gsl_matrix_free(_negU);
-    gsl_matrix_free(posU);
-    gsl_matrix_free(negU);
-    gsl_matrix_free(delta_W);
-    gsl_matrix_free(delta_U);
-    gsl_vector_free(acc_v0);
-    gsl_vector_free(acc_v1);
-    gsl_vector_free(acc_h0);
-    gsl_vector_free(acc_h1);
-    gsl_vector_free(acc_y0);
-    gsl_vector_free(acc_y1);
-    gsl_vector_free(delta_a);
-    gsl_vector_free(delta_b);
-    gsl_vector_free(delta_c);
+/* It trains a Discriminative Bernoulli RBM by the exact gradient of log P(y|x) for pattern classification
+Parameters: [D, m, n_epochs, batch_size]
+D: dataset
+m: RBM
+n_epochs: number of training epochs
+batch_size: size of batch data */
+double DiscriminativeBernoulliRBMTrainingbyExactGradient(Dataset *D, RBM *m, int n_epochs, int batch_size)
+{
+    return DiscriminativeGradientTraining(D, m, n_epochs, batch_size, 0.0);
+}
 
-    return train_error;
+/* It trains a Discriminative Bernoulli RBM by the exact gradient of log P(y|x) plus the gradient of log P(x,y), estimated by Contrastive Divergence and
+weighted by generative_weight, for pattern classification (hybrid training)
+Parameters: [D, m, n_epochs, batch_size, generative_weight]
+D: dataset
+m: RBM
+n_epochs: number of training epochs
+batch_size: size of batch data
+generative_weight: weight of the generative gradient */
+double DiscriminativeBernoulliRBMTrainingbyHybridGradient(Dataset *D, RBM *m, int n_epochs, int batch_size, double generative_weight)
+{
+    return DiscriminativeGradientTraining(D, m, n_epochs, batch_size, generative_weight);
 }
 
 /* It trains a Bernoulli RBM by Constrative Divergence for image reconstruction regarding DBMs at the bottom layer
@@ -3252,11 +3330,12 @@ n_CD_iterations: number of CD iterations
 batch_size: size of batch data */
 double Bernoulli_TrainingRBMbyCD4DBM_BottomLayer(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
@@ -3269,10 +3348,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayer(Dataset *D, RBM *m, int n_epoch
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -3282,10 +3359,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayer(Dataset *D, RBM *m, int n_epoch
     tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     error = 0;
 
@@ -3392,7 +3466,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayer(Dataset *D, RBM *m, int n_epoch
                     gsl_matrix_add(CDneg, tmpCDneg);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -3406,52 +3481,37 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayer(Dataset *D, RBM *m, int n_epoch
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); //it averages CDpos
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); //it averages CDneg
-            gsl_matrix_sub(CDpos, CDneg);              //it performs CDpos-CDneg
-            gsl_matrix_scale(CDpos, m->eta);           // it performs eta*(CDpos-CDneg)
-            gsl_matrix_scale(tmpW, m->alpha);          // it performs W' = alpha*W' (momentum)
-            gsl_matrix_memcpy(auxW, m->W);             // it performs auxW = W
-            gsl_matrix_scale(auxW, -m->lambda);        // it performs auxW = -lambda*W (weight decay)
-            gsl_matrix_add(tmpW, auxW);                // it performs W' = W-lambda*W' (weight decay)
-            gsl_matrix_add(tmpW, CDpos);               // it performs W' = W'+eta*(CDpos-CDneg)
-            gsl_matrix_add(m->W, tmpW);                // it performs W = W+W'
-
-            gsl_vector_scale(v1, 1.0 / batch_size); //it averages v1
-            gsl_vector_scale(vn, 1.0 / batch_size); //it averages vn
-            gsl_vector_sub(v1, vn);                 // it performs v1-vn
-            gsl_vector_scale(v1, m->eta);           //it performs eta*(v1-vn)
-            gsl_vector_scale(tmpa, m->alpha);       // it performs a'= alpha*a'
-            gsl_vector_add(tmpa, v1);               //it performs a' = alpha*a' + eta(v1-vn)
-            gsl_vector_add(m->a, tmpa);             //it performs a = a + a'*/
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); //it averages P(h1 = 1|v1)
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); //it averages P(h2 = 1|v2)
-            gsl_vector_scale(tmpb, m->alpha);               //it performs b'= alpha*b'
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         //it performs P(h1 = 1|v1) - P(h2 = 1|v2)
-            gsl_vector_scale(ctr_probh1, m->eta);           //it performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2))
-            gsl_vector_add(tmpb, ctr_probh1);               //it performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2))
-            gsl_vector_add(m->b, tmpb);                     // it performs b = b + b'
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
 
@@ -3459,8 +3519,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayer(Dataset *D, RBM *m, int n_epoch
     gsl_matrix_free(CDneg);
     gsl_matrix_free(tmpCDneg);
     gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
 
     return error;
 }
@@ -3475,40 +3534,44 @@ batch_size: size of batch data
 p: hidden units dropout rate */
 double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropout(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
+    int *active = NULL, *on = NULL, n_active;
+    double *h_on = NULL;
 
     srand(time(NULL));
     T = gsl_rng_default;
     r = gsl_rng_alloc(T);
     gsl_rng_set(r, random_seed_deep());
+    active = (int *)malloc(m->n_hidden_layer_neurons * sizeof(int));
+    on = (int *)malloc(m->n_hidden_layer_neurons * sizeof(int));
+    h_on = (double *)malloc(m->n_hidden_layer_neurons * sizeof(double));
+    if (!active || !on || !h_on)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropout.\n");
+        exit(-1);
+    }
 
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
 
     CDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     CDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     error = 0;
 
@@ -3534,8 +3597,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropout(Dataset *D, RBM *m,
 
             for (t = 0; t < batch_size; t++)
             {
-                /* It computes r for dropping out hidden units */
-                InitializeBias4DropoutHiddenUnits(m, p);
+                /* It draws r for dropping out hidden units, and it compacts the surviving ones */
+                n_active = SampleDropoutHiddenUnits(m, p, r, active);
 
                 if (z < D->size)
                 {
@@ -3554,7 +3617,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropout(Dataset *D, RBM *m,
                     for (i = 1; i <= n_CD_iterations; i++)
                     {
                         /* It computes the P(h=1|v1), i.e., it computes h1 */
-                        tmp_probh1 = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4DBM(m, m->r, m->v);
+                        tmp_probh1 = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4DBM4Compact(m, active, n_active, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -3571,7 +3634,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropout(Dataset *D, RBM *m,
                         gsl_vector_free(tmp_probh1);
 
                         /* It computes the P(v2=1|h1), i.e., it computes v2 */
-                        tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit(m, m->r, m->h);
+                        tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4Compact(m, active, n_active, m->h, on, h_on);
                         for (j = 0; j < m->n_visible_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -3582,7 +3645,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropout(Dataset *D, RBM *m,
                         }
 
                         /* It computes the P(h2=1|v2), i.e., it computes h2 (hn) */
-                        tmp_probhn = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4DBM(m, m->r, m->v);
+                        tmp_probhn = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4DBM4Compact(m, active, n_active, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -3605,20 +3668,13 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropout(Dataset *D, RBM *m,
                     /* It accumulates vn */
                     gsl_vector_add(vn, m->v);
 
-                    for (i = 0; i < tmpCDpos->size1; i++)
-                    {
-                        for (j = 0; j < tmpCDpos->size2; j++)
-                        {
-                            gsl_matrix_set(tmpCDpos, i, j, gsl_vector_get(D->sample[z].feature, i) * gsl_vector_get(probh1, j));
-                            gsl_matrix_set(tmpCDneg, i, j, gsl_vector_get(m->v, i) * gsl_vector_get(probhn, j));
-                        }
-                    }
-
-                    gsl_matrix_add(CDpos, tmpCDpos);
-                    gsl_matrix_add(CDneg, tmpCDneg);
+                    /* It accumulates the statistics of the surviving hidden units only */
+                    AccumulateDropoutStatistics(CDpos, D->sample[z].feature, probh1, active, n_active);
+                    AccumulateDropoutStatistics(CDneg, m->v, probhn, active, n_active);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -3632,61 +3688,46 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropout(Dataset *D, RBM *m,
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); //it averages CDpos
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); //it averages CDneg
-            gsl_matrix_sub(CDpos, CDneg);              //it performs CDpos-CDneg
-            gsl_matrix_scale(CDpos, m->eta);           // it performs eta*(CDpos-CDneg)
-            gsl_matrix_scale(tmpW, m->alpha);          // it performs W' = alpha*W' (momentum)
-            gsl_matrix_memcpy(auxW, m->W);             // it performs auxW = W
-            gsl_matrix_scale(auxW, -m->lambda);        // it performs auxW = -lambda*W (weight decay)
-            gsl_matrix_add(tmpW, auxW);                // it performs W' = W-lambda*W' (weight decay)
-            gsl_matrix_add(tmpW, CDpos);               // it performs W' = W'+eta*(CDpos-CDneg)
-            gsl_matrix_add(m->W, tmpW);                // it performs W = W+W'
-
-            gsl_vector_scale(v1, 1.0 / batch_size); //it averages v1
-            gsl_vector_scale(vn, 1.0 / batch_size); //it averages vn
-            gsl_vector_sub(v1, vn);                 // it performs v1-vn
-            gsl_vector_scale(v1, m->eta);           //it performs eta*(v1-vn)
-            gsl_vector_scale(tmpa, m->alpha);       // it performs a'= alpha*a'
-            gsl_vector_add(tmpa, v1);               //it performs a' = alpha*a' + eta(v1-vn)
-            gsl_vector_add(m->a, tmpa);             //it performs a = a + a'*/
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); //it averages P(h1 = 1|v1)
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); //it averages P(h2 = 1|v2)
-            gsl_vector_scale(tmpb, m->alpha);               //it performs b'= alpha*b'
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         //it performs P(h1 = 1|v1) - P(h2 = 1|v2)
-            gsl_vector_scale(ctr_probh1, m->eta);           //it performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2))
-            gsl_vector_add(tmpb, ctr_probh1);               //it performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2))
-            gsl_vector_add(m->b, tmpb);                     // it performs b = b + b'
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
+    free(active);
+    free(on);
+    free(h_on);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
 
     gsl_matrix_free(CDpos);
     gsl_matrix_free(CDneg);
-    gsl_matrix_free(tmpCDneg);
-    gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
 
     return error;
 }
@@ -3701,27 +3742,28 @@ batch_size: size of batch data
 p: dropconnect mask rate */
 double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropconnect(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
+    DropconnectMask *M = NULL;
 
     srand(time(NULL));
     T = gsl_rng_default;
     r = gsl_rng_alloc(T);
     gsl_rng_set(r, random_seed_deep());
+    M = CreateDropconnectMask(p, random_seed_deep());
 
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -3731,10 +3773,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropconnect(Dataset *D, RBM
     tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     error = 0;
 
@@ -3760,8 +3799,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropconnect(Dataset *D, RBM
 
             for (t = 0; t < batch_size; t++)
             {
-                /* It computes r for dropping connect weight matrix */
-                InitializeBias4DropconnectWeight(m, p);
+                /* It moves on to the dropconnect mask of the next sample, whose bits are hashed on the fly */
+                M->sample++;
 
                 if (z < D->size)
                 {
@@ -3780,7 +3819,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropconnect(Dataset *D, RBM
                     for (i = 1; i <= n_CD_iterations; i++)
                     {
                         /* It computes the P(h=1|v1), i.e., it computes h1 */
-                        tmp_probh1 = getProbabilityTurningOnHiddenUnit4DBM4Dropconnect(m, m->M, m->v);
+                        tmp_probh1 = getProbabilityTurningOnHiddenUnit4DBM4HashedDropconnect(m, M, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -3797,7 +3836,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropconnect(Dataset *D, RBM
                         gsl_vector_free(tmp_probh1);
 
                         /* It computes the P(v2=1|h1), i.e., it computes v2 */
-                        tmp_probvn = getProbabilityTurningOnVisibleUnit4Dropconnect(m, m->M, m->h);
+                        tmp_probvn = getProbabilityTurningOnVisibleUnit4HashedDropconnect(m, M, m->h);
                         for (j = 0; j < m->n_visible_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -3808,7 +3847,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropconnect(Dataset *D, RBM
                         }
 
                         /* It computes the P(h2=1|v2), i.e., it computes h2 (hn) */
-                        tmp_probhn = getProbabilityTurningOnHiddenUnit4DBM4Dropconnect(m, m->M, m->v);
+                        tmp_probhn = getProbabilityTurningOnHiddenUnit4DBM4HashedDropconnect(m, M, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -3844,7 +3883,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropconnect(Dataset *D, RBM
                     gsl_matrix_add(CDneg, tmpCDneg);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -3858,52 +3898,38 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropconnect(Dataset *D, RBM
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); //it averages CDpos
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); //it averages CDneg
-            gsl_matrix_sub(CDpos, CDneg);              //it performs CDpos-CDneg
-            gsl_matrix_scale(CDpos, m->eta);           // it performs eta*(CDpos-CDneg)
-            gsl_matrix_scale(tmpW, m->alpha);          // it performs W' = alpha*W' (momentum)
-            gsl_matrix_memcpy(auxW, m->W);             // it performs auxW = W
-            gsl_matrix_scale(auxW, -m->lambda);        // it performs auxW = -lambda*W (weight decay)
-            gsl_matrix_add(tmpW, auxW);                // it performs W' = W-lambda*W' (weight decay)
-            gsl_matrix_add(tmpW, CDpos);               // it performs W' = W'+eta*(CDpos-CDneg)
-            gsl_matrix_add(m->W, tmpW);                // it performs W = W+W'
-
-            gsl_vector_scale(v1, 1.0 / batch_size); //it averages v1
-            gsl_vector_scale(vn, 1.0 / batch_size); //it averages vn
-            gsl_vector_sub(v1, vn);                 // it performs v1-vn
-            gsl_vector_scale(v1, m->eta);           //it performs eta*(v1-vn)
-            gsl_vector_scale(tmpa, m->alpha);       // it performs a'= alpha*a'
-            gsl_vector_add(tmpa, v1);               //it performs a' = alpha*a' + eta(v1-vn)
-            gsl_vector_add(m->a, tmpa);             //it performs a = a + a'*/
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); //it averages P(h1 = 1|v1)
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); //it averages P(h2 = 1|v2)
-            gsl_vector_scale(tmpb, m->alpha);               //it performs b'= alpha*b'
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         //it performs P(h1 = 1|v1) - P(h2 = 1|v2)
-            gsl_vector_scale(ctr_probh1, m->eta);           //it performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2))
-            gsl_vector_add(tmpb, ctr_probh1);               //it performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2))
-            gsl_vector_add(m->b, tmpb);                     // it performs b = b + b'
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
+    DestroyDropconnectMask(&M);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
 
@@ -3911,8 +3937,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_BottomLayerwithDropconnect(Dataset *D, RBM
     gsl_matrix_free(CDneg);
     gsl_matrix_free(tmpCDneg);
     gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
 
     return error;
 }
@@ -3926,11 +3951,12 @@ n_CD_iterations: number of CD iterations
 batch_size: size of batch data */
 double Bernoulli_TrainingRBMbyCD4DBM_TopLayer(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
@@ -3943,10 +3969,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayer(Dataset *D, RBM *m, int n_epochs,
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -3956,10 +3980,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayer(Dataset *D, RBM *m, int n_epochs,
     tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     error = 0;
 
@@ -4067,7 +4088,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayer(Dataset *D, RBM *m, int n_epochs,
                     gsl_matrix_add(CDneg, tmpCDneg);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -4081,52 +4103,37 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayer(Dataset *D, RBM *m, int n_epochs,
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
 
@@ -4134,8 +4141,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayer(Dataset *D, RBM *m, int n_epochs,
     gsl_matrix_free(CDneg);
     gsl_matrix_free(tmpCDneg);
     gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
 
     return error;
 }
@@ -4150,40 +4156,44 @@ batch_size: size of batch data
 p: hidden neurons dropout rate */
 double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropout(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
+    int *active = NULL, *on = NULL, n_active;
+    double *h_on = NULL;
 
     srand(time(NULL));
     T = gsl_rng_default;
     r = gsl_rng_alloc(T);
     gsl_rng_set(r, random_seed_deep());
+    active = (int *)malloc(m->n_hidden_layer_neurons * sizeof(int));
+    on = (int *)malloc(m->n_hidden_layer_neurons * sizeof(int));
+    h_on = (double *)malloc(m->n_hidden_layer_neurons * sizeof(double));
+    if (!active || !on || !h_on)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropout.\n");
+        exit(-1);
+    }
 
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
 
     CDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     CDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     error = 0;
 
@@ -4209,8 +4219,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropout(Dataset *D, RBM *m, int
 
             for (t = 0; t < batch_size; t++)
             {
-                /* It computes r for dropping out hidden units */
-                InitializeBias4DropoutHiddenUnits(m, p);
+                /* It draws r for dropping out hidden units, and it compacts the surviving ones */
+                n_active = SampleDropoutHiddenUnits(m, p, r, active);
 
                 if (z < D->size)
                 {
@@ -4230,7 +4240,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropout(Dataset *D, RBM *m, int
                     {
 
                         /* It computes the P(h_n=1|h_(n-1)) -> Equation 25 */
-                        tmp_probh1 = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit(m, m->r, m->v);
+                        tmp_probh1 = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4Compact(m, active, n_active, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -4247,7 +4257,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropout(Dataset *D, RBM *m, int
                         gsl_vector_free(tmp_probh1);
 
                         /* It computes the P(h_(n-1)=1|h_n)) -> Equation 24 */
-                        tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4DBM(m, m->r, m->h);
+                        tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4DBM4Compact(m, active, n_active, m->h, on, h_on);
                         for (j = 0; j < m->n_visible_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -4258,7 +4268,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropout(Dataset *D, RBM *m, int
                         }
 
                         /* It computes the P(h_n=1|h_(n-1)) -> Equation 25 */
-                        tmp_probhn = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit(m, m->r, m->v);
+                        tmp_probhn = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4Compact(m, active, n_active, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -4281,20 +4291,13 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropout(Dataset *D, RBM *m, int
                     /* It accumulates vn */
                     gsl_vector_add(vn, m->v);
 
-                    for (i = 0; i < tmpCDpos->size1; i++)
-                    {
-                        for (j = 0; j < tmpCDpos->size2; j++)
-                        {
-                            gsl_matrix_set(tmpCDpos, i, j, gsl_vector_get(D->sample[z].feature, i) * gsl_vector_get(probh1, j));
-                            gsl_matrix_set(tmpCDneg, i, j, gsl_vector_get(m->v, i) * gsl_vector_get(probhn, j));
-                        }
-                    }
-
-                    gsl_matrix_add(CDpos, tmpCDpos);
-                    gsl_matrix_add(CDneg, tmpCDneg);
+                    /* It accumulates the statistics of the surviving hidden units only */
+                    AccumulateDropoutStatistics(CDpos, D->sample[z].feature, probh1, active, n_active);
+                    AccumulateDropoutStatistics(CDneg, m->v, probhn, active, n_active);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -4308,61 +4311,46 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropout(Dataset *D, RBM *m, int
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
+    free(active);
+    free(on);
+    free(h_on);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
 
     gsl_matrix_free(CDpos);
     gsl_matrix_free(CDneg);
-    gsl_matrix_free(tmpCDneg);
-    gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
 
     return error;
 }
@@ -4377,27 +4365,28 @@ batch_size: size of batch data
 p: dropconnect mask rate */
 double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropconnect(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
+    DropconnectMask *M = NULL;
 
     srand(time(NULL));
     T = gsl_rng_default;
     r = gsl_rng_alloc(T);
     gsl_rng_set(r, random_seed_deep());
+    M = CreateDropconnectMask(p, random_seed_deep());
 
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -4407,10 +4396,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropconnect(Dataset *D, RBM *m,
     tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     error = 0;
 
@@ -4436,8 +4422,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropconnect(Dataset *D, RBM *m,
 
             for (t = 0; t < batch_size; t++)
             {
-                /* It computes r for dropping connect mask weight */
-                InitializeBias4DropconnectWeight(m, p);
+                /* It moves on to the dropconnect mask of the next sample, whose bits are hashed on the fly */
+                M->sample++;
 
                 if (z < D->size)
                 {
@@ -4457,7 +4443,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropconnect(Dataset *D, RBM *m,
                     {
 
                         /* It computes the P(h_n=1|h_(n-1)) -> Equation 25 */
-                        tmp_probh1 = getProbabilityTurningOnHiddenUnit4Dropconnect(m, m->M, m->v);
+                        tmp_probh1 = getProbabilityTurningOnHiddenUnit4HashedDropconnect(m, M, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -4474,7 +4460,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropconnect(Dataset *D, RBM *m,
                         gsl_vector_free(tmp_probh1);
 
                         /* It computes the P(h_(n-1)=1|h_n)) -> Equation 24 */
-                        tmp_probvn = getProbabilityTurningOnVisibleUnit4DBM4Dropconnect(m, m->M, m->h);
+                        tmp_probvn = getProbabilityTurningOnVisibleUnit4DBM4HashedDropconnect(m, M, m->h);
                         for (j = 0; j < m->n_visible_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -4485,7 +4471,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropconnect(Dataset *D, RBM *m,
                         }
 
                         /* It computes the P(h_n=1|h_(n-1)) -> Equation 25 */
-                        tmp_probhn = getProbabilityTurningOnHiddenUnit4Dropconnect(m, m->M, m->v);
+                        tmp_probhn = getProbabilityTurningOnHiddenUnit4HashedDropconnect(m, M, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -4521,7 +4507,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropconnect(Dataset *D, RBM *m,
                     gsl_matrix_add(CDneg, tmpCDneg);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -4535,52 +4522,38 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropconnect(Dataset *D, RBM *m,
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
+    DestroyDropconnectMask(&M);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
 
@@ -4588,8 +4561,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_TopLayerwithDropconnect(Dataset *D, RBM *m,
     gsl_matrix_free(CDneg);
     gsl_matrix_free(tmpCDneg);
     gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
 
     return error;
 }
@@ -4603,11 +4575,12 @@ n_CD_iterations: number of CD iterations
 batch_size: size of batch data */
 double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayers(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
@@ -4620,10 +4593,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayers(Dataset *D, RBM *m, int
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -4633,10 +4604,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayers(Dataset *D, RBM *m, int
     tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     error = 0;
 
@@ -4744,7 +4712,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayers(Dataset *D, RBM *m, int
                     gsl_matrix_add(CDneg, tmpCDneg);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -4758,52 +4727,37 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayers(Dataset *D, RBM *m, int
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
 
@@ -4811,8 +4765,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayers(Dataset *D, RBM *m, int
     gsl_matrix_free(CDneg);
     gsl_matrix_free(tmpCDneg);
     gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
 
     return error;
 }
@@ -4827,40 +4780,44 @@ batch_size: size of batch data
 p: hidden neurons dropout rate */
 double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropout(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
+    int *active = NULL, *on = NULL, n_active;
+    double *h_on = NULL;
 
     srand(time(NULL));
     T = gsl_rng_default;
     r = gsl_rng_alloc(T);
     gsl_rng_set(r, random_seed_deep());
+    active = (int *)malloc(m->n_hidden_layer_neurons * sizeof(int));
+    on = (int *)malloc(m->n_hidden_layer_neurons * sizeof(int));
+    h_on = (double *)malloc(m->n_hidden_layer_neurons * sizeof(double));
+    if (!active || !on || !h_on)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropout.\n");
+        exit(-1);
+    }
 
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
 
     CDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     CDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     error = 0;
 
@@ -4886,8 +4843,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropout(Dataset *D, R
 
             for (t = 0; t < batch_size; t++)
             {
-                /* It computes r for dropping out hidden units */
-                InitializeBias4DropoutHiddenUnits(m, p);
+                /* It draws r for dropping out hidden units, and it compacts the surviving ones */
+                n_active = SampleDropoutHiddenUnits(m, p, r, active);
 
                 if (z < D->size)
                 {
@@ -4907,7 +4864,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropout(Dataset *D, R
                     {
 
                         /* It computes the P(h_k=1|h_(k-1)) -> Equation 27 */
-                        tmp_probh1 = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4DBM(m, m->r, m->v);
+                        tmp_probh1 = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4DBM4Compact(m, active, n_active, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -4924,7 +4881,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropout(Dataset *D, R
                         gsl_vector_free(tmp_probh1);
 
                         /* It computes the P(h_(k-1)=1|h_k) -> Equation 26 */
-                        tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4DBM(m, m->r, m->h);
+                        tmp_probvn = getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4DBM4Compact(m, active, n_active, m->h, on, h_on);
                         for (j = 0; j < m->n_visible_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -4935,7 +4892,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropout(Dataset *D, R
                         }
 
                         /* It computes the P(h_k=1|h_(k-1)) -> Equation 27 */
-                        tmp_probhn = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4DBM(m, m->r, m->v);
+                        tmp_probhn = getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4DBM4Compact(m, active, n_active, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -4958,20 +4915,13 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropout(Dataset *D, R
                     /* It accumulates vn */
                     gsl_vector_add(vn, m->v);
 
-                    for (i = 0; i < tmpCDpos->size1; i++)
-                    {
-                        for (j = 0; j < tmpCDpos->size2; j++)
-                        {
-                            gsl_matrix_set(tmpCDpos, i, j, gsl_vector_get(D->sample[z].feature, i) * gsl_vector_get(probh1, j));
-                            gsl_matrix_set(tmpCDneg, i, j, gsl_vector_get(m->v, i) * gsl_vector_get(probhn, j));
-                        }
-                    }
-
-                    gsl_matrix_add(CDpos, tmpCDpos);
-                    gsl_matrix_add(CDneg, tmpCDneg);
+                    /* It accumulates the statistics of the surviving hidden units only */
+                    AccumulateDropoutStatistics(CDpos, D->sample[z].feature, probh1, active, n_active);
+                    AccumulateDropoutStatistics(CDneg, m->v, probhn, active, n_active);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -4985,61 +4935,46 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropout(Dataset *D, R
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
+    free(active);
+    free(on);
+    free(h_on);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
 
     gsl_matrix_free(CDpos);
     gsl_matrix_free(CDneg);
-    gsl_matrix_free(tmpCDneg);
-    gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
 
     return error;
 }
@@ -5054,27 +4989,28 @@ batch_size: size of batch data
 p: hidden neurons dropout rate */
 double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropconnect(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
+    DropconnectMask *M = NULL;
 
     srand(time(NULL));
     T = gsl_rng_default;
     r = gsl_rng_alloc(T);
     gsl_rng_set(r, random_seed_deep());
+    M = CreateDropconnectMask(p, random_seed_deep());
 
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -5084,10 +5020,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropconnect(Dataset *
     tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     error = 0;
 
@@ -5113,8 +5046,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropconnect(Dataset *
 
             for (t = 0; t < batch_size; t++)
             {
-                /* It computes r for dropping connect mask weight */
-                InitializeBias4DropconnectWeight(m, p);
+                /* It moves on to the dropconnect mask of the next sample, whose bits are hashed on the fly */
+                M->sample++;
 
                 if (z < D->size)
                 {
@@ -5134,7 +5067,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropconnect(Dataset *
                     {
 
                         /* It computes the P(h_k=1|h_(k-1)) -> Equation 27 */
-                        tmp_probh1 = getProbabilityTurningOnHiddenUnit4DBM4Dropconnect(m, m->M, m->v);
+                        tmp_probh1 = getProbabilityTurningOnHiddenUnit4DBM4HashedDropconnect(m, M, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -5151,7 +5084,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropconnect(Dataset *
                         gsl_vector_free(tmp_probh1);
 
                         /* It computes the P(h_(k-1)=1|h_k) -> Equation 26 */
-                        tmp_probvn = getProbabilityTurningOnVisibleUnit4DBM4Dropconnect(m, m->M, m->h);
+                        tmp_probvn = getProbabilityTurningOnVisibleUnit4DBM4HashedDropconnect(m, M, m->h);
                         for (j = 0; j < m->n_visible_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -5162,7 +5095,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropconnect(Dataset *
                         }
 
                         /* It computes the P(h_k=1|h_(k-1)) -> Equation 27 */
-                        tmp_probhn = getProbabilityTurningOnHiddenUnit4DBM4Dropconnect(m, m->M, m->v);
+                        tmp_probhn = getProbabilityTurningOnHiddenUnit4DBM4HashedDropconnect(m, M, m->v);
                         for (j = 0; j < m->n_hidden_layer_neurons; j++)
                         {
                             sample = gsl_rng_uniform(r);
@@ -5198,7 +5131,8 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropconnect(Dataset *
                     gsl_matrix_add(CDneg, tmpCDneg);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -5212,52 +5146,38 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropconnect(Dataset *
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
+    DestroyDropconnectMask(&M);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
 
@@ -5265,8 +5185,7 @@ double Bernoulli_TrainingRBMbyCD4DBM_IntermediateLayerswithDropconnect(Dataset *
     gsl_matrix_free(CDneg);
     gsl_matrix_free(tmpCDneg);
     gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
 
     return error;
 }
@@ -5280,11 +5199,12 @@ n_CD_iterations: number of CD iterations
 batch_size: size of batch data */
 double Bernoulli_TrainingRBMbyPCD4DBM_BottomLayer(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL, *last_probhn = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL, *aux = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *last_probhn = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL, *aux = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
@@ -5297,10 +5217,8 @@ double Bernoulli_TrainingRBMbyPCD4DBM_BottomLayer(Dataset *D, RBM *m, int n_epoc
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -5310,10 +5228,7 @@ double Bernoulli_TrainingRBMbyPCD4DBM_BottomLayer(Dataset *D, RBM *m, int n_epoc
     tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     last_probhn = gsl_matrix_calloc(batch_size, m->n_hidden_layer_neurons);
     aux = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -5431,7 +5346,8 @@ double Bernoulli_TrainingRBMbyPCD4DBM_BottomLayer(Dataset *D, RBM *m, int n_epoc
                     gsl_matrix_add(CDneg, tmpCDneg);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -5445,52 +5361,37 @@ double Bernoulli_TrainingRBMbyPCD4DBM_BottomLayer(Dataset *D, RBM *m, int n_epoc
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
     gsl_vector_free(aux);
@@ -5499,8 +5400,7 @@ double Bernoulli_TrainingRBMbyPCD4DBM_BottomLayer(Dataset *D, RBM *m, int n_epoc
     gsl_matrix_free(CDneg);
     gsl_matrix_free(tmpCDneg);
     gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
     gsl_matrix_free(last_probhn);
 
     return error;
@@ -5515,11 +5415,12 @@ n_CD_iterations: number of CD iterations
 batch_size: size of batch data */
 double Bernoulli_TrainingRBMbyPCD4DBM_TopLayer(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL, *last_probhn = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL, *aux = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *last_probhn = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL, *aux = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
@@ -5532,10 +5433,8 @@ double Bernoulli_TrainingRBMbyPCD4DBM_TopLayer(Dataset *D, RBM *m, int n_epochs,
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -5545,10 +5444,7 @@ double Bernoulli_TrainingRBMbyPCD4DBM_TopLayer(Dataset *D, RBM *m, int n_epochs,
     tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     last_probhn = gsl_matrix_calloc(batch_size, m->n_hidden_layer_neurons);
     aux = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -5666,7 +5562,8 @@ double Bernoulli_TrainingRBMbyPCD4DBM_TopLayer(Dataset *D, RBM *m, int n_epochs,
                     gsl_matrix_add(CDneg, tmpCDneg);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -5680,52 +5577,37 @@ double Bernoulli_TrainingRBMbyPCD4DBM_TopLayer(Dataset *D, RBM *m, int n_epochs,
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
     gsl_vector_free(aux);
@@ -5734,8 +5616,7 @@ double Bernoulli_TrainingRBMbyPCD4DBM_TopLayer(Dataset *D, RBM *m, int n_epochs,
     gsl_matrix_free(CDneg);
     gsl_matrix_free(tmpCDneg);
     gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
     gsl_matrix_free(last_probhn);
 
     return error;
@@ -5750,11 +5631,12 @@ n_CD_iterations: number of CD iterations
 batch_size: size of batch data */
 double Bernoulli_TrainingRBMbyPCD4DBM_IntermediateLayers(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr;
+    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, trained;
     double error, sample, errorsum, pl, plsum;
     const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL, *last_probhn = NULL;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL, *aux = NULL;
+    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *last_probhn = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_vector *v1 = NULL, *vn = NULL, *aux = NULL;
     gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1, *tmp_probhn = NULL;
     gsl_vector *tmp_probvn = NULL;
     gsl_rng *r;
@@ -5767,10 +5649,8 @@ double Bernoulli_TrainingRBMbyPCD4DBM_IntermediateLayers(Dataset *D, RBM *m, int
     v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
     vn = gsl_vector_calloc(m->n_visible_layer_neurons);
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
 
     ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
     ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -5780,10 +5660,7 @@ double Bernoulli_TrainingRBMbyPCD4DBM_IntermediateLayers(Dataset *D, RBM *m, int
     tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
     tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
 
     last_probhn = gsl_matrix_calloc(batch_size, m->n_hidden_layer_neurons);
     aux = gsl_vector_calloc(m->n_hidden_layer_neurons);
@@ -5901,7 +5778,8 @@ double Bernoulli_TrainingRBMbyPCD4DBM_IntermediateLayers(Dataset *D, RBM *m, int
                     gsl_matrix_add(CDneg, tmpCDneg);
 
                     error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
+                    if (!m->monitor)
+                        pl += getPseudoLikelihood(m, m->v);
 
                     gsl_vector_free(probh1);
                     gsl_vector_free(probhn);
@@ -5915,52 +5793,37 @@ double Bernoulli_TrainingRBMbyPCD4DBM_IntermediateLayers(Dataset *D, RBM *m, int
             plsum = plsum + pl / ctr;
 
             /* It updates RBM parameters */
-            gsl_matrix_scale(CDpos, 1.0 / batch_size); /* It averages CDpos */
-            gsl_matrix_scale(CDneg, 1.0 / batch_size); /* It averages CDneg */
-            gsl_matrix_sub(CDpos, CDneg);              /* It performs CDpos-CDneg */
-            gsl_matrix_scale(CDpos, m->eta);           /* It performs eta*(CDpos-CDneg) */
-            gsl_matrix_scale(tmpW, m->alpha);          /* It performs W' = alpha*W' (momentum) */
-            gsl_matrix_memcpy(auxW, m->W);             /* It performs auxW = W */
-            gsl_matrix_scale(auxW, -m->lambda);        /* It performs auxW = -lambda*W (weight decay) */
-            gsl_matrix_add(tmpW, auxW);                /* It performs W' = W-lambda*W' (weight decay) */
-            gsl_matrix_add(tmpW, CDpos);               /* It performs W' = W'+eta*(CDpos-CDneg) */
-            gsl_matrix_add(m->W, tmpW);                /* It performs W = W+W' */
-
-            gsl_vector_scale(v1, 1.0 / batch_size); /* It averages v1 */
-            gsl_vector_scale(vn, 1.0 / batch_size); /* It averages vn */
-            gsl_vector_sub(v1, vn);                 /* It performs v1-vn */
-            gsl_vector_scale(v1, m->eta);           /* It performs eta*(v1-vn) */
-            gsl_vector_scale(tmpa, m->alpha);       /* It performs a'= alpha*a' */
-            gsl_vector_add(tmpa, v1);               /* It performs a' = alpha*a' + eta(v1-vn) */
-            gsl_vector_add(m->a, tmpa);             /* It performs a = a + a' */
-
-            gsl_vector_scale(ctr_probh1, 1.0 / batch_size); /* It averages P(h1 = 1|v1) */
-            gsl_vector_scale(ctr_probhn, 1.0 / batch_size); /* It averages P(h2 = 1|v2) */
-            gsl_vector_scale(tmpb, m->alpha);               /* It performs b'= alpha*b' */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);         /* It performs P(h1 = 1|v1) - P(h2 = 1|v2) */
-            gsl_vector_scale(ctr_probh1, m->eta);           /* It performs eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(tmpb, ctr_probh1);               /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) */
-            gsl_vector_add(m->b, tmpb);                     /* It performs b = b + b' */
+            UpdateParameterMatrix(m, m->W, CDpos, CDneg, 1.0 / batch_size, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(CDpos-CDneg) and W = W+W' */
+
+            UpdateParameterVector(m, m->a, v1, vn, 1.0 / batch_size, m->eta, tmpa); /* It performs a' = alpha*a' + eta*(v1-vn) and a = a + a' */
+
+            UpdateParameterVector(m, m->b, ctr_probh1, ctr_probhn, 1.0 / batch_size, m->eta, tmpb); /* It performs b' = alpha*b' + eta*(P(h1 = 1|v1) - P(h2 = 1|v2)) and b = b + b' */
             /********************************/
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = n <= n_batches ? n : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "    -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
         m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
 
     gsl_vector_free(v1);
     gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
     gsl_vector_free(ctr_probh1);
     gsl_vector_free(ctr_probhn);
     gsl_vector_free(aux);
@@ -5969,8 +5832,7 @@ double Bernoulli_TrainingRBMbyPCD4DBM_IntermediateLayers(Dataset *D, RBM *m, int
     gsl_matrix_free(CDneg);
     gsl_matrix_free(tmpCDneg);
     gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
+    DestroyParameterState(&tmpW);
     gsl_matrix_free(last_probhn);
 
     return error;
@@ -5979,110 +5841,277 @@ double Bernoulli_TrainingRBMbyPCD4DBM_IntermediateLayers(Dataset *D, RBM *m, int
 
 /* Gaussian-Bernoulli RBM Training */
 
-/* It trains a Gaussian-Bernoulli RBM by Constrative Divergence for image reconstruction (binary images)
-Parameters: [D, m, n_epochs, n_CD_iterations, batch_size]
-D: dataset
+/* It computes the probability of turning on the hidden units of a batch of Gaussian visible samples, i.e., P(h=1|v) = sigmoid((v/sigma)*W + b), from
+visible units that are already divided by their standard deviations, so sigma is not read again for every hidden unit
+Parameters: [m, S, labels, R, prob_H]
 m: RBM
-n_epochs: number of training epochs
-n_CD_iterations: number of CD iterations
-batch_size: size of batch data */
-double GaussianBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size)
+S: visible units divided by sigma (one sample per row)
+labels: label index of each sample, whose row of U is added to the input of the hidden units (Discriminative RBMs), or NULL
+R: hidden neurons dropout masks (one sample per row), or NULL
+prob_H: probability of hidden neurons (one sample per row, same number of rows as S) */
+static void GaussianBatchHiddenPass(RBM *m, gsl_matrix *S, int *labels, gsl_matrix *R, gsl_matrix *prob_H)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, w, line;
-    double error, sample, errorsum, pl, plsum, v_std_rate;
-    const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL, *tmpWxP = NULL, *matrix_data_W_probh1 = NULL, *matrix_probvn_W_probhn = NULL, *matrix_tmp_probh1;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL;
-    gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1 = NULL, *tmp_probhn = NULL;
-    gsl_vector *tmp_probvn = NULL, *tmp_sum2 = NULL, *tmp_sum4 = NULL;
-    gsl_rng *r;
-
-    /* Gaussian */
-    gsl_vector *p1 = NULL, *pf = NULL, *pf2 = NULL, *p2 = NULL, *invfstdInc = NULL, *std_rate = NULL, *invfstd = NULL;
-    p1 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    p2 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    pf = gsl_vector_calloc(m->n_visible_layer_neurons);
-    pf2 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmp_sum2 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmp_sum4 = gsl_vector_calloc(m->n_visible_layer_neurons);
-
-    invfstd = gsl_vector_calloc(m->n_visible_layer_neurons);
-    gsl_vector_set_zero(invfstd);
+    double *p, *u, *r, *b = gsl_vector_ptr(m->b, 0), tmp;
+    int i, j;
 
-    invfstdInc = gsl_vector_calloc(m->n_visible_layer_neurons);
-    gsl_vector_set_zero(invfstdInc);
+    gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, S, m->W, 0.0, prob_H); /* It computes (v/sigma)*W for the whole batch */
+    for (i = 0; i < prob_H->size1; i++)
+    {
+        p = gsl_matrix_ptr(prob_H, i, 0);
+        u = labels ? gsl_matrix_ptr(m->U, labels[i], 0) : NULL;
+        r = R ? gsl_matrix_ptr(R, i, 0) : NULL;
+        for (j = 0; j < prob_H->size2; j++)
+        {
+            tmp = p[j] + b[j];
+            if (u)
+                tmp += u[j];
+            tmp = SigmoidLogistic(tmp);
+            p[j] = r ? tmp * r[j] : tmp;
+        }
+    }
+}
 
-    std_rate = gsl_vector_calloc(n_epochs);
-    gsl_vector_set_zero(std_rate);
+/* It samples the Gaussian visible units of a batch given its hidden units, i.e., v = a + sigma*(W*h) + sigma*N(0,1), with a single GEMM for the whole
+batch and one standard normal draw per unit
+Parameters: [m, H, inv_sigma, r, V, S]
+m: RBM
+H: hidden units (one sample per row)
+inv_sigma: inverse of the standard deviation of each visible unit
+r: random number generator
+V: sampled visible units (one sample per row, same number of rows as H)
+S: sampled visible units divided by sigma, as used by the next hidden pass and the statistics */
+static void GaussianBatchVisibleSample(RBM *m, gsl_matrix *H, gsl_vector *inv_sigma, gsl_rng *r, gsl_matrix *V, gsl_matrix *S)
+{
+    double *v, *s, *a = gsl_vector_ptr(m->a, 0), *sigma = gsl_vector_ptr(m->sigma, 0), *is = gsl_vector_ptr(inv_sigma, 0);
+    int i, j;
 
-    matrix_data_W_probh1 = gsl_matrix_calloc(batch_size, m->n_visible_layer_neurons);
-    gsl_matrix_set_zero(matrix_data_W_probh1);
+    gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, H, m->W, 0.0, V); /* It computes h*W^T for the whole batch */
+    for (i = 0; i < V->size1; i++)
+    {
+        v = gsl_matrix_ptr(V, i, 0);
+        s = gsl_matrix_ptr(S, i, 0);
+        for (j = 0; j < V->size2; j++)
+        {
+            v[j] = sigma[j] * (v[j] + gsl_ran_gaussian_ziggurat(r, 1.0)) + a[j];
+            s[j] = v[j] * is[j];
+        }
+    }
+}
 
-    matrix_probvn_W_probhn = gsl_matrix_calloc(batch_size, m->n_visible_layer_neurons);
-    gsl_matrix_set_zero(matrix_probvn_W_probhn);
+/* It samples binary hidden units from their probabilities
+Parameters: [prob_H, r, H]
+prob_H: probability of hidden neurons (one sample per row)
+r: random number generator
+H: sampled hidden units (same shape as prob_H) */
+static void SampleGaussianBatchHiddenUnits(gsl_matrix *prob_H, gsl_rng *r, gsl_matrix *H)
+{
+    double *p, *h;
+    int i, j;
 
-    matrix_tmp_probh1 = gsl_matrix_calloc(batch_size, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(matrix_tmp_probh1);
+    for (i = 0; i < prob_H->size1; i++)
+    {
+        p = gsl_matrix_ptr(prob_H, i, 0);
+        h = gsl_matrix_ptr(H, i, 0);
+        for (j = 0; j < prob_H->size2; j++)
+            h[j] = p[j] > gsl_rng_uniform(r) ? 1.0 : 0.0;
+    }
+}
 
-    gsl_matrix *matrixData = NULL;
-    matrixData = gsl_matrix_calloc(batch_size, m->n_visible_layer_neurons);
-    gsl_matrix_set_zero(matrixData);
+/* It draws one hidden neurons dropout mask per sample of a batch
+Parameters: [R, p, r]
+R: dropout masks (one sample per row)
+p: probability of keeping a hidden unit
+r: random number generator */
+static void SampleGaussianBatchDropoutMasks(gsl_matrix *R, double p, gsl_rng *r)
+{
+    double *q;
+    int i, j;
 
-    gsl_vector *tmpVectorz = NULL;
-    tmpVectorz = gsl_vector_calloc(m->n_hidden_layer_neurons);
+    for (i = 0; i < R->size1; i++)
+    {
+        q = gsl_matrix_ptr(R, i, 0);
+        for (j = 0; j < R->size2; j++)
+            q[j] = gsl_ran_bernoulli(r, p);
+    }
+}
 
-    gsl_vector *vtmp = NULL;
-    vtmp = gsl_vector_calloc(m->n_visible_layer_neurons);
+/* It accumulates the statistics of a phase for the inverse standard deviations of the visible units, i.e., sum over the batch of
+2v(a - v/2)/sigma + v(W*p(h|v)), which is the derivative of -E(v,h) with respect to 1/sigma up to a constant that cancels between both phases
+Parameters: [m, V, prob_H, inv_sigma, Q, sign, grad]
+m: RBM
+V: visible units (one sample per row)
+prob_H: probability of hidden neurons given V
+inv_sigma: inverse of the standard deviation of each visible unit
+Q: scratch matrix with the shape of V
+sign: 1 for the positive phase and -1 for the negative one
+grad: statistics of the inverse standard deviations */
+static void AccumulateGaussianSigmaStatistics(RBM *m, gsl_matrix *V, gsl_matrix *prob_H, gsl_vector *inv_sigma, gsl_matrix *Q, double sign, gsl_vector *grad)
+{
+    double *v, *q, *a = gsl_vector_ptr(m->a, 0), *is = gsl_vector_ptr(inv_sigma, 0), *g = gsl_vector_ptr(grad, 0);
+    int i, j;
 
-    double rr = 0.001;
-    float tmp;
+    gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, prob_H, m->W, 0.0, Q); /* It computes W*p(h|v) for the whole batch */
+    for (i = 0; i < V->size1; i++)
+    {
+        v = gsl_matrix_ptr(V, i, 0);
+        q = gsl_matrix_ptr(Q, i, 0);
+        for (j = 0; j < V->size2; j++)
+            g[j] += sign * v[j] * ((2 * a[j] - v[j]) * is[j] + q[j]);
+    }
+}
 
-    srand(time(NULL));
-    T = gsl_rng_default;
-    r = gsl_rng_alloc(T);
-    gsl_rng_set(r, random_seed_deep());
+/* It updates the standard deviations of the visible units through the momentum of their inverses, which are kept above 1/0.005
+Parameters: [m, grad, invfstdInc, rate, n]
+m: RBM
+grad: difference between the positive and the negative statistics of the inverse standard deviations
+invfstdInc: last increment of the inverse standard deviations
+rate: learning rate of the inverse standard deviations
+n: number of samples in the batch */
+static void UpdateGaussianSigma(RBM *m, gsl_vector *grad, gsl_vector *invfstdInc, double rate, int n)
+{
+    double invfstd;
+    int j;
 
-    v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    vn = gsl_vector_calloc(m->n_visible_layer_neurons);
+    for (j = 0; j < m->n_visible_layer_neurons; j++)
+    {
+        gsl_vector_set(invfstdInc, j, m->alpha * gsl_vector_get(invfstdInc, j) + (rate / n) * gsl_vector_get(grad, j));
+        invfstd = 1.0 / gsl_vector_get(m->sigma, j) + gsl_vector_get(invfstdInc, j);
+        gsl_vector_set(m->sigma, j, 1.0 / invfstd);
+        if (0.005 > gsl_vector_get(m->sigma, j))
+            gsl_vector_set(m->sigma, j, 0.005);
+    }
+}
 
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
+/* It computes the inverse of the standard deviation of each visible unit once per batch, so the batch passes multiply instead of dividing
+Parameters: [m, inv_sigma]
+m: RBM
+inv_sigma: inverse of the standard deviation of each visible unit */
+static void getGaussianInverseSigma(RBM *m, gsl_vector *inv_sigma)
+{
+    int j;
 
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
+    for (j = 0; j < m->n_visible_layer_neurons; j++)
+        gsl_vector_set(inv_sigma, j, 1.0 / gsl_vector_get(m->sigma, j));
+}
 
-    ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
+/* It gathers a batch of samples, together with their visible units divided by sigma
+Parameters: [D, z, inv_sigma, X, S]
+D: dataset
+z: index of the first sample of the batch
+inv_sigma: inverse of the standard deviation of each visible unit
+X: visible units (one sample per row, as many rows as samples in the batch)
+S: visible units divided by sigma */
+static void getGaussianBatch(Dataset *D, int z, gsl_vector *inv_sigma, gsl_matrix *X, gsl_matrix *S)
+{
+    int i;
 
-    CDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    CDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpWxP = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    for (i = 0; i < X->size1; i++)
+        gsl_matrix_set_row(X, i, D->sample[z + i].feature);
+    gsl_matrix_memcpy(S, X);
+    for (i = 0; i < S->size1; i++)
+    {
+        gsl_vector_view row = gsl_matrix_row(S, i);
+        gsl_vector_mul(&row.vector, inv_sigma);
+    }
+}
 
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
+/* It computes the learning rate of the standard deviations of the visible units at a given epoch, which is zero during the first min(30, n_epochs/2)
+epochs, so the weights settle before the variances start to move
+Parameters: [m, e, n_epochs]
+m: RBM
+e: epoch (starting at 1)
+n_epochs: number of training epochs */
+static double getGaussianSigmaRate(RBM *m, int e, int n_epochs)
+{
+    int warm_up = n_epochs / 2 < 30 ? n_epochs / 2 : 30;
 
-    gsl_matrix *tmpMatriz = NULL;
-    tmpMatriz = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpMatriz);
+    return e - 1 < warm_up ? 0.0 : m->sigma_eta;
+}
 
-    v_std_rate = 30;
-    if ((n_epochs / 2) < v_std_rate)
-        v_std_rate = n_epochs / 2;
+/* It computes the sum of the pseudo-likelihoods of a batch of samples as getPseudoLikelihood does, flipping one random unit of each sample, but with a
+single GEMM for the free energies of the whole batch, from which the free energies of the flipped samples follow by a correction of one row of W
+Parameters: [m, V, A, r]
+m: RBM
+V: samples (one per row)
+A: scratch matrix with one row per sample and one column per hidden unit
+r: random number generator */
+static double getBatchPseudoLikelihood(RBM *m, gsl_matrix *V, gsl_matrix *A, gsl_rng *r)
+{
+    double *v, *z, *w, *b = gsl_vector_ptr(m->b, 0), av, delta, F, F_flipped, pl = 0.0;
+    gsl_vector_view row;
+    int i, j, index;
 
-    for (i = 0; i < n_epochs; i++)
+    gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, V, m->W, 0.0, A); /* It computes v*W for the whole batch */
+    for (i = 0; i < V->size1; i++)
     {
-        gsl_vector_set(std_rate, i, 0.001);
-
-        if (i < v_std_rate)
+        v = gsl_matrix_ptr(V, i, 0);
+        z = gsl_matrix_ptr(A, i, 0);
+        index = gsl_rng_uniform_int(r, (long int)m->n_visible_layer_neurons); /* It generates the index of the bit to be flipped */
+        delta = 1 - 2 * v[index];
+        w = gsl_matrix_ptr(m->W, index, 0);
+
+        row = gsl_matrix_row(V, i);
+        gsl_blas_ddot(m->a, &row.vector, &av);
+        F = -av;
+        F_flipped = -av - gsl_vector_get(m->a, index) * delta;
+        for (j = 0; j < A->size2; j++)
         {
-            gsl_vector_set(std_rate, i, 0.0);
+            F -= log(1 + exp(z[j] + b[j]));
+            F_flipped -= log(1 + exp(z[j] + b[j] + delta * w[j]));
         }
+        pl += m->n_visible_layer_neurons * log(SigmoidLogistic(F_flipped - F));
     }
 
+    return pl;
+}
+
+/* It trains a Gaussian-Bernoulli RBM by Constrative Divergence on whole mini-batches, with or without Dropout
+Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, p, dropout]
+D: dataset
+m: RBM
+n_epochs: number of training epochs
+n_CD_iterations: number of CD iterations
+batch_size: size of batch data
+p: probability of keeping a hidden unit
+dropout: it draws one hidden neurons dropout mask per sample if non-zero */
+static double GaussianBernoulliTraining(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p, int dropout)
+{
+    int e, z, i, k, n, n_batches = ceil((float)D->size / batch_size), trained;
+    double error, errorsum, pl, plsum, rate, rr = 0.001;
+    gsl_matrix *X = NULL, *S1 = NULL, *PH1 = NULL, *H = NULL, *V = NULL, *Sn = NULL, *PHn = NULL, *R = NULL, *Q = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix_view x, s1, ph1, h, v, sn, phn, rv, q;
+    gsl_vector_view ones_view, row_x, row_v;
+    gsl_vector *inv_sigma = NULL, *ones = NULL, *agrad = NULL, *bgrad = NULL, *sgrad = NULL, *invfstdInc = NULL;
+    const gsl_rng_type *T = NULL;
+    gsl_rng *r = NULL;
+
+    srand(time(NULL));
+    T = gsl_rng_default;
+    r = gsl_rng_alloc(T);
+    gsl_rng_set(r, random_seed_deep());
+
+    X = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    S1 = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    V = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    Sn = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    Q = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    PH1 = gsl_matrix_alloc(batch_size, m->n_hidden_layer_neurons);
+    PHn = gsl_matrix_alloc(batch_size, m->n_hidden_layer_neurons);
+    H = gsl_matrix_alloc(batch_size, m->n_hidden_layer_neurons);
+    if (dropout)
+        R = gsl_matrix_alloc(batch_size, m->n_hidden_layer_neurons);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    inv_sigma = gsl_vector_alloc(m->n_visible_layer_neurons);
+    agrad = gsl_vector_alloc(m->n_visible_layer_neurons);
+    sgrad = gsl_vector_alloc(m->n_visible_layer_neurons);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    invfstdInc = gsl_vector_calloc(m->n_visible_layer_neurons);
+    bgrad = gsl_vector_alloc(m->n_hidden_layer_neurons);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
+    ones = gsl_vector_alloc(batch_size);
+    gsl_vector_set_all(ones, 1.0);
+
     error = 0;
 
     /* For each epoch */
@@ -6090,299 +6119,134 @@ double GaussianBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, i
     {
         fprintf(stderr, "\nRunning epoch %d ... ", e);
         errorsum = plsum = 0.0;
-        z = 0;
+        rate = getGaussianSigmaRate(m, e, n_epochs);
+        m->alpha = e > 5 ? 0.9 : 0.5;
 
         /* For each batch */
-        for (n = 1; n <= n_batches; n++)
+        for (z = 0; z < D->size; z += batch_size)
         {
-            ctr = 0;
-            line = 0;
-            error = pl = 0.0;
-            gsl_matrix_set_zero(CDpos);
-            gsl_matrix_set_zero(CDneg);
-            gsl_vector_set_zero(v1);
-            gsl_vector_set_zero(vn);
-            gsl_vector_set_zero(ctr_probh1);
-            gsl_vector_set_zero(ctr_probhn);
-            gsl_vector_set_zero(pf);
-            gsl_vector_set_zero(pf2);
-            gsl_vector_set_zero(tmp_sum2);
-            gsl_vector_set_zero(tmp_sum4);
-
-            for (t = 0; t < batch_size; t++)
+            n = D->size - z < batch_size ? D->size - z : batch_size;
+            x = gsl_matrix_submatrix(X, 0, 0, n, X->size2);
+            s1 = gsl_matrix_submatrix(S1, 0, 0, n, S1->size2);
+            v = gsl_matrix_submatrix(V, 0, 0, n, V->size2);
+            sn = gsl_matrix_submatrix(Sn, 0, 0, n, Sn->size2);
+            q = gsl_matrix_submatrix(Q, 0, 0, n, Q->size2);
+            ph1 = gsl_matrix_submatrix(PH1, 0, 0, n, PH1->size2);
+            phn = gsl_matrix_submatrix(PHn, 0, 0, n, PHn->size2);
+            h = gsl_matrix_submatrix(H, 0, 0, n, H->size2);
+            ones_view = gsl_vector_subvector(ones, 0, n);
+
+            getGaussianInverseSigma(m, inv_sigma);
+            getGaussianBatch(D, z, inv_sigma, &x.matrix, &s1.matrix);
+            if (dropout)
             {
-                if (z < D->size)
-                {
-                    ctr++;
-                    probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
-                    probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
-                    probvn = gsl_vector_calloc(m->n_visible_layer_neurons);
-
-                    /* It sets v1 */
-                    setVisibleLayer(m, D->sample[z].feature);
-                    for (j = 0; j < m->n_visible_layer_neurons; j++)
-                        gsl_matrix_set(matrixData, line, j, gsl_vector_get(m->v, j));
-
-                    /* It accumulates v1 */
-                    for (i = 0; i < m->n_visible_layer_neurons; i++)
-                    {
-                        tmp = gsl_vector_get(m->v, i) / (gsl_vector_get(m->sigma, i) * gsl_vector_get(m->sigma, i));
-                        gsl_vector_set(vtmp, i, tmp);
-                    }
-                    gsl_vector_add(v1, vtmp);
-
-                    /* It computes the P(h=1|v1), i.e., it computes h1 */
-                    tmp_probh1 = getProbabilityTurningOnHiddenUnit4Gaussian(m, m->v, m->sigma);
-                    for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                    {
-                        sample = gsl_rng_uniform(r);
-                        if (gsl_vector_get(tmp_probh1, j) > sample)
-                            gsl_vector_set(m->h, j, 1.0);
-                        else
-                            gsl_vector_set(m->h, j, 0.0);
-                    }
-
-                    for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                    {
-                        gsl_matrix_set(matrix_tmp_probh1, line, j, gsl_vector_get(tmp_probh1, j));
-                    }
-
-                    gsl_vector_memcpy(probh1, tmp_probh1);
-                    gsl_vector_add(ctr_probh1, probh1);
-                    gsl_vector_free(tmp_probh1);
-
-                    /* For each CD iteration */
-                    for (i = 1; i <= n_CD_iterations; i++)
-                    {
-                        /* It computes the P(v2=1|h1), i.e., it computes v2 */
-                        tmp_probvn = getProbabilityTurningOnVisibleUnit4Gaussian(m, m->h, m->sigma);
-                        for (j = 0; j < m->n_visible_layer_neurons; j++)
-                        {
-                            tmp = gsl_vector_get(tmp_probvn, j) + gsl_ran_gaussian(r, gsl_vector_get(m->sigma, j));
-                            gsl_vector_set(m->v, j, tmp);
-                        }
-                        /* It computes the P(h2=1|v2), i.e., it computes h2 (hn) */
-                        tmp_probhn = getProbabilityTurningOnHiddenUnit4Gaussian(m, m->v, m->sigma);
-                        for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                        {
-                            sample = gsl_rng_uniform(r);
-                            if (gsl_vector_get(tmp_probhn, j) > sample)
-                                gsl_vector_set(m->h, j, 1.0);
-                            else
-                                gsl_vector_set(m->h, j, 0.0);
-                        }
-
-                        if (i == n_CD_iterations)
-                        { /* In case of n_CD_iterations > 1 */
-                            gsl_vector_memcpy(probhn, tmp_probhn);
-                            gsl_vector_add(ctr_probhn, probhn);
-                            gsl_vector_memcpy(probvn, m->v);
-                        }
-
-                        gsl_vector_free(tmp_probhn);
-                        gsl_vector_free(tmp_probvn);
-                    }
-
-                    /* It accumulates vn */
-                    for (i = 0; i < m->n_visible_layer_neurons; i++)
-                    {
-                        tmp = gsl_vector_get(m->v, i) / (gsl_vector_get(m->sigma, i) * gsl_vector_get(m->sigma, i));
-                        gsl_vector_set(vtmp, i, tmp);
-                    }
-                    gsl_vector_add(vn, vtmp);
-
-                    for (i = 0; i < tmpCDpos->size1; i++)
-                    {
-                        for (j = 0; j < tmpCDpos->size2; j++)
-                        {
-                            gsl_matrix_set(tmpCDpos, i, j, (gsl_vector_get(D->sample[z].feature, i) / gsl_vector_get(m->sigma, i)) * gsl_vector_get(probh1, j));
-                            gsl_matrix_set(tmpCDneg, i, j, (gsl_vector_get(m->v, i) / gsl_vector_get(m->sigma, i)) * gsl_vector_get(probhn, j));
-                        }
-                    }
-                    gsl_matrix_add(CDpos, tmpCDpos);
-                    gsl_matrix_add(CDneg, tmpCDneg);
-
-                    /* Starting gaussians */
-                    for (j = 0; j < m->n_visible_layer_neurons; j++)
-                    {
-                        tmp = ((2 * gsl_vector_get(D->sample[z].feature, j)) * ((gsl_vector_get(m->a, j) - (gsl_vector_get(D->sample[z].feature, j) / 2)) / gsl_vector_get(m->sigma, j)));
-                        gsl_vector_set(p1, j, tmp);
-                    }
-                    gsl_vector_add(pf, p1);
-
-                    w = 0;
-                    for (i = 0; i < tmpWxP->size1; i++)
-                    { /* Visible 3 */
-                        tmp = 0.0;
-                        for (j = 0; j < tmpWxP->size2; j++)
-                        { /* Hidden 4 */
-                            tmp += gsl_matrix_get(m->W, i, j) * gsl_vector_get(probh1, j);
-                        }
-                        gsl_matrix_set(matrix_data_W_probh1, line, i, (gsl_vector_get(D->sample[z].feature, w) * tmp));
-                        w++;
-                    }
-
-                    for (j = 0; j < m->n_visible_layer_neurons; j++)
-                    {
-                        tmp = ((2 * gsl_vector_get(probvn, j)) * ((gsl_vector_get(m->a, j) - (gsl_vector_get(probvn, j) / 2)) / gsl_vector_get(m->sigma, j)));
-                        gsl_vector_set(p2, j, tmp);
-                    }
-                    gsl_vector_add(pf2, p2);
-
-                    w = 0;
-                    for (i = 0; i < tmpWxP->size1; i++)
-                    { /* Visible 3 */
-                        tmp = 0.0;
-                        for (j = 0; j < tmpWxP->size2; j++)
-                        { /* Hidden 4 */
-                            tmp += gsl_matrix_get(m->W, i, j) * gsl_vector_get(probhn, j);
-                        }
-                        gsl_matrix_set(matrix_probvn_W_probhn, line, i, (gsl_vector_get(D->sample[z].feature, w) * tmp));
-                        w++;
-                    }
-
-                    error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
-
-                    gsl_vector_free(probh1);
-                    gsl_vector_free(probhn);
-                    gsl_vector_free(probvn);
-
-                    line++;
-                    z++;
-                }
+                rv = gsl_matrix_submatrix(R, 0, 0, n, R->size2);
+                SampleGaussianBatchDropoutMasks(&rv.matrix, p, r);
             }
 
-            errorsum = errorsum + error / ctr;
-            plsum = plsum + pl / ctr;
-
-            if (e > 5)
-            {
-                m->alpha = 0.9;
-            }
-            else
-            {
-                m->alpha = 0.5;
-            }
+            /* It computes the P(h=1|v1), i.e., it computes h1 */
+            GaussianBatchHiddenPass(m, &s1.matrix, NULL, dropout ? &rv.matrix : NULL, &ph1.matrix);
+            SampleGaussianBatchHiddenUnits(&ph1.matrix, r, &h.matrix);
 
-            for (j = 0; j < m->n_visible_layer_neurons; j++)
+            /* For each CD iteration */
+            for (k = 1; k <= n_CD_iterations; k++)
             {
-                tmp = 0.0;
-                for (i = 0; i < batch_size; i++)
-                {
-                    tmp += gsl_matrix_get(matrix_data_W_probh1, i, j);
-                }
-                gsl_vector_set(tmp_sum2, j, tmp);
+                /* It samples v2 given h1 and computes the P(h2=1|v2), i.e., it computes h2 (hn) */
+                GaussianBatchVisibleSample(m, &h.matrix, inv_sigma, r, &v.matrix, &sn.matrix);
+                GaussianBatchHiddenPass(m, &sn.matrix, NULL, dropout ? &rv.matrix : NULL, &phn.matrix);
+                if (k < n_CD_iterations)
+                    SampleGaussianBatchHiddenUnits(&phn.matrix, r, &h.matrix);
             }
-            gsl_vector_add(pf, tmp_sum2);
 
-            for (j = 0; j < m->n_visible_layer_neurons; j++)
+            error = 0.0;
+            for (i = 0; i < n; i++)
             {
-                tmp = 0.0;
-                for (i = 0; i < batch_size; i++)
-                {
-                    tmp += gsl_matrix_get(matrix_probvn_W_probhn, i, j);
-                }
-                gsl_vector_set(tmp_sum4, j, tmp);
+                row_x = gsl_matrix_row(&x.matrix, i);
+                row_v = gsl_matrix_row(&v.matrix, i);
+                error += getReconstructionError(&row_x.vector, &row_v.vector);
             }
-            gsl_vector_add(pf2, tmp_sum4);
-            gsl_vector_sub(pf, pf2);
+            pl = m->monitor ? 0.0 : getBatchPseudoLikelihood(m, &v.matrix, &h.matrix, r); /* h is no longer needed by this batch, and the monitor takes over the pseudo-likelihood */
+            errorsum += error / n;
+            plsum += pl / n;
 
-            /* Updating sigma */
-            for (j = 0; j < m->n_visible_layer_neurons; j++)
+            /* Updating sigma, whose statistics are taken with the parameters the batch was sampled with */
+            if (rate > 0)
             {
-                tmp = (m->alpha * gsl_vector_get(invfstdInc, j)) + (gsl_vector_get(std_rate, e - 1) / batch_size) * gsl_vector_get(pf, j);
-                gsl_vector_set(invfstdInc, j, tmp);
+                gsl_vector_set_zero(sgrad);
+                AccumulateGaussianSigmaStatistics(m, &x.matrix, &ph1.matrix, inv_sigma, &q.matrix, 1.0, sgrad);
+                AccumulateGaussianSigmaStatistics(m, &v.matrix, &phn.matrix, inv_sigma, &q.matrix, -1.0, sgrad);
             }
 
-            /* Updating w parameter */
-            gsl_matrix_sub(CDpos, CDneg);
-            gsl_matrix_scale(CDpos, (rr / batch_size));
-            gsl_matrix_scale(tmpW, m->alpha);
-            gsl_matrix_add(tmpW, CDpos);
-            gsl_matrix_memcpy(auxW, m->W);
-            gsl_matrix_scale(auxW, (rr * m->lambda));
-            gsl_matrix_sub(tmpW, auxW);
-
             /* Updating a parameter */
-            gsl_vector_sub(v1, vn);
-            gsl_vector_scale(v1, (rr / batch_size));
-            gsl_vector_scale(tmpa, m->alpha);
-            gsl_vector_add(tmpa, v1);
+            gsl_blas_dgemv(CblasTrans, 1.0 / n, &s1.matrix, &ones_view.vector, 0.0, agrad);  /* It performs E_data[v/sigma] */
+            gsl_blas_dgemv(CblasTrans, -1.0 / n, &sn.matrix, &ones_view.vector, 1.0, agrad); /* It performs E_data - E_model */
+            gsl_vector_mul(agrad, inv_sigma);                                                /* It performs (E_data - E_model)[v/sigma^2] */
 
             /* Updating b parameter */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);
-            gsl_vector_scale(ctr_probh1, (rr / batch_size));
-            gsl_vector_scale(tmpb, m->alpha);
-            gsl_vector_add(tmpb, ctr_probh1);
-
-            for (j = 0; j < m->n_visible_layer_neurons; j++)
-            {
-                gsl_vector_set(invfstd, j, (1.0 / gsl_vector_get(m->sigma, j)));
-            }
-            gsl_vector_add(invfstd, invfstdInc);
-            for (j = 0; j < m->n_visible_layer_neurons; j++)
-            {
-                gsl_vector_set(m->sigma, j, (1.0 / gsl_vector_get(invfstd, j)));
-                if (0.005 > gsl_vector_get(m->sigma, j))
-                {
-                    gsl_vector_set(m->sigma, j, 0.005);
-                }
-            }
-            gsl_matrix_add(m->W, tmpW);
-            gsl_vector_add(m->a, tmpa);
-            gsl_vector_add(m->b, tmpb);
+            gsl_blas_dgemv(CblasTrans, 1.0 / n, &ph1.matrix, &ones_view.vector, 0.0, bgrad);
+            gsl_blas_dgemv(CblasTrans, -1.0 / n, &phn.matrix, &ones_view.vector, 1.0, bgrad);
+
+            if (rate > 0)
+                UpdateGaussianSigma(m, sgrad, invfstdInc, rate, n);
+            UpdateParameterMatrix4Batch(m, m->W, &s1.matrix, &ph1.matrix, 1.0 / n, &sn.matrix, &phn.matrix, 1.0 / n, rr, rr * m->lambda, tmpW); /* It performs W' = alpha*W' + rr*(E_data[(v/sigma)h] - E_model[(v/sigma)h]) - rr*lambda*W and W = W + W' */
+            UpdateParameterVector(m, m->a, agrad, NULL, 1.0, rr, tmpa);
+            UpdateParameterVector(m, m->b, bgrad, NULL, 1.0, rr, tmpb);
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
+        trained = z < D->size ? z / batch_size + 1 : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        error = errorsum / trained;
+        pl = plsum / trained;
         fprintf(stderr, "  -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
         fprintf(stdout, "%d %lf %lf\n", e, error, pl);
 
-        if (error < 0.0001)
+        if (error < 0.0001 || HasStoppedEarly(m))
             e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
-
-    gsl_vector_free(tmpVectorz);
-    gsl_matrix_free(matrixData);
-    gsl_matrix_free(tmpMatriz);
-    gsl_vector_free(v1);
-    gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
-    gsl_vector_free(ctr_probh1);
-    gsl_vector_free(ctr_probhn);
+    gsl_matrix_free(X);
+    gsl_matrix_free(S1);
+    gsl_matrix_free(V);
+    gsl_matrix_free(Sn);
+    gsl_matrix_free(Q);
+    gsl_matrix_free(PH1);
+    gsl_matrix_free(PHn);
+    gsl_matrix_free(H);
+    if (dropout)
+        gsl_matrix_free(R);
+    DestroyParameterState(&tmpW);
+    gsl_vector_free(inv_sigma);
+    gsl_vector_free(agrad);
+    gsl_vector_free(sgrad);
+    DestroyParameterState(&tmpa);
     gsl_vector_free(invfstdInc);
-    gsl_vector_free(std_rate);
-    gsl_vector_free(invfstd);
-    gsl_matrix_free(matrix_data_W_probh1);
-    gsl_matrix_free(matrix_probvn_W_probhn);
-    gsl_vector_free(tmp_sum2);
-    gsl_vector_free(tmp_sum4);
-    gsl_vector_free(vtmp);
-
-    gsl_matrix_free(CDpos);
-    gsl_matrix_free(CDneg);
-    gsl_matrix_free(tmpCDneg);
-    gsl_matrix_free(tmpWxP);
-    gsl_matrix_free(matrix_tmp_probh1);
-    gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
-
-    gsl_vector_free(p1);
-    gsl_vector_free(pf);
-    gsl_vector_free(p2);
-    gsl_vector_free(pf2);
+    gsl_vector_free(bgrad);
+    DestroyParameterState(&tmpb);
+    gsl_vector_free(ones);
 
     return error;
 }
 
-/* It trains a Gaussian-Bernoulli RBM with Dropout by Constrative Divergence for image reconstruction (binary images)
-Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, p]
-D: dataset
+/* It trains a Gaussian-Bernoulli RBM by Constrative Divergence for image reconstruction (binary images)
+Parameters: [D, m, n_epochs, n_CD_iterations, batch_size]
+D: dataset
+m: RBM
+n_epochs: number of training epochs
+n_CD_iterations: number of CD iterations
+batch_size: size of batch data */
+double GaussianBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size)
+{
+    return GaussianBernoulliTraining(D, m, n_epochs, n_CD_iterations, batch_size, 1.0, 0);
+}
+
+/* It trains a Gaussian-Bernoulli RBM with Dropout by Constrative Divergence for image reconstruction (binary images)
+Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, p]
+D: dataset
 m: RBM
 n_epochs: number of training epochs
 n_CD_iterations: number of CD iterations
@@ -6390,663 +6254,85 @@ batch_size: size of batch data
 p: hidden neurons dropout rate */
 double GaussianBernoulliRBMTrainingbyContrastiveDivergencewithDropout(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
 {
-    int i, j, z, n, t, e, n_batches = ceil((float)D->size / batch_size), ctr, w, line;
-    double error, sample, errorsum, pl, plsum, v_std_rate;
-    const gsl_rng_type *T;
-    gsl_matrix *CDpos = NULL, *CDneg = NULL, *tmpCDpos = NULL, *tmpCDneg = NULL, *tmpW = NULL, *auxW = NULL, *tmpWxP = NULL, *matrix_data_W_probh1 = NULL, *matrix_probvn_W_probhn = NULL, *matrix_tmp_probh1;
-    gsl_vector *v1 = NULL, *vn = NULL, *tmpa = NULL, *tmpb = NULL;
-    gsl_vector *probh1 = NULL, *probhn = NULL, *probvn = NULL, *ctr_probh1 = NULL, *ctr_probhn = NULL, *tmp_probh1 = NULL, *tmp_probhn = NULL;
-    gsl_vector *tmp_probvn = NULL, *tmp_sum2 = NULL, *tmp_sum4 = NULL;
-    gsl_rng *r;
-
-    /* Gaussian */
-    gsl_vector *p1 = NULL, *pf = NULL, *pf2 = NULL, *p2 = NULL, *invfstdInc = NULL, *std_rate = NULL, *invfstd = NULL;
-    p1 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    p2 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    pf = gsl_vector_calloc(m->n_visible_layer_neurons);
-    pf2 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmp_sum2 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    tmp_sum4 = gsl_vector_calloc(m->n_visible_layer_neurons);
-
-    invfstd = gsl_vector_calloc(m->n_visible_layer_neurons);
-    gsl_vector_set_zero(invfstd);
-
-    invfstdInc = gsl_vector_calloc(m->n_visible_layer_neurons);
-    gsl_vector_set_zero(invfstdInc);
-
-    std_rate = gsl_vector_calloc(n_epochs);
-    gsl_vector_set_zero(std_rate);
-
-    matrix_data_W_probh1 = gsl_matrix_calloc(batch_size, m->n_visible_layer_neurons);
-    gsl_matrix_set_zero(matrix_data_W_probh1);
-
-    matrix_probvn_W_probhn = gsl_matrix_calloc(batch_size, m->n_visible_layer_neurons);
-    gsl_matrix_set_zero(matrix_probvn_W_probhn);
-
-    matrix_tmp_probh1 = gsl_matrix_calloc(batch_size, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(matrix_tmp_probh1);
-
-    gsl_matrix *matrixData = NULL;
-    matrixData = gsl_matrix_calloc(batch_size, m->n_visible_layer_neurons);
-    gsl_matrix_set_zero(matrixData);
-
-    gsl_vector *tmpVectorz = NULL;
-    tmpVectorz = gsl_vector_calloc(m->n_hidden_layer_neurons);
-
-    gsl_vector *vtmp = NULL;
-    vtmp = gsl_vector_calloc(m->n_visible_layer_neurons);
-
-    double rr = 0.001;
-    float tmp;
-
-    srand(time(NULL));
-    T = gsl_rng_default;
-    r = gsl_rng_alloc(T);
-    gsl_rng_set(r, random_seed_deep());
-
-    v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    vn = gsl_vector_calloc(m->n_visible_layer_neurons);
-
-    tmpa = gsl_vector_calloc(m->n_visible_layer_neurons);
-
-    tmpb = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    gsl_vector_set_zero(tmpa);
-    gsl_vector_set_zero(tmpb);
-
-    ctr_probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    ctr_probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
-
-    CDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    CDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDpos = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpCDneg = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpWxP = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    auxW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpW);
-    gsl_matrix_set_zero(auxW);
-
-    gsl_matrix *tmpMatriz = NULL;
-    tmpMatriz = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    gsl_matrix_set_zero(tmpMatriz);
+    return GaussianBernoulliTraining(D, m, n_epochs, n_CD_iterations, batch_size, p, 1);
+}
 
-    v_std_rate = 30;
-    if ((n_epochs / 2) < v_std_rate)
-        v_std_rate = n_epochs / 2;
+/* It computes the probability of the label units of a batch given its hidden units, i.e., P(y|h) = softmax(U*h + c), and it samples the label with the
+highest probability of each sample
+Parameters: [m, H, prob_Y, labels]
+m: DRBM
+H: hidden units (one sample per row)
+prob_Y: probability of label units (one sample per row, same number of rows as H)
+labels: index of the sampled label of each sample */
+static void GaussianBatchLabelPass(RBM *m, gsl_matrix *H, gsl_matrix *prob_Y, int *labels)
+{
+    double *y, *c = gsl_vector_ptr(m->c, 0), max, den;
+    int i, k;
 
-    for (i = 0; i < n_epochs; i++)
+    gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, H, m->U, 0.0, prob_Y); /* It computes U*h for the whole batch */
+    for (i = 0; i < prob_Y->size1; i++)
     {
-        gsl_vector_set(std_rate, i, 0.001);
-
-        if (i < v_std_rate)
+        y = gsl_matrix_ptr(prob_Y, i, 0);
+        labels[i] = 0;
+        for (k = 0; k < prob_Y->size2; k++)
         {
-            gsl_vector_set(std_rate, i, 0.0);
+            y[k] += c[k];
+            if (y[k] > y[labels[i]])
+                labels[i] = k;
         }
-    }
-
-    error = 0;
-
-    /* For each epoch */
-    for (e = 1; e <= n_epochs; e++)
-    {
-        fprintf(stderr, "\nRunning epoch %d ... ", e);
-        errorsum = plsum = 0.0;
-        z = 0;
-
-        /* For each batch */
-        for (n = 1; n <= n_batches; n++)
+        max = y[labels[i]];
+        den = 0.0;
+        for (k = 0; k < prob_Y->size2; k++)
         {
-            ctr = 0;
-            line = 0;
-            error = pl = 0.0;
-            gsl_matrix_set_zero(CDpos);
-            gsl_matrix_set_zero(CDneg);
-            gsl_vector_set_zero(v1);
-            gsl_vector_set_zero(vn);
-            gsl_vector_set_zero(ctr_probh1);
-            gsl_vector_set_zero(ctr_probhn);
-            gsl_vector_set_zero(pf);
-            gsl_vector_set_zero(pf2);
-            gsl_vector_set_zero(tmp_sum2);
-            gsl_vector_set_zero(tmp_sum4);
-
-            for (t = 0; t < batch_size; t++)
-            {
-                /* It computes r for dropping out hidden units */
-                InitializeBias4DropoutHiddenUnits(m, p);
-
-                if (z < D->size)
-                {
-                    ctr++;
-                    probh1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
-                    probhn = gsl_vector_calloc(m->n_hidden_layer_neurons);
-                    probvn = gsl_vector_calloc(m->n_visible_layer_neurons);
-
-                    /* It sets v1 */
-                    setVisibleLayer(m, D->sample[z].feature);
-                    for (j = 0; j < m->n_visible_layer_neurons; j++)
-                        gsl_matrix_set(matrixData, line, j, gsl_vector_get(m->v, j));
-
-                    /* It accumulates v1 */
-                    for (i = 0; i < m->n_visible_layer_neurons; i++)
-                    {
-                        tmp = gsl_vector_get(m->v, i) / (gsl_vector_get(m->sigma, i) * gsl_vector_get(m->sigma, i));
-                        gsl_vector_set(vtmp, i, tmp);
-                    }
-                    gsl_vector_add(v1, vtmp);
-
-                    /* It computes the P(h=1|v1), i.e., it computes h1 */
-                    tmp_probh1 = getProbabilityTurningOnHiddenUnit4Gaussian4Dropout(m, m->r, m->v, m->sigma);
-                    for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                    {
-                        sample = gsl_rng_uniform(r);
-                        if (gsl_vector_get(tmp_probh1, j) > sample)
-                            gsl_vector_set(m->h, j, 1.0);
-                        else
-                            gsl_vector_set(m->h, j, 0.0);
-                    }
-
-                    for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                    {
-                        gsl_matrix_set(matrix_tmp_probh1, line, j, gsl_vector_get(tmp_probh1, j));
-                    }
-
-                    gsl_vector_memcpy(probh1, tmp_probh1);
-                    gsl_vector_add(ctr_probh1, probh1);
-                    gsl_vector_free(tmp_probh1);
-
-                    /* For each CD iteration */
-                    for (i = 1; i <= n_CD_iterations; i++)
-                    {
-                        /* It computes the P(v2=1|h1), i.e., it computes v2 */
-                        tmp_probvn = getProbabilityTurningOnVisibleUnit4Gaussian4Dropout(m, m->r, m->h, m->sigma);
-                        for (j = 0; j < m->n_visible_layer_neurons; j++)
-                        {
-                            tmp = gsl_vector_get(tmp_probvn, j) + gsl_ran_gaussian(r, gsl_vector_get(m->sigma, j));
-                            gsl_vector_set(m->v, j, tmp);
-                        }
-                        /* It computes the P(h2=1|v2), i.e., it computes h2 (hn) */
-                        tmp_probhn = getProbabilityTurningOnHiddenUnit4Gaussian4Dropout(m, m->r, m->v, m->sigma);
-                        for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                        {
-                            sample = gsl_rng_uniform(r);
-                            if (gsl_vector_get(tmp_probhn, j) > sample)
-                                gsl_vector_set(m->h, j, 1.0);
-                            else
-                                gsl_vector_set(m->h, j, 0.0);
-                        }
-
-                        if (i == n_CD_iterations)
-                        { /* In case of n_CD_iterations > 1 */
-                            gsl_vector_memcpy(probhn, tmp_probhn);
-                            gsl_vector_add(ctr_probhn, probhn);
-                            gsl_vector_memcpy(probvn, m->v);
-                        }
-
-                        gsl_vector_free(tmp_probhn);
-                        gsl_vector_free(tmp_probvn);
-                    }
-
-                    /* It accumulates vn */
-                    for (i = 0; i < m->n_visible_layer_neurons; i++)
-                    {
-                        tmp = gsl_vector_get(m->v, i) / (gsl_vector_get(m->sigma, i) * gsl_vector_get(m->sigma, i));
-                        gsl_vector_set(vtmp, i, tmp);
-                    }
-                    gsl_vector_add(vn, vtmp);
-
-                    for (i = 0; i < tmpCDpos->size1; i++)
-                    {
-                        for (j = 0; j < tmpCDpos->size2; j++)
-                        {
-                            gsl_matrix_set(tmpCDpos, i, j, (gsl_vector_get(D->sample[z].feature, i) / gsl_vector_get(m->sigma, i)) * gsl_vector_get(probh1, j));
-                            gsl_matrix_set(tmpCDneg, i, j, (gsl_vector_get(m->v, i) / gsl_vector_get(m->sigma, i)) * gsl_vector_get(probhn, j));
-                        }
-                    }
-                    gsl_matrix_add(CDpos, tmpCDpos);
-                    gsl_matrix_add(CDneg, tmpCDneg);
-
-                    /* Starting gaussians */
-                    for (j = 0; j < m->n_visible_layer_neurons; j++)
-                    {
-                        tmp = ((2 * gsl_vector_get(D->sample[z].feature, j)) * ((gsl_vector_get(m->a, j) - (gsl_vector_get(D->sample[z].feature, j) / 2)) / gsl_vector_get(m->sigma, j)));
-                        gsl_vector_set(p1, j, tmp);
-                    }
-                    gsl_vector_add(pf, p1);
-
-                    w = 0;
-                    for (i = 0; i < tmpWxP->size1; i++)
-                    { /* Visible 3 */
-                        tmp = 0.0;
-                        for (j = 0; j < tmpWxP->size2; j++)
-                        { /* Hidden 4 */
-                            tmp += gsl_matrix_get(m->W, i, j) * gsl_vector_get(probh1, j);
-                        }
-                        gsl_matrix_set(matrix_data_W_probh1, line, i, (gsl_vector_get(D->sample[z].feature, w) * tmp));
-                        w++;
-                    }
-
-                    for (j = 0; j < m->n_visible_layer_neurons; j++)
-                    {
-                        tmp = ((2 * gsl_vector_get(probvn, j)) * ((gsl_vector_get(m->a, j) - (gsl_vector_get(probvn, j) / 2)) / gsl_vector_get(m->sigma, j)));
-                        gsl_vector_set(p2, j, tmp);
-                    }
-                    gsl_vector_add(pf2, p2);
-
-                    w = 0;
-                    for (i = 0; i < tmpWxP->size1; i++)
-                    { /* Visible 3 */
-                        tmp = 0.0;
-                        for (j = 0; j < tmpWxP->size2; j++)
-                        { /* Hidden 4 */
-                            tmp += gsl_matrix_get(m->W, i, j) * gsl_vector_get(probhn, j);
-                        }
-                        gsl_matrix_set(matrix_probvn_W_probhn, line, i, (gsl_vector_get(D->sample[z].feature, w) * tmp));
-                        w++;
-                    }
-
-                    error += getReconstructionError(D->sample[z].feature, probvn);
-                    pl += getPseudoLikelihood(m, m->v);
-
-                    gsl_vector_free(probh1);
-                    gsl_vector_free(probhn);
-                    gsl_vector_free(probvn);
-
-                    line++;
-                    z++;
-                }
-            }
-
-            errorsum = errorsum + error / ctr;
-            plsum = plsum + pl / ctr;
-
-            if (e > 5)
-            {
-                m->alpha = 0.9;
-            }
-            else
-            {
-                m->alpha = 0.5;
-            }
-
-            for (j = 0; j < m->n_visible_layer_neurons; j++)
-            {
-                tmp = 0.0;
-                for (i = 0; i < batch_size; i++)
-                {
-                    tmp += gsl_matrix_get(matrix_data_W_probh1, i, j);
-                }
-                gsl_vector_set(tmp_sum2, j, tmp);
-            }
-            gsl_vector_add(pf, tmp_sum2);
-
-            for (j = 0; j < m->n_visible_layer_neurons; j++)
-            {
-                tmp = 0.0;
-                for (i = 0; i < batch_size; i++)
-                {
-                    tmp += gsl_matrix_get(matrix_probvn_W_probhn, i, j);
-                }
-                gsl_vector_set(tmp_sum4, j, tmp);
-            }
-            gsl_vector_add(pf2, tmp_sum4);
-            gsl_vector_sub(pf, pf2);
-
-            /* Updating sigma */
-            for (j = 0; j < m->n_visible_layer_neurons; j++)
-            {
-                tmp = (m->alpha * gsl_vector_get(invfstdInc, j)) + (gsl_vector_get(std_rate, e - 1) / batch_size) * gsl_vector_get(pf, j);
-                gsl_vector_set(invfstdInc, j, tmp);
-            }
-
-            /* Updating w parameter */
-            gsl_matrix_sub(CDpos, CDneg);
-            gsl_matrix_scale(CDpos, (rr / batch_size));
-            gsl_matrix_scale(tmpW, m->alpha);
-            gsl_matrix_add(tmpW, CDpos);
-            gsl_matrix_memcpy(auxW, m->W);
-            gsl_matrix_scale(auxW, (rr * m->lambda));
-            gsl_matrix_sub(tmpW, auxW);
-
-            /* Updating a parameter */
-            gsl_vector_sub(v1, vn);
-            gsl_vector_scale(v1, (rr / batch_size));
-            gsl_vector_scale(tmpa, m->alpha);
-            gsl_vector_add(tmpa, v1);
-
-            /* Updating b parameter */
-            gsl_vector_sub(ctr_probh1, ctr_probhn);
-            gsl_vector_scale(ctr_probh1, (rr / batch_size));
-            gsl_vector_scale(tmpb, m->alpha);
-            gsl_vector_add(tmpb, ctr_probh1);
-
-            for (j = 0; j < m->n_visible_layer_neurons; j++)
-            {
-                gsl_vector_set(invfstd, j, (1.0 / gsl_vector_get(m->sigma, j)));
-            }
-            gsl_vector_add(invfstd, invfstdInc);
-            for (j = 0; j < m->n_visible_layer_neurons; j++)
-            {
-                gsl_vector_set(m->sigma, j, (1.0 / gsl_vector_get(invfstd, j)));
-                if (0.005 > gsl_vector_get(m->sigma, j))
-                {
-                    gsl_vector_set(m->sigma, j, 0.005);
-                }
-            }
-            gsl_matrix_add(m->W, tmpW);
-            gsl_vector_add(m->a, tmpa);
-            gsl_vector_add(m->b, tmpb);
+            y[k] = exp(y[k] - max);
+            den += y[k];
         }
-
-        error = errorsum / n_batches;
-        pl = plsum / n_batches;
-        fprintf(stderr, "  -> Reconstruction error: %lf with pseudo-likelihood of %lf", error, pl);
-        fprintf(stdout, "%d %lf %lf\n", e, error, pl);
-
-        if (error < 0.0001)
-            e = n_epochs + 1;
+        for (k = 0; k < prob_Y->size2; k++)
+            y[k] /= den;
     }
-
-    gsl_rng_free(r);
-
-    gsl_vector_free(tmpVectorz);
-    gsl_matrix_free(matrixData);
-    gsl_matrix_free(tmpMatriz);
-    gsl_vector_free(v1);
-    gsl_vector_free(vn);
-    gsl_vector_free(tmpa);
-    gsl_vector_free(tmpb);
-    gsl_vector_free(ctr_probh1);
-    gsl_vector_free(ctr_probhn);
-    gsl_vector_free(invfstdInc);
-    gsl_vector_free(std_rate);
-    gsl_vector_free(invfstd);
-    gsl_matrix_free(matrix_data_W_probh1);
-    gsl_matrix_free(matrix_probvn_W_probhn);
-    gsl_vector_free(tmp_sum2);
-    gsl_vector_free(tmp_sum4);
-    gsl_vector_free(vtmp);
-
-    gsl_matrix_free(CDpos);
-    gsl_matrix_free(CDneg);
-    gsl_matrix_free(tmpCDneg);
-    gsl_matrix_free(tmpWxP);
-    gsl_matrix_free(matrix_tmp_probh1);
-    gsl_matrix_free(tmpCDpos);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(auxW);
-
-    gsl_vector_free(p1);
-    gsl_vector_free(pf);
-    gsl_vector_free(p2);
-    gsl_vector_free(pf2);
-
-    return error;
 }
 
-/* It trains a Discriminative Gaussian-Bernoulli RBM by Constrative Divergence for pattern classification
-Parameters: [D, m, n_epochs, n_CD_iterations, batch_size]
-D: dataset
-m: DRBM
-n_epocs: number of epochs
-n_CD_iterations: number of Constrastive Divergence iterations
-batch_size: size of the mini-batch */
-double DiscriminativeGaussianBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size)
+/* It accumulates the label statistics of a phase, i.e., the probabilities of the hidden units into the row of U of each sample's label and the label counts
+Parameters: [prob_H, labels, sign, gradU, gradc]
+prob_H: probability of hidden neurons (one sample per row)
+labels: index of the label of each sample
+sign: 1 for the positive phase and -1 for the negative one
+gradU: statistics of U
+gradc: statistics of c */
+static void AccumulateGaussianLabelStatistics(gsl_matrix *prob_H, int *labels, double sign, gsl_matrix *gradU, gsl_vector *gradc)
 {
-    int e, z, j, i, n, n_batches = ceil((float)D->size / batch_size), t, ctr;
-    gsl_vector *y0 = NULL, *y1 = NULL, *py1 = NULL, *ph0 = NULL, *ph1 = NULL, *pv1 = NULL, *acc_v0 = NULL, *acc_v1 = NULL;
-    gsl_vector *acc_h0 = NULL, *acc_h1 = NULL, *acc_y0 = NULL, *acc_y1 = NULL, *delta_a = NULL, *delta_b = NULL, *delta_c = NULL;
-    gsl_matrix *_posW = NULL, *_negW = NULL, *posW = NULL, *negW = NULL, *_posU = NULL, *_negU = NULL, *posU = NULL, *negU = NULL;
-    gsl_matrix *tmpW = NULL, *tmpU = NULL, *delta_W = NULL, *delta_U = NULL;
-    double sample, error, errorsum, train_error;
-    const gsl_rng_type *T = NULL;
-    gsl_rng *r = NULL;
-
-    srand(time(NULL));
-    T = gsl_rng_default;
-    r = gsl_rng_alloc(T);
-    gsl_rng_set(r, random_seed_deep());
-
-    _posW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    posW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    _negW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    negW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-
-    _posU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-    posU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-    _negU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-    negU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-
-    delta_W = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    delta_U = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-
-    acc_v0 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    acc_v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
-
-    acc_h0 = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    acc_h1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    acc_y0 = gsl_vector_calloc(m->n_labels);
-    acc_y1 = gsl_vector_calloc(m->n_labels);
-
-    delta_a = gsl_vector_calloc(m->n_visible_layer_neurons);
-    delta_b = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    delta_c = gsl_vector_calloc(m->n_labels);
-
-    train_error = 0;
+    double *p, *u;
+    int i, j;
 
-    for (e = 1; e <= n_epochs; e++)
+    for (i = 0; i < prob_H->size1; i++)
     {
-        fprintf(stderr, "\nRunning epoch %d ... ", e);
-
-        errorsum = 0;
-        z = 0;
-
-        /* For each batch */
-        for (n = 1; n <= n_batches; n++)
-        {
-            ctr = 0;
-            error = 0.0;
-            gsl_matrix_set_zero(posW);
-            gsl_matrix_set_zero(negW);
-            gsl_matrix_set_zero(posU);
-            gsl_matrix_set_zero(negU);
-            gsl_vector_set_zero(acc_v0);
-            gsl_vector_set_zero(acc_v1);
-            gsl_vector_set_zero(acc_h0);
-            gsl_vector_set_zero(acc_h1);
-            gsl_vector_set_zero(acc_y0);
-            gsl_vector_set_zero(acc_y1);
-
-            for (t = 0; t < batch_size; t++)
-            {
-                if (z < D->size)
-                {
-                    ctr++;
-                    setVisibleLayer(m, D->sample[z].feature);
-                    gsl_vector_add(acc_v0, m->v);
-                    y0 = label2binary_gsl_vector(D->sample[z].label, D->nlabels);
-                    gsl_vector_add(acc_y0, y0);
-
-                    /* It computes the P(h0|v0,y0) */
-                    ph0 = getDiscriminativeProbabilityTurningOnHiddenUnit4GaussianVisibleUnit(m, y0);
-                    for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                    {
-                        sample = gsl_rng_uniform(r);
-                        if (gsl_vector_get(ph0, j) > sample)
-                            gsl_vector_set(m->h, j, 1.0);
-                        else
-                            gsl_vector_set(m->h, j, 0.0);
-                    }
-                    gsl_vector_add(acc_h0, ph0);
-
-                    /* It computes the P(v1|h0) */
-                    pv1 = getDiscriminativeProbabilityTurningOnVisibleUnit4GaussianVisibleUnit(m, m->h);
-                    for (j = 0; j < m->n_visible_layer_neurons; j++)
-                    {
-                        sample = gsl_rng_uniform(r);
-                        if (gsl_vector_get(pv1, j) > sample)
-                            gsl_vector_set(m->v, j, 1.0);
-                        else
-                            gsl_vector_set(m->v, j, 0.0);
-                    }
-                    gsl_vector_add(acc_v1, m->v);
-
-                    /* It computes the P(y1|h0) */
-                    py1 = getDiscriminativeProbabilityLabelUnit(m);
-                    y1 = gsl_vector_calloc(py1->size);
-                    gsl_vector_set(y1, gsl_vector_max_index(py1), 1.0); /* It samples the class with highest probability */
-                    gsl_vector_add(acc_y1, y1);
-
-                    /* It computes the P(h1|y1,v1) */
-                    ph1 = getDiscriminativeProbabilityTurningOnHiddenUnit(m, y1);
-                    for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                    {
-                        sample = gsl_rng_uniform(r);
-                        if (gsl_vector_get(ph1, j) > sample)
-                            gsl_vector_set(m->h, j, 1.0);
-                        else
-                            gsl_vector_set(m->h, j, 0.0);
-                    }
-                    gsl_vector_add(acc_h1, ph1);
-
-                    for (i = 0; i < _posW->size1; i++)
-                    {
-                        for (j = 0; j < _posW->size2; j++)
-                        {
-                            gsl_matrix_set(_posW, i, j, gsl_vector_get(ph0, j) * (gsl_vector_get(D->sample[z].feature, i) / gsl_vector_get(m->sigma, i)));
-                            gsl_matrix_set(_negW, i, j, gsl_vector_get(ph1, j) * (gsl_vector_get(m->v, i) / gsl_vector_get(m->sigma, i)));
-                        }
-                    }
-
-                    for (i = 0; i < _posU->size1; i++)
-                    {
-                        for (j = 0; j < _posU->size2; j++)
-                        {
-                            gsl_matrix_set(_posU, i, j, gsl_vector_get(ph0, j) * gsl_vector_get(y0, i));
-                            gsl_matrix_set(_negU, i, j, gsl_vector_get(ph1, j) * gsl_vector_get(y1, i));
-                        }
-                    }
-
-                    gsl_matrix_add(posW, _posW);
-                    gsl_matrix_add(negW, _negW);
-
-                    gsl_matrix_add(posU, _posU);
-                    gsl_matrix_add(negU, _negU);
-
-                    error += getReconstructionError(y0, py1);
-
-                    gsl_vector_free(y0);
-                    gsl_vector_free(y1);
-                    gsl_vector_free(py1);
-                    gsl_vector_free(ph0);
-                    gsl_vector_free(ph1);
-                    gsl_vector_free(pv1);
-
-                    z++;
-                }
-            }
-
-            errorsum = errorsum + error / ctr;
-
-            /* Updating W parameter */
-            gsl_matrix_sub(posW, negW); /* posW = posW-negW */
-            gsl_matrix_scale(posW, 1.0 / ctr);
-            gsl_matrix_scale(posW, m->eta); /* posW = eta*posW */
-            gsl_matrix_memcpy(tmpW, m->W);
-            gsl_matrix_scale(tmpW, -m->lambda);  /* tmp = -lambda*W */
-            gsl_matrix_add(posW, tmpW);          /* posW = eta*(posW-negW) - lambda*W */
-            gsl_matrix_scale(delta_W, m->alpha); /* delta_W = alpha*delta_W */
-            gsl_matrix_add(delta_W, posW);       /* delta_W = eta*(posW-negW) - lambda*W * alpha*delta_W */
-            gsl_matrix_add(m->W, delta_W);       /* W = W + delta_W */
-
-            /* Updating U parameter */
-            gsl_matrix_sub(posU, negU); /* posU = posU-negU */
-            gsl_matrix_scale(posU, 1.0 / ctr);
-            gsl_matrix_scale(posU, m->eta); /* posU = eta*posU */
-            gsl_matrix_memcpy(tmpU, m->U);
-            gsl_matrix_scale(tmpU, -m->lambda);  /* tmp = -lambda*U */
-            gsl_matrix_add(posU, tmpU);          /* posU = eta*(posU-negU) -lambda*U */
-            gsl_matrix_scale(delta_U, m->alpha); /* delta_U = alpha*delta_U */
-            gsl_matrix_add(delta_U, posU);       /* delta_U = eta*(posU-negU) -lambda*U + alpha*delta_U */
-            gsl_matrix_add(m->U, delta_U);       /* U = U + delta_U */
-
-            /* Updating a parameter */
-            gsl_vector_div(acc_v0, m->sigma); /* v0 = v0/sigma */
-            gsl_vector_div(acc_v1, m->sigma); /* v1 = v1/sigma */
-            gsl_vector_sub(acc_v0, acc_v1);   /* v0 = v0 - v1 */
-            gsl_vector_scale(acc_v0, 1.0 / ctr);
-            gsl_vector_scale(acc_v0, m->eta);    /* v0 = eta*v0 */
-            gsl_vector_scale(delta_a, m->alpha); /* delta_a = alpha*delta_a */
-            gsl_vector_add(delta_a, acc_v0);     /* delta_a = eta*(v0-v1) + alpha*delta_a */
-            gsl_vector_add(m->a, delta_a);       /* a = a + delta_a */
-
-            /* Updating b parameter */
-            gsl_vector_sub(acc_h0, acc_h1); /* h0 = h0 - h1 */
-            gsl_vector_scale(acc_h0, 1.0 / ctr);
-            gsl_vector_scale(acc_h0, m->eta);    /* h0 = eta*h0 */
-            gsl_vector_scale(delta_b, m->alpha); /* delta_b = alpha*delta_b */
-            gsl_vector_add(delta_b, acc_h0);     /* delta_b = eta*(h0 - h1) + alpha*delta_b */
-            gsl_vector_add(m->b, delta_b);       /* b = b + delta_b */
-
-            /* Updating c parameter */
-            gsl_vector_sub(acc_y0, acc_y1); /* y0 = y0 - y1 */
-            gsl_vector_scale(acc_y0, 1.0 / ctr);
-            gsl_vector_scale(acc_y0, m->eta);    /* y0 = eta*y0 */
-            gsl_vector_scale(delta_c, m->alpha); /* delta_c = alpha*delta_c */
-            gsl_vector_add(delta_c, acc_y0);     /* delta_c = eta*(y0 - y1) + alpha*delta_c */
-            gsl_vector_add(m->c, delta_c);       /* c = c + delta_c */
-        }
-
-        train_error = errorsum / n_batches;
-        fprintf(stderr, "MSE classification error: %lf OK", train_error);
+        p = gsl_matrix_ptr(prob_H, i, 0);
+        u = gsl_matrix_ptr(gradU, labels[i], 0);
+        for (j = 0; j < prob_H->size2; j++)
+            u[j] += sign * p[j];
+        *gsl_vector_ptr(gradc, labels[i]) += sign;
     }
-
-    gsl_rng_free(r);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(tmpU);
-    gsl_matrix_free(_posW);
-    gsl_matrix_free(posW);
-    gsl_matrix_free(_negW);
-    gsl_matrix_free(negW);
-    gsl_matrix_free(_posU);
-    gsl_matrix_free(_negU);
-    gsl_matrix_free(posU);
-    gsl_matrix_free(negU);
-    gsl_matrix_free(delta_W);
-    gsl_matrix_free(delta_U);
-    gsl_vector_free(acc_v0);
-    gsl_vector_free(acc_v1);
-    gsl_vector_free(acc_h0);
-    gsl_vector_free(acc_h1);
-    gsl_vector_free(acc_y0);
-    gsl_vector_free(acc_y1);
-    gsl_vector_free(delta_a);
-    gsl_vector_free(delta_b);
-    gsl_vector_free(delta_c);
-
-    return train_error;
 }
 
-/* It trains a Discriminative Gaussian-Bernoulli RBM with Dropout by Constrative Divergence for pattern classification
-Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, p]
+/* It trains a Discriminative Gaussian-Bernoulli RBM by Constrative Divergence on whole mini-batches, with or without Dropout
+Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, p, dropout]
 D: dataset
 m: DRBM
-n_epocs: number of epochs
+n_epochs: number of training epochs
 n_CD_iterations: number of Constrastive Divergence iterations
 batch_size: size of the mini-batch
-p: hidden neurons dropout rate */
-double DiscriminativeGaussianBernoulliRBMTrainingbyContrastiveDivergencewithDropout(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
+p: probability of keeping a hidden unit
+dropout: it draws one hidden neurons dropout mask per sample if non-zero */
+static double DiscriminativeGaussianBernoulliTraining(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p, int dropout)
 {
-    int e, z, j, i, n, n_batches = ceil((float)D->size / batch_size), t, ctr;
-    gsl_vector *y0 = NULL, *y1 = NULL, *py1 = NULL, *ph0 = NULL, *ph1 = NULL, *pv1 = NULL, *acc_v0 = NULL, *acc_v1 = NULL;
-    gsl_vector *acc_h0 = NULL, *acc_h1 = NULL, *acc_y0 = NULL, *acc_y1 = NULL, *delta_a = NULL, *delta_b = NULL, *delta_c = NULL;
-    gsl_matrix *_posW = NULL, *_negW = NULL, *posW = NULL, *negW = NULL, *_posU = NULL, *_negU = NULL, *posU = NULL, *negU = NULL;
-    gsl_matrix *tmpW = NULL, *tmpU = NULL, *delta_W = NULL, *delta_U = NULL;
-    double sample, error, errorsum, train_error;
+    int e, z, i, k, n, n_batches = ceil((float)D->size / batch_size), trained, *y0 = NULL, *y1 = NULL;
+    double error, errorsum, train_error, rate, *py, tmp;
+    gsl_matrix *X = NULL, *S0 = NULL, *PH0 = NULL, *H = NULL, *V = NULL, *Sn = NULL, *PHn = NULL, *PY = NULL, *R = NULL, *Q = NULL;
+    gsl_matrix *gradU = NULL;
+    ParameterState *delta_W = NULL, *delta_U = NULL, *delta_a = NULL, *delta_b = NULL, *delta_c = NULL;
+    gsl_matrix_view x, s0, ph0, h, v, sn, phn, py_view, rv, q;
+    gsl_vector_view ones_view;
+    gsl_vector *inv_sigma = NULL, *ones = NULL, *agrad = NULL, *bgrad = NULL, *cgrad = NULL, *sgrad = NULL, *invfstdInc = NULL;
     const gsl_rng_type *T = NULL;
     gsl_rng *r = NULL;
 
@@ -7055,231 +6341,200 @@ double DiscriminativeGaussianBernoulliRBMTrainingbyContrastiveDivergencewithDrop
     r = gsl_rng_alloc(T);
     gsl_rng_set(r, random_seed_deep());
 
-    _posW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    posW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    _negW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    negW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-
-    _posU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-    posU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-    _negU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-    negU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-
-    tmpW = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    tmpU = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-
-    delta_W = gsl_matrix_calloc(m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
-    delta_U = gsl_matrix_calloc(m->n_labels, m->n_hidden_layer_neurons);
-
-    acc_v0 = gsl_vector_calloc(m->n_visible_layer_neurons);
-    acc_v1 = gsl_vector_calloc(m->n_visible_layer_neurons);
-
-    acc_h0 = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    acc_h1 = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    acc_y0 = gsl_vector_calloc(m->n_labels);
-    acc_y1 = gsl_vector_calloc(m->n_labels);
-
-    delta_a = gsl_vector_calloc(m->n_visible_layer_neurons);
-    delta_b = gsl_vector_calloc(m->n_hidden_layer_neurons);
-    delta_c = gsl_vector_calloc(m->n_labels);
+    X = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    S0 = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    V = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    Sn = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    Q = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    PH0 = gsl_matrix_alloc(batch_size, m->n_hidden_layer_neurons);
+    PHn = gsl_matrix_alloc(batch_size, m->n_hidden_layer_neurons);
+    H = gsl_matrix_alloc(batch_size, m->n_hidden_layer_neurons);
+    PY = gsl_matrix_alloc(batch_size, m->n_labels);
+    if (dropout)
+        R = gsl_matrix_alloc(batch_size, m->n_hidden_layer_neurons);
+    y0 = (int *)malloc(batch_size * sizeof(int));
+    y1 = (int *)malloc(batch_size * sizeof(int));
+    if (!y0 || !y1)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @DiscriminativeGaussianBernoulliTraining.\n");
+        exit(-1);
+    }
+    gradU = gsl_matrix_alloc(m->n_labels, m->n_hidden_layer_neurons);
+    delta_W = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    delta_U = CreateParameterState(m, m->n_labels, m->n_hidden_layer_neurons);
+    inv_sigma = gsl_vector_alloc(m->n_visible_layer_neurons);
+    agrad = gsl_vector_alloc(m->n_visible_layer_neurons);
+    sgrad = gsl_vector_alloc(m->n_visible_layer_neurons);
+    invfstdInc = gsl_vector_calloc(m->n_visible_layer_neurons);
+    bgrad = gsl_vector_alloc(m->n_hidden_layer_neurons);
+    cgrad = gsl_vector_alloc(m->n_labels);
+    delta_a = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    delta_b = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
+    delta_c = CreateParameterState(m, m->n_labels, 1);
+    ones = gsl_vector_alloc(batch_size);
+    gsl_vector_set_all(ones, 1.0);
 
     train_error = 0;
 
     for (e = 1; e <= n_epochs; e++)
     {
         fprintf(stderr, "\nRunning epoch %d ... ", e);
-
         errorsum = 0;
-        z = 0;
+        rate = getGaussianSigmaRate(m, e, n_epochs);
 
         /* For each batch */
-        for (n = 1; n <= n_batches; n++)
+        for (z = 0; z < D->size; z += batch_size)
         {
-            ctr = 0;
-            error = 0.0;
-            gsl_matrix_set_zero(posW);
-            gsl_matrix_set_zero(negW);
-            gsl_matrix_set_zero(posU);
-            gsl_matrix_set_zero(negU);
-            gsl_vector_set_zero(acc_v0);
-            gsl_vector_set_zero(acc_v1);
-            gsl_vector_set_zero(acc_h0);
-            gsl_vector_set_zero(acc_h1);
-            gsl_vector_set_zero(acc_y0);
-            gsl_vector_set_zero(acc_y1);
-
-            for (t = 0; t < batch_size; t++)
+            n = D->size - z < batch_size ? D->size - z : batch_size;
+            x = gsl_matrix_submatrix(X, 0, 0, n, X->size2);
+            s0 = gsl_matrix_submatrix(S0, 0, 0, n, S0->size2);
+            v = gsl_matrix_submatrix(V, 0, 0, n, V->size2);
+            sn = gsl_matrix_submatrix(Sn, 0, 0, n, Sn->size2);
+            q = gsl_matrix_submatrix(Q, 0, 0, n, Q->size2);
+            ph0 = gsl_matrix_submatrix(PH0, 0, 0, n, PH0->size2);
+            phn = gsl_matrix_submatrix(PHn, 0, 0, n, PHn->size2);
+            h = gsl_matrix_submatrix(H, 0, 0, n, H->size2);
+            py_view = gsl_matrix_submatrix(PY, 0, 0, n, PY->size2);
+            ones_view = gsl_vector_subvector(ones, 0, n);
+
+            getGaussianInverseSigma(m, inv_sigma);
+            getGaussianBatch(D, z, inv_sigma, &x.matrix, &s0.matrix);
+            for (i = 0; i < n; i++)
+                y0[i] = D->sample[z + i].label - 1;
+            if (dropout)
             {
-                /* It computes r for dropping out hidden units */
-                InitializeBias4DropoutHiddenUnits(m, p);
-
-                if (z < D->size)
-                {
-                    ctr++;
-                    setVisibleLayer(m, D->sample[z].feature);
-                    gsl_vector_add(acc_v0, m->v);
-                    y0 = label2binary_gsl_vector(D->sample[z].label, D->nlabels);
-                    gsl_vector_add(acc_y0, y0);
-
-                    /* It computes the P(h0|v0,y0) */
-                    ph0 = getDiscriminativeProbabilityTurningOnHiddenUnit4GaussianVisibleUnit4Dropout(m, m->r, y0);
-                    for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                    {
-                        sample = gsl_rng_uniform(r);
-                        if (gsl_vector_get(ph0, j) > sample)
-                            gsl_vector_set(m->h, j, 1.0);
-                        else
-                            gsl_vector_set(m->h, j, 0.0);
-                    }
-                    gsl_vector_add(acc_h0, ph0);
-
-                    /* It computes the P(v1|h0) */
-                    pv1 = getDiscriminativeProbabilityTurningOnVisibleUnit4GaussianVisibleUnit4Dropout(m, m->r, m->h);
-                    for (j = 0; j < m->n_visible_layer_neurons; j++)
-                    {
-                        sample = gsl_rng_uniform(r);
-                        if (gsl_vector_get(pv1, j) > sample)
-                            gsl_vector_set(m->v, j, 1.0);
-                        else
-                            gsl_vector_set(m->v, j, 0.0);
-                    }
-                    gsl_vector_add(acc_v1, m->v);
-
-                    /* It computes the P(y1|h0) */
-                    py1 = getDiscriminativeProbabilityLabelUnit(m);
-                    y1 = gsl_vector_calloc(py1->size);
-                    gsl_vector_set(y1, gsl_vector_max_index(py1), 1.0); /* It samples the class with highest probability */
-                    gsl_vector_add(acc_y1, y1);
-
-                    /* It computes the P(h1|y1,v1) */
-                    ph1 = getDiscriminativeProbabilityTurningOnHiddenUnit4Dropout(m, m->r, y1);
-                    for (j = 0; j < m->n_hidden_layer_neurons; j++)
-                    {
-                        sample = gsl_rng_uniform(r);
-                        if (gsl_vector_get(ph1, j) > sample)
-                            gsl_vector_set(m->h, j, 1.0);
-                        else
-                            gsl_vector_set(m->h, j, 0.0);
-                    }
-                    gsl_vector_add(acc_h1, ph1);
-
-                    for (i = 0; i < _posW->size1; i++)
-                    {
-                        for (j = 0; j < _posW->size2; j++)
-                        {
-                            gsl_matrix_set(_posW, i, j, gsl_vector_get(ph0, j) * (gsl_vector_get(D->sample[z].feature, i) / gsl_vector_get(m->sigma, i)));
-                            gsl_matrix_set(_negW, i, j, gsl_vector_get(ph1, j) * (gsl_vector_get(m->v, i) / gsl_vector_get(m->sigma, i)));
-                        }
-                    }
-
-                    for (i = 0; i < _posU->size1; i++)
-                    {
-                        for (j = 0; j < _posU->size2; j++)
-                        {
-                            gsl_matrix_set(_posU, i, j, gsl_vector_get(ph0, j) * gsl_vector_get(y0, i));
-                            gsl_matrix_set(_negU, i, j, gsl_vector_get(ph1, j) * gsl_vector_get(y1, i));
-                        }
-                    }
-
-                    gsl_matrix_add(posW, _posW);
-                    gsl_matrix_add(negW, _negW);
-
-                    gsl_matrix_add(posU, _posU);
-                    gsl_matrix_add(negU, _negU);
+                rv = gsl_matrix_submatrix(R, 0, 0, n, R->size2);
+                SampleGaussianBatchDropoutMasks(&rv.matrix, p, r);
+            }
 
-                    error += getReconstructionError(y0, py1);
+            /* It computes the P(h0|v0,y0) */
+            GaussianBatchHiddenPass(m, &s0.matrix, y0, dropout ? &rv.matrix : NULL, &ph0.matrix);
+            SampleGaussianBatchHiddenUnits(&ph0.matrix, r, &h.matrix);
 
-                    gsl_vector_free(y0);
-                    gsl_vector_free(y1);
-                    gsl_vector_free(py1);
-                    gsl_vector_free(ph0);
-                    gsl_vector_free(ph1);
-                    gsl_vector_free(pv1);
+            for (k = 1; k <= n_CD_iterations; k++)
+            {
+                /* It samples v1 given h0 and computes the P(y1|h0), taking the class with highest probability */
+                GaussianBatchVisibleSample(m, &h.matrix, inv_sigma, r, &v.matrix, &sn.matrix);
+                GaussianBatchLabelPass(m, &h.matrix, &py_view.matrix, y1);
+
+                /* It computes the P(h1|y1,v1) */
+                GaussianBatchHiddenPass(m, &sn.matrix, y1, dropout ? &rv.matrix : NULL, &phn.matrix);
+                if (k < n_CD_iterations)
+                    SampleGaussianBatchHiddenUnits(&phn.matrix, r, &h.matrix);
+            }
 
-                    z++;
+            /* It computes the mean squared error between y0 and P(y1|h0) */
+            error = 0.0;
+            for (i = 0; i < n; i++)
+            {
+                py = gsl_matrix_ptr(&py_view.matrix, i, 0);
+                for (k = 0; k < m->n_labels; k++)
+                {
+                    tmp = (k == y0[i]) - py[k];
+                    error += tmp * tmp;
                 }
             }
+            errorsum += error / m->n_labels / n;
 
-            errorsum = errorsum + error / ctr;
-
-            /* Updating W parameter */
-            gsl_matrix_sub(posW, negW); /* posW = posW-negW */
-            gsl_matrix_scale(posW, 1.0 / ctr);
-            gsl_matrix_scale(posW, m->eta); /* posW = eta*posW */
-            gsl_matrix_memcpy(tmpW, m->W);
-            gsl_matrix_scale(tmpW, -m->lambda);  /* tmp = -lambda*W */
-            gsl_matrix_add(posW, tmpW);          /* posW = eta*(posW-negW) - lambda*W */
-            gsl_matrix_scale(delta_W, m->alpha); /* delta_W = alpha*delta_W */
-            gsl_matrix_add(delta_W, posW);       /* delta_W = eta*(posW-negW) - lambda*W * alpha*delta_W */
-            gsl_matrix_add(m->W, delta_W);       /* W = W + delta_W */
+            /* Updating sigma */
+            if (rate > 0)
+            {
+                gsl_vector_set_zero(sgrad);
+                AccumulateGaussianSigmaStatistics(m, &x.matrix, &ph0.matrix, inv_sigma, &q.matrix, 1.0, sgrad);
+                AccumulateGaussianSigmaStatistics(m, &v.matrix, &phn.matrix, inv_sigma, &q.matrix, -1.0, sgrad);
+            }
 
-            /* Updating U parameter */
-            gsl_matrix_sub(posU, negU); /* posU = posU-negU */
-            gsl_matrix_scale(posU, 1.0 / ctr);
-            gsl_matrix_scale(posU, m->eta); /* posU = eta*posU */
-            gsl_matrix_memcpy(tmpU, m->U);
-            gsl_matrix_scale(tmpU, -m->lambda);  /* tmp = -lambda*U */
-            gsl_matrix_add(posU, tmpU);          /* posU = eta*(posU-negU) -lambda*U */
-            gsl_matrix_scale(delta_U, m->alpha); /* delta_U = alpha*delta_U */
-            gsl_matrix_add(delta_U, posU);       /* delta_U = eta*(posU-negU) -lambda*U + alpha*delta_U */
-            gsl_matrix_add(m->U, delta_U);       /* U = U + delta_U */
+            /* Updating U and c parameters */
+            gsl_matrix_set_zero(gradU);
+            gsl_vector_set_zero(cgrad);
+            AccumulateGaussianLabelStatistics(&ph0.matrix, y0, 1.0, gradU, cgrad);
+            AccumulateGaussianLabelStatistics(&phn.matrix, y1, -1.0, gradU, cgrad);
 
             /* Updating a parameter */
-            gsl_vector_div(acc_v0, m->sigma); /* v0 = v0/sigma */
-            gsl_vector_div(acc_v1, m->sigma); /* v1 = v1/sigma */
-            gsl_vector_sub(acc_v0, acc_v1);   /* v0 = v0 - v1 */
-            gsl_vector_scale(acc_v0, 1.0 / ctr);
-            gsl_vector_scale(acc_v0, m->eta);    /* v0 = eta*v0 */
-            gsl_vector_scale(delta_a, m->alpha); /* delta_a = alpha*delta_a */
-            gsl_vector_add(delta_a, acc_v0);     /* delta_a = eta*(v0-v1) + alpha*delta_a */
-            gsl_vector_add(m->a, delta_a);       /* a = a + delta_a */
+            gsl_blas_dgemv(CblasTrans, 1.0 / n, &s0.matrix, &ones_view.vector, 0.0, agrad);  /* v0 = v0/sigma */
+            gsl_blas_dgemv(CblasTrans, -1.0 / n, &sn.matrix, &ones_view.vector, 1.0, agrad); /* v0 = (v0 - v1)/sigma */
 
             /* Updating b parameter */
-            gsl_vector_sub(acc_h0, acc_h1); /* h0 = h0 - h1 */
-            gsl_vector_scale(acc_h0, 1.0 / ctr);
-            gsl_vector_scale(acc_h0, m->eta);    /* h0 = eta*h0 */
-            gsl_vector_scale(delta_b, m->alpha); /* delta_b = alpha*delta_b */
-            gsl_vector_add(delta_b, acc_h0);     /* delta_b = eta*(h0 - h1) + alpha*delta_b */
-            gsl_vector_add(m->b, delta_b);       /* b = b + delta_b */
-
-            /* Updating c parameter */
-            gsl_vector_sub(acc_y0, acc_y1); /* y0 = y0 - y1 */
-            gsl_vector_scale(acc_y0, 1.0 / ctr);
-            gsl_vector_scale(acc_y0, m->eta);    /* y0 = eta*y0 */
-            gsl_vector_scale(delta_c, m->alpha); /* delta_c = alpha*delta_c */
-            gsl_vector_add(delta_c, acc_y0);     /* delta_c = eta*(y0 - y1) + alpha*delta_c */
-            gsl_vector_add(m->c, delta_c);       /* c = c + delta_c */
+            gsl_blas_dgemv(CblasTrans, 1.0 / n, &ph0.matrix, &ones_view.vector, 0.0, bgrad);  /* h0 = E[h0] */
+            gsl_blas_dgemv(CblasTrans, -1.0 / n, &phn.matrix, &ones_view.vector, 1.0, bgrad); /* h0 = h0 - h1 */
+
+            if (rate > 0)
+                UpdateGaussianSigma(m, sgrad, invfstdInc, rate, n);
+            UpdateParameterMatrix4Batch(m, m->W, &s0.matrix, &ph0.matrix, 1.0 / n, &sn.matrix, &phn.matrix, 1.0 / n, m->eta, m->lambda, delta_W); /* W = W + alpha*delta_W + eta*(posW-negW) - lambda*W */
+            UpdateParameterMatrix(m, m->U, gradU, NULL, 1.0 / n, m->eta, m->lambda, delta_U);                                                     /* U = U + alpha*delta_U + eta*(posU-negU) - lambda*U */
+            UpdateParameterVector(m, m->a, agrad, NULL, 1.0, m->eta, delta_a);                                                                    /* a = a + alpha*delta_a + eta*(v0-v1)/sigma */
+            UpdateParameterVector(m, m->b, bgrad, NULL, 1.0, m->eta, delta_b);                                                                    /* b = b + alpha*delta_b + eta*(h0 - h1) */
+            UpdateParameterVector(m, m->c, cgrad, NULL, 1.0 / n, m->eta, delta_c);                                                                /* c = c + alpha*delta_c + eta*(y0 - y1) */
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
         }
 
-        train_error = errorsum / n_batches;
+        trained = z < D->size ? z / batch_size + 1 : n_batches; /* batches trained, fewer than n_batches if the epoch stopped early */
+        train_error = errorsum / trained;
         fprintf(stderr, "MSE classification error: %lf OK", train_error);
+
+        if (HasStoppedEarly(m))
+            e = n_epochs + 1;
     }
+    RestoreEarlyStopping(m);
 
     gsl_rng_free(r);
-    gsl_matrix_free(tmpW);
-    gsl_matrix_free(tmpU);
-    gsl_matrix_free(_posW);
-    gsl_matrix_free(posW);
-    gsl_matrix_free(_negW);
-    gsl_matrix_free(negW);
-    gsl_matrix_free(_posU);
-    gsl_matrix_free(_negU);
-    gsl_matrix_free(posU);
-    gsl_matrix_free(negU);
-    gsl_matrix_free(delta_W);
-    gsl_matrix_free(delta_U);
-    gsl_vector_free(acc_v0);
-    gsl_vector_free(acc_v1);
-    gsl_vector_free(acc_h0);
-    gsl_vector_free(acc_h1);
-    gsl_vector_free(acc_y0);
-    gsl_vector_free(acc_y1);
-    gsl_vector_free(delta_a);
-    gsl_vector_free(delta_b);
-    gsl_vector_free(delta_c);
+    gsl_matrix_free(X);
+    gsl_matrix_free(S0);
+    gsl_matrix_free(V);
+    gsl_matrix_free(Sn);
+    gsl_matrix_free(Q);
+    gsl_matrix_free(PH0);
+    gsl_matrix_free(PHn);
+    gsl_matrix_free(H);
+    gsl_matrix_free(PY);
+    if (dropout)
+        gsl_matrix_free(R);
+    free(y0);
+    free(y1);
+    gsl_matrix_free(gradU);
+    DestroyParameterState(&delta_W);
+    DestroyParameterState(&delta_U);
+    gsl_vector_free(inv_sigma);
+    gsl_vector_free(agrad);
+    gsl_vector_free(sgrad);
+    gsl_vector_free(invfstdInc);
+    gsl_vector_free(bgrad);
+    gsl_vector_free(cgrad);
+    DestroyParameterState(&delta_a);
+    DestroyParameterState(&delta_b);
+    DestroyParameterState(&delta_c);
+    gsl_vector_free(ones);
 
     return train_error;
 }
+
+/* It trains a Discriminative Gaussian-Bernoulli RBM by Constrative Divergence for pattern classification
+Parameters: [D, m, n_epochs, n_CD_iterations, batch_size]
+D: dataset
+m: DRBM
+n_epocs: number of epochs
+n_CD_iterations: number of Constrastive Divergence iterations
+batch_size: size of the mini-batch */
+double DiscriminativeGaussianBernoulliRBMTrainingbyContrastiveDivergence(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size)
+{
+    return DiscriminativeGaussianBernoulliTraining(D, m, n_epochs, n_CD_iterations, batch_size, 1.0, 0);
+}
+
+/* It trains a Discriminative Gaussian-Bernoulli RBM with Dropout by Constrative Divergence for pattern classification
+Parameters: [D, m, n_epochs, n_CD_iterations, batch_size, p]
+D: dataset
+m: DRBM
+n_epocs: number of epochs
+n_CD_iterations: number of Constrastive Divergence iterations
+batch_size: size of the mini-batch
+p: hidden neurons dropout rate */
+double DiscriminativeGaussianBernoulliRBMTrainingbyContrastiveDivergencewithDropout(Dataset *D, RBM *m, int n_epochs, int n_CD_iterations, int batch_size, double p)
+{
+    return DiscriminativeGaussianBernoulliTraining(D, m, n_epochs, n_CD_iterations, batch_size, p, 1);
+}
 /**************************/
 
 /* Bernoulli RBM reconstruction/classification */
@@ -7331,38 +6586,61 @@ double GaussianBernoulliRBMReconstruction(Dataset *D, RBM *m)
     return error;
 }
 
-/* It classifies an input dataset given a trained RBM
+/* It predicts the label of every sample of a dataset as the one with the highest log-probability P(y|x), scoring one chunk of
+RBM_PROPAGATION_CHUNK_SIZE samples at a time
 Parameters: [D, m]
 D: dataset
-m: RBM */
-void _DiscriminativeBernoulliRBMClassification(Dataset *D, RBM *m)
+m: DRBM */
+static void PredictDiscriminativeLabels(Dataset *D, RBM *m)
 {
-    int i, y, label;
-    double proby_x, maxproby_x;
-    gsl_vector *prob = NULL;
+    gsl_matrix *X = NULL, *P = NULL;
+    gsl_matrix_view x, p;
+    double *q;
+    int z, i, y, n, chunk, label;
+
+    if (D->nlabels > m->n_labels)
+    {
+        fprintf(stderr, "\nDataset has more labels than the DRBM @PredictDiscriminativeLabels.\n");
+        return;
+    }
 
-    prob = gsl_vector_alloc(D->nlabels);
+    chunk = D->size < RBM_PROPAGATION_CHUNK_SIZE ? D->size : RBM_PROPAGATION_CHUNK_SIZE;
+    if (!chunk)
+        return;
+    X = gsl_matrix_alloc(chunk, m->n_visible_layer_neurons);
+    P = gsl_matrix_alloc(chunk, m->n_labels);
 
-    for (i = 0; i < D->size; i++)
+    for (z = 0; z < D->size; z += chunk)
     {
-        label = 0;
-        for (y = 0; y < D->nlabels; y++)
-        {
-            gsl_vector_set(prob, y, FreeEnergy4DRBM(m, y, D->sample[i].feature));
-        }
-        maxproby_x = -99999999999;
-        for (y = 0; y < D->nlabels; y++)
+        n = D->size - z < chunk ? D->size - z : chunk;
+        x = gsl_matrix_submatrix(X, 0, 0, n, X->size2);
+        p = gsl_matrix_submatrix(P, 0, 0, n, P->size2);
+        for (i = 0; i < n; i++)
+            gsl_matrix_set_row(&x.matrix, i, D->sample[z + i].feature);
+
+        getDiscriminativeBatchLogProbabilityLabelUnit(m, &x.matrix, &p.matrix);
+        for (i = 0; i < n; i++)
         {
-            proby_x = gsl_vector_get(prob, y);
-            if (proby_x > maxproby_x)
-            {
-                maxproby_x = proby_x;
-                label = y + 1;
-            }
+            q = gsl_matrix_ptr(&p.matrix, i, 0);
+            label = 0;
+            for (y = 1; y < D->nlabels; y++)
+                if (q[y] > q[label])
+                    label = y;
+            D->sample[z + i].predict = label + 1;
         }
-        D->sample[i].predict = label;
     }
-    gsl_vector_free(prob);
+
+    gsl_matrix_free(X);
+    gsl_matrix_free(P);
+}
+
+/* It classifies an input dataset given a trained RBM
+Parameters: [D, m]
+D: dataset
+m: RBM */
+void _DiscriminativeBernoulliRBMClassification(Dataset *D, RBM *m)
+{
+    PredictDiscriminativeLabels(D, m);
 }
 
 /* It classifies an input dataset given a trained RBM and it outputs the classification error
@@ -7372,28 +6650,9 @@ D: dataset
 m: RBM */
 double DiscriminativeBernoulliRBMClassification(Dataset *D, RBM *m)
 {
-    int i, y;
-    double maxprob, prob, Acc;
-    Subgraph *g = NULL;
-
-    for (i = 0; i < D->size; i++)
-    {
-        maxprob = -99999999999;
-        for (y = 0; y < D->nlabels; y++)
-        {
-            prob = FreeEnergy4DRBM(m, y, D->sample[i].feature);
-            if (prob > maxprob)
-            {
-                maxprob = prob;
-                D->sample[i].predict = y + 1;
-            }
-        }
-    }
-    g = Dataset2Subgraph(D);
-    Acc = opf_Accuracy(g);
-    DestroySubgraph(&g);
+    PredictDiscriminativeLabels(D, m);
 
-    return 1 - Acc;
+    return 1 - getDatasetAccuracy(D);
 }
 /**************************/
 
@@ -7614,94 +6873,236 @@ gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4DBM(RBM *m,
         gsl_vector_set(h, j, tmp);
     }
 
-    return h;
+    return h;
+}
+
+/* It computes the probability of turning on a hidden unit - Fast version
+Parameters: [m, v, prob_h]
+m: RBM
+v: visible units vector
+prob_h: probability of hidden neurons */
+void FASTgetProbabilityTurningOnHiddenUnit(RBM *m, gsl_vector *v, gsl_vector *prob_h)
+{
+    int j;
+    double tmp;
+
+    if (prob_h)
+    {
+        /* It computes W^T*v, which walks the rows of W with unit stride */
+        gsl_blas_dgemv(CblasTrans, 1.0, m->W, v, 0.0, prob_h);
+        for (j = 0; j < m->n_hidden_layer_neurons; j++)
+        {
+            tmp = gsl_vector_get(prob_h, j) + gsl_vector_get(m->b, j);
+            tmp /= m->t;
+            tmp = SigmoidLogistic(tmp);
+            gsl_vector_set(prob_h, j, tmp);
+        }
+    }
+    else
+        fprintf(stderr, "\nThere is no prob_h vector allocated @FASTgetProbabilityTurningOnHiddenUnit.\n");
+}
+
+/* It computes the probability of turning on the hidden units of a batch of samples at once
+Parameters: [m, V, prob_H]
+m: RBM
+V: visible units matrix (one sample per row)
+prob_H: probability of hidden neurons (one sample per row, same number of rows as V) */
+void getBatchProbabilityTurningOnHiddenUnit(RBM *m, gsl_matrix *V, gsl_matrix *prob_H)
+{
+    int i, j;
+    double tmp;
+
+    if (prob_H)
+    {
+        /* It computes V*W in a single GEMM, so W is streamed once for the whole batch */
+        gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, V, m->W, 0.0, prob_H);
+        for (i = 0; i < prob_H->size1; i++)
+        {
+            for (j = 0; j < m->n_hidden_layer_neurons; j++)
+            {
+                tmp = gsl_matrix_get(prob_H, i, j) + gsl_vector_get(m->b, j);
+                tmp /= m->t;
+                tmp = SigmoidLogistic(tmp);
+                gsl_matrix_set(prob_H, i, j, tmp);
+            }
+        }
+    }
+    else
+        fprintf(stderr, "\nThere is no prob_H matrix allocated @getBatchProbabilityTurningOnHiddenUnit.\n");
+}
+
+/* It computes the log-probability of every label given each sample of a batch, i.e., log P(y|x) for Equation 2 of paper "Learning Algorithms for the
+Classification Restricted Boltzmann Machine". W*x + b is computed once per sample by a single GEMM for the whole batch, and every label only adds its
+row of U before the softplus sum, so scoring costs O(V*H + L*H) per sample instead of the O(L*V*H) of calling FreeEnergy4DRBM for each label.
+The samples are scored concurrently
+Parameters: [m, X, log_P]
+m: DRBM
+X: visible units matrix (one sample per row)
+log_P: log-probability of label units (one sample per row, same number of rows as X, and m->n_labels columns) */
+void getDiscriminativeBatchLogProbabilityLabelUnit(RBM *m, gsl_matrix *X, gsl_matrix *log_P)
+{
+    gsl_matrix *A = NULL;
+    int i;
+
+    if (!log_P)
+    {
+        fprintf(stderr, "\nThere is no log_P matrix allocated @getDiscriminativeBatchLogProbabilityLabelUnit.\n");
+        return;
+    }
+
+    A = gsl_matrix_alloc(X->size1, m->n_hidden_layer_neurons);
+    gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, X, m->W, 0.0, A); /* It computes W*x for the whole batch */
+    for (i = 0; i < A->size1; i++)
+    {
+        gsl_vector_view row = gsl_matrix_row(A, i);
+        gsl_vector_add(&row.vector, m->b); /* It computes W*x + b, which is shared by all labels */
+    }
+
+#pragma omp parallel for schedule(static)
+    for (i = 0; i < A->size1; i++)
+        getDiscriminativeRowLogProbability(m, gsl_matrix_ptr(A, i, 0), 0, gsl_matrix_ptr(log_P, i, 0), NULL, NULL);
+
+    gsl_matrix_free(A);
+}
+
+/* It computes the probability of turning on the hidden units of every sample of a dataset, one GEMM per chunk of RBM_PROPAGATION_CHUNK_SIZE samples,
+as used to make the output of a layer the input to the next one during greedy pre-training (the temperature is not applied)
+Parameters: [m, D, scale, H]
+m: RBM
+D: dataset with m's visible units
+scale: factor applied to the weights (e.g., 2 for the doubled bottom-up input of DBM layers)
+H: dataset created by CreateDatasetBuffer with room for m's hidden units, which is resized to them and may be D itself */
+void getDatasetProbabilityTurningOnHiddenUnit(RBM *m, Dataset *D, double scale, Dataset *H)
+{
+    gsl_matrix *V = NULL, *P = NULL;
+    gsl_matrix_view v, p;
+    gsl_vector *h = NULL;
+    int z, i, j, n, chunk;
+
+    if (D->nfeatures != m->n_visible_layer_neurons || D->size != H->size)
+    {
+        fprintf(stderr, "\nDataset does not match the RBM @getDatasetProbabilityTurningOnHiddenUnit.\n");
+        return;
+    }
+    if (H->size && (size_t)H->size * m->n_hidden_layer_neurons > H->sample[0].feature->block->size)
+    {
+        fprintf(stderr, "\nOutput dataset is too small for the hidden layer @getDatasetProbabilityTurningOnHiddenUnit.\n");
+        return;
+    }
+
+    chunk = D->size < RBM_PROPAGATION_CHUNK_SIZE ? D->size : RBM_PROPAGATION_CHUNK_SIZE;
+    if (chunk)
+    {
+        V = gsl_matrix_alloc(chunk, m->n_visible_layer_neurons);
+        P = gsl_matrix_alloc(chunk, m->n_hidden_layer_neurons);
+    }
+
+    for (z = 0; z < D->size; z += chunk)
+    {
+        n = D->size - z < chunk ? D->size - z : chunk;
+        v = gsl_matrix_submatrix(V, 0, 0, n, V->size2);
+        p = gsl_matrix_submatrix(P, 0, 0, n, P->size2);
+
+        /* The whole chunk is gathered before any of its rows is overwritten, so H may alias D */
+        for (i = 0; i < n; i++)
+            gsl_matrix_set_row(&v.matrix, i, D->sample[z + i].feature);
+        gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, scale, &v.matrix, m->W, 0.0, &p.matrix);
+
+        for (i = 0; i < n; i++)
+        {
+            /* Rows of H are as long as its widest layer, so writing a wider output stays within the sample */
+            h = H->sample[z + i].feature;
+            for (j = 0; j < m->n_hidden_layer_neurons; j++)
+                h->data[j * h->stride] = SigmoidLogistic(gsl_matrix_get(&p.matrix, i, j) + gsl_vector_get(m->b, j));
+            H->sample[z + i].label = D->sample[z + i].label;
+        }
+    }
+    ResizeDatasetBuffer(H, m->n_hidden_layer_neurons);
+    H->nlabels = D->nlabels;
+
+    if (chunk)
+    {
+        gsl_matrix_free(V);
+        gsl_matrix_free(P);
+    }
 }
 
-/* It computes the probability of turning on a hidden unit - Fast version
-Parameters: [m, v, prob_h]
-m: RBM
-v: visible units vector
-prob_h: probability of hidden neurons */
-void FASTgetProbabilityTurningOnHiddenUnit(RBM *m, gsl_vector *v, gsl_vector *prob_h)
+/* It makes the output of a layer just trained by a greedy pre-training step the input to the next one, reusing a single activation buffer
+for every layer so the memory peaks at the training set plus its widest hidden layer
+Parameters: [D, m, n_layers, id, scale, buffer]
+D: training set
+m: stack of RBMs
+n_layers: number of RBMs
+id: layer just trained
+scale: factor applied to the weights of the layer (see getDatasetProbabilityTurningOnHiddenUnit)
+buffer: activation buffer, which is allocated on the first call and must be deallocated by the caller
+It returns the input to layer id + 1 (or NULL if id is the top layer, since its output is not needed) */
+Dataset *PropagateGreedyLayer(Dataset *D, RBM **m, int n_layers, int id, double scale, Dataset **buffer)
 {
-    int i, j;
-    double tmp;
+    int l, width = 0;
 
-    if (prob_h)
+    if (id >= n_layers - 1)
+        return NULL;
+
+    if (!*buffer)
     {
-        for (j = 0; j < m->n_hidden_layer_neurons; j++)
-        {
-            tmp = 0.0;
-            for (i = 0; i < m->n_visible_layer_neurons; i++)
-                tmp += (gsl_vector_get(v, i) * gsl_matrix_get(m->W, i, j));
-            tmp += gsl_vector_get(m->b, j);
-            tmp /= m->t;
-            tmp = SigmoidLogistic(tmp);
-            gsl_vector_set(prob_h, j, tmp);
-        }
+        for (l = 0; l < n_layers - 1; l++)
+            if (m[l]->n_hidden_layer_neurons > width)
+                width = m[l]->n_hidden_layer_neurons;
+        *buffer = CreateDatasetBuffer(D->size, width);
     }
-    else
-        fprintf(stderr, "\nThere is no prob_h vector allocated @FASTgetProbabilityTurningOnHiddenUnit.\n");
+
+    getDatasetProbabilityTurningOnHiddenUnit(m[id], id ? *buffer : D, scale, *buffer);
+
+    return *buffer;
 }
 
 /* It computes the probability of turning on a hidden unit j for FPCD
-Parameters: [m, v, fast_W]
+Parameters: [m, v, eff_W]
 m: RBM
 v: visible units vector
-fast_W: weight matrix for FPCD */
-gsl_vector *getProbabilityTurningOnHiddenUnit4FPCD(RBM *m, gsl_vector *v, gsl_matrix *fast_W)
+eff_W: effective weights W + fast_W, maintained by the FPCD trainer */
+gsl_vector *getProbabilityTurningOnHiddenUnit4FPCD(RBM *m, gsl_vector *v, gsl_matrix *eff_W)
 {
-    int i, j;
+    int j;
     gsl_vector *h = NULL;
-    double tmp;
 
-    h = gsl_vector_calloc(m->n_hidden_layer_neurons);
+    h = gsl_vector_alloc(m->n_hidden_layer_neurons);
+    gsl_vector_memcpy(h, m->b);
+    gsl_blas_dgemv(CblasTrans, 1.0, eff_W, v, 1.0, h); /* It performs h = eff_W^T v + b */
     for (j = 0; j < m->n_hidden_layer_neurons; j++)
-    {
-        tmp = 0.0;
-        for (i = 0; i < m->n_visible_layer_neurons; i++)
-            tmp += (gsl_vector_get(v, i) * (gsl_matrix_get(m->W, i, j) + gsl_matrix_get(fast_W, i, j)));
-        tmp += gsl_vector_get(m->b, j);
-        tmp = SigmoidLogistic(tmp);
-        gsl_vector_set(h, j, tmp);
-    }
+        gsl_vector_set(h, j, SigmoidLogistic(gsl_vector_get(h, j)));
 
     return h;
 }
 
 /* It computes the probability of dropping out visible units and turning on a hidden unit j for FPCD
-Parameters: [m, r, v, fast_W]
+Parameters: [m, r, v, eff_W]
 m: RBM
 r: hidden units dropout array
 v: visible units vector
-fast_W: weight matrix for FPCD */
-gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4FPCD(RBM *m, gsl_vector *r, gsl_vector *v, gsl_matrix *fast_W)
+eff_W: effective weights W + fast_W, maintained by the FPCD trainer */
+gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4FPCD(RBM *m, gsl_vector *r, gsl_vector *v, gsl_matrix *eff_W)
 {
-    int i, j;
+    int j;
     gsl_vector *h = NULL;
-    double tmp;
 
-    h = gsl_vector_calloc(m->n_hidden_layer_neurons);
+    h = gsl_vector_alloc(m->n_hidden_layer_neurons);
+    gsl_vector_memcpy(h, m->b);
+    gsl_blas_dgemv(CblasTrans, 1.0, eff_W, v, 1.0, h); /* It performs h = eff_W^T v + b */
     for (j = 0; j < m->n_hidden_layer_neurons; j++)
-    {
-        tmp = 0.0;
-        for (i = 0; i < m->n_visible_layer_neurons; i++)
-            tmp += (gsl_vector_get(v, i) * (gsl_matrix_get(m->W, i, j) + gsl_matrix_get(fast_W, i, j)));
-        tmp += gsl_vector_get(m->b, j);
-        tmp = SigmoidLogistic(tmp) * gsl_vector_get(m->r, j);
-        gsl_vector_set(h, j, tmp);
-    }
+        gsl_vector_set(h, j, SigmoidLogistic(gsl_vector_get(h, j)) * gsl_vector_get(m->r, j));
 
     return h;
 }
 
 /* It computes the probability of turning on a hidden unit j for FPCD with a dropconnect mask
-Parameters: [m, M, v, fast_W]
+Parameters: [m, M, v, eff_W]
 m: RBM
 M: dropconnect mask
 v: visible units vector
-fast_W: weight matrix for FPCD */
-gsl_vector *getProbabilityTurningOnHiddenUnit4FPCD4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *v, gsl_matrix *fast_W)
+eff_W: effective weights W + fast_W, maintained by the FPCD trainer */
+gsl_vector *getProbabilityTurningOnHiddenUnit4FPCD4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *v, gsl_matrix *eff_W)
 {
     int i, j;
     gsl_vector *h = NULL;
@@ -7712,7 +7113,7 @@ gsl_vector *getProbabilityTurningOnHiddenUnit4FPCD4Dropconnect(RBM *m, gsl_matri
     {
         tmp = 0.0;
         for (i = 0; i < m->n_visible_layer_neurons; i++)
-            tmp += ((gsl_vector_get(v, i) * (gsl_matrix_get(m->W, i, j) + gsl_matrix_get(fast_W, i, j))) * gsl_matrix_get(m->M, i, j));
+            tmp += ((gsl_vector_get(v, i) * gsl_matrix_get(eff_W, i, j)) * gsl_matrix_get(m->M, i, j));
         tmp += gsl_vector_get(m->b, j);
         tmp = SigmoidLogistic(tmp);
         gsl_vector_set(h, j, tmp);
@@ -7876,11 +7277,31 @@ gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4DBM(RBM *m,
 }
 
 /* It computes the probability of turning on a visible unit j for FPCD
-Parameters: [m, h, fast_W]
+Parameters: [m, h, eff_W]
+m: RBM
+h: hidden units vector
+eff_W: effective weights W + fast_W, maintained by the FPCD trainer */
+gsl_vector *getProbabilityTurningOnVisibleUnit4FPCD(RBM *m, gsl_vector *h, gsl_matrix *eff_W)
+{
+    int j;
+    gsl_vector *v = NULL;
+
+    v = gsl_vector_alloc(m->n_visible_layer_neurons);
+    gsl_vector_memcpy(v, m->a);
+    gsl_blas_dgemv(CblasNoTrans, 1.0, eff_W, h, 1.0, v); /* It performs v = eff_W h + a */
+    for (j = 0; j < m->n_visible_layer_neurons; j++)
+        gsl_vector_set(v, j, SigmoidLogistic(gsl_vector_get(v, j)));
+
+    return v;
+}
+
+/* It computes the probability of dropping out hidden units and turning on a visible unit j for FPCD
+Parameters: [m, r, h, eff_W]
 m: RBM
+r: hidden units dropout array
 h: hidden units vector
-fast_W: weight matrix for FPCD */
-gsl_vector *getProbabilityTurningOnVisibleUnit4FPCD(RBM *m, gsl_vector *h, gsl_matrix *fast_W)
+eff_W: effective weights W + fast_W, maintained by the FPCD trainer */
+gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4FPCD(RBM *m, gsl_vector *r, gsl_vector *h, gsl_matrix *eff_W)
 {
     int i, j;
     gsl_vector *v = NULL;
@@ -7892,7 +7313,7 @@ gsl_vector *getProbabilityTurningOnVisibleUnit4FPCD(RBM *m, gsl_vector *h, gsl_m
     {
         tmp = 0.0;
         for (i = 0; i < m->n_hidden_layer_neurons; i++)
-            tmp += (gsl_vector_get(h, i) * (gsl_matrix_get(m->W, j, i) + gsl_matrix_get(fast_W, j, i)));
+            tmp += (gsl_vector_get(h, i) * gsl_vector_get(r, i) * gsl_matrix_get(eff_W, j, i));
         tmp += gsl_vector_get(m->a, j);
         tmp = SigmoidLogistic(tmp);
         gsl_vector_set(v, j, tmp);
@@ -7901,13 +7322,13 @@ gsl_vector *getProbabilityTurningOnVisibleUnit4FPCD(RBM *m, gsl_vector *h, gsl_m
     return v;
 }
 
-/* It computes the probability of dropping out hidden units and turning on a visible unit j for FPCD
-Parameters: [m, r, h, fast_W]
+/* It computes the probability of turning on a visible unit j for FPCD using a dropconnect mask
+Parameters: [m, M, h, eff_W]
 m: RBM
-r: hidden units dropout array
+M: dropconnect mask
 h: hidden units vector
-fast_W: weight matrix for FPCD */
-gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4FPCD(RBM *m, gsl_vector *r, gsl_vector *h, gsl_matrix *fast_W)
+eff_W: effective weights W + fast_W, maintained by the FPCD trainer */
+gsl_vector *getProbabilityTurningOnVisibleUnit4FPCD4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *h, gsl_matrix *eff_W)
 {
     int i, j;
     gsl_vector *v = NULL;
@@ -7919,7 +7340,7 @@ gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4FPCD(RBM *m
     {
         tmp = 0.0;
         for (i = 0; i < m->n_hidden_layer_neurons; i++)
-            tmp += (gsl_vector_get(h, i) * gsl_vector_get(r, i) * (gsl_matrix_get(m->W, j, i) + gsl_matrix_get(fast_W, j, i)));
+            tmp += ((gsl_vector_get(h, i) * gsl_matrix_get(eff_W, j, i)) * gsl_matrix_get(m->M, j, i));
         tmp += gsl_vector_get(m->a, j);
         tmp = SigmoidLogistic(tmp);
         gsl_vector_set(v, j, tmp);
@@ -7928,33 +7349,312 @@ gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4FPCD(RBM *m
     return v;
 }
 
-/* It computes the probability of turning on a visible unit j for FPCD using a dropconnect mask
-Parameters: [m, M, h, fast_W]
-m: RBM
+/* It mixes the bits of a 64-bit word (the finalizer of MurmurHash3)
+Parameters: [x]
+x: word */
+static inline uint64_t MixDropconnectBits(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+
+    return x;
+}
+
+/* It computes the key every connection hash of the current sample of a dropconnect mask is derived from
+Parameters: [M]
+M: dropconnect mask */
+static inline uint64_t getDropconnectSampleKey(DropconnectMask *M)
+{
+    return MixDropconnectBits(M->seed ^ MixDropconnectBits(M->sample * 0x9E3779B97F4A7C15ULL + 1));
+}
+
+/* It tells whether connection k = i * n_hidden_layer_neurons + j is kept by the mask of a sample
+Parameters: [M, key, k]
+M: dropconnect mask
+key: key of the sample
+k: connection */
+static inline int KeepDropconnectConnection(DropconnectMask *M, uint64_t key, uint64_t k)
+{
+    return (MixDropconnectBits(key + k * 0xD1B54A32D192ED03ULL) >> 11) < M->threshold;
+}
+
+/* It computes the hidden units' probabilities with a hashed dropconnect mask, fusing the mask into the product: the rows of W are visited once,
+skipping the ones whose visible unit is off, and the mask bits are hashed as the connections are read
+Parameters: [m, M, W, v, scale, t]
+m: RBM, whose hidden biases are used
+M: dropconnect mask
+W: weights
+v: visible units vector
+scale: factor applied to the masked input (2 for the bottom layer of a DBM)
+t: temperature */
+static gsl_vector *HashedDropconnectHiddenPass(RBM *m, DropconnectMask *M, gsl_matrix *W, gsl_vector *v, double scale, double t)
+{
+    uint64_t key = getDropconnectSampleKey(M), k;
+    gsl_vector *h = NULL;
+    double x, *w, *y;
+    int i, j;
+
+    h = gsl_vector_calloc(m->n_hidden_layer_neurons);
+    y = h->data;
+    for (i = 0; i < m->n_visible_layer_neurons; i++)
+    {
+        x = gsl_vector_get(v, i);
+        if (x == 0.0)
+            continue;
+        w = gsl_matrix_ptr(W, i, 0);
+        k = (uint64_t)i * m->n_hidden_layer_neurons;
+        for (j = 0; j < m->n_hidden_layer_neurons; j++)
+            if (KeepDropconnectConnection(M, key, k + j))
+                y[j] += x * w[j];
+    }
+    for (j = 0; j < m->n_hidden_layer_neurons; j++)
+        y[j] = SigmoidLogistic((scale * y[j] + gsl_vector_get(m->b, j)) / t);
+
+    return h;
+}
+
+/* It computes the visible units' probabilities with a hashed dropconnect mask, fusing the mask into the product
+Parameters: [m, M, W, h, scale]
+m: RBM, whose visible biases are used
 M: dropconnect mask
+W: weights
 h: hidden units vector
-fast_W: weight matrix for FPCD */
-gsl_vector *getProbabilityTurningOnVisibleUnit4FPCD4Dropconnect(RBM *m, gsl_matrix *M, gsl_vector *h, gsl_matrix *fast_W)
+scale: factor applied to the masked input (2 for the top layer of a DBM) */
+static gsl_vector *HashedDropconnectVisiblePass(RBM *m, DropconnectMask *M, gsl_matrix *W, gsl_vector *h, double scale)
 {
+    uint64_t key = getDropconnectSampleKey(M), k;
+    gsl_vector *v = NULL;
+    double tmp, x, *w;
     int i, j;
+
+    v = gsl_vector_alloc(m->n_visible_layer_neurons);
+    for (j = 0; j < m->n_visible_layer_neurons; j++)
+    {
+        tmp = 0.0;
+        w = gsl_matrix_ptr(W, j, 0);
+        k = (uint64_t)j * m->n_hidden_layer_neurons;
+        for (i = 0; i < m->n_hidden_layer_neurons; i++)
+        {
+            x = gsl_vector_get(h, i);
+            if (x != 0.0 && KeepDropconnectConnection(M, key, k + i))
+                tmp += x * w[i];
+        }
+        gsl_vector_set(v, j, SigmoidLogistic(scale * tmp + gsl_vector_get(m->a, j)));
+    }
+
+    return v;
+}
+
+/* It computes the probability of turning on a hidden unit j using a hashed dropconnect mask
+Parameters: [m, M, v]
+m: RBM
+M: dropconnect mask
+v: visible units array */
+gsl_vector *getProbabilityTurningOnHiddenUnit4HashedDropconnect(RBM *m, DropconnectMask *M, gsl_vector *v)
+{
+    return HashedDropconnectHiddenPass(m, M, m->W, v, 1.0, m->t);
+}
+
+/* It computes the probability of turning on a hidden unit j using a hashed dropconnect mask considering a DBM at bottom layer using Equation 22
+Parameters: [m, M, v]
+m: RBM
+M: dropconnect mask
+v: visible units vector */
+gsl_vector *getProbabilityTurningOnHiddenUnit4DBM4HashedDropconnect(RBM *m, DropconnectMask *M, gsl_vector *v)
+{
+    return HashedDropconnectHiddenPass(m, M, m->W, v, 2.0, m->t);
+}
+
+/* It computes the probability of turning on a hidden unit j for FPCD using a hashed dropconnect mask
+Parameters: [m, M, v, eff_W]
+m: RBM
+M: dropconnect mask
+v: visible units vector
+eff_W: effective weights W + fast_W, maintained by the FPCD trainer */
+gsl_vector *getProbabilityTurningOnHiddenUnit4FPCD4HashedDropconnect(RBM *m, DropconnectMask *M, gsl_vector *v, gsl_matrix *eff_W)
+{
+    return HashedDropconnectHiddenPass(m, M, eff_W, v, 1.0, 1.0);
+}
+
+/* It computes the probability of turning on a visible unit j using a hashed dropconnect mask
+Parameters: [m, M, h]
+m: RBM
+M: dropconnect mask
+h: hidden units array */
+gsl_vector *getProbabilityTurningOnVisibleUnit4HashedDropconnect(RBM *m, DropconnectMask *M, gsl_vector *h)
+{
+    return HashedDropconnectVisiblePass(m, M, m->W, h, 1.0);
+}
+
+/* It computes the probability of turning on a visible unit j using a hashed dropconnect mask considering a DBM at top layer
+Parameters: [m, M, h]
+m: DBM
+M: dropconnect mask
+h: hidden units array */
+gsl_vector *getProbabilityTurningOnVisibleUnit4DBM4HashedDropconnect(RBM *m, DropconnectMask *M, gsl_vector *h)
+{
+    return HashedDropconnectVisiblePass(m, M, m->W, h, 2.0);
+}
+
+/* It computes the probability of turning on a visible unit j for FPCD using a hashed dropconnect mask
+Parameters: [m, M, h, eff_W]
+m: RBM
+M: dropconnect mask
+h: hidden units vector
+eff_W: effective weights W + fast_W, maintained by the FPCD trainer */
+gsl_vector *getProbabilityTurningOnVisibleUnit4FPCD4HashedDropconnect(RBM *m, DropconnectMask *M, gsl_vector *h, gsl_matrix *eff_W)
+{
+    return HashedDropconnectVisiblePass(m, M, eff_W, h, 1.0);
+}
+
+/* It computes the hidden units' probabilities for the surviving hidden units only, gathering their columns of W row by row
+and skipping the rows whose visible unit is off. The dropped units are left at zero, as if multiplied by their dropout bias
+Parameters: [m, active, n_active, W, v, scale, t]
+m: RBM, whose hidden biases are used
+active: indices of the surviving hidden units
+n_active: number of surviving hidden units
+W: weights
+v: visible units vector
+scale: factor applied to the input (2 for the bottom layer of a DBM)
+t: temperature */
+static gsl_vector *CompactDropoutHiddenPass(RBM *m, int *active, int n_active, gsl_matrix *W, gsl_vector *v, double scale, double t)
+{
+    gsl_vector *h = NULL;
+    double x, *w, *y;
+    int i, k;
+
+    h = gsl_vector_calloc(m->n_hidden_layer_neurons);
+    y = h->data;
+    for (i = 0; i < m->n_visible_layer_neurons; i++)
+    {
+        x = gsl_vector_get(v, i);
+        if (x == 0.0)
+            continue;
+        w = gsl_matrix_ptr(W, i, 0);
+        for (k = 0; k < n_active; k++)
+            y[active[k]] += x * w[active[k]];
+    }
+    for (k = 0; k < n_active; k++)
+        y[active[k]] = SigmoidLogistic((scale * y[active[k]] + gsl_vector_get(m->b, active[k])) / t);
+
+    return h;
+}
+
+/* It computes the visible units' probabilities reading the surviving hidden units only, and among them the ones that are on
+Parameters: [m, active, n_active, on, x, W, h, scale]
+m: RBM, whose visible biases are used
+active: indices of the surviving hidden units
+n_active: number of surviving hidden units
+on: scratch for the indices of the surviving hidden units that are on, with room for all the hidden units
+x: scratch for their values, with room for all the hidden units
+W: weights
+h: hidden units vector
+scale: factor applied to the input (2 for the top layer of a DBM) */
+static gsl_vector *CompactDropoutVisiblePass(RBM *m, int *active, int n_active, int *on, double *x, gsl_matrix *W, gsl_vector *h, double scale)
+{
     gsl_vector *v = NULL;
-    double tmp;
+    double tmp, *w;
+    int i, j, k, n_on = 0;
 
-    v = gsl_vector_calloc(m->n_visible_layer_neurons);
+    for (k = 0; k < n_active; k++)
+    {
+        if (gsl_vector_get(h, active[k]) != 0.0)
+        {
+            on[n_on] = active[k];
+            x[n_on++] = gsl_vector_get(h, active[k]);
+        }
+    }
 
+    v = gsl_vector_alloc(m->n_visible_layer_neurons);
     for (j = 0; j < m->n_visible_layer_neurons; j++)
     {
         tmp = 0.0;
-        for (i = 0; i < m->n_hidden_layer_neurons; i++)
-            tmp += ((gsl_vector_get(h, i) * (gsl_matrix_get(m->W, j, i) + gsl_matrix_get(fast_W, j, i))) * gsl_matrix_get(m->M, j, i));
-        tmp += gsl_vector_get(m->a, j);
-        tmp = SigmoidLogistic(tmp);
-        gsl_vector_set(v, j, tmp);
+        w = gsl_matrix_ptr(W, j, 0);
+        for (i = 0; i < n_on; i++)
+            tmp += x[i] * w[on[i]];
+        gsl_vector_set(v, j, SigmoidLogistic(scale * tmp + gsl_vector_get(m->a, j)));
     }
 
     return v;
 }
 
+/* It computes the probability of turning on the surviving hidden units only, as described by Equation 11
+Parameters: [m, active, n_active, v]
+m: RBM
+active: indices of the surviving hidden units
+n_active: number of surviving hidden units
+v: visible units array */
+gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4Compact(RBM *m, int *active, int n_active, gsl_vector *v)
+{
+    return CompactDropoutHiddenPass(m, active, n_active, m->W, v, 1.0, 1.0);
+}
+
+/* It computes the probability of turning on the surviving hidden units only considering a DBM at bottom layer using Equation 22
+Parameters: [m, active, n_active, v]
+m: RBM
+active: indices of the surviving hidden units
+n_active: number of surviving hidden units
+v: visible units vector */
+gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4DBM4Compact(RBM *m, int *active, int n_active, gsl_vector *v)
+{
+    return CompactDropoutHiddenPass(m, active, n_active, m->W, v, 2.0, m->t);
+}
+
+/* It computes the probability of turning on the surviving hidden units only for FPCD
+Parameters: [m, active, n_active, v, eff_W]
+m: RBM
+active: indices of the surviving hidden units
+n_active: number of surviving hidden units
+v: visible units vector
+eff_W: effective weights W + fast_W, maintained by the FPCD trainer */
+gsl_vector *getProbabilityDroppingVisibleUnitOut4TurningOnHiddenUnit4FPCD4Compact(RBM *m, int *active, int n_active, gsl_vector *v, gsl_matrix *eff_W)
+{
+    return CompactDropoutHiddenPass(m, active, n_active, eff_W, v, 1.0, 1.0);
+}
+
+/* It computes the probability of turning on a visible unit j reading the surviving hidden units only, as described by Equation 11
+Parameters: [m, active, n_active, h, on, h_on]
+m: RBM
+active: indices of the surviving hidden units
+n_active: number of surviving hidden units
+h: hidden units vector
+on: scratch of the trainer for the indices of the surviving hidden units that are on (n_hidden_layer_neurons entries)
+h_on: scratch of the trainer for their values (n_hidden_layer_neurons entries) */
+gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4Compact(RBM *m, int *active, int n_active, gsl_vector *h, int *on, double *h_on)
+{
+    return CompactDropoutVisiblePass(m, active, n_active, on, h_on, m->W, h, 1.0);
+}
+
+/* It computes the probability of turning on a visible unit j reading the surviving hidden units only considering a DBM at top layer
+Parameters: [m, active, n_active, h, on, h_on]
+m: DBM
+active: indices of the surviving hidden units
+n_active: number of surviving hidden units
+h: hidden units array
+on: scratch of the trainer for the indices of the surviving hidden units that are on (n_hidden_layer_neurons entries)
+h_on: scratch of the trainer for their values (n_hidden_layer_neurons entries) */
+gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4DBM4Compact(RBM *m, int *active, int n_active, gsl_vector *h, int *on, double *h_on)
+{
+    return CompactDropoutVisiblePass(m, active, n_active, on, h_on, m->W, h, 2.0);
+}
+
+/* It computes the probability of turning on a visible unit j reading the surviving hidden units only for FPCD
+Parameters: [m, active, n_active, h, on, h_on, eff_W]
+m: RBM
+active: indices of the surviving hidden units
+n_active: number of surviving hidden units
+h: hidden units vector
+on: scratch of the trainer for the indices of the surviving hidden units that are on (n_hidden_layer_neurons entries)
+h_on: scratch of the trainer for their values (n_hidden_layer_neurons entries)
+eff_W: effective weights W + fast_W, maintained by the FPCD trainer */
+gsl_vector *getProbabilityDroppingHiddenUnitOut4TurningOnVisibleUnit4FPCD4Compact(RBM *m, int *active, int n_active, gsl_vector *h, int *on, double *h_on, gsl_matrix *eff_W)
+{
+    return CompactDropoutVisiblePass(m, active, n_active, on, h_on, eff_W, h, 1.0);
+}
+
 /* It computes the probability of turning on a hidden unit j considering Gaussian RBMs
 Parameters: [m, v, sigma]
 m: DRBM
@@ -8308,3 +8008,172 @@ double getPseudoLikelihood(RBM *m, gsl_vector *x)
     return pl;
 }
 /**************************/
+
+/* RBM serialization */
+
+/* It writes the header shared by all binary model files
+Parameters: [fp, kind, n_layers]
+fp: file opened for binary writing
+kind: model kind (MODEL_FILE_RBM, MODEL_FILE_DBN or MODEL_FILE_DBM)
+n_layers: number of RBMs that follow the header
+It returns 0 on success and a non-zero value otherwise */
+int fwriteModelHeader(FILE *fp, int kind, int n_layers)
+{
+    int info[2];
+
+    info[0] = kind;
+    info[1] = n_layers;
+    if (fwrite(MODEL_FILE_MAGIC, sizeof(char), 8, fp) != 8 || fwrite(info, sizeof(int), 2, fp) != 2)
+        return -1;
+
+    return 0;
+}
+
+/* It reads and validates the header of a binary model file
+Parameters: [fp, kind, n_layers]
+fp: file opened for binary reading
+kind: output model kind
+n_layers: output number of RBMs that follow the header
+It returns 0 on success and a non-zero value otherwise */
+int freadModelHeader(FILE *fp, int *kind, int *n_layers)
+{
+    char magic[8];
+    int info[2];
+
+    if (fread(magic, sizeof(char), 8, fp) != 8 || memcmp(magic, MODEL_FILE_MAGIC, 8))
+    {
+        fprintf(stderr, "\nNot a binary model file @freadModelHeader.\n");
+        return -1;
+    }
+    if (fread(info, sizeof(int), 2, fp) != 2 || info[1] <= 0)
+    {
+        fprintf(stderr, "\nCorrupted binary model header @freadModelHeader.\n");
+        return -1;
+    }
+    *kind = info[0];
+    *n_layers = info[1];
+
+    return 0;
+}
+
+/* It writes the parameters of an RBM to a binary stream
+Parameters: [fp, m]
+fp: file opened for binary writing
+m: RBM
+It returns 0 on success and a non-zero value otherwise */
+int fwriteRBMParameters(FILE *fp, RBM *m)
+{
+    int dim[3];
+
+    if (!m)
+    {
+        fprintf(stderr, "\nThere is no RBM allocated @fwriteRBMParameters.\n");
+        return -1;
+    }
+
+    dim[0] = m->n_visible_layer_neurons;
+    dim[1] = m->n_hidden_layer_neurons;
+    dim[2] = m->n_labels;
+    if (fwrite(dim, sizeof(int), 3, fp) != 3)
+        return -1;
+    if (fwrite(&m->t, sizeof(double), 1, fp) != 1)
+        return -1;
+
+    if (gsl_matrix_fwrite(fp, m->W) || gsl_vector_fwrite(fp, m->a) || gsl_vector_fwrite(fp, m->b))
+        return -1;
+    if (gsl_matrix_fwrite(fp, m->U) || gsl_vector_fwrite(fp, m->c))
+        return -1;
+
+    return 0;
+}
+
+/* It reads the parameters of an RBM written by fwriteRBMParameters and allocates a new RBM with them
+Parameters: [fp]
+fp: file opened for binary reading
+It returns NULL if the stream is truncated or corrupted */
+RBM *freadRBMParameters(FILE *fp)
+{
+    int dim[3];
+    double t;
+    RBM *m = NULL;
+
+    if (fread(dim, sizeof(int), 3, fp) != 3 || fread(&t, sizeof(double), 1, fp) != 1)
+    {
+        fprintf(stderr, "\nUnable to read RBM header @freadRBMParameters.\n");
+        return NULL;
+    }
+    if (dim[0] <= 0 || dim[1] <= 0 || dim[2] <= 0)
+    {
+        fprintf(stderr, "\nInvalid RBM dimensions (%d, %d, %d) @freadRBMParameters.\n", dim[0], dim[1], dim[2]);
+        return NULL;
+    }
+
+    m = CreateRBM(dim[0], dim[1], dim[2]);
+    m->t = t;
+    if (gsl_matrix_fread(fp, m->W) || gsl_vector_fread(fp, m->a) || gsl_vector_fread(fp, m->b) ||
+        gsl_matrix_fread(fp, m->U) || gsl_vector_fread(fp, m->c))
+    {
+        fprintf(stderr, "\nUnable to read RBM parameters @freadRBMParameters.\n");
+        DestroyRBM(&m);
+        return NULL;
+    }
+
+    return m;
+}
+/**************************/
+
+/* It saves an RBM to a binary model file
+Parameters: [m, file]
+m: RBM
+file: file name
+It returns 0 on success and a non-zero value otherwise */
+int saveRBMParametersBinary(RBM *m, char *file)
+{
+    int status = 0;
+    FILE *fp = NULL;
+
+    fp = fopen(file, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "\nUnable to open %s @saveRBMParametersBinary.\n", file);
+        return -1;
+    }
+
+    status = fwriteModelHeader(fp, MODEL_FILE_RBM, 1);
+    if (!status)
+        status = fwriteRBMParameters(fp, m);
+    if (fclose(fp))
+        status = -1;
+
+    if (status)
+        fprintf(stderr, "\nUnable to write %s @saveRBMParametersBinary.\n", file);
+
+    return status;
+}
+
+/* It allocates an RBM from a binary model file written by saveRBMParametersBinary
+Parameters: [file]
+file: file name
+It returns NULL if the file cannot be read or does not hold an RBM */
+RBM *loadRBMFromBinaryFile(char *file)
+{
+    int kind, n_layers;
+    FILE *fp = NULL;
+    RBM *m = NULL;
+
+    fp = fopen(file, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "\nUnable to open %s @loadRBMFromBinaryFile.\n", file);
+        return NULL;
+    }
+
+    if (freadModelHeader(fp, &kind, &n_layers) || kind != MODEL_FILE_RBM || n_layers != 1)
+        fprintf(stderr, "\n%s is not a binary RBM file @loadRBMFromBinaryFile.\n", file);
+    else
+        m = freadRBMParameters(fp);
+    fclose(fp);
+
+    return m;
+}
+/**************************/
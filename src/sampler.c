@@ -0,0 +1,863 @@
+#include "sampler.h"
+#include "optimizer.h"
+#include "stopping.h"
+#include "monitor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+
+/* Allocation and deallocation */
+
+/* It allocates a pool of persistent chains (fantasy particles) whose states start uniformly random
+Parameters: [m, n_chains]
+m: RBM
+n_chains: number of chains */
+ChainPool *CreateChainPool(RBM *m, int n_chains)
+{
+    ChainPool *c = NULL;
+
+    if (n_chains <= 0)
+    {
+        fprintf(stderr, "\nInvalid number of chains @CreateChainPool.\n");
+        return NULL;
+    }
+
+    c = (ChainPool *)malloc(sizeof(ChainPool));
+    if (!c)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @CreateChainPool.\n");
+        exit(-1);
+    }
+    c->n_chains = n_chains;
+    c->V = gsl_matrix_alloc(n_chains, m->n_visible_layer_neurons);
+    c->H = gsl_matrix_alloc(n_chains, m->n_hidden_layer_neurons);
+    c->PV = gsl_matrix_alloc(n_chains, m->n_visible_layer_neurons);
+    c->PH = gsl_matrix_alloc(n_chains, m->n_hidden_layer_neurons);
+
+    srand(time(NULL));
+    c->r = gsl_rng_alloc(gsl_rng_default);
+    gsl_rng_set(c->r, random_seed_deep());
+
+    gsl_matrix_set_all(c->V, 0.5);
+    SampleBernoulliMatrix(c->V, c->V, c->r);
+    gsl_matrix_set_all(c->H, 0.5);
+    SampleBernoulliMatrix(c->H, c->H, c->r);
+
+    return c;
+}
+
+/* It deallocates a pool of persistent chains
+Parameters: [c]
+c: chain pool */
+void DestroyChainPool(ChainPool **c)
+{
+    if (*c)
+    {
+        gsl_matrix_free((*c)->V);
+        gsl_matrix_free((*c)->H);
+        gsl_matrix_free((*c)->PV);
+        gsl_matrix_free((*c)->PH);
+        gsl_rng_free((*c)->r);
+        free(*c);
+        *c = NULL;
+    }
+}
+
+/* It allocates a parallel tempering sampler whose replicas start from uniformly random states
+Parameters: [m, n_chains, n_replicas, max_temperature, swap_interval]
+m: RBM, whose temperature m->t is the one of the coldest replica
+n_chains: number of chains run by each replica
+n_replicas: number of replicas, with temperatures spaced geometrically from m->t to max_temperature
+max_temperature: temperature of the hottest replica
+swap_interval: number of Gibbs steps between two rounds of replica exchanges */
+TemperingSampler *CreateTemperingSampler(RBM *m, int n_chains, int n_replicas, double max_temperature, int swap_interval)
+{
+    TemperingSampler *s = NULL;
+    unsigned long seed;
+    int k;
+
+    if (n_chains <= 0 || n_replicas <= 0 || swap_interval <= 0 || max_temperature < m->t)
+    {
+        fprintf(stderr, "\nInvalid number of chains, replicas, swap interval or temperature ladder @CreateTemperingSampler.\n");
+        return NULL;
+    }
+
+    s = (TemperingSampler *)calloc(1, sizeof(TemperingSampler));
+    if (!s)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @CreateTemperingSampler.\n");
+        exit(-1);
+    }
+    s->n_chains = n_chains;
+    s->n_replicas = n_replicas;
+    s->swap_interval = swap_interval;
+
+    s->t = (double *)malloc(n_replicas * sizeof(double));
+    s->V = (gsl_matrix **)malloc(n_replicas * sizeof(gsl_matrix *));
+    s->H = (gsl_matrix **)malloc(n_replicas * sizeof(gsl_matrix *));
+    s->P = (gsl_matrix **)malloc(n_replicas * sizeof(gsl_matrix *));
+    s->Q = (gsl_matrix **)malloc(n_replicas * sizeof(gsl_matrix *));
+    s->E = (gsl_vector **)malloc(n_replicas * sizeof(gsl_vector *));
+    s->r = (gsl_rng **)malloc(n_replicas * sizeof(gsl_rng *));
+    s->n_proposed = (unsigned long *)calloc(n_replicas, sizeof(unsigned long));
+    s->n_accepted = (unsigned long *)calloc(n_replicas, sizeof(unsigned long));
+
+    srand(time(NULL));
+    seed = random_seed_deep();
+    for (k = 0; k < n_replicas; k++)
+    {
+        s->t[k] = n_replicas > 1 ? m->t * pow(max_temperature / m->t, (double)k / (n_replicas - 1)) : m->t;
+        s->V[k] = gsl_matrix_alloc(n_chains, m->n_visible_layer_neurons);
+        s->H[k] = gsl_matrix_alloc(n_chains, m->n_hidden_layer_neurons);
+        s->P[k] = gsl_matrix_alloc(n_chains, m->n_hidden_layer_neurons);
+        s->Q[k] = gsl_matrix_alloc(n_chains, m->n_visible_layer_neurons);
+        s->E[k] = gsl_vector_calloc(n_chains);
+        s->r[k] = gsl_rng_alloc(gsl_rng_default);
+        gsl_rng_set(s->r[k], seed + k);
+
+        gsl_matrix_set_all(s->V[k], 0.5);
+        SampleBernoulliMatrix(s->V[k], s->V[k], s->r[k]);
+        gsl_matrix_set_all(s->H[k], 0.5);
+        SampleBernoulliMatrix(s->H[k], s->H[k], s->r[k]);
+    }
+
+    return s;
+}
+
+/* It deallocates a parallel tempering sampler
+Parameters: [s]
+s: parallel tempering sampler */
+void DestroyTemperingSampler(TemperingSampler **s)
+{
+    int k;
+
+    if (*s)
+    {
+        for (k = 0; k < (*s)->n_replicas; k++)
+        {
+            gsl_matrix_free((*s)->V[k]);
+            gsl_matrix_free((*s)->H[k]);
+            gsl_matrix_free((*s)->P[k]);
+            gsl_matrix_free((*s)->Q[k]);
+            gsl_vector_free((*s)->E[k]);
+            gsl_rng_free((*s)->r[k]);
+        }
+        free((*s)->t);
+        free((*s)->V);
+        free((*s)->H);
+        free((*s)->P);
+        free((*s)->Q);
+        free((*s)->E);
+        free((*s)->r);
+        free((*s)->n_proposed);
+        free((*s)->n_accepted);
+        free(*s);
+        *s = NULL;
+    }
+}
+/* It allocates a sample generator that runs Gibbs chains on the top layer of a model and carries their states down through the layers beneath it.
+Chain i draws its initial state and all of its samples from its own generator, seeded with seed + i
+Parameters: [m, n_layers, n_chains, burn_in, thinning, seed]
+m: layers of the model, from the bottom one to the top one (a single RBM for n_layers = 1)
+n_layers: number of layers
+n_chains: number of independent chains
+burn_in: number of Gibbs steps discarded before the first sample of each chain
+thinning: number of Gibbs steps between two samples of a chain
+seed: seed of the chains' generators */
+SampleGenerator *CreateSampleGenerator(RBM **m, int n_layers, int n_chains, int burn_in, int thinning, unsigned long seed)
+{
+    SampleGenerator *g = NULL;
+    int i, j, l;
+
+    if (!m || n_layers <= 0 || n_chains <= 0 || burn_in < 0 || thinning <= 0)
+    {
+        fprintf(stderr, "\nInvalid model, number of chains, burn-in or thinning @CreateSampleGenerator.\n");
+        return NULL;
+    }
+
+    g = (SampleGenerator *)calloc(1, sizeof(SampleGenerator));
+    if (!g)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @CreateSampleGenerator.\n");
+        exit(-1);
+    }
+    g->m = m;
+    g->n_layers = n_layers;
+    g->n_chains = n_chains;
+    g->burn_in = burn_in;
+    g->thinning = thinning;
+
+    g->V = gsl_matrix_alloc(n_chains, m[n_layers - 1]->n_visible_layer_neurons);
+    g->H = gsl_matrix_alloc(n_chains, m[n_layers - 1]->n_hidden_layer_neurons);
+    g->PV = gsl_matrix_alloc(n_chains, m[n_layers - 1]->n_visible_layer_neurons);
+    g->PH = gsl_matrix_alloc(n_chains, m[n_layers - 1]->n_hidden_layer_neurons);
+    g->X = (gsl_matrix **)calloc(n_layers, sizeof(gsl_matrix *));
+    for (l = 0; l < n_layers - 1; l++)
+        g->X[l] = gsl_matrix_alloc(n_chains, m[l]->n_visible_layer_neurons);
+
+    g->r = (gsl_rng **)malloc(n_chains * sizeof(gsl_rng *));
+    for (i = 0; i < n_chains; i++)
+    {
+        g->r[i] = gsl_rng_alloc(gsl_rng_default);
+        gsl_rng_set(g->r[i], seed + i);
+        for (j = 0; j < g->V->size2; j++)
+            gsl_matrix_set(g->V, i, j, gsl_rng_uniform(g->r[i]) < 0.5 ? 1.0 : 0.0);
+    }
+
+    return g;
+}
+
+/* It deallocates a sample generator, leaving the model untouched
+Parameters: [g]
+g: sample generator */
+void DestroySampleGenerator(SampleGenerator **g)
+{
+    int i, l;
+
+    if (*g)
+    {
+        gsl_matrix_free((*g)->V);
+        gsl_matrix_free((*g)->H);
+        gsl_matrix_free((*g)->PV);
+        gsl_matrix_free((*g)->PH);
+        for (l = 0; l < (*g)->n_layers - 1; l++)
+            gsl_matrix_free((*g)->X[l]);
+        free((*g)->X);
+        for (i = 0; i < (*g)->n_chains; i++)
+            gsl_rng_free((*g)->r[i]);
+        free((*g)->r);
+        free(*g);
+        *g = NULL;
+    }
+}
+/**********************************************/
+
+/* Persistent chains */
+
+/* It advances every chain of a pool by a number of Gibbs steps (v given h, and then h given v), each one made of two GEMMs over the whole pool.
+Afterwards, c->V holds the model samples and c->PH their hidden units' probabilities
+Parameters: [c, m, W, n_steps]
+c: chain pool
+m: RBM, whose biases and temperature are used
+W: weights the chains are run with (m->W for PCD, or the effective weights W + fast_W for FPCD)
+n_steps: number of Gibbs steps */
+void RunChainPool(ChainPool *c, RBM *m, gsl_matrix *W, int n_steps)
+{
+    double *p;
+    int step, i, j;
+
+    for (step = 0; step < n_steps; step++)
+    {
+        /* It samples v ~ P(v|h) */
+        gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, c->H, W, 0.0, c->PV);
+        for (i = 0; i < c->n_chains; i++)
+        {
+            p = gsl_matrix_ptr(c->PV, i, 0);
+            for (j = 0; j < m->n_visible_layer_neurons; j++)
+                p[j] = SigmoidLogistic(p[j] + gsl_vector_get(m->a, j));
+        }
+        SampleBernoulliMatrix(c->PV, c->V, c->r);
+
+        /* It samples h ~ P(h|v) */
+        gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, c->V, W, 0.0, c->PH);
+        for (i = 0; i < c->n_chains; i++)
+        {
+            p = gsl_matrix_ptr(c->PH, i, 0);
+            for (j = 0; j < m->n_hidden_layer_neurons; j++)
+                p[j] = SigmoidLogistic((p[j] + gsl_vector_get(m->b, j)) / m->t);
+        }
+        SampleBernoulliMatrix(c->PH, c->H, c->r);
+    }
+}
+/**********************************************/
+
+/* Parallel tempering */
+
+/* It runs one Gibbs step (v given h, and then h given v) over all chains of a replica, computing the energy of their new states on the fly
+Parameters: [s, m, k]
+s: parallel tempering sampler
+m: RBM
+k: replica */
+static void TemperingGibbsStep(TemperingSampler *s, RBM *m, int k)
+{
+    gsl_matrix *V = s->V[k], *H = s->H[k], *P = s->P[k], *Q = s->Q[k];
+    double beta = 1.0 / s->t[k], x, energy, *v, *h, *p, *q;
+    int i, j;
+
+    /* It samples v ~ P(v|h) at the replica's temperature */
+    gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, H, m->W, 0.0, Q);
+    for (i = 0; i < V->size1; i++)
+    {
+        v = gsl_matrix_ptr(V, i, 0);
+        q = gsl_matrix_ptr(Q, i, 0);
+        for (j = 0; j < V->size2; j++)
+            v[j] = SigmoidLogistic(beta * (q[j] + gsl_vector_get(m->a, j))) >= gsl_rng_uniform(s->r[k]) ? 1.0 : 0.0;
+    }
+
+    /* It samples h ~ P(h|v), and E(v,h) = -v'Wh - a'v - b'h is accumulated as the hidden units are drawn */
+    gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, V, m->W, 0.0, P);
+    for (i = 0; i < H->size1; i++)
+    {
+        v = gsl_matrix_ptr(V, i, 0);
+        h = gsl_matrix_ptr(H, i, 0);
+        p = gsl_matrix_ptr(P, i, 0);
+        energy = 0.0;
+        for (j = 0; j < V->size2; j++)
+            energy -= gsl_vector_get(m->a, j) * v[j];
+        for (j = 0; j < H->size2; j++)
+        {
+            x = p[j] + gsl_vector_get(m->b, j);
+            p[j] = SigmoidLogistic(beta * x);
+            h[j] = p[j] >= gsl_rng_uniform(s->r[k]) ? 1.0 : 0.0;
+            energy -= x * h[j];
+        }
+        gsl_vector_set(s->E[k], i, energy);
+    }
+}
+
+/* It proposes to exchange the states of every chain between adjacent replicas, alternating between the pairs (0,1), (2,3), ... and (1,2), (3,4), ...
+The states of replicas k and k + 1 are swapped with probability min(1, exp((1/t_k - 1/t_k+1)(E_k - E_k+1)))
+Parameters: [s]
+s: parallel tempering sampler */
+static void ExchangeTemperingReplicas(TemperingSampler *s)
+{
+    gsl_vector_view x, y;
+    double delta, aux;
+    int k, c;
+
+    for (k = s->n_rounds % 2; k < s->n_replicas - 1; k += 2)
+    {
+        for (c = 0; c < s->n_chains; c++)
+        {
+            delta = (1.0 / s->t[k] - 1.0 / s->t[k + 1]) * (gsl_vector_get(s->E[k], c) - gsl_vector_get(s->E[k + 1], c));
+            s->n_proposed[k]++;
+            if (delta < 0 && gsl_rng_uniform(s->r[0]) >= exp(delta))
+                continue;
+
+            x = gsl_matrix_row(s->V[k], c);
+            y = gsl_matrix_row(s->V[k + 1], c);
+            gsl_vector_swap(&x.vector, &y.vector);
+            x = gsl_matrix_row(s->H[k], c);
+            y = gsl_matrix_row(s->H[k + 1], c);
+            gsl_vector_swap(&x.vector, &y.vector);
+            aux = gsl_vector_get(s->E[k], c);
+            gsl_vector_set(s->E[k], c, gsl_vector_get(s->E[k + 1], c));
+            gsl_vector_set(s->E[k + 1], c, aux);
+            s->n_accepted[k]++;
+        }
+    }
+    s->n_rounds++;
+}
+
+/* It advances every replica by a number of Gibbs steps, exchanging adjacent replicas every swap_interval steps. The replicas are advanced concurrently,
+each one with its own generator. Afterwards, s->V[0] holds the model samples and s->P[0] their hidden units' probabilities
+Parameters: [s, m, n_steps]
+s: parallel tempering sampler
+m: RBM
+n_steps: number of Gibbs steps */
+void RunTemperingSampler(TemperingSampler *s, RBM *m, int n_steps)
+{
+    int step, k;
+
+    for (step = 0; step < n_steps; step++)
+    {
+        /* Exchanges happen before a step, so the hidden probabilities left in P always belong to the last visible states */
+        if (s->n_steps && s->n_steps % s->swap_interval == 0)
+            ExchangeTemperingReplicas(s);
+
+#pragma omp parallel for schedule(dynamic)
+        for (k = 0; k < s->n_replicas; k++)
+            TemperingGibbsStep(s, m, k);
+        s->n_steps++;
+    }
+}
+
+/* It computes the fraction of the proposed exchanges that were accepted so far
+Parameters: [s]
+s: parallel tempering sampler */
+double getTemperingSamplerSwapRate(TemperingSampler *s)
+{
+    unsigned long proposed = 0, accepted = 0;
+    int k;
+
+    for (k = 0; k < s->n_replicas; k++)
+    {
+        proposed += s->n_proposed[k];
+        accepted += s->n_accepted[k];
+    }
+
+    return proposed ? (double)accepted / proposed : 0.0;
+}
+/**********************************************/
+
+/* Bernoulli RBM training */
+
+/* It trains a Bernoulli RBM whose negative phase is drawn by a parallel tempering sampler instead of single persistent chains.
+The chains of the coldest replica give the model statistics, while the hotter ones cross between modes and hand their states down through exchanges
+Parameters: [D, m, n_epochs, n_gibbs_sampling, batch_size, n_chains, n_replicas, max_temperature, swap_interval]
+D: dataset
+m: RBM
+n_epochs: number of training epochs
+n_gibbs_sampling: number of Gibbs steps of the sampler per mini-batch
+batch_size: size of batch data
+n_chains: number of chains of each replica
+n_replicas: number of replicas (1 falls back to plain persistent chains)
+max_temperature: temperature of the hottest replica
+swap_interval: number of Gibbs steps between two rounds of replica exchanges */
+double BernoulliRBMTrainingbyParallelTempering(Dataset *D, RBM *m, int n_epochs, int n_gibbs_sampling, int batch_size, int n_chains, int n_replicas, double max_temperature, int swap_interval)
+{
+    int e, z, i, j, n, trained;
+    double error, errorsum, aux, *p, *q;
+    TemperingSampler *s = NULL;
+    gsl_matrix *X = NULL, *PH = NULL, *R = NULL;
+    ParameterState *tmpW = NULL, *tmpa = NULL, *tmpb = NULL;
+    gsl_matrix_view x, ph, rv;
+    gsl_vector_view data_ones, chain_ones;
+    gsl_vector *agrad = NULL, *bgrad = NULL, *ones = NULL;
+
+    s = CreateTemperingSampler(m, n_chains, n_replicas, max_temperature, swap_interval);
+    if (!s)
+        return 0.0;
+
+    X = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    PH = gsl_matrix_alloc(batch_size, m->n_hidden_layer_neurons);
+    R = gsl_matrix_alloc(batch_size, m->n_visible_layer_neurons);
+    tmpW = CreateParameterState(m, m->n_visible_layer_neurons, m->n_hidden_layer_neurons);
+    tmpa = CreateParameterState(m, m->n_visible_layer_neurons, 1);
+    tmpb = CreateParameterState(m, m->n_hidden_layer_neurons, 1);
+    agrad = gsl_vector_alloc(m->n_visible_layer_neurons);
+    bgrad = gsl_vector_alloc(m->n_hidden_layer_neurons);
+    ones = gsl_vector_alloc(batch_size > n_chains ? batch_size : n_chains);
+    gsl_vector_set_all(ones, 1.0);
+    chain_ones = gsl_vector_subvector(ones, 0, n_chains);
+
+    error = 0;
+
+    /* For each epoch */
+    for (e = 1; e <= n_epochs; e++)
+    {
+        fprintf(stderr, "\nRunning epoch %d ... ", e);
+
+        errorsum = 0;
+
+        /* For each batch */
+        for (z = 0; z < D->size; z += batch_size)
+        {
+            n = D->size - z < batch_size ? D->size - z : batch_size;
+            x = gsl_matrix_submatrix(X, 0, 0, n, X->size2);
+            ph = gsl_matrix_submatrix(PH, 0, 0, n, PH->size2);
+            rv = gsl_matrix_submatrix(R, 0, 0, n, R->size2);
+            data_ones = gsl_vector_subvector(ones, 0, n);
+            for (i = 0; i < n; i++)
+                gsl_matrix_set_row(&x.matrix, i, D->sample[z + i].feature);
+
+            /* Positive phase */
+            getBatchProbabilityTurningOnHiddenUnit(m, &x.matrix, &ph.matrix);
+
+            /* It reconstructs the mini-batch from its hidden probabilities */
+            gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, &ph.matrix, m->W, 0.0, &rv.matrix);
+            for (i = 0; i < n; i++)
+            {
+                p = gsl_matrix_ptr(&x.matrix, i, 0);
+                q = gsl_matrix_ptr(&rv.matrix, i, 0);
+                aux = 0.0;
+                for (j = 0; j < R->size2; j++)
+                {
+                    q[j] = SigmoidLogistic(q[j] + gsl_vector_get(m->a, j));
+                    aux += (p[j] - q[j]) * (p[j] - q[j]);
+                }
+                errorsum += aux / R->size2;
+            }
+
+            /* Negative phase */
+            RunTemperingSampler(s, m, n_gibbs_sampling);
+
+            /* It updates RBM parameters */
+            UpdateParameterMatrix4Batch(m, m->W, &x.matrix, &ph.matrix, 1.0 / n, s->V[0], s->P[0], 1.0 / n_chains, m->eta, m->lambda, tmpW); /* It performs W' = alpha*W' - lambda*W + eta*(E_data - E_model) and W = W+W' */
+
+            gsl_blas_dgemv(CblasTrans, 1.0 / n, &x.matrix, &data_ones.vector, 0.0, agrad);        /* It performs E_data[v] */
+            gsl_blas_dgemv(CblasTrans, -1.0 / n_chains, s->V[0], &chain_ones.vector, 1.0, agrad); /* It performs E_data[v] - E_model[v] */
+            UpdateParameterVector(m, m->a, agrad, NULL, 1.0, m->eta, tmpa);                       /* It performs a' = alpha*a' + eta*(E_data - E_model) and a = a + a' */
+
+            gsl_blas_dgemv(CblasTrans, 1.0 / n, &ph.matrix, &data_ones.vector, 0.0, bgrad);       /* It performs E_data[h] */
+            gsl_blas_dgemv(CblasTrans, -1.0 / n_chains, s->P[0], &chain_ones.vector, 1.0, bgrad); /* It performs E_data[h] - E_model[h] */
+            UpdateParameterVector(m, m->b, bgrad, NULL, 1.0, m->eta, tmpb);                       /* It performs b' = alpha*b' + eta*(E_data - E_model) and b = b + b' */
+
+            PublishTrainingMonitor(m);
+            if (CheckEarlyStopping(D, m))
+                break;
+        }
+
+        trained = z < D->size ? z + n : D->size; /* samples trained, fewer than D->size if the epoch stopped early */
+        error = errorsum / trained;
+        fprintf(stderr, "    -> Reconstruction error: %lf with %.2lf%% of the replica exchanges accepted", error, 100 * getTemperingSamplerSwapRate(s));
+        fprintf(stdout, "%d %lf\n", e, error);
+
+        m->eta = m->eta_max - ((m->eta_max - m->eta_min) / n_epochs) * e;
+
+        if (error < 0.0001 || HasStoppedEarly(m))
+            e = n_epochs + 1;
+    }
+    RestoreEarlyStopping(m);
+
+    DestroyTemperingSampler(&s);
+
+    gsl_matrix_free(X);
+    gsl_matrix_free(PH);
+    gsl_matrix_free(R);
+    DestroyParameterState(&tmpW);
+    DestroyParameterState(&tmpa);
+    DestroyParameterState(&tmpb);
+    gsl_vector_free(agrad);
+    gsl_vector_free(bgrad);
+    gsl_vector_free(ones);
+
+    return error;
+}
+/**********************************************/
+
+/* Sample generation */
+
+/* It advances a block of chains of a generator by a number of Gibbs steps (h given v, and then v given h) on the top RBM, and it carries
+their visible states down through the layers beneath it, sampling every intermediate layer and keeping the probabilities of the bottom one
+Parameters: [g, first, size, n_steps]
+g: sample generator
+first: first chain of the block
+size: number of chains in the block
+n_steps: number of Gibbs steps */
+static void AdvanceGeneratorBlock(SampleGenerator *g, int first, int size, int n_steps)
+{
+    RBM *m = g->m[g->n_layers - 1];
+    gsl_matrix_view V, H, PV, PH, X;
+    gsl_matrix *S = NULL;
+    gsl_rng *r = NULL;
+    double *p, *s;
+    int step, i, j, l;
+
+    V = gsl_matrix_submatrix(g->V, first, 0, size, g->V->size2);
+    H = gsl_matrix_submatrix(g->H, first, 0, size, g->H->size2);
+    PV = gsl_matrix_submatrix(g->PV, first, 0, size, g->PV->size2);
+    PH = gsl_matrix_submatrix(g->PH, first, 0, size, g->PH->size2);
+
+    for (step = 0; step < n_steps; step++)
+    {
+        /* It samples h ~ P(h|v) */
+        gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, &V.matrix, m->W, 0.0, &PH.matrix);
+        for (i = 0; i < size; i++)
+        {
+            r = g->r[first + i];
+            p = gsl_matrix_ptr(&PH.matrix, i, 0);
+            s = gsl_matrix_ptr(&H.matrix, i, 0);
+            for (j = 0; j < m->n_hidden_layer_neurons; j++)
+            {
+                p[j] = SigmoidLogistic((p[j] + gsl_vector_get(m->b, j)) / m->t);
+                s[j] = p[j] >= gsl_rng_uniform(r) ? 1.0 : 0.0;
+            }
+        }
+
+        /* It samples v ~ P(v|h) */
+        gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, &H.matrix, m->W, 0.0, &PV.matrix);
+        for (i = 0; i < size; i++)
+        {
+            r = g->r[first + i];
+            p = gsl_matrix_ptr(&PV.matrix, i, 0);
+            s = gsl_matrix_ptr(&V.matrix, i, 0);
+            for (j = 0; j < m->n_visible_layer_neurons; j++)
+            {
+                p[j] = SigmoidLogistic(p[j] + gsl_vector_get(m->a, j));
+                s[j] = p[j] >= gsl_rng_uniform(r) ? 1.0 : 0.0;
+            }
+        }
+    }
+
+    /* It runs the directed down pass, where the visible units of each layer are the hidden ones of the layer beneath it */
+    S = &V.matrix;
+    for (l = g->n_layers - 2; l >= 0; l--)
+    {
+        X = gsl_matrix_submatrix(g->X[l], first, 0, size, g->X[l]->size2);
+        gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, S, g->m[l]->W, 0.0, &X.matrix);
+        for (i = 0; i < size; i++)
+        {
+            r = g->r[first + i];
+            p = gsl_matrix_ptr(&X.matrix, i, 0);
+            for (j = 0; j < g->m[l]->n_visible_layer_neurons; j++)
+            {
+                p[j] = SigmoidLogistic(p[j] + gsl_vector_get(g->m[l]->a, j));
+                if (l)
+                    p[j] = p[j] >= gsl_rng_uniform(r) ? 1.0 : 0.0;
+            }
+        }
+        S = &X.matrix;
+    }
+}
+
+/* It draws one sample from every chain of a generator. The first call runs burn_in + thinning Gibbs steps and the following ones thinning steps,
+and blocks of chains are advanced concurrently. Since every chain owns its generator, the samples do not depend on the number of threads
+Parameters: [g]
+g: sample generator
+It returns a matrix owned by the generator with one sample per row (the visible units' probabilities of the bottom layer), which is overwritten by the next call */
+gsl_matrix *RunSampleGenerator(SampleGenerator *g)
+{
+    int n_steps, z;
+
+    n_steps = (g->n_rounds ? 0 : g->burn_in) + g->thinning;
+
+#pragma omp parallel for schedule(dynamic)
+    for (z = 0; z < g->n_chains; z += SAMPLE_GENERATOR_BLOCK_SIZE)
+        AdvanceGeneratorBlock(g, z, g->n_chains - z < SAMPLE_GENERATOR_BLOCK_SIZE ? g->n_chains - z : SAMPLE_GENERATOR_BLOCK_SIZE, n_steps);
+    g->n_rounds++;
+
+    return g->n_layers > 1 ? g->X[0] : g->PV;
+}
+
+/* It draws a number of samples from every chain of a generator into a new dataset, where sample k of chain i is stored at position k * n_chains + i
+Parameters: [g, n_samples]
+g: sample generator
+n_samples: number of samples drawn from each chain */
+static Dataset *GenerateSamples(SampleGenerator *g, int n_samples)
+{
+    Dataset *G = NULL;
+    gsl_matrix *S = NULL;
+    int i, k;
+
+    if (n_samples <= 0 || (long)n_samples * g->n_chains > INT_MAX)
+    {
+        fprintf(stderr, "\nInvalid number of samples @GenerateSamples.\n");
+        return NULL;
+    }
+
+    G = CreateDataset(n_samples * g->n_chains, g->m[0]->n_visible_layer_neurons);
+    G->nlabels = 0;
+    for (k = 0; k < n_samples; k++)
+    {
+        S = RunSampleGenerator(g);
+        for (i = 0; i < g->n_chains; i++)
+        {
+            gsl_matrix_get_row(G->sample[k * g->n_chains + i].feature, S, i);
+            G->sample[k * g->n_chains + i].label = 0;
+        }
+    }
+
+    return G;
+}
+
+/* It writes a whole buffer at a given offset of a file, resuming short writes
+Parameters: [fd, buf, n, offset]
+fd: file descriptor
+buf: buffer
+n: number of bytes
+offset: position in the file
+It returns 0 on success */
+static int pwriteAll(int fd, const char *buf, size_t n, off_t offset)
+{
+    ssize_t written;
+
+    while (n > 0)
+    {
+        written = pwrite(fd, buf, n, offset);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        buf += written;
+        n -= written;
+        offset += written;
+    }
+
+    return 0;
+}
+
+/* It draws a number of samples from every chain of a generator straight into a file with LibOPF's binary dataset format (the one read by ReadSubgraph),
+where sample k of chain i is the node k * n_chains + i. Every round of samples is converted and written by blocks of chains concurrently, each thread
+placing its records with pwrite at their final offsets
+Parameters: [g, filename, n_samples]
+g: sample generator
+filename: output file
+n_samples: number of samples drawn from each chain
+It returns 0 on success */
+static int WriteSamples(SampleGenerator *g, char *filename, int n_samples)
+{
+    int header[3], n_features = g->m[0]->n_visible_layer_neurons, fd, k, z, failed = 0;
+    size_t record = 2 * sizeof(int) + n_features * sizeof(float);
+    gsl_matrix *S = NULL;
+
+    if (n_samples <= 0 || (long)n_samples * g->n_chains > INT_MAX)
+    {
+        fprintf(stderr, "\nInvalid number of samples @WriteSamples.\n");
+        return 1;
+    }
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "\nUnable to open file %s @WriteSamples.\n", filename);
+        return 1;
+    }
+
+    header[0] = n_samples * g->n_chains; /* number of nodes */
+    header[1] = 0;                       /* number of labels */
+    header[2] = n_features;              /* number of features */
+    failed = pwriteAll(fd, (char *)header, sizeof(header), 0);
+
+    for (k = 0; k < n_samples && !failed; k++)
+    {
+        S = RunSampleGenerator(g);
+
+#pragma omp parallel reduction(|| : failed)
+        {
+            char *buf = (char *)malloc(SAMPLE_GENERATOR_BLOCK_SIZE * record), *rec;
+            int i, j, n, node;
+            float *feat;
+
+#pragma omp for schedule(dynamic)
+            for (z = 0; z < g->n_chains; z += SAMPLE_GENERATOR_BLOCK_SIZE)
+            {
+                n = g->n_chains - z < SAMPLE_GENERATOR_BLOCK_SIZE ? g->n_chains - z : SAMPLE_GENERATOR_BLOCK_SIZE;
+                for (i = 0; i < n; i++)
+                {
+                    rec = buf + i * record;
+                    node = k * g->n_chains + z + i;
+                    memcpy(rec, &node, sizeof(int));           /* position */
+                    memset(rec + sizeof(int), 0, sizeof(int)); /* true label */
+                    feat = (float *)(rec + 2 * sizeof(int));
+                    for (j = 0; j < n_features; j++)
+                        feat[j] = (float)gsl_matrix_get(S, z + i, j);
+                }
+                if (pwriteAll(fd, buf, n * record, sizeof(header) + (off_t)(k * g->n_chains + z) * record))
+                    failed = 1;
+            }
+            free(buf);
+        }
+    }
+
+    if (close(fd) || failed)
+    {
+        fprintf(stderr, "\nUnable to write file %s @WriteSamples.\n", filename);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* It generates samples from a trained RBM by running many independent Gibbs chains as a matrix
+Parameters: [m, n_chains, n_samples, burn_in, thinning, seed]
+m: RBM
+n_chains: number of chains
+n_samples: number of samples drawn from each chain
+burn_in: number of Gibbs steps discarded before the first sample of each chain
+thinning: number of Gibbs steps between two samples of a chain
+seed: seed of the chains' generators, which makes the output reproducible
+It returns a dataset with n_chains * n_samples visible units' probabilities, where sample k of chain i is stored at position k * n_chains + i */
+Dataset *GenerateRBMSamples(RBM *m, int n_chains, int n_samples, int burn_in, int thinning, unsigned long seed)
+{
+    SampleGenerator *g = NULL;
+    Dataset *G = NULL;
+
+    if (!m)
+    {
+        fprintf(stderr, "\nThere is no RBM allocated @GenerateRBMSamples.\n");
+        return NULL;
+    }
+
+    g = CreateSampleGenerator(&m, 1, n_chains, burn_in, thinning, seed);
+    if (!g)
+        return NULL;
+    G = GenerateSamples(g, n_samples);
+    DestroySampleGenerator(&g);
+
+    return G;
+}
+
+/* It generates samples from a trained DBN by running many independent Gibbs chains on its top RBM, followed by a directed down pass through the layers beneath it
+Parameters: [d, n_chains, n_samples, burn_in, thinning, seed]
+d: DBN
+n_chains: number of chains
+n_samples: number of samples drawn from each chain
+burn_in: number of Gibbs steps discarded before the first sample of each chain
+thinning: number of Gibbs steps between two samples of a chain
+seed: seed of the chains' generators, which makes the output reproducible
+It returns a dataset with n_chains * n_samples visible units' probabilities, where sample k of chain i is stored at position k * n_chains + i */
+Dataset *GenerateDBNSamples(DBN *d, int n_chains, int n_samples, int burn_in, int thinning, unsigned long seed)
+{
+    SampleGenerator *g = NULL;
+    Dataset *G = NULL;
+
+    if (!d)
+    {
+        fprintf(stderr, "\nThere is no DBN allocated @GenerateDBNSamples.\n");
+        return NULL;
+    }
+
+    g = CreateSampleGenerator(d->m, d->n_layers, n_chains, burn_in, thinning, seed);
+    if (!g)
+        return NULL;
+    G = GenerateSamples(g, n_samples);
+    DestroySampleGenerator(&g);
+
+    return G;
+}
+
+/* It generates samples from a trained RBM straight into a binary dataset file, without holding them in memory
+Parameters: [m, filename, n_chains, n_samples, burn_in, thinning, seed]
+m: RBM
+filename: output file, in LibOPF's binary dataset format
+n_chains: number of chains
+n_samples: number of samples drawn from each chain
+burn_in: number of Gibbs steps discarded before the first sample of each chain
+thinning: number of Gibbs steps between two samples of a chain
+seed: seed of the chains' generators, which makes the output reproducible
+It returns 0 on success */
+int WriteGeneratedRBMSamples(RBM *m, char *filename, int n_chains, int n_samples, int burn_in, int thinning, unsigned long seed)
+{
+    SampleGenerator *g = NULL;
+    int status;
+
+    if (!m)
+    {
+        fprintf(stderr, "\nThere is no RBM allocated @WriteGeneratedRBMSamples.\n");
+        return 1;
+    }
+
+    g = CreateSampleGenerator(&m, 1, n_chains, burn_in, thinning, seed);
+    if (!g)
+        return 1;
+    status = WriteSamples(g, filename, n_samples);
+    DestroySampleGenerator(&g);
+
+    return status;
+}
+
+/* It generates samples from a trained DBN straight into a binary dataset file, without holding them in memory
+Parameters: [d, filename, n_chains, n_samples, burn_in, thinning, seed]
+d: DBN
+filename: output file, in LibOPF's binary dataset format
+n_chains: number of chains
+n_samples: number of samples drawn from each chain
+burn_in: number of Gibbs steps discarded before the first sample of each chain
+thinning: number of Gibbs steps between two samples of a chain
+seed: seed of the chains' generators, which makes the output reproducible
+It returns 0 on success */
+int WriteGeneratedDBNSamples(DBN *d, char *filename, int n_chains, int n_samples, int burn_in, int thinning, unsigned long seed)
+{
+    SampleGenerator *g = NULL;
+    int status;
+
+    if (!d)
+    {
+        fprintf(stderr, "\nThere is no DBN allocated @WriteGeneratedDBNSamples.\n");
+        return 1;
+    }
+
+    g = CreateSampleGenerator(d->m, d->n_layers, n_chains, burn_in, thinning, seed);
+    if (!g)
+        return 1;
+    status = WriteSamples(g, filename, n_samples);
+    DestroySampleGenerator(&g);
+
+    return status;
+}
+/**********************************************/
@@ -0,0 +1,928 @@
+#include "serving.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+
+typedef struct _ServingConnection
+{
+    Server *s;
+    int fd;
+    ServingRequest req; /* a connection has at most one request in flight, so its buffers are reused */
+    struct _ServingConnection *prev, *next;
+} ServingConnection;
+
+typedef struct _ServingWorkerArgs
+{
+    Server *s;
+    int id; /* index of the worker's epoch slot */
+} ServingWorkerArgs;
+
+/* It reads the running flag, which StopServer may clear from a signal handler without holding any lock
+Parameters: [s]
+s: server */
+static int IsRunning(Server *s)
+{
+    return __atomic_load_n(&s->running, __ATOMIC_SEQ_CST);
+}
+/**********************************************/
+
+/* Socket I/O */
+
+/* It reads exactly size bytes from a socket
+Parameters: [fd, buf, size]
+fd: socket
+buf: output buffer
+size: number of bytes
+It returns 0 on success and -1 on error or end of stream */
+static int ReadFull(int fd, void *buf, size_t size)
+{
+    char *p = (char *)buf;
+    ssize_t n;
+
+    while (size > 0)
+    {
+        n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+/* It writes exactly size bytes to a socket without raising SIGPIPE if the peer has gone away
+Parameters: [fd, buf, size]
+fd: socket
+buf: input buffer
+size: number of bytes
+It returns 0 on success and -1 on error */
+static int WriteFull(int fd, const void *buf, size_t size)
+{
+    const char *p = (const char *)buf;
+    ssize_t n;
+
+    while (size > 0)
+    {
+        n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+/* It reads and throws away the payload of a rejected message, so the connection stays in sync
+Parameters: [fd, n]
+fd: socket
+n: number of doubles to skip */
+static int DiscardFull(int fd, uint32_t n)
+{
+    double buf[256];
+    uint32_t k;
+
+    while (n > 0)
+    {
+        k = n < 256 ? n : 256;
+        if (ReadFull(fd, buf, k * sizeof(double)))
+            return -1;
+        n -= k;
+    }
+
+    return 0;
+}
+
+/* It sends a response header followed by an optional payload
+Parameters: [fd, status, y]
+fd: socket
+status: response status
+y: output features (NULL for an empty payload) */
+static int SendResponse(int fd, int status, gsl_vector *y)
+{
+    ServingHeader header;
+
+    header.code = status;
+    header.n = y ? y->size : 0;
+    if (WriteFull(fd, &header, sizeof(ServingHeader)))
+        return -1;
+    if (y && WriteFull(fd, y->data, y->size * sizeof(double)))
+        return -1;
+
+    return 0;
+}
+/**********************************************/
+
+/* Request queue */
+
+/* It adds a number of microseconds to a timestamp
+Parameters: [ts, us]
+ts: timestamp
+us: microseconds */
+static void AddMicroseconds(struct timespec *ts, long us)
+{
+    ts->tv_sec += us / 1000000;
+    ts->tv_nsec += (us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* It queues a request and blocks until a worker has answered it, or it rejects it right away when the queue is full
+Parameters: [s, req]
+s: server
+req: request whose input features are already filled in
+It returns the request status */
+static int SubmitRequest(Server *s, ServingRequest *req)
+{
+    int status;
+
+    pthread_mutex_lock(&s->lock);
+    if (!IsRunning(s))
+        status = SERVING_STATUS_SHUTDOWN;
+    else if (s->n_pending >= s->config.queue_capacity)
+        status = SERVING_STATUS_BUSY;
+    else
+    {
+        req->done = 0;
+        req->next = NULL;
+        clock_gettime(CLOCK_MONOTONIC, &req->arrival);
+        if (s->tail)
+            s->tail->next = req;
+        else
+            s->head = req;
+        s->tail = req;
+        s->n_pending++;
+        pthread_cond_signal(&s->not_empty);
+
+        while (!req->done)
+            pthread_cond_wait(&req->finished, &s->lock);
+        status = req->status;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return status;
+}
+
+/* It removes the oldest pending request from the queue, and it must be called with the server lock held
+Parameters: [s]
+s: server */
+static ServingRequest *PopRequest(Server *s)
+{
+    ServingRequest *req = s->head;
+
+    s->head = req->next;
+    if (!s->head)
+        s->tail = NULL;
+    s->n_pending--;
+
+    return req;
+}
+/**********************************************/
+
+/* Model publication */
+
+/* It frees the retired models that no worker can hold anymore, and it must be called with the reload lock held
+A model retired at epoch R may still be used by a worker that entered its batch at an epoch lower than R.
+Parameters: [s]
+s: server */
+static void ReclaimServedModels(Server *s)
+{
+    ServedModel *model = NULL, **prev = NULL;
+    unsigned long e, oldest = ULONG_MAX;
+    int i;
+
+    for (i = 0; i < s->config.n_workers; i++)
+    {
+        e = __atomic_load_n(&s->active[i].epoch, __ATOMIC_SEQ_CST);
+        if (e && e < oldest)
+            oldest = e;
+    }
+
+    prev = &s->retired;
+    while (*prev)
+    {
+        model = *prev;
+        if (model->retire_epoch <= oldest)
+        {
+            *prev = model->next;
+            DestroyServedModel(&model);
+        }
+        else
+            prev = &model->next;
+    }
+}
+
+/* It replaces the served model with an atomic pointer exchange, so workers never wait for a reload
+Batches already running finish with the previous model, which is reclaimed later on.
+Parameters: [s, model]
+s: server
+model: model to be published, which becomes owned by the server
+It returns the version assigned to the model */
+unsigned long PublishServerModel(Server *s, ServedModel *model)
+{
+    ServedModel *old = NULL;
+
+    pthread_mutex_lock(&s->reload_lock);
+    model->version = ++s->n_versions;
+    old = __atomic_exchange_n(&s->model, model, __ATOMIC_SEQ_CST);
+    if (old)
+    {
+        old->retire_epoch = __atomic_add_fetch(&s->epoch, 1, __ATOMIC_SEQ_CST);
+        old->next = s->retired;
+        s->retired = old;
+        ReclaimServedModels(s);
+
+        /* Outputs of older versions can no longer be hit, since lookups are tagged with the version, so their room is given back at once */
+        if (s->cache)
+            ClearFeatureCache(s->cache);
+    }
+    pthread_mutex_unlock(&s->reload_lock);
+
+    return model->version;
+}
+/**********************************************/
+
+/* Threads */
+
+/* It gathers pending requests into batches of at most max_batch_size samples and runs them through BatchForwardPass
+A batch is closed when it is full or when the deadline of its oldest request expires, whichever comes first.
+Parameters: [arg]
+arg: server and worker index */
+static void *ServingWorker(void *arg)
+{
+    ServingWorkerArgs *args = (ServingWorkerArgs *)arg;
+    Server *s = args->s;
+    ServingEpoch *active = &s->active[args->id];
+    ServingRequest **batch = NULL;
+    ServedModel *model = NULL;
+    int *computed = NULL;
+    DBNWorkspace *w = NULL;
+    gsl_matrix *X = NULL, *H = NULL;
+    gsl_matrix_view Xk;
+    struct timespec deadline, start, end;
+    unsigned long version = 0;
+    int i, k, n, n_ok, n_inputs, n_outputs;
+
+    free(args);
+    batch = (ServingRequest **)malloc(s->config.max_batch_size * sizeof(ServingRequest *));
+    computed = (int *)malloc(s->config.max_batch_size * sizeof(int));
+
+    pthread_mutex_lock(&s->lock);
+    while (1)
+    {
+        while (IsRunning(s) && !s->head)
+            pthread_cond_wait(&s->not_empty, &s->lock);
+        if (!s->head) /* the server is stopping and the queue has been drained */
+            break;
+
+        n = 0;
+        batch[n++] = PopRequest(s);
+        deadline = batch[0]->arrival;
+        AddMicroseconds(&deadline, s->config.max_delay_us);
+        while (n < s->config.max_batch_size)
+        {
+            if (s->head)
+                batch[n++] = PopRequest(s);
+            else if (!IsRunning(s) || pthread_cond_timedwait(&s->not_empty, &s->lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < n; i++)
+            RecordMetricsHistogram(&s->metrics->queue_wait, getElapsedNanoseconds(&batch[i]->arrival, &start));
+
+        /* It announces the epoch before reading the model pointer, so a concurrent reload cannot reclaim the model in use */
+        __atomic_store_n(&active->epoch, __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+        model = __atomic_load_n(&s->model, __ATOMIC_SEQ_CST);
+        n_inputs = model->stack.m[0]->n_visible_layer_neurons;
+        n_outputs = model->stack.m[model->stack.n_layers - 1]->n_hidden_layer_neurons;
+        if (model->version != version)
+        {
+            DestroyDBNWorkspace(&w);
+            if (X)
+                gsl_matrix_free(X);
+            w = CreateDBNWorkspace(&model->stack, s->config.max_batch_size);
+            w->metrics = s->metrics;
+            X = gsl_matrix_alloc(s->config.max_batch_size, n_inputs);
+            version = model->version;
+        }
+
+        /* Requests shaped for another model version are rejected individually, and cached inputs are answered without being computed */
+        for (i = k = n_ok = 0; i < n; i++)
+        {
+            computed[i] = 0;
+            if (batch[i]->x->size != n_inputs)
+            {
+                batch[i]->status = SERVING_STATUS_BAD_REQUEST;
+                continue;
+            }
+            batch[i]->status = SERVING_STATUS_OK;
+            n_ok++;
+            if (!batch[i]->y || batch[i]->y->size != n_outputs)
+            {
+                if (batch[i]->y)
+                    gsl_vector_free(batch[i]->y);
+                batch[i]->y = gsl_vector_alloc(n_outputs);
+            }
+            if (s->cache && LookupFeatureCache(s->cache, batch[i]->x, model->version, batch[i]->y))
+                continue;
+            gsl_matrix_set_row(X, k++, batch[i]->x);
+            computed[i] = 1;
+        }
+        IncrementMetricsCounter(&model->n_requests, n_ok);
+        if (k)
+        {
+            Xk = gsl_matrix_submatrix(X, 0, 0, k, n_inputs);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            H = BatchForwardPass(&Xk.matrix, &model->stack, w);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            RecordMetricsHistogram(&s->metrics->compute, getElapsedNanoseconds(&start, &end));
+            RecordMetricsHistogram(&s->metrics->batch_size, k);
+            IncrementMetricsCounter(&s->metrics->batches, 1);
+            IncrementMetricsCounter(&model->n_batches, 1);
+            for (i = k = 0; i < n; i++)
+            {
+                if (!computed[i])
+                    continue;
+                gsl_matrix_get_row(batch[i]->y, H, k++);
+                if (s->cache)
+                    InsertFeatureCache(s->cache, batch[i]->x, model->version, batch[i]->y);
+            }
+        }
+        __atomic_store_n(&active->epoch, 0, __ATOMIC_SEQ_CST);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        for (i = 0; i < n; i++)
+            RecordMetricsHistogram(&s->metrics->latency, getElapsedNanoseconds(&batch[i]->arrival, &end));
+
+        pthread_mutex_lock(&s->lock);
+        for (i = 0; i < n; i++)
+        {
+            batch[i]->done = 1;
+            pthread_cond_signal(&batch[i]->finished);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (X)
+        gsl_matrix_free(X);
+    DestroyDBNWorkspace(&w);
+    free(computed);
+    free(batch);
+
+    return NULL;
+}
+
+/* It checks the model file every reload_interval_ms, and it publishes the new model whenever the file is replaced or rewritten
+A file that cannot be loaded (e.g., still being written) is retried on the next check, and the current model keeps being served meanwhile.
+Parameters: [arg]
+arg: server */
+static void *ServingWatcher(void *arg)
+{
+    Server *s = (Server *)arg;
+    ServedModel *model = NULL;
+    struct timespec deadline;
+    struct stat st;
+
+    pthread_mutex_lock(&s->lock);
+    while (IsRunning(s))
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        AddMicroseconds(&deadline, 1000L * s->config.reload_interval_ms);
+        pthread_cond_timedwait(&s->stopped, &s->lock, &deadline);
+        if (!IsRunning(s))
+            break;
+        pthread_mutex_unlock(&s->lock);
+
+        if (!stat(s->config.model_path, &st) &&
+            (st.st_ino != s->model_stat.st_ino || st.st_size != s->model_stat.st_size ||
+             st.st_mtim.tv_sec != s->model_stat.st_mtim.tv_sec || st.st_mtim.tv_nsec != s->model_stat.st_mtim.tv_nsec))
+        {
+            model = LoadServedModel(s->config.model_path);
+            if (model)
+            {
+                s->model_stat = st;
+                fprintf(stderr, "\nPublished model version %lu from %s\n", PublishServerModel(s, model), s->config.model_path);
+            }
+        }
+
+        /* Models retired while workers were busy are reclaimed as soon as those batches finish */
+        pthread_mutex_lock(&s->reload_lock);
+        ReclaimServedModels(s);
+        pthread_mutex_unlock(&s->reload_lock);
+
+        pthread_mutex_lock(&s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+/* It unlinks a connection from the server, closes its socket and deallocates it
+Parameters: [c]
+c: connection */
+static void ReleaseConnection(ServingConnection *c)
+{
+    Server *s = c->s;
+
+    pthread_mutex_lock(&s->lock);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        s->connections = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    if (--s->n_connections == 0)
+        pthread_cond_signal(&s->no_connections);
+    pthread_mutex_unlock(&s->lock);
+
+    close(c->fd);
+    pthread_cond_destroy(&c->req.finished);
+    if (c->req.x)
+        gsl_vector_free(c->req.x);
+    if (c->req.y)
+        gsl_vector_free(c->req.y);
+    free(c);
+}
+
+/* It answers a metrics request with the registry and the request counts of the models still in memory, in the Prometheus text format
+Parameters: [s, fd]
+s: server
+fd: socket */
+static int SendMetrics(Server *s, int fd)
+{
+    ServingHeader header;
+    ServedModel *model = NULL;
+    char *kind[4] = {"unknown", "rbm", "dbn", "dbm"};
+    char *text = NULL;
+    size_t size = 0;
+    FILE *fp = NULL;
+    int status;
+
+    fp = open_memstream(&text, &size);
+    if (!fp)
+        return SendResponse(fd, SERVING_STATUS_BAD_REQUEST, NULL);
+
+    PrintMetrics(fp, s->metrics, "deepd");
+    if (s->cache)
+    {
+        fprintf(fp, "# HELP deepd_cache_lookups_total Feature cache lookups by result\n");
+        fprintf(fp, "# TYPE deepd_cache_lookups_total counter\n");
+        fprintf(fp, "deepd_cache_lookups_total{result=\"hit\"} %llu\n", (unsigned long long)__atomic_load_n(&s->cache->hits, __ATOMIC_RELAXED));
+        fprintf(fp, "deepd_cache_lookups_total{result=\"miss\"} %llu\n", (unsigned long long)__atomic_load_n(&s->cache->misses, __ATOMIC_RELAXED));
+        fprintf(fp, "# HELP deepd_cache_evictions_total Feature cache entries evicted to make room for new ones\n");
+        fprintf(fp, "# TYPE deepd_cache_evictions_total counter\n");
+        fprintf(fp, "deepd_cache_evictions_total %llu\n", (unsigned long long)__atomic_load_n(&s->cache->evictions, __ATOMIC_RELAXED));
+    }
+
+    /* Retired models are only reclaimed under the reload lock, so none of them can be freed while they are listed */
+    pthread_mutex_lock(&s->reload_lock);
+    fprintf(fp, "# HELP deepd_model_version Version of the model answering new requests\n");
+    fprintf(fp, "# TYPE deepd_model_version gauge\n");
+    fprintf(fp, "deepd_model_version %lu\n", s->model->version);
+    fprintf(fp, "# HELP deepd_model_requests_total Requests answered by each model still in memory\n");
+    fprintf(fp, "# TYPE deepd_model_requests_total counter\n");
+    for (model = s->model; model; model = model == s->model ? s->retired : model->next)
+        fprintf(fp, "deepd_model_requests_total{kind=\"%s\",version=\"%lu\"} %llu\n", kind[model->kind >= 1 && model->kind <= 3 ? model->kind : 0],
+                model->version, (unsigned long long)__atomic_load_n(&model->n_requests, __ATOMIC_RELAXED));
+    fprintf(fp, "# HELP deepd_model_batches_total Batches run with each model still in memory\n");
+    fprintf(fp, "# TYPE deepd_model_batches_total counter\n");
+    for (model = s->model; model; model = model == s->model ? s->retired : model->next)
+        fprintf(fp, "deepd_model_batches_total{kind=\"%s\",version=\"%lu\"} %llu\n", kind[model->kind >= 1 && model->kind <= 3 ? model->kind : 0],
+                model->version, (unsigned long long)__atomic_load_n(&model->n_batches, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(&s->reload_lock);
+    fclose(fp);
+
+    header.code = SERVING_STATUS_OK;
+    header.n = size;
+    status = WriteFull(fd, &header, sizeof(ServingHeader)) || WriteFull(fd, text, size) ? -1 : 0;
+    free(text);
+
+    return status;
+}
+
+/* It answers the requests of one client connection until the client hangs up or the server stops
+Parameters: [arg]
+arg: connection */
+static void *ServeConnection(void *arg)
+{
+    ServingConnection *c = (ServingConnection *)arg;
+    Server *s = c->s;
+    ServingHeader header;
+    int status;
+
+    while (!ReadFull(c->fd, &header, sizeof(ServingHeader)))
+    {
+        if (header.code == SERVING_OP_METRICS && header.n == 0)
+        {
+            if (SendMetrics(s, c->fd))
+                break;
+            continue;
+        }
+        if (header.code != SERVING_OP_INFER || header.n == 0 || header.n > SERVING_MAX_FEATURES)
+        {
+            IncrementMetricsCounter(&s->metrics->requests[SERVING_STATUS_BAD_REQUEST], 1);
+            if (DiscardFull(c->fd, header.n) || SendResponse(c->fd, SERVING_STATUS_BAD_REQUEST, NULL))
+                break;
+            continue;
+        }
+
+        /* The input size is checked by the worker against the model version that answers the request */
+        if (!c->req.x || c->req.x->size != header.n)
+        {
+            if (c->req.x)
+                gsl_vector_free(c->req.x);
+            c->req.x = gsl_vector_alloc(header.n);
+        }
+        if (ReadFull(c->fd, c->req.x->data, header.n * sizeof(double)))
+            break;
+
+        status = SubmitRequest(s, &c->req);
+        IncrementMetricsCounter(&s->metrics->requests[status], 1);
+        if (SendResponse(c->fd, status, status == SERVING_STATUS_OK ? c->req.y : NULL))
+            break;
+    }
+
+    ReleaseConnection(c);
+
+    return NULL;
+}
+/**********************************************/
+
+/* Allocation and deallocation */
+
+/* It loads a binary RBM, DBN or DBM model file to be served
+Parameters: [file]
+file: file name
+It returns NULL if the file cannot be read or holds an unknown kind of model */
+ServedModel *LoadServedModel(char *file)
+{
+    ServedModel *model = NULL;
+    FILE *fp = NULL;
+    RBM *m = NULL;
+    DBN *dbn = NULL;
+    DBM *dbm = NULL;
+    int kind, n_layers;
+
+    fp = fopen(file, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "\nUnable to open %s @LoadServedModel.\n", file);
+        return NULL;
+    }
+    if (freadModelHeader(fp, &kind, &n_layers))
+    {
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+
+    model = (ServedModel *)calloc(1, sizeof(ServedModel));
+    model->kind = kind;
+    switch (kind)
+    {
+    case MODEL_FILE_RBM:
+        m = loadRBMFromBinaryFile(file);
+        if (m)
+        {
+            model->stack.n_layers = 1;
+            model->stack.m = (RBM **)malloc(sizeof(RBM *));
+            model->stack.m[0] = m;
+        }
+        break;
+    case MODEL_FILE_DBN:
+        dbn = loadDBNFromBinaryFile(file);
+        if (dbn)
+        {
+            model->stack = *dbn;
+            free(dbn);
+        }
+        break;
+    case MODEL_FILE_DBM:
+        dbm = loadDBMFromBinaryFile(file);
+        if (dbm)
+        {
+            model->stack.n_layers = dbm->n_layers;
+            model->stack.m = dbm->m;
+            free(dbm);
+        }
+        break;
+    default:
+        fprintf(stderr, "\nUnknown kind of model %d in %s @LoadServedModel.\n", kind, file);
+    }
+
+    if (!model->stack.m)
+    {
+        free(model);
+        return NULL;
+    }
+
+    return model;
+}
+
+/* It deallocates a served model
+Parameters: [model]
+model: served model */
+void DestroyServedModel(ServedModel **model)
+{
+    int l;
+
+    if (*model)
+    {
+        for (l = 0; l < (*model)->stack.n_layers; l++)
+            DestroyRBM(&(*model)->stack.m[l]);
+        free((*model)->stack.m);
+        free(*model);
+        *model = NULL;
+    }
+}
+
+/* It loads the model, binds the server socket and starts the worker threads, as well as the model watcher if hot reloading is enabled
+Parameters: [config]
+config: serving configuration
+It returns NULL if the configuration is invalid, the model cannot be loaded or the socket cannot be bound */
+Server *CreateServer(ServingConfig *config)
+{
+    Server *s = NULL;
+    ServedModel *model = NULL;
+    ServingWorkerArgs *args = NULL;
+    struct sockaddr_un addr;
+    struct stat st;
+    pthread_condattr_t attr;
+    int i;
+
+    if (config->n_workers <= 0 || config->max_batch_size <= 0 || config->max_delay_us < 0 || config->queue_capacity <= 0 || config->reload_interval_ms < 0 || config->cache_capacity < 0)
+    {
+        fprintf(stderr, "\nInvalid serving configuration @CreateServer.\n");
+        return NULL;
+    }
+    if (strlen(config->socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "\nSocket path %s is too long @CreateServer.\n", config->socket_path);
+        return NULL;
+    }
+
+    /* The file is identified before being read, so a replacement written meanwhile is picked up by the watcher */
+    memset(&st, 0, sizeof(struct stat));
+    stat(config->model_path, &st);
+    model = LoadServedModel(config->model_path);
+    if (!model)
+        return NULL;
+
+    s = (Server *)calloc(1, sizeof(Server));
+    if (!s)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @CreateServer.\n");
+        exit(-1);
+    }
+    s->config = *config;
+    s->running = 1;
+    s->epoch = 1;
+    s->model_stat = st;
+
+    s->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, config->socket_path);
+    unlink(config->socket_path);
+    if (s->listen_fd < 0 || bind(s->listen_fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) || listen(s->listen_fd, SOMAXCONN))
+    {
+        fprintf(stderr, "\nUnable to listen on %s: %s @CreateServer.\n", config->socket_path, strerror(errno));
+        if (s->listen_fd >= 0)
+            close(s->listen_fd);
+        DestroyServedModel(&model);
+        free(s);
+        return NULL;
+    }
+
+    /* The batching deadlines are measured with the monotonic clock, so wall clock adjustments do not stretch them */
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_mutex_init(&s->reload_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->not_empty, &attr);
+    pthread_cond_init(&s->stopped, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&s->no_connections, NULL);
+
+    s->active = (ServingEpoch *)calloc(config->n_workers, sizeof(ServingEpoch));
+    s->metrics = CreateMetrics();
+    if (config->cache_capacity > 0)
+        s->cache = CreateFeatureCache(config->cache_capacity, 4 * config->n_workers);
+    PublishServerModel(s, model);
+
+    s->workers = (pthread_t *)malloc(config->n_workers * sizeof(pthread_t));
+    for (i = 0; i < config->n_workers; i++)
+    {
+        args = (ServingWorkerArgs *)malloc(sizeof(ServingWorkerArgs));
+        args->s = s;
+        args->id = i;
+        pthread_create(&s->workers[i], NULL, ServingWorker, args);
+    }
+    if (config->reload_interval_ms > 0)
+        pthread_create(&s->watcher, NULL, ServingWatcher, s);
+
+    return s;
+}
+
+/* It deallocates a server after RunServer has returned, including every model it has published
+Parameters: [s]
+s: server */
+void DestroyServer(Server **s)
+{
+    ServedModel *model = NULL;
+
+    if (*s)
+    {
+        close((*s)->listen_fd);
+        unlink((*s)->config.socket_path);
+        DestroyServedModel(&(*s)->model);
+        while ((*s)->retired)
+        {
+            model = (*s)->retired;
+            (*s)->retired = model->next;
+            DestroyServedModel(&model);
+        }
+        pthread_mutex_destroy(&(*s)->lock);
+        pthread_mutex_destroy(&(*s)->reload_lock);
+        pthread_cond_destroy(&(*s)->not_empty);
+        pthread_cond_destroy(&(*s)->no_connections);
+        pthread_cond_destroy(&(*s)->stopped);
+        free((*s)->active);
+        DestroyMetrics(&(*s)->metrics);
+        DestroyFeatureCache(&(*s)->cache);
+        free((*s)->workers);
+        free(*s);
+        *s = NULL;
+    }
+}
+/**********************************************/
+
+/* Serving */
+
+/* It accepts client connections until StopServer is called
+Then, it answers every queued request, closes the client connections and joins the worker threads.
+Parameters: [s]
+s: server */
+void RunServer(Server *s)
+{
+    ServingConnection *c = NULL;
+    pthread_t thread;
+    int fd, i;
+
+    while (IsRunning(s))
+    {
+        fd = accept(s->listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno != EINTR && IsRunning(s))
+                fprintf(stderr, "\nUnable to accept connection: %s @RunServer.\n", strerror(errno));
+            continue;
+        }
+
+        c = (ServingConnection *)calloc(1, sizeof(ServingConnection));
+        c->s = s;
+        c->fd = fd;
+        pthread_cond_init(&c->req.finished, NULL);
+
+        pthread_mutex_lock(&s->lock);
+        c->next = s->connections;
+        if (s->connections)
+            s->connections->prev = c;
+        s->connections = c;
+        s->n_connections++;
+        pthread_mutex_unlock(&s->lock);
+
+        if (pthread_create(&thread, NULL, ServeConnection, c))
+        {
+            fprintf(stderr, "\nUnable to start connection thread @RunServer.\n");
+            ReleaseConnection(c);
+        }
+        else
+            pthread_detach(thread);
+    }
+
+    /* Requests already queued are still answered, since workers only leave once the queue is empty */
+    pthread_mutex_lock(&s->lock);
+    __atomic_store_n(&s->running, 0, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&s->not_empty);
+    pthread_cond_broadcast(&s->stopped);
+    for (c = s->connections; c; c = c->next)
+        shutdown(c->fd, SHUT_RD);
+    while (s->n_connections > 0)
+        pthread_cond_wait(&s->no_connections, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+
+    for (i = 0; i < s->config.n_workers; i++)
+        pthread_join(s->workers[i], NULL);
+    if (s->config.reload_interval_ms > 0)
+        pthread_join(s->watcher, NULL);
+}
+
+/* It asks RunServer to return, and it only performs async-signal-safe operations
+Parameters: [s]
+s: server */
+void StopServer(Server *s)
+{
+    __atomic_store_n(&s->running, 0, __ATOMIC_SEQ_CST);
+    shutdown(s->listen_fd, SHUT_RDWR);
+}
+/**********************************************/
+
+/* Client */
+
+/* It opens a client connection to a server
+Parameters: [socket_path]
+socket_path: path of the server socket
+It returns the connected socket or -1 on error */
+int ConnectServer(char *socket_path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)))
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* It sends one inference request and waits for its response
+Parameters: [fd, x, y]
+fd: socket returned by ConnectServer
+x: input features (contiguous vector)
+y: output features (contiguous vector), sized to the top layer of the served model
+It returns the response status, or -1 if the connection failed */
+int RequestServerInference(int fd, gsl_vector *x, gsl_vector *y)
+{
+    ServingHeader header;
+
+    header.code = SERVING_OP_INFER;
+    header.n = x->size;
+    if (WriteFull(fd, &header, sizeof(ServingHeader)) || WriteFull(fd, x->data, x->size * sizeof(double)))
+        return -1;
+
+    if (ReadFull(fd, &header, sizeof(ServingHeader)))
+        return -1;
+    if (header.n != 0 && header.n != y->size)
+    {
+        DiscardFull(fd, header.n);
+        fprintf(stderr, "\nResponse has %u features instead of %zu @RequestServerInference.\n", header.n, y->size);
+        return -1;
+    }
+    if (header.n && ReadFull(fd, y->data, y->size * sizeof(double)))
+        return -1;
+
+    return header.code;
+}
+/**********************************************/
+
+/* It fetches the server metrics in the Prometheus text format
+Parameters: [fd]
+fd: socket returned by ConnectServer
+It returns a NUL-terminated string to be freed by the caller, or NULL if the connection failed */
+char *RequestServerMetrics(int fd)
+{
+    ServingHeader header;
+    char *text = NULL;
+
+    header.code = SERVING_OP_METRICS;
+    header.n = 0;
+    if (WriteFull(fd, &header, sizeof(ServingHeader)) || ReadFull(fd, &header, sizeof(ServingHeader)) || header.code != SERVING_STATUS_OK)
+        return NULL;
+
+    text = (char *)malloc(header.n + 1);
+    if (ReadFull(fd, text, header.n))
+    {
+        free(text);
+        return NULL;
+    }
+    text[header.n] = '\0';
+
+    return text;
+}
+/**********************************************/
@@ -0,0 +1,543 @@
+#include "stopping.h"
+
+#include <float.h>
+
+static const char *metric_name[] = {"reconstruction error", "free-energy gap", "classification error"};
+
+/* Allocation and deallocation */
+
+/* It allocates an early stopping criterion over a held-out dataset
+Parameters: [validation, metric, patience, interval]
+validation: held-out dataset, which must outlive the criterion
+metric: STOPPING_RECONSTRUCTION_ERROR, STOPPING_FREE_ENERGY_GAP or STOPPING_CLASSIFICATION_ERROR
+patience: evaluations in a row without improvement after which training stops
+interval: batches between two evaluations */
+EarlyStopping *CreateEarlyStopping(Dataset *validation, int metric, int patience, int interval)
+{
+    EarlyStopping *s = NULL;
+
+    if (!validation || !validation->size)
+    {
+        fprintf(stderr, "\nThere are no held-out samples @CreateEarlyStopping.\n");
+        return NULL;
+    }
+
+    s = (EarlyStopping *)calloc(1, sizeof(EarlyStopping));
+    if (!s)
+    {
+        fprintf(stderr, "\nUnable to alloc memory @CreateEarlyStopping.\n");
+        exit(-1);
+    }
+
+    if (metric < STOPPING_RECONSTRUCTION_ERROR || metric > STOPPING_CLASSIFICATION_ERROR)
+    {
+        fprintf(stderr, "\nInvalid metric %d, using the reconstruction error @CreateEarlyStopping.\n", metric);
+        metric = STOPPING_RECONSTRUCTION_ERROR;
+    }
+
+    s->validation = validation;
+    s->metric = metric;
+    s->patience = patience > 0 ? patience : 1;
+    s->interval = interval > 0 ? interval : 1;
+    s->best = s->gap_min = DBL_MAX;
+
+    return s;
+}
+
+/* It allocates a criterion with the settings of another one over the input of a layer, as used by the greedy layer-wise trainers, which cannot
+classify, so the classification error falls back to the reconstruction error
+Parameters: [s, validation]
+s: criterion whose settings are copied
+validation: held-out samples propagated up to the visible units of the layer */
+EarlyStopping *CreateLayerEarlyStopping(EarlyStopping *s, Dataset *validation)
+{
+    EarlyStopping *l = NULL;
+    int metric = s->metric;
+
+    if (metric == STOPPING_CLASSIFICATION_ERROR)
+    {
+        fprintf(stderr, "\nThe classification error is only available for DRBMs, using the reconstruction error @CreateLayerEarlyStopping.\n");
+        metric = STOPPING_RECONSTRUCTION_ERROR;
+    }
+
+    l = CreateEarlyStopping(validation, metric, s->patience, s->interval);
+    if (l)
+        l->min_delta = s->min_delta;
+
+    return l;
+}
+
+/* It deallocates the snapshot of a criterion
+Parameters: [s]
+s: early stopping criterion */
+static void DestroyEarlyStoppingSnapshot(EarlyStopping *s)
+{
+    int l;
+
+    for (l = 0; l < s->n_layers; l++)
+    {
+        gsl_matrix_free(s->W[l]);
+        gsl_matrix_free(s->U[l]);
+        gsl_vector_free(s->a[l]);
+        gsl_vector_free(s->b[l]);
+        gsl_vector_free(s->c[l]);
+        if (s->sigma[l])
+            gsl_vector_free(s->sigma[l]);
+    }
+    free(s->W);
+    free(s->U);
+    free(s->a);
+    free(s->b);
+    free(s->c);
+    free(s->sigma);
+    s->W = s->U = NULL;
+    s->a = s->b = s->c = s->sigma = NULL;
+    s->n_layers = 0;
+}
+
+/* It deallocates an early stopping criterion
+Parameters: [s]
+s: early stopping criterion */
+void DestroyEarlyStopping(EarlyStopping **s)
+{
+    if (*s)
+    {
+        DestroyEarlyStoppingSnapshot(*s);
+        free(*s);
+        *s = NULL;
+    }
+}
+/**********************************************/
+
+/* Evaluation */
+
+/* It gathers a chunk of held-out samples, divided by the standard deviations of the visible units if they are Gaussian
+Parameters: [D, z, m, X]
+D: dataset
+z: index of the first sample of the chunk
+m: RBM
+X: visible units (one sample per row, as many rows as samples in the chunk) */
+static void getEarlyStoppingChunk(Dataset *D, int z, RBM *m, gsl_matrix *X)
+{
+    int i;
+
+    for (i = 0; i < X->size1; i++)
+    {
+        gsl_vector_view row = gsl_matrix_row(X, i);
+        gsl_vector_memcpy(&row.vector, D->sample[z + i].feature);
+        if (m->sigma)
+            gsl_vector_div(&row.vector, m->sigma);
+    }
+}
+
+/* It computes the mean squared error of the mean-field reconstruction of the first n samples of a dataset, i.e., of P(v|P(h|v)) for Bernoulli
+visible units and of a + sigma*(W*P(h|v)) for Gaussian ones, one GEMM per chunk of RBM_PROPAGATION_CHUNK_SIZE samples
+Parameters: [D, n, m]
+D: dataset
+n: number of samples
+m: RBM */
+double getHeldOutReconstructionError(Dataset *D, int n, RBM *m)
+{
+    double error = 0.0;
+    int z;
+
+#pragma omp parallel reduction(+ : error)
+    {
+        gsl_matrix *X = gsl_matrix_alloc(RBM_PROPAGATION_CHUNK_SIZE, m->n_visible_layer_neurons);
+        gsl_matrix *H = gsl_matrix_alloc(RBM_PROPAGATION_CHUNK_SIZE, m->n_hidden_layer_neurons);
+        gsl_matrix_view x, h;
+        double *p, *in, *a = gsl_vector_ptr(m->a, 0), *b = gsl_vector_ptr(m->b, 0), out, diff;
+        int i, j, k;
+
+#pragma omp for schedule(dynamic)
+        for (z = 0; z < n; z += RBM_PROPAGATION_CHUNK_SIZE)
+        {
+            k = n - z < RBM_PROPAGATION_CHUNK_SIZE ? n - z : RBM_PROPAGATION_CHUNK_SIZE;
+            x = gsl_matrix_submatrix(X, 0, 0, k, X->size2);
+            h = gsl_matrix_submatrix(H, 0, 0, k, H->size2);
+            getEarlyStoppingChunk(D, z, m, &x.matrix);
+
+            /* Up pass */
+            gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, &x.matrix, m->W, 0.0, &h.matrix);
+            for (i = 0; i < k; i++)
+            {
+                p = gsl_matrix_ptr(&h.matrix, i, 0);
+                for (j = 0; j < H->size2; j++)
+                    p[j] = SigmoidLogistic(m->sigma ? p[j] + b[j] : (p[j] + b[j]) / m->t);
+            }
+
+            /* Down pass, which overwrites the chunk with its reconstruction */
+            gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, &h.matrix, m->W, 0.0, &x.matrix);
+            for (i = 0; i < k; i++)
+            {
+                p = gsl_matrix_ptr(&x.matrix, i, 0);
+                in = gsl_vector_ptr(D->sample[z + i].feature, 0);
+                diff = 0.0;
+                for (j = 0; j < X->size2; j++)
+                {
+                    out = m->sigma ? gsl_vector_get(m->sigma, j) * p[j] + a[j] : SigmoidLogistic(p[j] + a[j]);
+                    diff += (in[j] - out) * (in[j] - out);
+                }
+                error += diff / X->size2;
+            }
+        }
+        gsl_matrix_free(X);
+        gsl_matrix_free(H);
+    }
+
+    return error / n;
+}
+
+/* It computes the mean free energy of the first n samples of a dataset, i.e., of -a*v - sum_j softplus(W_j*v + b_j) for Bernoulli visible units
+and of sum_i (v_i - a_i)^2/(2*sigma_i^2) - sum_j softplus(W_j*(v/sigma) + b_j) for Gaussian ones
+Parameters: [D, n, m]
+D: dataset
+n: number of samples
+m: RBM */
+double getHeldOutFreeEnergy(Dataset *D, int n, RBM *m)
+{
+    double energy = 0.0;
+    int z;
+
+#pragma omp parallel reduction(+ : energy)
+    {
+        gsl_matrix *X = gsl_matrix_alloc(RBM_PROPAGATION_CHUNK_SIZE, m->n_visible_layer_neurons);
+        gsl_matrix *H = gsl_matrix_alloc(RBM_PROPAGATION_CHUNK_SIZE, m->n_hidden_layer_neurons);
+        gsl_matrix_view x, h;
+        double *p, *in, *a = gsl_vector_ptr(m->a, 0), *b = gsl_vector_ptr(m->b, 0), tmp;
+        int i, j, k;
+
+#pragma omp for schedule(dynamic)
+        for (z = 0; z < n; z += RBM_PROPAGATION_CHUNK_SIZE)
+        {
+            k = n - z < RBM_PROPAGATION_CHUNK_SIZE ? n - z : RBM_PROPAGATION_CHUNK_SIZE;
+            x = gsl_matrix_submatrix(X, 0, 0, k, X->size2);
+            h = gsl_matrix_submatrix(H, 0, 0, k, H->size2);
+            getEarlyStoppingChunk(D, z, m, &x.matrix);
+
+            gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, &x.matrix, m->W, 0.0, &h.matrix);
+            for (i = 0; i < k; i++)
+            {
+                p = gsl_matrix_ptr(&h.matrix, i, 0);
+                in = gsl_vector_ptr(D->sample[z + i].feature, 0);
+                for (j = 0; j < H->size2; j++)
+                {
+                    tmp = p[j] + b[j];
+                    energy -= tmp > 0 ? tmp + log1p(exp(-tmp)) : log1p(exp(tmp)); /* softplus, which does not overflow */
+                }
+                for (j = 0; j < X->size2; j++)
+                {
+                    if (m->sigma)
+                    {
+                        tmp = (in[j] - a[j]) / gsl_vector_get(m->sigma, j);
+                        energy += 0.5 * tmp * tmp;
+                    }
+                    else
+                        energy -= a[j] * in[j];
+                }
+            }
+        }
+        gsl_matrix_free(X);
+        gsl_matrix_free(H);
+    }
+
+    return energy / n;
+}
+
+/* It computes the fraction of samples of a dataset whose label with the highest log-probability P(y|x) is not theirs, scoring one chunk of
+RBM_PROPAGATION_CHUNK_SIZE samples at a time
+Parameters: [D, m]
+D: dataset
+m: DRBM */
+double getHeldOutClassificationError(Dataset *D, RBM *m)
+{
+    int z, errors = 0, n_labels = D->nlabels < m->n_labels ? D->nlabels : m->n_labels;
+
+    if (n_labels < 1)
+        n_labels = m->n_labels;
+
+#pragma omp parallel reduction(+ : errors)
+    {
+        gsl_matrix *X = gsl_matrix_alloc(RBM_PROPAGATION_CHUNK_SIZE, m->n_visible_layer_neurons);
+        gsl_matrix *P = gsl_matrix_alloc(RBM_PROPAGATION_CHUNK_SIZE, m->n_labels);
+        gsl_matrix_view x, p;
+        double *q;
+        int i, y, k, label;
+
+#pragma omp for schedule(dynamic)
+        for (z = 0; z < D->size; z += RBM_PROPAGATION_CHUNK_SIZE)
+        {
+            k = D->size - z < RBM_PROPAGATION_CHUNK_SIZE ? D->size - z : RBM_PROPAGATION_CHUNK_SIZE;
+            x = gsl_matrix_submatrix(X, 0, 0, k, X->size2);
+            p = gsl_matrix_submatrix(P, 0, 0, k, P->size2);
+            getEarlyStoppingChunk(D, z, m, &x.matrix);
+
+            getDiscriminativeBatchLogProbabilityLabelUnit(m, &x.matrix, &p.matrix);
+            for (i = 0; i < k; i++)
+            {
+                q = gsl_matrix_ptr(&p.matrix, i, 0);
+                label = 0;
+                for (y = 1; y < n_labels; y++)
+                    if (q[y] > q[label])
+                        label = y;
+                if (label + 1 != D->sample[z + i].label)
+                    errors++;
+            }
+        }
+        gsl_matrix_free(X);
+        gsl_matrix_free(P);
+    }
+
+    return (double)errors / D->size;
+}
+
+/* It computes the metric of a criterion for an RBM over the held-out samples. The free-energy gap is taken against the first samples of the
+training set, as many as there are held-out ones, so both sides always cover the same samples
+Parameters: [D, m, s]
+D: training set
+m: RBM
+s: early stopping criterion */
+double getEarlyStoppingMetric(Dataset *D, RBM *m, EarlyStopping *s)
+{
+    int n;
+
+    switch (s->metric)
+    {
+    case STOPPING_FREE_ENERGY_GAP:
+        n = D->size < s->validation->size ? D->size : s->validation->size;
+        return getHeldOutFreeEnergy(s->validation, s->validation->size, m) - getHeldOutFreeEnergy(D, n, m);
+    case STOPPING_CLASSIFICATION_ERROR:
+        return getHeldOutClassificationError(s->validation, m);
+    }
+
+    return getHeldOutReconstructionError(s->validation, s->validation->size, m);
+}
+/**********************************************/
+
+/* Training hooks */
+
+/* It copies the parameters of the layers of a model into the snapshot of a criterion, allocating it on the first call
+Parameters: [s, m, n_layers]
+s: early stopping criterion
+m: layers of the model
+n_layers: number of layers */
+static void SaveEarlyStoppingSnapshot(EarlyStopping *s, RBM **m, int n_layers)
+{
+    int l;
+
+    if (!s->n_layers)
+    {
+        s->W = (gsl_matrix **)malloc(n_layers * sizeof(gsl_matrix *));
+        s->U = (gsl_matrix **)malloc(n_layers * sizeof(gsl_matrix *));
+        s->a = (gsl_vector **)malloc(n_layers * sizeof(gsl_vector *));
+        s->b = (gsl_vector **)malloc(n_layers * sizeof(gsl_vector *));
+        s->c = (gsl_vector **)malloc(n_layers * sizeof(gsl_vector *));
+        s->sigma = (gsl_vector **)malloc(n_layers * sizeof(gsl_vector *));
+        if (!s->W || !s->U || !s->a || !s->b || !s->c || !s->sigma)
+        {
+            fprintf(stderr, "\nUnable to alloc memory @SaveEarlyStoppingSnapshot.\n");
+            exit(-1);
+        }
+        for (l = 0; l < n_layers; l++)
+        {
+            s->W[l] = gsl_matrix_alloc(m[l]->W->size1, m[l]->W->size2);
+            s->U[l] = gsl_matrix_alloc(m[l]->U->size1, m[l]->U->size2);
+            s->a[l] = gsl_vector_alloc(m[l]->a->size);
+            s->b[l] = gsl_vector_alloc(m[l]->b->size);
+            s->c[l] = gsl_vector_alloc(m[l]->c->size);
+            s->sigma[l] = m[l]->sigma ? gsl_vector_alloc(m[l]->sigma->size) : NULL;
+        }
+        s->n_layers = n_layers;
+    }
+
+    for (l = 0; l < n_layers; l++)
+    {
+        gsl_matrix_memcpy(s->W[l], m[l]->W);
+        gsl_matrix_memcpy(s->U[l], m[l]->U);
+        gsl_vector_memcpy(s->a[l], m[l]->a);
+        gsl_vector_memcpy(s->b[l], m[l]->b);
+        gsl_vector_memcpy(s->c[l], m[l]->c);
+        if (s->sigma[l])
+            gsl_vector_memcpy(s->sigma[l], m[l]->sigma);
+    }
+}
+
+/* It makes the current parameters of a model the best ones so far
+Parameters: [s, value, m, n_layers]
+s: early stopping criterion
+value: value the snapshot is chosen by
+m: layers of the model
+n_layers: number of layers */
+static void KeepEarlyStoppingSnapshot(EarlyStopping *s, double value, RBM **m, int n_layers)
+{
+    s->best = value;
+    s->best_evaluation = s->n_evaluations;
+    s->best_batches = s->batches;
+    SaveEarlyStoppingSnapshot(s, m, n_layers);
+}
+
+/* It records a new value of the metric, taking a snapshot of the model if it improves on the best one so far
+Parameters: [s, value, m, n_layers]
+s: early stopping criterion
+value: value of the metric
+m: layers of the model
+n_layers: number of layers */
+static int UpdateEarlyStopping(EarlyStopping *s, double value, RBM **m, int n_layers)
+{
+    s->n_evaluations++;
+    if (value < s->best - s->min_delta)
+    {
+        s->n_misses = 0;
+        KeepEarlyStoppingSnapshot(s, value, m, n_layers);
+    }
+    else if (++s->n_misses >= s->patience)
+    {
+        s->stop = 1;
+        fprintf(stderr, "\nStopping early after %ld batches: the held-out %s has not improved on %lf for %d evaluations", s->batches,
+                metric_name[s->metric], s->best, s->patience);
+    }
+
+    return s->stop;
+}
+
+/* It records a new value of the free-energy gap, which grows from about 0 as soon as training starts and thus cannot tell the best parameters
+apart: it only triggers the stop, once it has stayed more than min_delta above its running minimum for patience evaluations in a row after a
+warm-up of patience evaluations, while the snapshot is the one with the lowest held-out reconstruction error
+Parameters: [s, gap, error, m, n_layers]
+s: early stopping criterion
+gap: free-energy gap
+error: held-out reconstruction error
+m: layers of the model
+n_layers: number of layers */
+static int UpdateEarlyStoppingGap(EarlyStopping *s, double gap, double error, RBM **m, int n_layers)
+{
+    s->n_evaluations++;
+    if (error < s->best)
+        KeepEarlyStoppingSnapshot(s, error, m, n_layers);
+
+    if (gap < s->gap_min)
+        s->gap_min = gap;
+    if (s->n_evaluations <= s->patience || gap <= s->gap_min + s->min_delta)
+        s->n_misses = 0;
+    else if (++s->n_misses >= s->patience)
+    {
+        s->stop = 1;
+        fprintf(stderr, "\nStopping early after %ld batches: the held-out free-energy gap has stayed more than %lf above its minimum of %lf for %d evaluations",
+                s->batches, s->min_delta, s->gap_min, s->patience);
+    }
+
+    return s->stop;
+}
+
+/* It copies the snapshot of a criterion back into the layers of a model whenever batches were trained after it was taken, even if it is the one of
+the last evaluation, and resets the criterion for the next run
+Parameters: [s, m, n_layers]
+s: early stopping criterion
+m: layers of the model
+n_layers: number of layers */
+static void LoadEarlyStoppingSnapshot(EarlyStopping *s, RBM **m, int n_layers)
+{
+    int l, metric;
+
+    if (s->best_evaluation && s->batches > s->best_batches)
+    {
+        metric = s->metric == STOPPING_FREE_ENERGY_GAP ? STOPPING_RECONSTRUCTION_ERROR : s->metric; /* the gap does not choose the snapshot */
+        fprintf(stderr, "\nRestoring the parameters of evaluation %d out of %d, after batch %ld of %ld (held-out %s of %lf)", s->best_evaluation,
+                s->n_evaluations, s->best_batches, s->batches, metric_name[metric], s->best);
+        for (l = 0; l < n_layers; l++)
+        {
+            gsl_matrix_memcpy(m[l]->W, s->W[l]);
+            gsl_matrix_memcpy(m[l]->U, s->U[l]);
+            gsl_vector_memcpy(m[l]->a, s->a[l]);
+            gsl_vector_memcpy(m[l]->b, s->b[l]);
+            gsl_vector_memcpy(m[l]->c, s->c[l]);
+            if (s->sigma[l])
+                gsl_vector_memcpy(m[l]->sigma, s->sigma[l]);
+        }
+    }
+
+    DestroyEarlyStoppingSnapshot(s);
+    s->batches = s->best_batches = 0;
+    s->n_evaluations = s->n_misses = s->best_evaluation = 0;
+    s->stop = 0;
+    s->best = s->gap_min = DBL_MAX;
+}
+
+/* It accounts for a trained batch, evaluating the RBM over the held-out samples every s->interval batches. The trainers call it after every update,
+and it does nothing if m->stopping is not set
+Parameters: [D, m]
+D: training set
+m: RBM
+It returns 1 once training must stop and 0 otherwise */
+int CheckEarlyStopping(Dataset *D, RBM *m)
+{
+    EarlyStopping *s = m->stopping;
+
+    if (!s)
+        return 0;
+    s->batches++;
+    if (s->stop)
+        return 1;
+    if (s->batches % s->interval)
+        return 0;
+
+    if (s->metric == STOPPING_FREE_ENERGY_GAP)
+        return UpdateEarlyStoppingGap(s, getEarlyStoppingMetric(D, m, s), getHeldOutReconstructionError(s->validation, s->validation->size, m), &m, 1);
+
+    return UpdateEarlyStopping(s, getEarlyStoppingMetric(D, m, s), &m, 1);
+}
+
+/* It returns 1 if the criterion of an RBM has run out of patience
+Parameters: [m]
+m: RBM */
+int HasStoppedEarly(RBM *m)
+{
+    return m->stopping ? m->stopping->stop : 0;
+}
+
+/* It restores the best parameters found by the run, which the trainers call before returning, and resets the criterion for the next one. The
+parameters are left untouched if no batch was trained after the best snapshot or there was no evaluation
+Parameters: [m]
+m: RBM */
+void RestoreEarlyStopping(RBM *m)
+{
+    if (m->stopping)
+        LoadEarlyStoppingSnapshot(m->stopping, &m, 1);
+}
+
+/* It accounts for a batch of DBM joint training, evaluating the DBM every s->interval batches by the reconstruction error of the held-out
+samples, which is the only metric available for DBMs
+Parameters: [d]
+d: DBM
+It returns 1 once training must stop and 0 otherwise */
+int CheckDBMEarlyStopping(DBM *d)
+{
+    EarlyStopping *s = d->stopping;
+
+    if (!s)
+        return 0;
+    s->batches++;
+    if (s->stop)
+        return 1;
+    if (s->batches % s->interval)
+        return 0;
+
+    return UpdateEarlyStopping(s, getDBMReconstructionError(s->validation, d), d->m, d->n_layers);
+}
+
+/* It returns 1 if the criterion of a DBM has run out of patience
+Parameters: [d]
+d: DBM */
+int HasDBMStoppedEarly(DBM *d)
+{
+    return d->stopping ? d->stopping->stop : 0;
+}
+
+/* It restores the best parameters of every DBM layer found by the run, and resets the criterion for the next one
+Parameters: [d]
+d: DBM */
+void RestoreDBMEarlyStopping(DBM *d)
+{
+    if (d->stopping)
+        LoadEarlyStoppingSnapshot(d->stopping, d->m, d->n_layers);
+}